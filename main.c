@@ -18,44 +18,1046 @@
  */
 
 #include "netpbm_gs.h"
+#include "server.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+
+#define DEFAULT_CACHE_SIZE_MB 1024
+
+/* Outputs of Sobel operator on packed bitmaps */
+#define BITMAP_MASK 1
+#define BITMAP_MAGNITUDE 2
+
+/* Thresholds of Sobel operator results */
+#define THRESHOLD_VALUE 1
+#define THRESHOLD_OTSU 2
+
+/* Input files read at once with -B */
+#define BATCH_FILES 32
+
+/**
+ * @brief command line options
+ */
+struct options {
+	char *ifilename;
+	char *ofilename;
+	unsigned long n_threads;
+	uint8_t auto_tune; /**< Pick threads for each image, -p auto */
+	netpbm_tuning_t tuning; /**< Costs of this machine, with auto_tune */
+	uint8_t calibrate; /**< Measure costs and store tuning profile */
+	uint8_t counters; /**< Print hardware counters of Sobel workers */
+	unsigned long do_sobel;
+	uint32_t blur; /**< Gaussian kernel size applied before Sobel, or 0 */
+	uint8_t bitmap; /**< Process packed P4, one of BITMAP_* */
+	uint8_t print_stats; /**< Print statistics of Sobel results */
+	uint8_t threshold_mode; /**< Threshold results, one of THRESHOLD_* */
+	uint32_t threshold; /**< Threshold with THRESHOLD_VALUE */
+	uint32_t level; /**< Process image downsampled 2^level times */
+	enum NETPBM_DOWNSAMPLE level_filter;
+	uint8_t all_levels; /**< Also write results of the lower levels */
+	uint8_t thin; /**< Suppress non-maxima of Sobel results */
+	uint8_t pin; /**< Pin Sobel workers to CPUs of NUMA nodes */
+
+	uint8_t do_greyscale;
+
+	uint8_t do_region;
+	netpbm_rect_t region;
+
+	uint8_t do_strip; /**< Write rows [strip_start, strip_end) only */
+	uint32_t strip_start;
+	uint32_t strip_end;
+	uint8_t do_merge; /**< Merge strips given after the options */
+	uint8_t direct; /**< Threads store binary output in place */
+
+	uint8_t do_stream;
+	uint8_t incremental;
+	uint8_t do_batch; /**< Process pairs of files given after the options */
+	enum NETPBM_BATCH_BACKEND batch_backend;
+	int arena_flags; /**< Flags of the buffer arena used for streams */
+
+	netpbm_cache_t cache; /**< Result cache, dir is NULL if disabled */
+
+	char *trace_path; /**< Write timeline of the processing here */
+
+	char *server_socket; /**< Run as server on this socket */
+	char *client_socket; /**< Send request to the server on this socket */
+};
+
+/**
+ * @brief options that affect the result, hashed into the cache key
+ */
+struct cache_opts {
+	uint32_t version; /**< Bumped when output of the same options changes */
+	uint8_t do_greyscale;
+	uint8_t do_sobel;
+	uint8_t do_region;
+	uint8_t do_stream;
+	netpbm_rect_t region;
+	uint32_t blur;
+	uint8_t bitmap;
+	uint8_t do_strip;
+	uint8_t threshold_mode;
+	uint32_t threshold;
+	uint32_t level;
+	uint32_t level_filter;
+	uint8_t thin;
+};
+
 
 void print_usage(char *binary_name)
 {
-	printf("Usage: %s -i ifilename -o filename [-g] [-p n_threads] [-h] [-s value]\n"
+	printf("Usage: %s -i ifilename -o filename [-g] [-p n_threads|auto] [-h] [-s value] [-b size]"
+		" [-r x,y,w,h] [-m [-d]] [-H] [-c cache_dir [-C size_mb]] [-k kernels] [-e]"
+		" [-1 mask|magnitude] [-R first,end] [-T trace] [-D] [-x] [-t otsu|value]"
+		" [-l level[,box|gaussian] [-L]] [-n] [-N]\n"
+		"       %s -M -i ifilename -o filename [-g] strip...\n"
+		"       %s -B auto|uring|stdio [-g] [-s value] [-b size] [-p n_threads|auto]"
+		" ifilename ofilename...\n"
+		"       %s -S socket [-p n_threads|auto]\n"
+		"       %s -A\n"
+		"       %s -U socket -i ifilename -o filename [-g] [-s value]\n"
 		"\t-i\t- Input file name. Required.\n"
 		"\t-o\t- Output file name. Required.\n"
 		"\t-g\t- turn image to greyscale. Required for RGB images\n"
-		"\t-p\t- split Sobel operator between n threads\n"
+		"\t-p\t- split Sobel operator and ASCII decoding/encoding "
+		"between n threads. With auto, threads are picked for each "
+		"image\n"
 		"\t-h\t- show this message and exit\n"
 		"\t-s\t- Apply Sobel operator to the image "
-		"if value is != 0. Enabled by default\n",
-		binary_name
+		"if value is != 0. Enabled by default\n"
+		"\t-b\t- smooth the image with 3x3 or 5x5 Gaussian kernel "
+		"before Sobel operator\n"
+		"\t-r\t- only process region of w x h pixels starting at "
+		"column x, row y\n"
+		"\t-m\t- process every image of a multi-image stream. "
+		"Use - for stdin/stdout\n"
+		"\t-d\t- with -m, only recompute Sobel for tiles that "
+		"changed since the previous image\n"
+		"\t-H\t- back large buffers with huge pages\n"
+		"\t-c\t- reuse results of the same input and options "
+		"stored in cache_dir\n"
+		"\t-C\t- limit cache size to size_mb megabytes. "
+		"Default is %d\n"
+		"\t-S\t- run as server, listening on the Unix socket\n"
+		"\t-U\t- let server on the Unix socket process the image, "
+		"with -g and -s only. Use - for stdin/stdout\n"
+		"\t-k\t- use scalar, sse2, avx2 or avx512 kernels instead of "
+		"the best ones the CPU supports\n"
+		"\t-A\t- measure this machine and store tuning profile "
+		"used by -p auto\n"
+		"\t-e\t- print hardware counters of Sobel operator threads\n"
+		"\t-1\t- apply Sobel operator to packed P4 image, writing "
+		"P4 edge mask or P5 magnitudes\n"
+		"\t-R\t- only process rows first to end - 1 of binary image, "
+		"writing them without header\n"
+		"\t-M\t- merge strips written with -R into the image, "
+		"taking its size from ifilename\n"
+		"\t-T\t- write timeline of worker threads and stages to the "
+		"trace file in Chrome trace event format\n"
+		"\t-D\t- let threads store rows of binary image straight to "
+		"the output file, P5 rows as soon as Sobel operator computes them\n"
+		"\t-x\t- print minimum, maximum, mean, percentiles and Otsu "
+		"threshold of Sobel operator results\n"
+		"\t-t\t- set results above the threshold, or the one picked "
+		"by Otsu's method, to maxval and others to 0\n"
+		"\t-l\t- process image downsampled level times by half, "
+		"averaging 2x2 pixels or weighting 4x4 pixels with Gaussian "
+		"kernel\n"
+		"\t-L\t- with -l, also write results of every lower level, "
+		"inserting -level before the extension of filename\n"
+		"\t-n\t- thin edges to one pixel, keeping only results that "
+		"are maxima along their gradient direction\n"
+		"\t-N\t- pin Sobel operator threads to CPUs spread over NUMA "
+		"nodes, and let each of them copy its own part of the image\n"
+		"\t-B\t- process every pair of input and output files given "
+		"after the options, reading and writing %d files at once with "
+		"io_uring, or stdio if it is not available\n",
+		binary_name, binary_name, binary_name, binary_name, binary_name,
+		binary_name, DEFAULT_CACHE_SIZE_MB, BATCH_FILES
 	);
 }
 
+/**
+ * @brief print statistics of Sobel operator results
+ */
+void print_histogram(FILE *file, const netpbm_histogram_t *histogram)
+{
+	double mean = histogram->pixels > 0
+		? (double) histogram->sum / histogram->pixels : 0;
+
+	fprintf(file, "Sobel results: min %u, max %u, mean %.2f\n",
+		histogram->min, histogram->max, mean);
+	fprintf(file, "Percentiles: 50%% %u, 90%% %u, 99%% %u\n",
+		netpbm_histogram_percentile(histogram, 50),
+		netpbm_histogram_percentile(histogram, 90),
+		netpbm_histogram_percentile(histogram, 99));
+	fprintf(file, "Otsu threshold: %u\n", netpbm_histogram_otsu(histogram));
+}
+
+/**
+ * @brief add time elapsed between start and finish to total
+ */
+void add_elapsed(struct timespec *total,
+		const struct timespec *start, const struct timespec *finish)
+{
+	total->tv_sec += finish->tv_sec - start->tv_sec;
+	// Nanoseconds can go negative, since they are the remainder.
+	// Adjust for it here.
+	total->tv_nsec += finish->tv_nsec - start->tv_nsec;
+	while (total->tv_nsec < 0) {
+		// Compiler doesn't like the engineering notation here
+		total->tv_nsec += 1000000000;
+		--total->tv_sec;
+	}
+	while (total->tv_nsec >= 1000000000) {
+		total->tv_nsec -= 1000000000;
+		++total->tv_sec;
+	}
+}
+
+/**
+ * @brief print hardware counters, marking the unavailable ones
+ */
+void print_counters(FILE *file, const uint64_t *counters, uint32_t valid)
+{
+	static const char *names[NETPBM_COUNTERS] = {
+		[NETPBM_COUNTER_CYCLES] = "cycles",
+		[NETPBM_COUNTER_INSTRUCTIONS] = "instructions",
+		[NETPBM_COUNTER_LLC_MISSES] = "LLC misses",
+		[NETPBM_COUNTER_BRANCH_MISSES] = "branch misses"
+	};
+
+	if (valid == 0) {
+		fprintf(file, "Hardware counters are not available\n");
+		return;
+	}
+
+	fprintf(file, "Hardware counters:");
+
+	for (int c = 0; c < NETPBM_COUNTERS; c++) {
+		if (valid & (1U << c))
+			fprintf(file, "%s %llu %s", c ? "," : "",
+				(unsigned long long) counters[c], names[c]);
+		else
+			fprintf(file, "%s %s n/a", c ? "," : "", names[c]);
+	}
+
+	const uint32_t ipc = (1U << NETPBM_COUNTER_CYCLES)
+		| (1U << NETPBM_COUNTER_INSTRUCTIONS);
+
+	if ((valid & ipc) == ipc && counters[NETPBM_COUNTER_CYCLES] > 0)
+		fprintf(file, " (%.2f instructions per cycle)",
+			(double) counters[NETPBM_COUNTER_INSTRUCTIONS]
+			/ counters[NETPBM_COUNTER_CYCLES]);
+
+	fprintf(file, "\n");
+}
+
+/**
+ * @brief get path of the tuning profile
+ *
+ * NETPBM_TUNING environment variable overrides the default path in the
+ * user configuration directory, which is created if create_dir is set.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int tuning_path(char *path, size_t size, int create_dir)
+{
+	const char *forced = getenv("NETPBM_TUNING");
+	const char *config = getenv("XDG_CONFIG_HOME");
+	const char *home = getenv("HOME");
+	char dir[PATH_MAX];
+
+	if (forced != NULL) {
+		if ((size_t) snprintf(path, size, "%s", forced) >= size)
+			goto too_long;
+		return 0;
+	}
+
+	if (config != NULL && config[0] != '\0') {
+		if ((size_t) snprintf(dir, sizeof(dir), "%s", config) >= sizeof(dir))
+			goto too_long;
+	} else if (home != NULL) {
+		if ((size_t) snprintf(dir, sizeof(dir), "%s/.config", home) >= sizeof(dir))
+			goto too_long;
+	} else {
+		fprintf(stderr, "Unable to find configuration directory\n");
+		return -1;
+	}
+
+	if (create_dir && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create directory %s: error %d\n",
+			dir, errno);
+		return -1;
+	}
+
+	if ((size_t) snprintf(path, size, "%s/ngsobel.tuning", dir) >= size)
+		goto too_long;
+
+	return 0;
+
+too_long:
+	fprintf(stderr, "Tuning profile path is too long\n");
+	return -1;
+}
+
+/**
+ * @brief measure costs of this machine and store them
+ */
+int calibrate(void)
+{
+	netpbm_tuning_t tuning;
+	char path[PATH_MAX];
+
+	if (tuning_path(path, sizeof(path), 1) != 0)
+		return -1;
+
+	if (netpbm_tuning_calibrate(&tuning) != 0)
+		return -1;
+
+	printf("Sobel operator takes %.3f nanoseconds per pixel\n"
+		"Starting a thread takes %.0f nanoseconds\n"
+		"Handing a task to a pool thread takes %.0f nanoseconds\n"
+		"%lu CPUs are available\n",
+		tuning.pixel_ns, tuning.thread_ns, tuning.task_ns,
+		netpbm_available_cpus());
+
+	if (netpbm_tuning_save(&tuning, path) != 0)
+		return -1;
+
+	printf("Tuning profile stored to %s\n", path);
+
+	return 0;
+}
+
+/**
+ * @brief state shared by processing of the stream images
+ */
+struct stream_state {
+	const struct options *opts;
+	netpbm_sobel_opts_t sobel_opts;
+	netpbm_delta_t delta;
+
+	struct timespec elapsed; /**< Time spent in Sobel operator */
+	size_t tiles_changed;
+	size_t tiles_total;
+	netpbm_sobel_stats_t frame_stats; /**< Work done on the last image */
+	size_t pixels;
+	size_t pixels_skipped;
+	uint64_t counters[NETPBM_COUNTERS];
+	uint32_t counters_valid; /**< Counters valid for every image */
+};
+
+/**
+ * @brief process one image of a stream, called by the pipeline
+ */
+int process_frame(netpbm_image_t *image, void *arg)
+{
+	struct stream_state *state = (struct stream_state *) arg;
+	const struct options *opts = state->opts;
+
+	if (opts->do_greyscale && netpbm_to_greyscale(image) != 0)
+		return -1;
+
+	if (!opts->do_sobel)
+		return 0;
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (opts->incremental) {
+		if (netpbm_sobel_delta(&state->delta, image, opts->n_threads) != 0)
+			return -1;
+
+		state->tiles_changed += state->delta.tiles_changed;
+		state->tiles_total += (size_t)state->delta.tiles_x
+			* state->delta.tiles_y;
+	} else {
+		if (opts->auto_tune)
+			netpbm_sobel_tune(&opts->tuning, image, &state->sobel_opts);
+
+		if (netpbm_sobel_ext(image, &state->sobel_opts) != 0)
+			return -1;
+
+		state->pixels += state->frame_stats.pixels;
+		state->pixels_skipped += state->frame_stats.skipped;
+		state->counters_valid &= state->frame_stats.counters_valid;
+
+		for (int c = 0; c < NETPBM_COUNTERS; c++)
+			state->counters[c] += state->frame_stats.counters[c];
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	add_elapsed(&state->elapsed, &start, &finish);
+
+	return 0;
+}
+
+/**
+ * @brief process every image of a multi-image stream
+ *
+ * Next image is read and previous one is written while the current one is
+ * processed. Buffers and worker threads are reused between images.
+ * Messages are printed to stderr, since output stream may be stdout.
+ */
+int process_stream(const struct options *opts)
+{
+	netpbm_stream_t istream, ostream;
+	struct stream_state state = {
+		.opts = opts,
+		.counters_valid = (1U << NETPBM_COUNTERS) - 1
+	};
+	struct timespec start, finish;
+	int ret = -1;
+
+	if (netpbm_stream_open(&istream, opts->ifilename, "r") != 0)
+		return -1;
+
+	if (netpbm_stream_open(&ostream, opts->ofilename, "w") != 0) {
+		netpbm_stream_close(&istream);
+		return -1;
+	}
+
+	netpbm_pool_t *pool = netpbm_pool_create(opts->n_threads);
+	netpbm_arena_t *arena = netpbm_arena_create(opts->arena_flags);
+	if (pool == NULL || arena == NULL)
+		goto out;
+
+	istream.arena = arena;
+	ostream.arena = arena;
+
+	state.sobel_opts = (netpbm_sobel_opts_t){
+		.n_threads = opts->n_threads,
+		.pool = pool,
+		.arena = arena,
+		.blur = opts->blur,
+		.stats = &state.frame_stats,
+		.counters = opts->counters,
+		.pin = opts->pin
+	};
+
+	if (opts->pin && netpbm_pool_pin(pool) != 0)
+		fprintf(stderr, "Unable to pin threads, running them unpinned\n");
+
+	netpbm_delta_init(&state.delta, 0);
+	state.delta.pool = pool;
+	state.delta.arena = arena;
+
+	netpbm_pipeline_t pipeline = {
+		.input = &istream,
+		.output = &ostream,
+		.process = process_frame,
+		.arg = &state
+	};
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = netpbm_pipeline_run(&pipeline);
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	netpbm_delta_free(&state.delta);
+
+	if (ret == 0) {
+		struct timespec total = { 0, 0 };
+		add_elapsed(&total, &start, &finish);
+
+		fprintf(stderr, "Processed %zu images in %li seconds and %li nanoseconds\n",
+			ostream.count, total.tv_sec, total.tv_nsec);
+
+		if (opts->do_sobel)
+			fprintf(stderr, "Sobel algorithm took %li seconds and %li nanoseconds\n",
+				state.elapsed.tv_sec, state.elapsed.tv_nsec);
+
+		if (opts->do_sobel && opts->incremental)
+			fprintf(stderr, "Recomputed %zu of %zu tiles\n",
+				state.tiles_changed, state.tiles_total);
+		else if (opts->do_sobel && state.pixels > 0)
+			fprintf(stderr, "Skipped %.1f%% of pixels in uniform tiles\n",
+				100.0 * state.pixels_skipped / state.pixels);
+
+		if (opts->do_sobel && !opts->incremental && opts->counters)
+			print_counters(stderr, state.counters, state.counters_valid);
+
+		netpbm_arena_stats_t stats;
+		netpbm_arena_stats(arena, &stats);
+		fprintf(stderr, "Reused %zu of %zu buffers, holding %zu KiB\n",
+			stats.reused, stats.requests, stats.bytes >> 10);
+	}
+
+out:
+	netpbm_pool_destroy(pool);
+	// image data belongs to the arena
+	netpbm_arena_destroy(arena);
+
+	if (netpbm_stream_close(&ostream) != 0)
+		ret = -1;
+	netpbm_stream_close(&istream);
+
+	return ret;
+}
+
+/**
+ * @brief files of a batch and their images
+ *
+ * Batches take turns in two groups, so that one group is processed while
+ * the other writes results of the previous batch and reads the next one.
+ */
+struct batch_group {
+	netpbm_batch_t *batch; /**< Own requests and buffer of the group */
+	netpbm_image_t images[BATCH_FILES];
+	char *inputs[BATCH_FILES];
+	char *outputs[BATCH_FILES];
+	size_t count; /**< Images held, written by the next batch_group_io() */
+
+	char **files; /**< Input and output filename of every pair */
+	size_t n_pairs;
+	size_t first; /**< Pair to read next, n_pairs to only write */
+	unsigned long n_threads;
+	int ret; /**< Result of batch_group_io() on its own thread */
+};
+
+/**
+ * @brief Helper function that writes images held by the group, and reads
+ * the next batch of files into it
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int batch_group_io(struct batch_group *group)
+{
+	if (group->count > 0) {
+		int ret = netpbm_batch_write(group->batch, group->outputs,
+			group->images, group->count, group->n_threads);
+
+		for (size_t i = 0; i < group->count; i++)
+			free_netpbm_image(&group->images[i]);
+		group->count = 0;
+
+		if (ret != 0)
+			return -1;
+	}
+
+	if (group->first >= group->n_pairs)
+		return 0;
+
+	size_t count = group->n_pairs - group->first < BATCH_FILES
+		? group->n_pairs - group->first : BATCH_FILES;
+
+	for (size_t i = 0; i < count; i++) {
+		group->inputs[i] = group->files[2 * (group->first + i)];
+		group->outputs[i] = group->files[2 * (group->first + i) + 1];
+	}
+
+	if (netpbm_batch_read(group->batch, group->inputs, group->images,
+			count, group->n_threads) != 0)
+		return -1;
+
+	group->count = count;
+
+	return 0;
+}
+
+static void *batch_io_task(void *arguments)
+{
+	struct batch_group *group = (struct batch_group *) arguments;
+
+	group->ret = batch_group_io(group);
+
+	return NULL;
+}
+
+/**
+ * @brief process pairs of input and output files
+ *
+ * Files are read BATCH_FILES at a time, so that their requests are in
+ * flight together, and images are processed one after another by the
+ * pool. Meanwhile, results of the previous batch are written and the next
+ * batch is read on another thread, so the pool doesn't wait for the disk.
+ *
+ * @param[in] files - input and output filename of every pair
+ * @param[in] n_pairs - amount of the pairs
+ */
+int process_batch(const struct options *opts, char **files, size_t n_pairs)
+{
+	struct stream_state state = {
+		.opts = opts,
+		.counters_valid = (1U << NETPBM_COUNTERS) - 1
+	};
+	struct batch_group groups[2];
+	struct timespec start, finish;
+	int ret = -1;
+
+	for (size_t g = 0; g < 2; g++) {
+		groups[g] = (struct batch_group){
+			.batch = netpbm_batch_create(opts->batch_backend, 0),
+			.files = files,
+			.n_pairs = n_pairs,
+			.n_threads = opts->n_threads
+		};
+	}
+
+	netpbm_pool_t *pool = netpbm_pool_create(opts->n_threads);
+	netpbm_arena_t *arena = netpbm_arena_create(opts->arena_flags);
+	if (groups[0].batch == NULL || groups[1].batch == NULL
+		|| pool == NULL || arena == NULL)
+		goto out;
+
+	state.sobel_opts = (netpbm_sobel_opts_t){
+		.n_threads = opts->n_threads,
+		.pool = pool,
+		.arena = arena,
+		.blur = opts->blur,
+		.stats = &state.frame_stats,
+		.counters = opts->counters,
+		.pin = opts->pin
+	};
+
+	if (opts->pin && netpbm_pool_pin(pool) != 0)
+		fprintf(stderr, "Unable to pin threads, running them unpinned\n");
+
+	printf("Using %s for file I/O\n",
+		netpbm_batch_backend(groups[0].batch) == NETPBM_BATCH_URING
+		? "io_uring" : "stdio");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// nothing to process while the first batch is read
+	if (batch_group_io(&groups[0]) != 0)
+		goto out;
+
+	for (size_t first = 0; first < n_pairs; first += BATCH_FILES) {
+		struct batch_group *current = &groups[first / BATCH_FILES % 2];
+		struct batch_group *other = &groups[(first / BATCH_FILES + 1) % 2];
+		pthread_t io;
+
+		other->first = first + BATCH_FILES;
+		if (pthread_create(&io, NULL, batch_io_task, other) != 0) {
+			fprintf(stderr, "Unable to create batch I/O thread\n");
+			goto out;
+		}
+
+		int processed = 0;
+
+		for (size_t i = 0; i < current->count; i++) {
+			processed = process_frame(&current->images[i], &state) == 0;
+			if (!processed)
+				break;
+		}
+
+		// images of the other group are only touched by its thread
+		pthread_join(io, NULL);
+
+		if (!processed || other->ret != 0)
+			goto out;
+	}
+
+	// results of the last batch have nothing to overlap with
+	struct batch_group *last = &groups[(n_pairs - 1) / BATCH_FILES % 2];
+
+	last->first = n_pairs;
+	if (batch_group_io(last) != 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	struct timespec total = { 0, 0 };
+	add_elapsed(&total, &start, &finish);
+
+	printf("Processed %zu images in %li seconds and %li nanoseconds\n",
+		n_pairs, total.tv_sec, total.tv_nsec);
+
+	if (opts->do_sobel) {
+		printf("Sobel algorithm took %li seconds and %li nanoseconds\n",
+			state.elapsed.tv_sec, state.elapsed.tv_nsec);
+
+		if (state.pixels > 0)
+			printf("Skipped %.1f%% of pixels in uniform tiles\n",
+				100.0 * state.pixels_skipped / state.pixels);
+
+		if (opts->counters)
+			print_counters(stdout, state.counters, state.counters_valid);
+	}
+
+	ret = 0;
+
+out:
+	for (size_t g = 0; g < 2; g++) {
+		for (size_t i = 0; i < groups[g].count; i++)
+			free_netpbm_image(&groups[g].images[i]);
+
+		netpbm_batch_destroy(groups[g].batch);
+	}
+
+	netpbm_pool_destroy(pool);
+	netpbm_arena_destroy(arena);
+
+	return ret;
+}
+
+/**
+ * @brief apply Sobel operator, thinning the edges if requested
+ *
+ * Directions of the gradients are stored by Sobel workers, so they are
+ * not computed again for non-maximum suppression.
+ */
+int find_edges(const struct options *opts, netpbm_image_t *image,
+		netpbm_sobel_opts_t *sobel_opts)
+{
+	if (!opts->thin)
+		return netpbm_sobel_ext(image, sobel_opts);
+
+	uint8_t *direction = (uint8_t *) malloc((size_t)image->width
+		* image->height + 1);
+
+	if (direction == NULL) {
+		fprintf(stderr, "Unable to allocate memory for directions\n");
+		return -1;
+	}
+
+	sobel_opts->direction = direction;
+
+	int ret = netpbm_sobel_ext(image, sobel_opts);
+
+	if (ret == 0)
+		ret = netpbm_suppress_nonmaxima(image, direction, sobel_opts);
+
+	sobel_opts->direction = NULL;
+	free(direction);
+
+	return ret;
+}
+
+/**
+ * @brief get filename of the pyramid level, inserting -level before
+ * the extension
+ */
+void level_filename(const char *filename, uint32_t level, char *path,
+		size_t size)
+{
+	const char *slash = strrchr(filename, '/');
+	const char *dot = strrchr(filename, '.');
+
+	if (dot == NULL || (slash != NULL && dot < slash))
+		dot = filename + strlen(filename);
+
+	snprintf(path, size, "%.*s-%u%s", (int)(dot - filename), filename,
+		level, dot);
+}
+
+/**
+ * @brief replace image with the level of its pyramid
+ *
+ * With all_levels, Sobel operator results of the image and lower levels
+ * are written to their own files.
+ */
+int pyramid_level(const struct options *opts, netpbm_image_t *image)
+{
+	int pixmap = image->type == NETPBM_ASCII_PIXMAP
+		|| image->type == NETPBM_BINARY_PIXMAP;
+
+	if (pixmap && !opts->do_greyscale) {
+		fprintf(stderr, "Turn image into greyscale first using -g flag\n");
+		return -1;
+	}
+
+	/* Otherwise the first downsampling turns pixmaps grey on its own */
+	if (pixmap && opts->all_levels && netpbm_to_greyscale(image) != 0)
+		return -1;
+
+	netpbm_image_t *levels = (netpbm_image_t *) calloc(opts->level,
+		sizeof(netpbm_image_t));
+
+	if (levels == NULL) {
+		fprintf(stderr, "Unable to allocate memory for pyramid\n");
+		return -1;
+	}
+
+	if (netpbm_pyramid(image, levels, opts->level, opts->level_filter) != 0) {
+		free(levels);
+		return -1;
+	}
+
+	int ret = 0;
+
+	for (uint32_t k = 0; opts->all_levels && k < opts->level; k++) {
+		netpbm_image_t *level = k == 0 ? image : &levels[k - 1];
+		netpbm_sobel_opts_t sobel_opts = {
+			.n_threads = opts->n_threads,
+			.blur = opts->blur,
+			.pin = opts->pin
+		};
+		char path[PATH_MAX];
+
+		level_filename(opts->ofilename, k, path, sizeof(path));
+
+		if ((opts->do_sobel && find_edges(opts, level, &sobel_opts) != 0)
+			|| write_netpbm_file_mt(path, level, opts->n_threads) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	for (uint32_t k = 0; k + 1 < opts->level; k++)
+		free_netpbm_image(&levels[k]);
+
+	free_netpbm_image(image);
+	*image = levels[opts->level - 1];
+	free(levels);
+
+	return ret;
+}
+
+/**
+ * @brief process single image, or region of it
+ */
+int process_image(const struct options *opts)
+{
+	netpbm_image_t image;
+	netpbm_rect_t region = opts->region;
+
+	if (!opts->do_region) {
+		if (read_netpbm_file_mt(opts->ifilename, &image, NULL,
+				opts->n_threads) != 0)
+			return -1;
+	} else {
+		/* Sobel operator needs neighbours of the edge pixels, and
+		 * smoothing needs neighbours of those, so region is loaded with
+		 * a halo, which is cropped away later. Suppression compares
+		 * results with their neighbours, which widens it by a pixel
+		 */
+		uint32_t halo = opts->do_sobel
+			? 1 + opts->blur / 2 + (opts->thin ? 1 : 0) : 0;
+		netpbm_rect_t loaded = {
+			.x = region.x > halo ? region.x - halo : 0,
+			.y = region.y > halo ? region.y - halo : 0,
+		};
+		uint64_t right = (uint64_t)region.x + region.width + halo;
+		uint64_t bottom = (uint64_t)region.y + region.height + halo;
+
+		loaded.width = right - loaded.x > UINT32_MAX
+			? UINT32_MAX : right - loaded.x;
+		loaded.height = bottom - loaded.y > UINT32_MAX
+			? UINT32_MAX : bottom - loaded.y;
+
+		if (read_netpbm_file_mt(opts->ifilename, &image, &loaded,
+				opts->n_threads) != 0)
+			return -1;
+
+		/* Translate region into coordinates of the loaded image */
+		region.x -= loaded.x;
+		region.y -= loaded.y;
+
+		if (region.x >= loaded.width || region.y >= loaded.height) {
+			fprintf(stderr, "Region is outside of the image\n");
+			free_netpbm_image(&image);
+			return -1;
+		}
+
+		if (region.width > loaded.width - region.x)
+			region.width = loaded.width - region.x;
+		if (region.height > loaded.height - region.y)
+			region.height = loaded.height - region.y;
+	}
+
+	if (opts->level > 0) {
+		if (pyramid_level(opts, &image) != 0) {
+			free_netpbm_image(&image);
+			return -1;
+		}
+	} else if (opts->do_greyscale && netpbm_to_greyscale(&image) != 0) {
+		free_netpbm_image(&image);
+		return -1;
+	}
+
+	/* Sobel workers store greymap rows to the file as they compute them,
+	 * unless the image is cropped, thinned or thresholded afterwards
+	 */
+	netpbm_output_t output;
+	int stored = opts->direct && opts->do_sobel && !opts->do_region
+		&& !opts->thin && !opts->threshold_mode
+		&& image.type == NETPBM_BINARY_GREYMAP;
+	netpbm_histogram_t histogram = { .bins = NULL };
+
+	if (stored && netpbm_output_open(&output, opts->ofilename, &image) != 0) {
+		free_netpbm_image(&image);
+		return -1;
+	}
+
+	if (opts->do_sobel) {
+		struct timespec start, finish;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		netpbm_sobel_stats_t stats = { 0 };
+		netpbm_sobel_opts_t sobel_opts = {
+			.n_threads = opts->n_threads,
+			.blur = opts->blur,
+			.stats = &stats,
+			.counters = opts->counters,
+			.output = stored ? &output : NULL,
+			.histogram = opts->print_stats
+				|| opts->threshold_mode == THRESHOLD_OTSU
+				? &histogram : NULL,
+			.pin = opts->pin
+		};
+
+		if (opts->auto_tune) {
+			netpbm_sobel_tune(&opts->tuning, &image, &sobel_opts);
+			printf("Using %lu threads\n", sobel_opts.n_threads);
+		}
+
+		int ret = find_edges(opts, &image, &sobel_opts);
+
+		if (stored && netpbm_output_close(&output) != 0)
+			ret = -1;
+
+		if (ret != 0) {
+			netpbm_histogram_free(&histogram);
+			free_netpbm_image(&image);
+			return -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+
+		struct timespec elapsed = { 0, 0 };
+		add_elapsed(&elapsed, &start, &finish);
+
+		// Decimals not used for more precise comparisons
+		printf("Sobel algorithm took %li seconds and %li nanoseconds\n",
+			elapsed.tv_sec, elapsed.tv_nsec);
+
+		if (stats.pixels > 0)
+			printf("Skipped %.1f%% of pixels in uniform tiles\n",
+				100.0 * stats.skipped / stats.pixels);
+
+		if (opts->counters)
+			print_counters(stdout, stats.counters, stats.counters_valid);
+
+		if (opts->print_stats)
+			print_histogram(stdout, &histogram);
+	}
+
+	uint32_t threshold = opts->threshold_mode == THRESHOLD_OTSU
+		? netpbm_histogram_otsu(&histogram) : opts->threshold;
+
+	netpbm_histogram_free(&histogram);
+
+	if (opts->threshold_mode && netpbm_threshold(&image, threshold) != 0) {
+		free_netpbm_image(&image);
+		return -1;
+	}
+
+	if (opts->do_region && netpbm_crop(&image, &region) != 0) {
+		free_netpbm_image(&image);
+		return -1;
+	}
+
+	int ret = 0;
+
+	if (opts->do_strip)
+		ret = write_netpbm_strip(opts->ofilename, &image);
+	else if (opts->direct && NETPBM_TYPE_IS_BINARY(image.type))
+		ret = stored ? 0 : write_netpbm_file_direct(opts->ofilename,
+			&image, opts->n_threads);
+	else
+		ret = write_netpbm_file_mt(opts->ofilename, &image, opts->n_threads);
+
+	free_netpbm_image(&image);
+
+	return ret;
+}
+
+/**
+ * @brief stitch strips into the image that a single run would write
+ */
+int merge_strips(const struct options *opts, char **strips, size_t n_strips)
+{
+	netpbm_image_t header;
+
+	if (read_netpbm_file_header(opts->ifilename, &header) != 0)
+		return -1;
+
+	// greyscale conversion is the only option that changes the header
+	if (opts->do_greyscale && (header.type == NETPBM_ASCII_PIXMAP
+		|| header.type == NETPBM_BINARY_PIXMAP))
+		header.type -= 1;
+
+	return netpbm_merge_strips(opts->ofilename, &header, strips, n_strips);
+}
+
+/**
+ * @brief find edges of P4 image without unpacking it
+ */
+int process_bitmap(const struct options *opts)
+{
+	netpbm_bitmap_t bitmap, edges = { .data = NULL };
+	uint8_t *magnitudes = NULL;
+	int ret = -1;
+
+	if (read_netpbm_bitmap(opts->ifilename, &bitmap) != 0)
+		return -1;
+
+	if (opts->bitmap == BITMAP_MASK) {
+		if (netpbm_bitmap_alloc(&edges, bitmap.width, bitmap.height) != 0)
+			goto out;
+	} else {
+		magnitudes = (uint8_t *) malloc((size_t)bitmap.width * bitmap.height + 1);
+		if (magnitudes == NULL) {
+			fprintf(stderr, "Unable to allocate memory for output\n");
+			goto out;
+		}
+	}
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	netpbm_sobel_opts_t sobel_opts = { .n_threads = opts->n_threads };
+
+	if (netpbm_sobel_bitmap(&bitmap, edges.data ? &edges : NULL,
+			magnitudes, &sobel_opts) != 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	struct timespec elapsed = { 0, 0 };
+	add_elapsed(&elapsed, &start, &finish);
+
+	printf("Sobel algorithm took %li seconds and %li nanoseconds\n",
+		elapsed.tv_sec, elapsed.tv_nsec);
+
+	if (opts->bitmap == BITMAP_MASK)
+		ret = write_netpbm_bitmap(opts->ofilename, &edges);
+	else
+		ret = write_netpbm_bytes(opts->ofilename, bitmap.width,
+			bitmap.height, magnitudes);
+
+out:
+	free(magnitudes);
+	free_netpbm_bitmap(&edges);
+	free_netpbm_bitmap(&bitmap);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	// Parse arguments
 	int c;
 	extern char *optarg;
 
-	char *ifilename = NULL;
-	char *ofilename = NULL;
-	unsigned long n_threads = 1;
-	unsigned long do_sobel = 1;
-
-	uint8_t do_greyscale = 0;
+	struct options opts = {
+		.n_threads = 1,
+		.do_sobel = 1,
+		.cache.max_size = (uint64_t)DEFAULT_CACHE_SIZE_MB << 20
+	};
 
-	while ((c = getopt(argc, argv, "i:o:p:ghs:")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:p:ghs:b:r:mdHc:C:S:U:k:Ae1:R:MT:Dxt:l:LnNB:")) != -1) {
 		switch (c) {
 		case 'i':
 			/* Man page does not state whether optarg must be
@@ -63,19 +1065,159 @@ int main(int argc, char *argv[])
 			 * element. However, to avoid problems with different
 			 * implementation, I explicitly copy it.
 			 */
-			ifilename = strdup(optarg);
+			opts.ifilename = strdup(optarg);
 			break;
 		case 'o':
-			ofilename = strdup(optarg);
+			opts.ofilename = strdup(optarg);
 			break;
 		case 'p':
-			n_threads = strtoul(optarg, NULL, 10);
+			// threads for decoding and pools, Sobel picks its own
+			if (strcmp(optarg, "auto") == 0) {
+				opts.auto_tune = 1;
+				opts.n_threads = netpbm_available_cpus();
+			} else {
+				opts.auto_tune = 0;
+				opts.n_threads = strtoul(optarg, NULL, 10);
+			}
 			break;
 		case 'g':
-			do_greyscale = 1;
+			opts.do_greyscale = 1;
 			break;
 		case 's':
-			do_sobel = strtoul(optarg, NULL, 10);
+			opts.do_sobel = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts.blur = strtoul(optarg, NULL, 10);
+			if (opts.blur != 3 && opts.blur != 5) {
+				fprintf(stderr, "Blur kernel size must be 3 or 5\n");
+				return -1;
+			}
+			break;
+		case 'r':
+			if (sscanf(optarg, "%u,%u,%u,%u",
+					&opts.region.x, &opts.region.y,
+					&opts.region.width, &opts.region.height) != 4
+				|| opts.region.width == 0 || opts.region.height == 0
+			) {
+				fprintf(stderr, "Invalid region, expected x,y,w,h\n");
+				return -1;
+			}
+			opts.do_region = 1;
+			break;
+		case 'R':
+			if (sscanf(optarg, "%u,%u", &opts.strip_start,
+					&opts.strip_end) != 2
+				|| opts.strip_start >= opts.strip_end
+			) {
+				fprintf(stderr, "Invalid strip, expected first,end rows\n");
+				return -1;
+			}
+			opts.do_strip = 1;
+			break;
+		case 'M':
+			opts.do_merge = 1;
+			break;
+		case 'T':
+			opts.trace_path = strdup(optarg);
+			break;
+		case 'D':
+			opts.direct = 1;
+			break;
+		case 'x':
+			opts.print_stats = 1;
+			break;
+		case 'l': {
+			char filter[16] = "box";
+
+			if (sscanf(optarg, "%u,%15s", &opts.level, filter) < 1
+				|| opts.level == 0 || opts.level > 16) {
+				fprintf(stderr, "Level must be from 1 to 16\n");
+				return -1;
+			}
+
+			if (strcmp(filter, "box") == 0) {
+				opts.level_filter = NETPBM_DOWNSAMPLE_BOX;
+			} else if (strcmp(filter, "gaussian") == 0) {
+				opts.level_filter = NETPBM_DOWNSAMPLE_GAUSSIAN;
+			} else {
+				fprintf(stderr, "Filter must be box or gaussian\n");
+				return -1;
+			}
+			break;
+		}
+		case 'L':
+			opts.all_levels = 1;
+			break;
+		case 'n':
+			opts.thin = 1;
+			break;
+		case 'N':
+			opts.pin = 1;
+			break;
+		case 't':
+			if (strcmp(optarg, "otsu") == 0) {
+				opts.threshold_mode = THRESHOLD_OTSU;
+			} else if (sscanf(optarg, "%u", &opts.threshold) == 1) {
+				opts.threshold_mode = THRESHOLD_VALUE;
+			} else {
+				fprintf(stderr, "Threshold must be otsu or a value\n");
+				return -1;
+			}
+			break;
+		case 'B':
+			if (strcmp(optarg, "auto") == 0) {
+				opts.batch_backend = NETPBM_BATCH_AUTO;
+			} else if (strcmp(optarg, "uring") == 0) {
+				opts.batch_backend = NETPBM_BATCH_URING;
+			} else if (strcmp(optarg, "stdio") == 0) {
+				opts.batch_backend = NETPBM_BATCH_STDIO;
+			} else {
+				fprintf(stderr, "Batch I/O must be auto, uring or stdio\n");
+				return -1;
+			}
+			opts.do_batch = 1;
+			break;
+		case 'm':
+			opts.do_stream = 1;
+			break;
+		case 'd':
+			opts.incremental = 1;
+			break;
+		case 'H':
+			opts.arena_flags |= NETPBM_ARENA_HUGE_PAGES;
+			netpbm_set_huge_pages(1);
+			break;
+		case 'c':
+			opts.cache.dir = strdup(optarg);
+			break;
+		case 'C':
+			opts.cache.max_size = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'S':
+			opts.server_socket = strdup(optarg);
+			break;
+		case 'U':
+			opts.client_socket = strdup(optarg);
+			break;
+		case 'k':
+			if (netpbm_set_kernels(optarg) == -1)
+				return -1;
+			break;
+		case 'A':
+			opts.calibrate = 1;
+			break;
+		case 'e':
+			opts.counters = 1;
+			break;
+		case '1':
+			if (strcmp(optarg, "mask") == 0) {
+				opts.bitmap = BITMAP_MASK;
+			} else if (strcmp(optarg, "magnitude") == 0) {
+				opts.bitmap = BITMAP_MAGNITUDE;
+			} else {
+				fprintf(stderr, "Bitmap output must be mask or magnitude\n");
+				return -1;
+			}
 			break;
 		case 'h':
 			print_usage(argv[0]);
@@ -89,59 +1231,276 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (n_threads == 0 || n_threads == ULONG_MAX) {
+	if (opts.n_threads == 0 || opts.n_threads == ULONG_MAX) {
 		fprintf(stderr, "Invalid number of threads\n");
 		return -1;
 	}
 
-	if (ifilename == NULL) {
+	if (opts.calibrate)
+		return calibrate();
+
+	if (opts.auto_tune) {
+		char path[PATH_MAX];
+
+		// guesses are still better than nothing without a profile
+		netpbm_tuning_default(&opts.tuning);
+		if (tuning_path(path, sizeof(path), 0) == 0)
+			netpbm_tuning_load(&opts.tuning, path);
+	}
+
+	if (opts.trace_path != NULL && (opts.server_socket != NULL
+		|| opts.client_socket != NULL)) {
+		fprintf(stderr, "Trace can't be used with server processing\n");
+		return -1;
+	}
+
+	if (opts.server_socket != NULL) {
+		int ret = server_run(opts.server_socket, opts.n_threads);
+		free(opts.server_socket);
+		return ret;
+	}
+
+	if (opts.do_batch) {
+		if (opts.ifilename != NULL || opts.ofilename != NULL
+			|| optind == argc || (argc - optind) % 2 != 0) {
+			fprintf(stderr, "Please specify pairs of input and output "
+					"files after the options\n");
+			return -1;
+		}
+
+		if (opts.do_stream || opts.incremental || opts.do_region
+			|| opts.do_strip || opts.do_merge || opts.direct
+			|| opts.bitmap || opts.print_stats || opts.threshold_mode
+			|| opts.level || opts.thin || opts.cache.dir != NULL
+			|| opts.client_socket != NULL) {
+			fprintf(stderr, "Batches can only be turned greyscale "
+					"and processed by Sobel operator\n");
+			return -1;
+		}
+
+		int ret = -1;
+
+		if (opts.trace_path == NULL
+			|| netpbm_trace_start(opts.trace_path) == 0) {
+			ret = process_batch(&opts, argv + optind,
+				(argc - optind) / 2);
+
+			if (opts.trace_path != NULL && netpbm_trace_stop() != 0)
+				ret = -1;
+		}
+
+		free(opts.trace_path);
+		return ret;
+	}
+
+	if (opts.ifilename == NULL) {
 		fprintf(stderr, "Please specify input file using -i flag. "
 				"Check -h flag for usage\n");
 		return -1;
 	}
 
-	if (ofilename == NULL) {
+	if (opts.ofilename == NULL) {
 		fprintf(stderr, "Please specify output file using -o flag. "
 				"Check -h flag for usage\n");
 		return -1;
 	}
 
-	netpbm_image_t image;
+	if (opts.do_stream && opts.do_region) {
+		fprintf(stderr, "Region can't be used with streams\n");
+		return -1;
+	}
 
-	if (read_netpbm_file(ifilename, &image) != 0)
+	if (opts.blur && (opts.incremental || opts.client_socket != NULL)) {
+		fprintf(stderr, "Blur can't be used with incremental "
+				"or server processing\n");
 		return -1;
+	}
 
-	if (do_greyscale && netpbm_to_greyscale(&image) != 0)
+	if (opts.bitmap && (opts.do_stream || opts.do_region || opts.blur
+		|| opts.do_greyscale || !opts.do_sobel
+		|| opts.client_socket != NULL)) {
+		fprintf(stderr, "Packed bitmaps are only processed by Sobel "
+				"operator, without other options\n");
 		return -1;
+	}
 
-	if (do_sobel) {
-		struct timespec start, finish;
-		clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((opts.do_strip || opts.do_merge) && (opts.do_stream
+		|| opts.do_region || opts.bitmap || opts.client_socket != NULL
+		|| (opts.do_strip && opts.do_merge))) {
+		fprintf(stderr, "Strips can't be used with streams, regions, "
+				"bitmaps or server processing\n");
+		return -1;
+	}
+
+	if (opts.direct && (opts.do_stream || opts.do_strip || opts.do_merge
+		|| opts.bitmap || opts.client_socket != NULL)) {
+		fprintf(stderr, "Output can't be stored in place for streams, "
+				"strips, bitmaps or server processing\n");
+		return -1;
+	}
+
+	if ((opts.print_stats || opts.threshold_mode) && (!opts.do_sobel
+		|| opts.do_stream || opts.bitmap || opts.do_merge
+		|| opts.client_socket != NULL)) {
+		fprintf(stderr, "Statistics and thresholds need Sobel operator "
+				"on a single image\n");
+		return -1;
+	}
+
+	/* Results around the region are counted too, and every strip would
+	 * pick its own threshold
+	 */
+	if ((opts.print_stats || opts.threshold_mode == THRESHOLD_OTSU)
+		&& (opts.do_region || opts.do_strip)) {
+		fprintf(stderr, "Statistics can't be computed for regions "
+				"or strips\n");
+		return -1;
+	}
+
+	if (opts.thin && (!opts.do_sobel || opts.do_stream || opts.bitmap
+		|| opts.do_merge || opts.client_socket != NULL)) {
+		fprintf(stderr, "Edges can only be thinned by Sobel operator "
+				"on a single image\n");
+		return -1;
+	}
+
+	if (opts.level && (opts.do_stream || opts.do_region || opts.do_strip
+		|| opts.do_merge || opts.bitmap || opts.client_socket != NULL)) {
+		fprintf(stderr, "Pyramid levels can't be used with streams, "
+				"regions, strips, bitmaps or server processing\n");
+		return -1;
+	}
+
+	/* Server processes whole images with its own threads, so only
+	 * greyscale and Sobel operator are passed to it
+	 */
+	if (opts.client_socket != NULL && (opts.do_stream || opts.incremental
+		|| opts.do_region || opts.cache.dir != NULL || opts.counters
+		|| opts.pin || opts.arena_flags || opts.auto_tune
+		|| opts.n_threads != 1)) {
+		fprintf(stderr, "Streams, regions, cache, counters, threads, "
+				"pinning and huge pages can't be used with "
+				"server processing\n");
+		return -1;
+	}
+
+	if (opts.all_levels && (!opts.level || strcmp(opts.ofilename, "-") == 0)) {
+		fprintf(stderr, "All levels can only be written with -l "
+				"to a file\n");
+		return -1;
+	}
+
+	if (opts.do_merge && optind == argc) {
+		fprintf(stderr, "Please specify strips to merge after the options\n");
+		return -1;
+	}
+
+	if (opts.do_merge) {
+		int ret = merge_strips(&opts, argv + optind, argc - optind);
+
+		free(opts.ifilename);
+		free(opts.ofilename);
+		return ret;
+	}
+
+	if (opts.do_strip) {
+		/* Strip is a region spanning the whole width, so it is
+		 * loaded with the halo rows and cropped the same way
+		 */
+		opts.do_region = 1;
+		opts.region = (netpbm_rect_t){
+			.x = 0,
+			.y = opts.strip_start,
+			.width = UINT32_MAX,
+			.height = opts.strip_end - opts.strip_start
+		};
+	}
+
+	if (opts.client_socket != NULL) {
+		int ret = client_request(opts.client_socket,
+			opts.ifilename, opts.ofilename,
+			opts.do_greyscale, opts.do_sobel != 0);
 
-		if (netpbm_sobel(&image, n_threads) != 0)
+		free(opts.client_socket);
+		free(opts.ifilename);
+		free(opts.ofilename);
+		return ret;
+	}
+
+	/* Cache works on whole files, so pipes are never cached. Statistics
+	 * and lower pyramid levels are only known after processing
+	 */
+	int use_cache = opts.cache.dir != NULL && !opts.print_stats
+		&& !opts.all_levels
+		&& strcmp(opts.ifilename, "-") != 0
+		&& strcmp(opts.ofilename, "-") != 0;
+	uint64_t cache_key = 0;
+	int ret;
+
+	if (use_cache) {
+		struct cache_opts key_opts;
+
+		// padding is hashed too, so it must be zeroed
+		memset(&key_opts, 0, sizeof(key_opts));
+		key_opts.version = 1;
+		key_opts.do_greyscale = opts.do_greyscale;
+		key_opts.do_sobel = opts.do_sobel != 0;
+		key_opts.do_region = opts.do_region;
+		key_opts.do_stream = opts.do_stream;
+		key_opts.blur = opts.do_sobel ? opts.blur : 0;
+		key_opts.bitmap = opts.bitmap;
+		key_opts.do_strip = opts.do_strip;
+		key_opts.threshold_mode = opts.threshold_mode;
+		key_opts.threshold = opts.threshold;
+		key_opts.level = opts.level;
+		key_opts.level_filter = opts.level_filter;
+		key_opts.thin = opts.thin;
+		if (opts.do_region)
+			key_opts.region = opts.region;
+
+		if (netpbm_cache_key(opts.ifilename, &key_opts,
+				sizeof(key_opts), &cache_key) != 0)
 			return -1;
 
-		clock_gettime(CLOCK_MONOTONIC, &finish);
+		ret = netpbm_cache_fetch(&opts.cache, cache_key, opts.ofilename);
 
-		time_t seconds = finish.tv_sec - start.tv_sec;
-		// Nanoseconds can go negative, since they are the remainder.
-		// Adjust for it here.
-		long int nanoseconds = finish.tv_nsec - start.tv_nsec;
-		while (nanoseconds < 0) {
-			// Compiler doesn't like the engineering notation here
-			nanoseconds += 1000000000;
-			--seconds;
+		if (ret == 1) {
+			printf("Result taken from cache\n");
+			ret = 0;
+			goto out;
 		}
-		// Decimals not used for more precise comparisons
-		printf("Sobel algorithm took %li seconds and %li nanoseconds\n", seconds, nanoseconds);
 
+		// continue without cache if it is broken
+		if (ret < 0)
+			use_cache = 0;
 	}
 
-	write_netpbm_file(ofilename, &image);
+	if (opts.trace_path != NULL && netpbm_trace_start(opts.trace_path) != 0) {
+		ret = -1;
+		goto out;
+	}
 
-	free_netpbm_image(&image);
-	free(ifilename);
-	free(ofilename);
+	if (opts.bitmap)
+		ret = process_bitmap(&opts);
+	else if (opts.do_stream)
+		ret = process_stream(&opts);
+	else
+		ret = process_image(&opts);
 
-	return 0;
+	if (opts.trace_path != NULL && netpbm_trace_stop() != 0)
+		ret = -1;
+
+	// result is already written, so only the next runs are slower
+	if (ret == 0 && use_cache
+		&& netpbm_cache_store(&opts.cache, cache_key, opts.ofilename) != 0)
+		fprintf(stderr, "Unable to cache the result, it will be "
+				"computed again next time\n");
+
+out:
+	free(opts.ifilename);
+	free(opts.ofilename);
+	free(opts.cache.dir);
+	free(opts.trace_path);
+
+	return ret;
 }
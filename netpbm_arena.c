@@ -0,0 +1,360 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_arena.c
+ * @author Sergey Koziakov
+ * @brief implementation of the arena of reusable buffers
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+/** Smallest buffer handed out by the arena */
+#define ARENA_MIN_SIZE 4096
+/** Buffers are aligned to the cache line */
+#define ARENA_ALIGNMENT 64
+/** Size of a huge page on x86-64 and most other platforms */
+#define ARENA_HUGE_PAGE_SIZE (2UL << 20)
+
+static int huge_pages = 0; /**< Advise huge pages for buffers outside arenas */
+
+struct arena_block {
+	void *ptr;
+	size_t size; /**< Size of the size class */
+	int mapped; /**< Allocated with mmap() rather than malloc() */
+	struct arena_block *next;
+};
+
+struct netpbm_arena {
+	pthread_mutex_t lock;
+	int flags;
+
+	struct arena_block *free_blocks; /**< Released buffers, newest first */
+	struct arena_block *used_blocks; /**< Buffers handed out */
+	size_t free_bytes; /**< Size of the released buffers */
+	size_t used_bytes; /**< Size of the buffers handed out */
+	size_t peak_bytes; /**< Most bytes handed out at once */
+
+	netpbm_arena_stats_t stats;
+};
+
+/**
+ * @brief Helper function that rounds size up to its size class
+ *
+ * Classes are spaced by a quarter of the power of two, so at most 25% of
+ * a buffer is wasted. Huge page backed classes are whole huge pages.
+ */
+static size_t class_size(const netpbm_arena_t *arena, size_t size)
+{
+	if (size <= ARENA_MIN_SIZE)
+		return ARENA_MIN_SIZE;
+
+	if ((arena->flags & NETPBM_ARENA_HUGE_PAGES)
+		&& size >= ARENA_HUGE_PAGE_SIZE)
+		return (size + ARENA_HUGE_PAGE_SIZE - 1) & ~(ARENA_HUGE_PAGE_SIZE - 1);
+
+	unsigned int log2 = 63 - __builtin_clzll((unsigned long long)(size - 1));
+	size_t step = (size_t)1 << (log2 - 2);
+
+	return (size + step - 1) & ~(step - 1);
+}
+
+/**
+ * @brief Helper function that gets memory for a new block
+ *
+ * Huge pages are requested explicitly first. If none are reserved in the
+ * system, transparent huge pages are asked for instead.
+ */
+static int block_map(const netpbm_arena_t *arena, struct arena_block *block)
+{
+	if ((arena->flags & NETPBM_ARENA_HUGE_PAGES)
+		&& block->size >= ARENA_HUGE_PAGE_SIZE) {
+		void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		ptr = mmap(NULL, block->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		if (ptr == MAP_FAILED) {
+			ptr = mmap(NULL, block->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (ptr != MAP_FAILED)
+				madvise(ptr, block->size, MADV_HUGEPAGE);
+#endif
+		}
+
+		if (ptr == MAP_FAILED)
+			return -1;
+
+		block->ptr = ptr;
+		block->mapped = 1;
+		return 0;
+	}
+
+	block->mapped = 0;
+	return posix_memalign(&block->ptr, ARENA_ALIGNMENT, block->size) == 0
+		? 0 : -1;
+}
+
+static void block_unmap(struct arena_block *block)
+{
+	if (block->mapped)
+		munmap(block->ptr, block->size);
+	else
+		free(block->ptr);
+}
+
+/**
+ * @brief Helper function that frees every block of the list
+ */
+static size_t free_list(struct arena_block *block)
+{
+	size_t bytes = 0;
+
+	while (block != NULL) {
+		struct arena_block *next = block->next;
+
+		bytes += block->size;
+		block_unmap(block);
+		free(block);
+		block = next;
+	}
+
+	return bytes;
+}
+
+netpbm_arena_t *netpbm_arena_create(int flags)
+{
+	netpbm_arena_t *arena = (netpbm_arena_t *) calloc(1, sizeof(netpbm_arena_t));
+	if (arena == NULL)
+		return NULL;
+
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->flags = flags;
+
+	return arena;
+}
+
+void *netpbm_arena_alloc(netpbm_arena_t *arena, size_t size)
+{
+	size_t wanted = class_size(arena, size);
+	struct arena_block *block = NULL;
+
+	pthread_mutex_lock(&arena->lock);
+	arena->stats.requests++;
+
+	/* Take released block of the same class */
+	for (struct arena_block **prev = &arena->free_blocks; *prev != NULL;
+			prev = &(*prev)->next) {
+		if ((*prev)->size == wanted) {
+			block = *prev;
+			*prev = block->next;
+			arena->free_bytes -= block->size;
+			arena->stats.reused++;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	if (block == NULL) {
+		block = (struct arena_block *) malloc(sizeof(struct arena_block));
+
+		if (block != NULL) {
+			block->size = wanted;
+
+			if (block_map(arena, block) != 0) {
+				free(block);
+				block = NULL;
+			}
+		}
+
+		if (block == NULL) {
+			fprintf(stderr, "Unable to allocate %zu bytes\n", size);
+			return NULL;
+		}
+
+		pthread_mutex_lock(&arena->lock);
+		arena->stats.blocks++;
+		arena->stats.bytes += block->size;
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	block->next = arena->used_blocks;
+	arena->used_blocks = block;
+	arena->used_bytes += block->size;
+	if (arena->used_bytes > arena->peak_bytes)
+		arena->peak_bytes = arena->used_bytes;
+	pthread_mutex_unlock(&arena->lock);
+
+	return block->ptr;
+}
+
+/**
+ * @brief Helper function that detaches the oldest released blocks
+ *
+ * Images of the same size need no more released memory than was ever
+ * handed out at once, so anything above that belongs to sizes that are
+ * no longer used. Called with the lock held.
+ *
+ * @return list of the detached blocks, to be freed after unlocking
+ */
+static struct arena_block *evict_blocks(netpbm_arena_t *arena)
+{
+	struct arena_block *evicted = NULL;
+
+	while (arena->free_bytes > arena->peak_bytes) {
+		struct arena_block **oldest = &arena->free_blocks;
+
+		while ((*oldest)->next != NULL)
+			oldest = &(*oldest)->next;
+
+		struct arena_block *block = *oldest;
+		*oldest = NULL;
+
+		arena->free_bytes -= block->size;
+		arena->stats.blocks--;
+		arena->stats.bytes -= block->size;
+
+		block->next = evicted;
+		evicted = block;
+	}
+
+	return evicted;
+}
+
+void netpbm_arena_release(netpbm_arena_t *arena, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+
+	pthread_mutex_lock(&arena->lock);
+
+	for (struct arena_block **prev = &arena->used_blocks; *prev != NULL;
+			prev = &(*prev)->next) {
+		struct arena_block *block = *prev;
+
+		if (block->ptr == ptr) {
+			*prev = block->next;
+			block->next = arena->free_blocks;
+			arena->free_blocks = block;
+			arena->used_bytes -= block->size;
+			arena->free_bytes += block->size;
+
+			struct arena_block *evicted = evict_blocks(arena);
+
+			pthread_mutex_unlock(&arena->lock);
+
+			free_list(evicted);
+			return;
+		}
+	}
+
+	pthread_mutex_unlock(&arena->lock);
+
+	fprintf(stderr, "Buffer %p does not belong to the arena\n", ptr);
+}
+
+void netpbm_arena_trim(netpbm_arena_t *arena)
+{
+	pthread_mutex_lock(&arena->lock);
+
+	struct arena_block *blocks = arena->free_blocks;
+	arena->free_blocks = NULL;
+	arena->free_bytes = 0;
+
+	for (struct arena_block *block = blocks; block != NULL; block = block->next)
+		arena->stats.blocks--;
+
+	arena->stats.bytes -= free_list(blocks);
+
+	pthread_mutex_unlock(&arena->lock);
+}
+
+void netpbm_arena_stats(netpbm_arena_t *arena, netpbm_arena_stats_t *stats)
+{
+	pthread_mutex_lock(&arena->lock);
+	*stats = arena->stats;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+void netpbm_arena_destroy(netpbm_arena_t *arena)
+{
+	if (arena == NULL)
+		return;
+
+	free_list(arena->free_blocks);
+	free_list(arena->used_blocks);
+
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+void netpbm_set_huge_pages(int enable)
+{
+	huge_pages = enable;
+}
+
+void netpbm_advise_huge_pages(void *ptr, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (!huge_pages || ptr == NULL || size < ARENA_HUGE_PAGE_SIZE)
+		return;
+
+	/* Only whole pages inside the buffer can be advised */
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t)ptr + size) & ~(page - 1);
+
+	if (end > start)
+		madvise((void *)start, end - start, MADV_HUGEPAGE);
+#else
+	(void) ptr;
+	(void) size;
+#endif
+}
+
+void *netpbm_scratch_alloc(netpbm_arena_t *arena, size_t size)
+{
+	if (arena != NULL)
+		return netpbm_arena_alloc(arena, size);
+
+	void *ptr = malloc(size);
+	netpbm_advise_huge_pages(ptr, size);
+
+	return ptr;
+}
+
+void netpbm_scratch_free(netpbm_arena_t *arena, void *ptr)
+{
+	if (arena != NULL)
+		netpbm_arena_release(arena, ptr);
+	else
+		free(ptr);
+}
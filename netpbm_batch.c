@@ -0,0 +1,757 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_batch.c
+ * @author Sergey Koziakov
+ * @brief batches of image files read and written together with io_uring
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) \
+	&& defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define NETPBM_URING
+#endif
+#endif
+
+/** Requests in flight when the depth is not given */
+#define DEFAULT_DEPTH 64
+/** Kernels refuse rings much deeper than this */
+#define MAX_DEPTH 4096
+
+/** Files start at multiples of this in the buffer */
+#define FILE_ALIGN 64
+/** Buffer grows by at least this much */
+#define BUFFER_GRANULE (1 << 20)
+/** Longest request, since lengths of the requests are 32-bit */
+#define MAX_TRANSFER (1U << 30)
+
+/** Longest header written by write_netpbm_image(): magic, width,
+ * height and maxval, each followed by a newline
+ */
+#define MAX_HEADER (3 + 3 * 11)
+
+/**
+ * @brief file of the batch and its transfer
+ */
+struct batch_file {
+	int fd; /**< Open file, or -1 */
+	int stdio; /**< Size is unknown, so file is read with stdio */
+	int error; /**< errno of the failed transfer, 0 otherwise */
+	uint8_t *data; /**< Contents of the file in the batch buffer */
+	size_t size; /**< Bytes to transfer */
+	size_t done; /**< Bytes transferred so far */
+};
+
+struct netpbm_batch {
+	enum NETPBM_BATCH_BACKEND backend;
+
+#ifdef NETPBM_URING
+	int ring_fd;
+	unsigned int entries; /**< Size of the submission queue */
+	unsigned int queued; /**< Requests queued, but not submitted yet */
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring; /**< Same as sq_ring if the kernel maps them at once */
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/** Files are transferred to and from this buffer, reused between
+	 * batches. It is registered with the kernel if it allows it */
+	uint8_t *buffer;
+	size_t buffer_size;
+	int registered;
+#endif
+};
+
+#ifdef NETPBM_URING
+/**
+ * @brief Helper function that unmaps the rings and closes them
+ */
+static void ring_destroy(struct netpbm_batch *batch)
+{
+	if (batch->sqes != NULL)
+		munmap(batch->sqes, batch->sqes_size);
+	if (batch->cq_ring != NULL && batch->cq_ring != batch->sq_ring)
+		munmap(batch->cq_ring, batch->cq_ring_size);
+	if (batch->sq_ring != NULL)
+		munmap(batch->sq_ring, batch->sq_ring_size);
+	if (batch->buffer != NULL)
+		munmap(batch->buffer, batch->buffer_size);
+
+	// buffers are unregistered along with the ring
+	if (batch->ring_fd >= 0)
+		close(batch->ring_fd);
+}
+
+/**
+ * @brief Helper function that maps the pages of the ring to the pointer,
+ * leaving NULL on error
+ */
+static int ring_map(void **ptr, size_t size, int ring_fd, off_t offset)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+
+	*ptr = map == MAP_FAILED ? NULL : map;
+	return *ptr != NULL ? 0 : -1;
+}
+
+/**
+ * @brief Helper function that creates io_uring rings of the batch
+ *
+ * @return 0 if no problem occured, -1 with errno set otherwise
+ */
+static int ring_setup(struct netpbm_batch *batch, unsigned int depth)
+{
+	struct io_uring_params params;
+	int saved_errno;
+
+	memset(&params, 0, sizeof(params));
+
+	batch->ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (batch->ring_fd < 0)
+		return -1;
+
+	batch->entries = params.sq_entries;
+	batch->sq_ring_size = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned int);
+	batch->cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	batch->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (batch->cq_ring_size > batch->sq_ring_size)
+			batch->sq_ring_size = batch->cq_ring_size;
+		batch->cq_ring_size = batch->sq_ring_size;
+	}
+
+	if (ring_map(&batch->sq_ring, batch->sq_ring_size, batch->ring_fd,
+			IORING_OFF_SQ_RING) != 0)
+		goto error;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		batch->cq_ring = batch->sq_ring;
+	else if (ring_map(&batch->cq_ring, batch->cq_ring_size,
+			batch->ring_fd, IORING_OFF_CQ_RING) != 0)
+		goto error;
+
+	if (ring_map((void **) &batch->sqes, batch->sqes_size, batch->ring_fd,
+			IORING_OFF_SQES) != 0)
+		goto error;
+
+	uint8_t *sq = (uint8_t *) batch->sq_ring;
+	uint8_t *cq = (uint8_t *) batch->cq_ring;
+
+	batch->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	batch->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	batch->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	batch->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	batch->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	batch->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	batch->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+
+error:
+	saved_errno = errno;
+	ring_destroy(batch);
+	batch->ring_fd = -1;
+	errno = saved_errno;
+
+	return -1;
+}
+
+/**
+ * @brief Helper function that makes the buffer hold at least size bytes
+ *
+ * Registered buffers are pinned and counted against RLIMIT_MEMLOCK, so
+ * the kernel may refuse them. Requests don't use them then, which only
+ * costs mapping the pages on every request.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int reserve_buffer(struct netpbm_batch *batch, size_t size)
+{
+	if (size <= batch->buffer_size)
+		return 0;
+
+	if (batch->registered)
+		syscall(__NR_io_uring_register, batch->ring_fd,
+			IORING_UNREGISTER_BUFFERS, NULL, 0);
+	if (batch->buffer != NULL)
+		munmap(batch->buffer, batch->buffer_size);
+
+	batch->buffer = NULL;
+	batch->buffer_size = 0;
+	batch->registered = 0;
+
+	if (size > SIZE_MAX - BUFFER_GRANULE) {
+		fprintf(stderr, "Unable to allocate memory for batch\n");
+		return -1;
+	}
+
+	size_t capacity = size + BUFFER_GRANULE - 1;
+
+	capacity -= capacity % BUFFER_GRANULE;
+
+	void *buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buffer == MAP_FAILED) {
+		fprintf(stderr, "Unable to allocate memory for batch\n");
+		return -1;
+	}
+
+	netpbm_advise_huge_pages(buffer, capacity);
+
+	batch->buffer = (uint8_t *) buffer;
+	batch->buffer_size = capacity;
+
+	struct iovec iov = { .iov_base = buffer, .iov_len = capacity };
+
+	batch->registered = syscall(__NR_io_uring_register, batch->ring_fd,
+		IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that queues transfer of the rest of the file
+ */
+static void queue_transfer(struct netpbm_batch *batch,
+		const struct batch_file *file, size_t index, int write)
+{
+	const unsigned int tail = *batch->sq_tail;
+	const unsigned int slot = tail & *batch->sq_mask;
+	struct io_uring_sqe *sqe = &batch->sqes[slot];
+	size_t length = file->size - file->done;
+
+	if (length > MAX_TRANSFER)
+		length = MAX_TRANSFER;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	if (batch->registered)
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->fd = file->fd;
+	sqe->off = file->done;
+	sqe->addr = (uintptr_t) (file->data + file->done);
+	sqe->len = length;
+	sqe->buf_index = 0;
+	sqe->user_data = index;
+
+	batch->sq_array[slot] = slot;
+
+	// kernel reads the request only after it sees the new tail
+	__atomic_store_n(batch->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	batch->queued++;
+}
+
+/**
+ * @brief Helper function that transfers every open file of the batch
+ *
+ * Up to the depth of the ring, requests are in flight at once. Short
+ * transfers are continued by new requests, and failed ones leave errno
+ * in the file.
+ *
+ * @return 0 if the ring worked, -1 otherwise
+ */
+static int run_transfers(struct netpbm_batch *batch, struct batch_file *files,
+		size_t count, int write)
+{
+	size_t next = 0;
+	size_t in_flight = 0;
+
+	while (next < count || in_flight > 0) {
+		for (; next < count && in_flight < batch->entries; next++) {
+			if (files[next].fd < 0 || files[next].done == files[next].size)
+				continue;
+
+			queue_transfer(batch, &files[next], next, write);
+			in_flight++;
+		}
+
+		if (in_flight == 0)
+			break;
+
+		int submitted = syscall(__NR_io_uring_enter, batch->ring_fd,
+			batch->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (submitted < 0) {
+			// completions must be reaped before more is submitted
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				fprintf(stderr, "Unable to submit batch: error %d\n",
+					errno);
+				return -1;
+			}
+			submitted = 0;
+		}
+
+		batch->queued -= submitted;
+
+		unsigned int head = *batch->cq_head;
+		const unsigned int tail = __atomic_load_n(batch->cq_tail,
+			__ATOMIC_ACQUIRE);
+
+		/* Requests in flight never exceed the submission queue, so
+		 * continuations always fit into it
+		 */
+		for (; head != tail; head++) {
+			const struct io_uring_cqe *cqe
+				= &batch->cqes[head & *batch->cq_mask];
+			struct batch_file *file = &files[cqe->user_data];
+
+			in_flight--;
+
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+				// retried as is
+			} else if (cqe->res < 0) {
+				file->error = -cqe->res;
+				continue;
+			} else if (cqe->res == 0) {
+				// file got shorter since it was opened
+				file->error = EIO;
+				continue;
+			} else {
+				file->done += cqe->res;
+			}
+
+			if (file->done < file->size) {
+				queue_transfer(batch, file, cqe->user_data, write);
+				in_flight++;
+			}
+		}
+
+		__atomic_store_n(batch->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that closes files of the batch
+ *
+ * @return 0 if every file was closed, -1 otherwise
+ */
+static int close_files(struct batch_file *files, size_t count)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].fd >= 0 && close(files[i].fd) != 0)
+			ret = -1;
+		files[i].fd = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that reads every file into the buffer at once,
+ * and then decodes images from it
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_uring(struct netpbm_batch *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads)
+{
+	struct batch_file *files = (struct batch_file *)
+		calloc(count, sizeof(struct batch_file));
+	size_t total = 0;
+	int ret = -1;
+
+	if (files == NULL) {
+		fprintf(stderr, "Unable to allocate memory for batch\n");
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		files[i].fd = -1;
+
+	for (size_t i = 0; i < count; i++) {
+		struct stat st;
+
+		files[i].fd = open(filenames[i], O_RDONLY | O_CLOEXEC);
+
+		if (files[i].fd < 0) {
+			fprintf(stderr, "Unable to open file: error %d\n", errno);
+			goto out;
+		}
+
+		if (fstat(files[i].fd, &st) != 0) {
+			fprintf(stderr, "Unable to stat file: error %d\n", errno);
+			goto out;
+		}
+
+		// pipes and devices are read up to their end by stdio
+		if (!S_ISREG(st.st_mode)) {
+			close(files[i].fd);
+			files[i].fd = -1;
+			files[i].stdio = 1;
+			continue;
+		}
+
+		files[i].size = st.st_size;
+		// offset in the buffer until it is mapped
+		files[i].data = (uint8_t *) total;
+		total += (files[i].size + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+	}
+
+	if (reserve_buffer(batch, total) != 0)
+		goto out;
+
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].size > 0)
+			files[i].data = batch->buffer + (size_t) files[i].data;
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+
+	if (run_transfers(batch, files, count, 0) != 0)
+		goto out;
+
+	netpbm_trace_end("batch read", trace, 0, count);
+	close_files(files, count);
+
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].stdio) {
+			if (read_netpbm_file_mt(filenames[i], &imgs[i], NULL,
+					n_threads) != 0)
+				goto out;
+			continue;
+		}
+
+		if (files[i].error != 0) {
+			fprintf(stderr, "Error reading file: error %d\n",
+				files[i].error);
+			goto out;
+		}
+
+		FILE *ifile = files[i].size > 0
+			? fmemopen(files[i].data, files[i].size, "rb") : NULL;
+
+		if (ifile == NULL) {
+			fprintf(stderr, "Error reading file\n");
+			goto out;
+		}
+
+		trace = netpbm_trace_begin();
+
+		int read = netpbm_read_image(ifile, &imgs[i], n_threads);
+
+		fclose(ifile);
+		if (read != 0)
+			goto out;
+
+		netpbm_trace_end("read", trace, i, imgs[i].height);
+	}
+
+	ret = 0;
+
+out:
+	close_files(files, count);
+	free(files);
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that returns upper bound of the file size
+ * written by write_netpbm_image()
+ *
+ * @return 0 if no problem occured, -1 if the size overflows
+ */
+static int file_size_bound(const netpbm_image_t *img, size_t *size)
+{
+	size_t pixels, pixel_length = 1;
+
+	if (netpbm_size_mul(img->width, img->height, &pixels) != 0)
+		return -1;
+
+	switch (img->type) {
+	case NETPBM_ASCII_BITMAP:
+	case NETPBM_ASCII_GREYMAP:
+		// values are clamped to maxval, and followed by a space
+		for (uint32_t v = img->maxval; v >= 10; v /= 10)
+			pixel_length++;
+		pixel_length++;
+		break;
+	case NETPBM_ASCII_PIXMAP:
+		pixel_length = 3 * 4;
+		break;
+	case NETPBM_BINARY_BITMAP:
+		pixels = ((size_t)img->width + 7) / 8 * img->height;
+		break;
+	case NETPBM_BINARY_PIXMAP:
+		pixel_length = 3;
+		break;
+	case NETPBM_BINARY_GREYMAP:
+		break;
+	default:
+		pixel_length = 0;
+		break;
+	}
+
+	if (netpbm_size_mul(pixels, pixel_length, size) != 0
+		|| *size > SIZE_MAX - MAX_HEADER - FILE_ALIGN)
+		return -1;
+
+	*size += MAX_HEADER;
+	return 0;
+}
+
+/**
+ * @brief Helper function that encodes every image into the buffer, and
+ * then writes all files at once
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int write_uring(struct netpbm_batch *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads)
+{
+	struct batch_file *files = (struct batch_file *)
+		calloc(count, sizeof(struct batch_file));
+	size_t total = 0;
+	int ret = -1;
+
+	if (files == NULL) {
+		fprintf(stderr, "Unable to allocate memory for batch\n");
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		files[i].fd = -1;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t bound;
+
+		if (file_size_bound(&imgs[i], &bound) != 0
+			|| total > SIZE_MAX - bound - FILE_ALIGN) {
+			fprintf(stderr, "Image is too big\n");
+			goto out;
+		}
+
+		files[i].data = (uint8_t *) total;
+		// one more byte for the terminator fmemopen() puts after data
+		files[i].size = bound + 1;
+		total += (files[i].size + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+	}
+
+	if (reserve_buffer(batch, total) != 0)
+		goto out;
+
+	for (size_t i = 0; i < count; i++) {
+		files[i].data = batch->buffer + (size_t) files[i].data;
+
+		FILE *ofile = fmemopen(files[i].data, files[i].size, "w");
+
+		if (ofile == NULL) {
+			fprintf(stderr, "Error writing file\n");
+			goto out;
+		}
+
+		uint64_t trace = netpbm_trace_begin();
+		int written = netpbm_write_image(ofile, &imgs[i], n_threads);
+		long length = fflush(ofile) == 0 ? ftell(ofile) : -1;
+
+		fclose(ofile);
+		if (written != 0 || length < 0)
+			goto out;
+
+		netpbm_trace_end("write", trace, i, imgs[i].height);
+		files[i].size = length;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		files[i].fd = open(filenames[i],
+			O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+		if (files[i].fd < 0) {
+			fprintf(stderr, "Unable to open file: error %d\n", errno);
+			goto out;
+		}
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+
+	if (run_transfers(batch, files, count, 1) != 0)
+		goto out;
+
+	netpbm_trace_end("batch write", trace, 0, count);
+
+	ret = close_files(files, count);
+
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].error != 0)
+			ret = -1;
+	}
+
+	if (ret != 0)
+		fprintf(stderr, "Error writing file\n");
+
+out:
+	close_files(files, count);
+	free(files);
+
+	return ret;
+}
+#endif // NETPBM_URING
+
+netpbm_batch_t *netpbm_batch_create(enum NETPBM_BATCH_BACKEND backend,
+		unsigned int depth)
+{
+	struct netpbm_batch *batch = (struct netpbm_batch *)
+		calloc(1, sizeof(struct netpbm_batch));
+
+	if (batch == NULL) {
+		fprintf(stderr, "Unable to allocate memory for batch\n");
+		return NULL;
+	}
+
+	batch->backend = NETPBM_BATCH_STDIO;
+
+	if (depth == 0)
+		depth = DEFAULT_DEPTH;
+	if (depth > MAX_DEPTH)
+		depth = MAX_DEPTH;
+
+	if (backend == NETPBM_BATCH_STDIO)
+		return batch;
+
+#ifdef NETPBM_URING
+	// kernels without io_uring, or sandboxes forbidding it, use stdio
+	if (ring_setup(batch, depth) == 0) {
+		batch->backend = NETPBM_BATCH_URING;
+		return batch;
+	}
+#else
+	(void) depth;
+	errno = ENOSYS;
+#endif
+
+	if (backend == NETPBM_BATCH_URING) {
+		fprintf(stderr, "Unable to set up io_uring: error %d\n", errno);
+		free(batch);
+		return NULL;
+	}
+
+	return batch;
+}
+
+enum NETPBM_BATCH_BACKEND netpbm_batch_backend(const netpbm_batch_t *batch)
+{
+	return batch->backend;
+}
+
+int netpbm_batch_read(netpbm_batch_t *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < count; i++)
+		imgs[i].data = NULL;
+
+	if (count == 0)
+		return 0;
+
+	if (batch->backend == NETPBM_BATCH_STDIO) {
+		for (size_t i = 0; i < count && ret == 0; i++)
+			ret = read_netpbm_file_mt(filenames[i], &imgs[i], NULL,
+				n_threads);
+	}
+#ifdef NETPBM_URING
+	else {
+		ret = read_uring(batch, filenames, imgs, count, n_threads);
+	}
+#endif
+
+	// images read before the failure are freed too
+	if (ret != 0) {
+		for (size_t i = 0; i < count; i++) {
+			free_netpbm_image(&imgs[i]);
+			imgs[i].data = NULL;
+		}
+	}
+
+	return ret;
+}
+
+int netpbm_batch_write(netpbm_batch_t *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads)
+{
+	int ret = 0;
+
+	if (count == 0)
+		return 0;
+
+#ifdef NETPBM_URING
+	if (batch->backend == NETPBM_BATCH_URING)
+		return write_uring(batch, filenames, imgs, count, n_threads);
+#endif
+
+	for (size_t i = 0; i < count; i++) {
+		if (write_netpbm_file_mt(filenames[i], &imgs[i], n_threads) != 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+void netpbm_batch_destroy(netpbm_batch_t *batch)
+{
+	if (batch == NULL)
+		return;
+
+#ifdef NETPBM_URING
+	if (batch->backend == NETPBM_BATCH_URING)
+		ring_destroy(batch);
+#endif
+
+	free(batch);
+}
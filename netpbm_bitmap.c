@@ -0,0 +1,319 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_bitmap.c
+ * @author Sergey Koziakov
+ * @brief Sobel operator on packed 1-bit images
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <math.h>
+
+/** Sobel value of a bitmap is one of gradients -4..4 in each direction */
+#define GRADIENTS 9
+
+/**
+ * @brief Data local to the worker thread
+ */
+struct bitmap_worker_info {
+	const netpbm_bitmap_t *bmp;
+	netpbm_bitmap_t *edges;
+	uint8_t *magnitudes;
+
+	/** Magnitude for (gx + 4) * GRADIENTS + gy + 4 */
+	const uint8_t *table;
+	uint64_t *mask; /**< Edge row, if edges are not stored */
+
+	uint32_t y_start;
+	uint32_t y_end;
+};
+
+int netpbm_bitmap_alloc(netpbm_bitmap_t *bmp, uint32_t width,
+		uint32_t height)
+{
+	size_t stride = ((size_t)width + 63) / 64 + 2;
+	size_t size;
+
+	bmp->data = NULL;
+
+	if (netpbm_size_mul(stride, (size_t)height + 2, &size) != 0
+		|| netpbm_size_mul(size, sizeof(uint64_t), &size) != 0) {
+		fprintf(stderr, "Image is too big\n");
+		return -1;
+	}
+
+	bmp->data = (uint64_t *) calloc(1, size);
+	if (bmp->data == NULL) {
+		fprintf(stderr, "Unable to allocate memory for image\n");
+		return -1;
+	}
+
+	bmp->width = width;
+	bmp->height = height;
+	bmp->stride = stride;
+
+	return 0;
+}
+
+int free_netpbm_bitmap(netpbm_bitmap_t *bmp)
+{
+	free(bmp->data);
+	bmp->data = NULL;
+	return 0;
+}
+
+static inline const uint64_t *bitmap_row(const netpbm_bitmap_t *bmp, int64_t y)
+{
+	return bmp->data + (size_t)(y + 1) * bmp->stride + 1;
+}
+
+/** Byte k of each lane is 1 */
+#define LANES_ONE 0x0101010101010101ULL
+
+/**
+ * @brief Helper function that spreads 8 bits to the lowest bits of bytes
+ *
+ * The most significant bit goes to the byte 0, as pixels are stored.
+ */
+static inline uint64_t spread_bits(uint64_t word, int byte)
+{
+	const uint64_t bits = (word >> (56 - 8 * byte)) & 0xff;
+
+	return ((bits * 0x8040201008040201ULL) >> 7) & LANES_ONE;
+}
+
+/**
+ * @brief Helper function that returns x + 2y + z sums of 8 pixels as bytes
+ */
+static inline uint64_t sum_lanes(const uint64_t plane[3], int byte)
+{
+	return spread_bits(plane[0], byte) | spread_bits(plane[1], byte) << 1
+		| spread_bits(plane[2], byte) << 2;
+}
+
+/**
+ * @brief Helper function that turns edge words of the row into magnitudes
+ *
+ * Gradients are only unpacked for the words with edges. Sums of the
+ * neighbours are bit-sliced the same way as in sobel_bits kernel, then
+ * 8 pixels at a time are spread to bytes to index the magnitude table.
+ */
+static void magnitude_row(const struct bitmap_worker_info *info, uint32_t y,
+		const uint64_t *mask)
+{
+	const uint64_t *a = bitmap_row(info->bmp, (int64_t)y - 1);
+	const uint64_t *b = bitmap_row(info->bmp, y);
+	const uint64_t *c = bitmap_row(info->bmp, (int64_t)y + 1);
+	const uint32_t width = info->bmp->width;
+	uint8_t *dest = info->magnitudes + (size_t)y * width;
+
+	for (size_t i = 0; i * 64 < width; i++) {
+		const uint32_t n = width - i * 64 < 64 ? width - i * 64 : 64;
+
+		if (mask[i] == 0) {
+			memset(dest + i * 64, 0, n);
+			continue;
+		}
+
+		uint64_t al = (a[i] >> 1) | (a[i - 1] << 63);
+		uint64_t ar = (a[i] << 1) | (a[i + 1] >> 63);
+		uint64_t bl = (b[i] >> 1) | (b[i - 1] << 63);
+		uint64_t br = (b[i] << 1) | (b[i + 1] >> 63);
+		uint64_t cl = (c[i] >> 1) | (c[i - 1] << 63);
+		uint64_t cr = (c[i] << 1) | (c[i + 1] >> 63);
+
+		/* Bit planes of x + 2y + z sums: right, left, bottom, top */
+		const uint64_t planes[4][3] = {
+			{ ar ^ cr, (ar & cr) ^ br, ar & cr & br },
+			{ al ^ cl, (al & cl) ^ bl, al & cl & bl },
+			{ cl ^ cr, (cl & cr) ^ c[i], cl & cr & c[i] },
+			{ al ^ ar, (al & ar) ^ a[i], al & ar & a[i] }
+		};
+
+		for (uint32_t k = 0; k < n; k += 8) {
+			const int byte = k / 8;
+			/* Sums are 0..4, so the offset differences never borrow */
+			uint64_t gx = sum_lanes(planes[0], byte) + 4 * LANES_ONE
+				- sum_lanes(planes[1], byte);
+			uint64_t gy = sum_lanes(planes[2], byte) + 4 * LANES_ONE
+				- sum_lanes(planes[3], byte);
+			uint64_t index = gx * GRADIENTS + gy;
+			const uint32_t end = n - k < 8 ? n - k : 8;
+
+			for (uint32_t l = 0; l < end; l++)
+				dest[i * 64 + k + l] = info->table[(index >> (8 * l)) & 0xff];
+		}
+	}
+}
+
+static void *bitmap_task(void *arguments)
+{
+	struct bitmap_worker_info *info = (struct bitmap_worker_info *) arguments;
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
+	const size_t words = info->bmp->stride - 2;
+	const uint32_t width = info->bmp->width;
+	const uint64_t last_mask = width % 64 ? ~0ULL << (64 - width % 64) : ~0ULL;
+	uint64_t trace = netpbm_trace_begin();
+
+	if (words == 0)
+		return NULL;
+
+	for (uint32_t y = info->y_start; y < info->y_end; y++) {
+		uint64_t *out = info->edges != NULL
+			? (uint64_t *) bitmap_row(info->edges, y) : info->mask;
+
+		kernels->sobel_bits(bitmap_row(info->bmp, (int64_t)y - 1),
+			bitmap_row(info->bmp, y),
+			bitmap_row(info->bmp, (int64_t)y + 1), out, words);
+
+		// pixels past the width see the last one as an edge
+		out[words - 1] &= last_mask;
+
+		if (info->magnitudes != NULL)
+			magnitude_row(info, y, out);
+	}
+
+	netpbm_trace_end("bitmap task", trace, info->y_start,
+		info->y_end - info->y_start);
+
+	return NULL;
+}
+
+int netpbm_sobel_bitmap(const netpbm_bitmap_t *bmp, netpbm_bitmap_t *edges,
+		uint8_t *magnitudes, const netpbm_sobel_opts_t *opts)
+{
+	unsigned long n_threads = opts->n_threads;
+
+	if (opts->pool != NULL && n_threads == 0)
+		n_threads = netpbm_pool_size(opts->pool);
+
+	if (bmp->data == NULL) {
+		fprintf(stderr, "Bitmap structure is not initialized\n");
+		return -1;
+	}
+
+	if (edges != NULL && (edges->width != bmp->width
+		|| edges->height != bmp->height || edges->data == NULL)) {
+		fprintf(stderr, "Edge bitmap must have the size of the image\n");
+		return -1;
+	}
+
+	if (n_threads == 0 || n_threads == ULONG_MAX) {
+		fprintf(stderr, "Invalid amount of threads!\n");
+		return -1;
+	}
+
+	if (opts->blur != 0) {
+		fprintf(stderr, "Bitmaps can't be smoothed\n");
+		return -1;
+	}
+
+	if (n_threads > bmp->height)
+		n_threads = bmp->height ? bmp->height : 1;
+
+	/* Magnitudes of the unpacked 0 or 255 pixels, computed the same way
+	 * as by the Sobel operator, scaled so that the strongest edge of a
+	 * bitmap, with gradients of 4 and 2, is 255
+	 */
+	uint8_t table[GRADIENTS * GRADIENTS];
+	const uint32_t strongest = (uint32_t) sqrt(255.0 * 255.0 * 20);
+
+	for (int gx = -4; gx <= 4; gx++) {
+		for (int gy = -4; gy <= 4; gy++) {
+			uint32_t sum = 255 * 255 * (uint32_t)(gx * gx + gy * gy);
+			uint32_t value = (uint32_t) sqrt((double) sum) * 255 / strongest;
+
+			table[(gx + 4) * GRADIENTS + gy + 4] = value > 255 ? 255 : value;
+		}
+	}
+
+	const size_t words = bmp->stride - 2;
+	struct bitmap_worker_info *w_info = (struct bitmap_worker_info *)
+		calloc(n_threads, sizeof(struct bitmap_worker_info));
+	pthread_t *threads = (pthread_t *) calloc(n_threads, sizeof(pthread_t));
+	uint64_t *masks = edges == NULL
+		? (uint64_t *) calloc(n_threads * words + 1, sizeof(uint64_t)) : NULL;
+	unsigned long created = 0;
+	int ret = -1;
+
+	if (w_info == NULL || threads == NULL || (edges == NULL && masks == NULL)) {
+		fprintf(stderr, "Unable to allocate memory for Sobel operator\n");
+		goto out;
+	}
+
+	/* split rows between n threads */
+	uint32_t e = bmp->height / n_threads;
+	uint32_t o = bmp->height % n_threads;
+	uint32_t ind = 0;
+
+	for (size_t t = 0; t < n_threads; t++) {
+		uint32_t end = ind + e + (t < o ? 1 : 0);
+
+		w_info[t] = (struct bitmap_worker_info){
+			.bmp = bmp,
+			.edges = edges,
+			.magnitudes = magnitudes,
+			.table = table,
+			.mask = masks != NULL ? masks + t * words : NULL,
+			.y_start = ind,
+			.y_end = end
+		};
+		ind = end;
+	}
+
+	if (opts->pool != NULL) {
+		if (netpbm_pool_run(opts->pool, bitmap_task, w_info,
+				sizeof(struct bitmap_worker_info), n_threads) != 0)
+			goto out;
+
+		ret = 0;
+		goto out;
+	}
+
+	for (; created < n_threads; created++) {
+		if (pthread_create(&threads[created], NULL, bitmap_task,
+				&w_info[created]) != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", created);
+			break;
+		}
+	}
+
+	// threads that were started still use the buffers
+	for (unsigned long t = 0; t < created; t++)
+		pthread_join(threads[t], NULL);
+
+	if (created == n_threads)
+		ret = 0;
+
+out:
+	free(masks);
+	free(threads);
+	free(w_info);
+
+	return ret;
+}
@@ -0,0 +1,394 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_cache.c
+ * @author Sergey Koziakov
+ * @brief implementation of on-disk cache of processed images
+ */
+
+#include "netpbm_gs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#define HASH_BLOCK_SIZE (1 << 20)
+
+/* XXH64 primes */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(X, R) (((X) << (R)) | ((X) >> (64 - (R))))
+
+/**
+ * @brief state of XXH64-style hash over a sequence of buffers
+ */
+struct hash_state {
+	uint64_t v[4];
+	uint64_t total_len;
+	uint8_t tail[32];
+	size_t tail_len;
+};
+
+static inline uint64_t read_u64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= hash_round(0, v);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void hash_init(struct hash_state *h)
+{
+	memset(h, 0, sizeof(struct hash_state));
+	h->v[0] = PRIME64_1 + PRIME64_2;
+	h->v[1] = PRIME64_2;
+	h->v[2] = 0;
+	h->v[3] = -PRIME64_1;
+}
+
+static void hash_stripe(struct hash_state *h, const uint8_t *p)
+{
+	for (int lane = 0; lane < 4; lane++)
+		h->v[lane] = hash_round(h->v[lane], read_u64(p + lane * 8));
+}
+
+static void hash_update(struct hash_state *h, const uint8_t *p, size_t len)
+{
+	h->total_len += len;
+
+	if (h->tail_len > 0) {
+		size_t fill = 32 - h->tail_len;
+		if (fill > len)
+			fill = len;
+
+		memcpy(h->tail + h->tail_len, p, fill);
+		h->tail_len += fill;
+		p += fill;
+		len -= fill;
+
+		if (h->tail_len < 32)
+			return;
+
+		hash_stripe(h, h->tail);
+		h->tail_len = 0;
+	}
+
+	for (; len >= 32; p += 32, len -= 32)
+		hash_stripe(h, p);
+
+	memcpy(h->tail, p, len);
+	h->tail_len = len;
+}
+
+static uint64_t hash_final(const struct hash_state *h)
+{
+	uint64_t acc;
+
+	if (h->total_len >= 32) {
+		acc = ROTL64(h->v[0], 1) + ROTL64(h->v[1], 7)
+			+ ROTL64(h->v[2], 12) + ROTL64(h->v[3], 18);
+		for (int lane = 0; lane < 4; lane++)
+			acc = hash_merge(acc, h->v[lane]);
+	} else {
+		acc = h->v[2] + PRIME64_5;
+	}
+
+	acc += h->total_len;
+
+	const uint8_t *p = h->tail;
+	size_t len = h->tail_len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		acc ^= hash_round(0, read_u64(p));
+		acc = ROTL64(acc, 27) * PRIME64_1 + PRIME64_4;
+	}
+
+	if (len >= 4) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		acc ^= (uint64_t)v * PRIME64_1;
+		acc = ROTL64(acc, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+
+	for (; len > 0; p++, len--) {
+		acc ^= (*p) * PRIME64_5;
+		acc = ROTL64(acc, 11) * PRIME64_1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= PRIME64_2;
+	acc ^= acc >> 29;
+	acc *= PRIME64_3;
+	acc ^= acc >> 32;
+
+	return acc;
+}
+
+/**
+ * @brief Helper function that copies file contents
+ *
+ * Tries to clone the file first, which is free on copy-on-write
+ * filesystems, and falls back to copying data.
+ */
+static int copy_file(const char *from, const char *to)
+{
+	int ret = -1;
+	int ifd = open(from, O_RDONLY);
+	if (ifd < 0)
+		return -1;
+
+	int ofd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ofd < 0) {
+		close(ifd);
+		return -1;
+	}
+
+#ifdef FICLONE
+	if (ioctl(ofd, FICLONE, ifd) == 0) {
+		ret = 0;
+		goto out;
+	}
+#endif
+
+	uint8_t *buffer = (uint8_t *) malloc(HASH_BLOCK_SIZE);
+	if (buffer == NULL)
+		goto out;
+
+	ssize_t n;
+	while ((n = read(ifd, buffer, HASH_BLOCK_SIZE)) > 0) {
+		for (ssize_t written = 0; written < n; ) {
+			ssize_t w = write(ofd, buffer + written, n - written);
+			if (w < 0) {
+				free(buffer);
+				goto out;
+			}
+			written += w;
+		}
+	}
+
+	free(buffer);
+	ret = n == 0 ? 0 : -1;
+
+out:
+	close(ifd);
+	if (close(ofd) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+static void cache_path(const netpbm_cache_t *cache, uint64_t key,
+		char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016llx.pnm", cache->dir,
+		(unsigned long long) key);
+}
+
+int netpbm_cache_key(const char *filename, const void *opts,
+		size_t opts_size, uint64_t *key)
+{
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	uint8_t *buffer = (uint8_t *) malloc(HASH_BLOCK_SIZE);
+	if (buffer == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	struct hash_state h;
+	hash_init(&h);
+	hash_update(&h, (const uint8_t *) opts, opts_size);
+
+	ssize_t n;
+	while ((n = read(fd, buffer, HASH_BLOCK_SIZE)) > 0)
+		hash_update(&h, buffer, n);
+
+	free(buffer);
+	close(fd);
+
+	if (n < 0)
+		return -1;
+
+	*key = hash_final(&h);
+	return 0;
+}
+
+int netpbm_cache_fetch(const netpbm_cache_t *cache, uint64_t key,
+		const char *ofilename)
+{
+	char path[4096];
+	cache_path(cache, key, path, sizeof(path));
+
+	if (access(path, R_OK) != 0)
+		return 0;
+
+	if (copy_file(path, ofilename) != 0) {
+		fprintf(stderr, "Unable to copy cached result\n");
+		return -1;
+	}
+
+	// Modification time tracks recent use for eviction
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	return 1;
+}
+
+/**
+ * @brief cache entry, as seen by eviction
+ */
+struct cache_entry {
+	char name[32];
+	off_t size;
+	struct timespec used;
+};
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct cache_entry *ea = (const struct cache_entry *) a;
+	const struct cache_entry *eb = (const struct cache_entry *) b;
+
+	if (ea->used.tv_sec != eb->used.tv_sec)
+		return ea->used.tv_sec < eb->used.tv_sec ? -1 : 1;
+	if (ea->used.tv_nsec != eb->used.tv_nsec)
+		return ea->used.tv_nsec < eb->used.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/**
+ * @brief Helper function that removes least recently used entries until
+ * cache fits into its size limit
+ */
+static int cache_evict(const netpbm_cache_t *cache)
+{
+	DIR *dir = opendir(cache->dir);
+	if (dir == NULL)
+		return -1;
+
+	struct cache_entry *entries = NULL;
+	size_t n_entries = 0;
+	size_t capacity = 0;
+	uint64_t total = 0;
+	struct dirent *ent;
+	char path[4096];
+
+	while ((ent = readdir(dir)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		struct stat st;
+
+		// only touch files that look like cache entries
+		if (len != 20 || strcmp(ent->d_name + 16, ".pnm") != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+
+		if (n_entries == capacity) {
+			capacity = capacity * 2 + 64;
+			struct cache_entry *grown = (struct cache_entry *)
+				realloc(entries, sizeof(struct cache_entry) * capacity);
+			if (grown == NULL) {
+				free(entries);
+				closedir(dir);
+				return -1;
+			}
+			entries = grown;
+		}
+
+		strcpy(entries[n_entries].name, ent->d_name);
+		entries[n_entries].size = st.st_size;
+		entries[n_entries].used = st.st_mtim;
+		n_entries++;
+		total += st.st_size;
+	}
+
+	closedir(dir);
+
+	qsort(entries, n_entries, sizeof(struct cache_entry), compare_entries);
+
+	for (size_t e = 0; e < n_entries && total > cache->max_size; e++) {
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[e].name);
+		if (unlink(path) == 0)
+			total -= entries[e].size;
+	}
+
+	free(entries);
+	return 0;
+}
+
+int netpbm_cache_store(const netpbm_cache_t *cache, uint64_t key,
+		const char *ofilename)
+{
+	char path[4096];
+	char tmp_path[4096 + 32];
+
+	if (mkdir(cache->dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create cache directory: error %d\n", errno);
+		return -1;
+	}
+
+	cache_path(cache, key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path, (long) getpid());
+
+	/* Entry appears atomically, so concurrent runs never see a partial
+	 * result
+	 */
+	if (copy_file(ofilename, tmp_path) != 0 || rename(tmp_path, path) != 0) {
+		fprintf(stderr, "Unable to store result in cache\n");
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return cache_evict(cache);
+}
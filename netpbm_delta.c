@@ -0,0 +1,386 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_delta.c
+ * @author Sergey Koziakov
+ * @brief implementation of incremental Sobel processing of frame sequences
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include <errno.h>
+
+#define DEFAULT_TILE_SIZE 32
+
+/* Bits of the dirty mask, one for each tile of the 3x3 neighbourhood */
+#define DIRTY_BIT(DX, DY) (1U << (((DY) + 1) * 3 + ((DX) + 1)))
+#define DIRTY_SELF DIRTY_BIT(0, 0)
+
+/**
+ * @brief Data local to the worker thread
+ */
+struct delta_worker_info {
+	netpbm_delta_t *delta;
+
+	size_t t_start; /**< first index in the list of dirty tiles */
+	size_t t_end; /**< index after the last one */
+};
+
+/**
+ * @brief Helper function that recomputes part of the output tile
+ *
+ * Recomputes Sobel output for the rectangle of the tile, given in
+ * coordinates relative to the tile, and clipped to the tile size.
+ */
+static void recompute_rect(netpbm_delta_t *delta,
+		uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+		int rx, int ry, int rw, int rh)
+{
+	int tw = x1 - x0;
+	int th = y1 - y0;
+
+	if (rx < 0)
+		rx = 0;
+	if (ry < 0)
+		ry = 0;
+	if (rx + rw > tw)
+		rw = tw - rx;
+	if (ry + rh > th)
+		rh = th - ry;
+
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
+
+	for (int row = 0; row < rh; row++) {
+		kernels->sobel_span(delta->p_frame, delta->width + 2, delta->output,
+			x0 + rx, y0 + ry + row, rw);
+	}
+}
+
+static void *delta_thread_task(void *arguments)
+{
+	struct delta_worker_info *info = (struct delta_worker_info *) arguments;
+	netpbm_delta_t *delta = info->delta;
+	uint64_t trace = netpbm_trace_begin();
+
+	for (size_t i = info->t_start; i < info->t_end; i++) {
+		size_t t = delta->order[i];
+		uint16_t mask = delta->dirty[t];
+
+		uint32_t x0 = (t % delta->tiles_x) * delta->tile_size;
+		uint32_t y0 = (t / delta->tiles_x) * delta->tile_size;
+		uint32_t x1 = x0 + delta->tile_size;
+		uint32_t y1 = y0 + delta->tile_size;
+
+		if (x1 > delta->width)
+			x1 = delta->width;
+		if (y1 > delta->height)
+			y1 = delta->height;
+
+		int tw = x1 - x0;
+		int th = y1 - y0;
+
+		if (mask & DIRTY_SELF) {
+			recompute_rect(delta, x0, y0, x1, y1, 0, 0, tw, th);
+			continue;
+		}
+
+		/* Only the tile itself is unchanged, so only pixels next to
+		 * the changed neighbours are affected
+		 */
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				if (!(mask & DIRTY_BIT(dx, dy)))
+					continue;
+
+				int rx = dx < 0 ? 0 : (dx > 0 ? tw - 1 : 0);
+				int ry = dy < 0 ? 0 : (dy > 0 ? th - 1 : 0);
+				int rw = dx == 0 ? tw : 1;
+				int rh = dy == 0 ? th : 1;
+
+				recompute_rect(delta, x0, y0, x1, y1,
+					rx, ry, rw, rh);
+			}
+		}
+	}
+
+	netpbm_trace_end("delta task", trace, info->t_start,
+		info->t_end - info->t_start);
+
+	return NULL;
+}
+
+int netpbm_delta_init(netpbm_delta_t *delta, uint32_t tile_size)
+{
+	memset(delta, 0, sizeof(netpbm_delta_t));
+	delta->tile_size = tile_size ? tile_size : DEFAULT_TILE_SIZE;
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that (re)allocates state for the new frame size
+ */
+static int delta_resize(netpbm_delta_t *delta, uint32_t width, uint32_t height)
+{
+	size_t p_elems, o_size;
+
+	if ((size_t)width + 2 > UINT32_MAX
+		|| netpbm_size_mul((size_t)width + 2, (size_t)height + 2, &p_elems) != 0
+		|| netpbm_size_mul((size_t)width * height, sizeof(uint32_t),
+			&o_size) != 0) {
+		fprintf(stderr, "Image is too big\n");
+		return -1;
+	}
+
+	free(delta->p_frame);
+	free(delta->output);
+	free(delta->dirty);
+	free(delta->order);
+
+	delta->width = width;
+	delta->height = height;
+	delta->tiles_x = ((size_t)width + delta->tile_size - 1) / delta->tile_size;
+	delta->tiles_y = ((size_t)height + delta->tile_size - 1) / delta->tile_size;
+
+	size_t n_tiles = (size_t)delta->tiles_x * delta->tiles_y;
+
+	delta->p_frame = (uint32_t *) calloc(p_elems, sizeof(uint32_t));
+	delta->output = (uint32_t *) malloc(o_size);
+	delta->dirty = (uint16_t *) malloc(sizeof(uint16_t) * n_tiles);
+	delta->order = (size_t *) malloc(sizeof(size_t) * n_tiles);
+
+	if (delta->p_frame == NULL || delta->output == NULL
+		|| delta->dirty == NULL || delta->order == NULL) {
+		fprintf(stderr, "Unable to allocate memory for frame state\n");
+		netpbm_delta_free(delta);
+		return -1;
+	}
+
+	netpbm_advise_huge_pages(delta->p_frame, p_elems * sizeof(uint32_t));
+	netpbm_advise_huge_pages(delta->output, o_size);
+
+	return 0;
+}
+
+int netpbm_sobel_delta(netpbm_delta_t *delta, netpbm_image_t *img,
+		unsigned long n_threads)
+{
+	if (img->data == NULL) {
+		fprintf(stderr, "Image structure is not initialized\n");
+		return -1;
+	}
+
+	if (img->type == NETPBM_ASCII_PIXMAP || img->type == NETPBM_BINARY_PIXMAP) {
+		fprintf(stderr, "Turn image into greyscale first using -g flag\n");
+		return -1;
+	}
+
+	if (n_threads == 0 || n_threads == ULONG_MAX) {
+		fprintf(stderr, "Invalid amount of threads!\n");
+		return -1;
+	}
+
+	int first_frame = 0;
+
+	if (delta->width != img->width || delta->height != img->height
+		|| delta->p_frame == NULL) {
+		if (delta_resize(delta, img->width, img->height) != 0)
+			return -1;
+		first_frame = 1;
+	}
+
+	const uint32_t p_width = img->width + 2;
+	const size_t n_tiles = (size_t)delta->tiles_x * delta->tiles_y;
+
+	/* Compare tiles with the previous frame, and store changed ones */
+	uint8_t *changed = (uint8_t *) netpbm_scratch_alloc(delta->arena,
+		n_tiles * sizeof(uint8_t));
+	if (changed == NULL)
+		return -1;
+
+	memset(changed, 0, n_tiles * sizeof(uint8_t));
+
+	delta->tiles_changed = 0;
+
+	for (size_t t = 0; t < n_tiles; t++) {
+		uint32_t x0 = (t % delta->tiles_x) * delta->tile_size;
+		uint32_t y0 = (t / delta->tiles_x) * delta->tile_size;
+		uint32_t tw = delta->tile_size;
+		uint32_t th = delta->tile_size;
+
+		if (x0 + tw > img->width)
+			tw = img->width - x0;
+		if (y0 + th > img->height)
+			th = img->height - y0;
+
+		for (uint32_t row = y0; row < y0 + th; row++) {
+			uint32_t *prev = delta->p_frame + (size_t)(row + 1) * p_width + x0 + 1;
+			uint32_t *cur = img->data + (size_t)row * img->width + x0;
+
+			if (first_frame || memcmp(prev, cur, sizeof(uint32_t) * tw) != 0) {
+				changed[t] = 1;
+				break;
+			}
+		}
+
+		if (!changed[t])
+			continue;
+
+		delta->tiles_changed++;
+
+		for (uint32_t row = y0; row < y0 + th; row++) {
+			memcpy(delta->p_frame + (size_t)(row + 1) * p_width + x0 + 1,
+				img->data + (size_t)row * img->width + x0,
+				sizeof(uint32_t) * tw
+			);
+		}
+	}
+
+	/* Output tile is dirty if any tile of its neighbourhood changed */
+	for (size_t t = 0; t < n_tiles; t++) {
+		int tx = t % delta->tiles_x;
+		int ty = t / delta->tiles_x;
+		uint16_t mask = 0;
+
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				if (tx + dx < 0 || tx + dx >= (int)delta->tiles_x
+					|| ty + dy < 0 || ty + dy >= (int)delta->tiles_y)
+					continue;
+
+				if (changed[(size_t)(ty + dy) * delta->tiles_x + (tx + dx)])
+					mask |= DIRTY_BIT(dx, dy);
+			}
+		}
+
+		delta->dirty[t] = mask;
+	}
+
+	netpbm_scratch_free(delta->arena, changed);
+
+	/* Collect dirty tiles, so that threads get equal share of work */
+	size_t n_dirty = 0;
+	for (size_t t = 0; t < n_tiles; t++) {
+		if (delta->dirty[t] != 0)
+			delta->order[n_dirty++] = t;
+	}
+
+	if (n_threads > n_dirty)
+		n_threads = n_dirty;
+
+	struct delta_worker_info *w_info = (struct delta_worker_info *)
+		netpbm_scratch_alloc(delta->arena,
+			sizeof(struct delta_worker_info) * n_threads);
+
+	pthread_t *threads = (pthread_t *) netpbm_scratch_alloc(delta->arena,
+		sizeof(pthread_t) * n_threads);
+
+	int ret = -1;
+
+	if (w_info == NULL || threads == NULL)
+		goto out;
+
+	/* split the job between n threads */
+	size_t e = n_threads ? n_dirty / n_threads : 0;
+	size_t o = n_threads ? n_dirty % n_threads : 0;
+	size_t ind = 0;
+
+	for (size_t t = 0; t < n_threads; t++) {
+		size_t end = ind + e;
+		if (o > 0) {
+			o--;
+			end += 1;
+		}
+		w_info[t] = (struct delta_worker_info){
+			.delta = delta,
+			.t_start = ind,
+			.t_end = end
+		};
+		ind = end;
+	}
+
+	if (delta->pool != NULL) {
+		if (netpbm_pool_run(delta->pool, delta_thread_task, w_info,
+				sizeof(struct delta_worker_info), n_threads) != 0)
+			goto out;
+	} else {
+		size_t created = 0;
+		int failed = 0;
+
+		for (; created < n_threads; created++) {
+			if (pthread_create(
+				&threads[created], NULL,
+				delta_thread_task,
+				(void*)(&w_info[created])
+			) != 0) {
+				fprintf(stderr, "Unable to create thread %lu!\n",
+					created);
+				failed = 1;
+				break;
+			}
+		}
+
+		// threads that were started still use the buffers
+		for (size_t t = 0; t < created; t++) {
+			if (pthread_join(threads[t], NULL) != 0) {
+				fprintf(stderr, "Unable to join thread %lu\n", t);
+				failed = 1;
+			}
+		}
+
+		if (failed)
+			goto out;
+	}
+
+	memcpy(img->data, delta->output,
+		sizeof(uint32_t) * img->width * img->height);
+
+	ret = 0;
+
+out:
+	netpbm_scratch_free(delta->arena, threads);
+	netpbm_scratch_free(delta->arena, w_info);
+
+	return ret;
+}
+
+int netpbm_delta_free(netpbm_delta_t *delta)
+{
+	free(delta->p_frame);
+	free(delta->output);
+	free(delta->dirty);
+	free(delta->order);
+
+	delta->p_frame = NULL;
+	delta->output = NULL;
+	delta->dirty = NULL;
+	delta->order = NULL;
+	delta->width = 0;
+	delta->height = 0;
+
+	return 0;
+}
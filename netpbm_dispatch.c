@@ -0,0 +1,108 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_dispatch.c
+ * @author Sergey Koziakov
+ * @brief selection of hot loops for the instruction set of the CPU
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+static const struct netpbm_kernels *selected = NULL;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Helper function that finds kernels by name, if the CPU supports them
+ */
+static const struct netpbm_kernels *find_kernels(const char *name)
+{
+	if (strcmp(name, "scalar") == 0)
+		return &netpbm_kernels_scalar;
+
+#ifdef NETPBM_X86_KERNELS
+	__builtin_cpu_init();
+
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+		return &netpbm_kernels_sse2;
+
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		return &netpbm_kernels_avx2;
+
+	if (strcmp(name, "avx512") == 0
+		&& __builtin_cpu_supports("avx512f")
+		&& __builtin_cpu_supports("avx512bw"))
+		return &netpbm_kernels_avx512;
+#endif
+
+	return NULL;
+}
+
+static void select_kernels(void)
+{
+	const char *forced = getenv("NETPBM_KERNELS");
+
+	if (forced != NULL) {
+		selected = find_kernels(forced);
+
+		if (selected == NULL)
+			fprintf(stderr, "Kernels %s are not available\n", forced);
+	}
+
+	const char *best[] = { "avx512", "avx2", "sse2" };
+
+	for (size_t i = 0; selected == NULL && i < sizeof(best) / sizeof(*best); i++)
+		selected = find_kernels(best[i]);
+
+	if (selected == NULL)
+		selected = &netpbm_kernels_scalar;
+}
+
+const struct netpbm_kernels *netpbm_get_kernels(void)
+{
+	pthread_once(&select_once, select_kernels);
+	return selected;
+}
+
+int netpbm_set_kernels(const char *name)
+{
+	const struct netpbm_kernels *kernels = find_kernels(name);
+
+	if (kernels == NULL) {
+		fprintf(stderr, "Kernels %s are not available\n", name);
+		return -1;
+	}
+
+	// keep automatic selection from overriding the choice later
+	pthread_once(&select_once, select_kernels);
+	selected = kernels;
+
+	return 0;
+}
+
+const char *netpbm_kernels_name(void)
+{
+	return netpbm_get_kernels()->name;
+}
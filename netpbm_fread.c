@@ -24,13 +24,19 @@
  */
 
 #include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <endian.h>
+#include <pthread.h>
 
 #include <errno.h>
 
+#define READ_BLOCK_SIZE (1 << 20)
+
 /* File Processing Helper Functions */
 
 static inline int FIND_EOL(FILE *ifile)
@@ -63,7 +69,7 @@ static inline int SKIP_EOL(FILE *ifile)
 			continue;
 
 		else {
-			fseek(ifile, -1, SEEK_CUR);
+			ungetc(byte, ifile);
 			break;
 		}
 	}
@@ -93,7 +99,7 @@ static inline int SKIP_WHITESPACE(FILE *ifile)
 			continue;
 
 		} else {
-			fseek(ifile, -1, SEEK_CUR);
+			ungetc(byte, ifile);
 			break;
 
 		};
@@ -102,6 +108,19 @@ static inline int SKIP_WHITESPACE(FILE *ifile)
 	return 0;
 }
 
+static inline int SKIP_SINGLE_WHITESPACE(FILE *ifile)
+{
+	uint8_t byte;
+
+	if (fread(&byte, sizeof(uint8_t), 1, ifile) != 1)
+		return -1;
+
+	if (!isspace(byte))
+		return -1;
+
+	return 0;
+}
+
 static inline int READ_BYTE(FILE *ifile, uint32_t *dest)
 {
 	uint8_t byte;
@@ -117,8 +136,7 @@ static inline int READ_BYTE(FILE *ifile, uint32_t *dest)
 static inline int READ_NUMBER(FILE *ifile, uint32_t *dest)
 {
 	uint8_t byte;
-	uint8_t n_digits = 0;
-	char number[8];
+	uint64_t number = 0;
 
 	while (1) {
 		if (fread(&byte, sizeof(char), 1, ifile) != 1) {
@@ -126,11 +144,15 @@ static inline int READ_NUMBER(FILE *ifile, uint32_t *dest)
 			return -1;
 		}
 		if (byte >= '0' && byte <= '9') {
-			number[n_digits++] = byte;
+			number = number * 10 + (byte - '0');
+
+			if (number > UINT32_MAX) {
+				fprintf(stderr, "Number is too big\n");
+				return -1;
+			}
 		} else {
-			number[n_digits] = '\0';
-			fseek(ifile, -1, SEEK_CUR);
-			*dest = strtol(number, NULL, 0);
+			ungetc(byte, ifile);
+			*dest = number;
 			break;
 		}
 	}
@@ -155,17 +177,416 @@ static inline int READ_PIXEL_WORD(FILE *ifile, uint32_t maxval, uint32_t *dest)
 	return 0;
 }
 
-/* End File Processing Helper Functions */
+/**
+ * @brief Helper function that reads a region of binary image data
+ *
+ * Binary formats have fixed row size, so only rows and columns of the
+ * region are read, and everything else is skipped using fseek(). File
+ * position must be at the first byte of the image data.
+ *
+ * @param[in] ifile - file to read from
+ * @param[out] img - image with allocated data and filled header fields
+ * @param[in] image_width - width of the whole image in the file
+ * @param[in] region - region to read, already clipped to the image
+ * @param[in] arena - arena for the row buffer, or NULL
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_binary_region(FILE *ifile, netpbm_image_t *img,
+		uint32_t image_width, const netpbm_rect_t *region,
+		netpbm_arena_t *arena)
+{
+	long data_start = ftell(ifile);
+	long row_bytes;
+	long first_byte;
+	size_t read_bytes;
+
+	switch (img->type) {
+	case NETPBM_BINARY_BITMAP:
+		// rows are padded to a whole byte
+		row_bytes = ((long)image_width + 7) / 8;
+		first_byte = region->x / 8;
+		read_bytes = ((size_t)region->x + region->width + 7) / 8 - first_byte;
+		break;
+	case NETPBM_BINARY_GREYMAP:
+		row_bytes = image_width;
+		first_byte = region->x;
+		read_bytes = region->width;
+		break;
+	case NETPBM_BINARY_PIXMAP:
+		row_bytes = (long)image_width * 3;
+		first_byte = (long)region->x * 3;
+		read_bytes = (size_t)region->width * 3;
+		break;
+	default:
+		return -1;
+	}
 
-int read_netpbm_file(char *filename, netpbm_image_t *img)
+	uint8_t *row_data = (uint8_t *) netpbm_scratch_alloc(arena, read_bytes);
+	if (row_data == NULL)
+		return -1;
+
+	/* Rows are contiguous when the region spans the whole width, so
+	 * there is no need to seek between them. This also keeps non-seekable
+	 * streams working for full image reads.
+	 */
+	int contiguous = (first_byte == 0 && (long)read_bytes == row_bytes);
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
+
+	for (uint32_t row = 0; row < region->height; row++) {
+		if (!contiguous || (row == 0 && region->y != 0)) {
+			long offset = data_start
+				+ (long)(region->y + row) * row_bytes + first_byte;
+
+			if (fseek(ifile, offset, SEEK_SET) != 0)
+				goto error;
+		}
+
+		if (fread(row_data, 1, read_bytes, ifile) != read_bytes)
+			goto error;
+
+		uint32_t *dest = img->data + (size_t)row * region->width;
+
+		if (img->type == NETPBM_BINARY_BITMAP) {
+			kernels->unpack_bits(row_data, region->x % 8,
+				dest, region->width);
+			continue;
+		}
+
+		for (uint32_t column = 0; column < region->width; column++) {
+			if (img->type == NETPBM_BINARY_GREYMAP) {
+				dest[column] = row_data[column];
+
+			} else {
+				const uint8_t *rgb = row_data + (size_t)column * 3;
+
+				dest[column]
+					= (rgb[0] & 0xff)
+					+ ((rgb[1] & 0xff) << 8)
+					+ ((rgb[2] & 0xff) << 16);
+			}
+		}
+	}
+
+	netpbm_scratch_free(arena, row_data);
+	return 0;
+
+error:
+	netpbm_scratch_free(arena, row_data);
+	return -1;
+}
+
+/**
+ * @brief Chunk of ASCII image data decoded by one thread
+ */
+struct ascii_chunk {
+	const uint8_t *body; /**< Image data from the current position to EOF */
+	size_t body_len;
+
+	size_t start; /**< First byte of the chunk */
+	size_t end; /**< Byte after the last one, chunk ends on whitespace */
+
+	size_t n_tokens; /**< Tokens in the chunk before invalid character */
+	int invalid; /**< Chunk contains a character that isn't digit or space */
+
+	size_t first_token; /**< Index of the first token of the chunk */
+	size_t total_tokens; /**< Tokens needed for the whole image */
+
+	netpbm_image_t *img;
+	const netpbm_rect_t *region;
+	uint32_t image_width;
+
+	int error;
+};
+
+/**
+ * @brief Helper function that skips whitespace and comments in the buffer
+ *
+ * @return position of the first byte after them
+ */
+static size_t skip_buffer_whitespace(const uint8_t *body, size_t pos, size_t len)
 {
-	FILE *ifile = fopen(filename, "rb");
+	while (pos < len) {
+		if (body[pos] == '#') {
+			while (pos < len && body[pos] != '\n' && body[pos] != '\r')
+				pos++;
+		} else if (isspace(body[pos])) {
+			pos++;
+		} else {
+			break;
+		}
+	}
 
-	if (ifile == NULL) {
-		fprintf(stderr, "Unable to open file: error %d\n", errno);
+	return pos;
+}
+
+static void *count_tokens_task(void *arguments)
+{
+	struct ascii_chunk *chunk = (struct ascii_chunk *) arguments;
+	size_t pos = chunk->start;
+	uint64_t trace = netpbm_trace_begin();
+
+	while (1) {
+		pos = skip_buffer_whitespace(chunk->body, pos, chunk->end);
+
+		if (pos >= chunk->end)
+			break;
+
+		if (chunk->body[pos] < '0' || chunk->body[pos] > '9') {
+			chunk->invalid = 1;
+			break;
+		}
+
+		chunk->n_tokens++;
+
+		while (pos < chunk->end
+			&& chunk->body[pos] >= '0' && chunk->body[pos] <= '9')
+			pos++;
+	}
+
+	netpbm_trace_end("count tokens", trace, chunk->start,
+		chunk->end - chunk->start);
+
+	return NULL;
+}
+
+static void *parse_tokens_task(void *arguments)
+{
+	struct ascii_chunk *chunk = (struct ascii_chunk *) arguments;
+	netpbm_image_t *img = chunk->img;
+	const netpbm_rect_t *region = chunk->region;
+
+	const size_t tpp = img->type == NETPBM_ASCII_PIXMAP ? 3 : 1;
+
+	size_t token = chunk->first_token;
+	size_t last_token = chunk->first_token + chunk->n_tokens;
+	size_t pos = chunk->start;
+	uint64_t trace = netpbm_trace_begin();
+
+	if (last_token > chunk->total_tokens)
+		last_token = chunk->total_tokens;
+
+	/* Pixel belongs to the thread that has its first token, so components
+	 * of the pixel started by the previous chunk are skipped, and the
+	 * last pixel may be finished past the end of the chunk
+	 */
+	size_t skip = (tpp - token % tpp) % tpp;
+
+	uint32_t components[3];
+
+	while (token < last_token || (token % tpp != 0 && token < chunk->total_tokens)) {
+		pos = skip_buffer_whitespace(chunk->body, pos, chunk->body_len);
+
+		uint64_t number = 0;
+		size_t n_digits = 0;
+
+		while (pos < chunk->body_len
+			&& chunk->body[pos] >= '0' && chunk->body[pos] <= '9') {
+			if (number <= UINT32_MAX)
+				number = number * 10 + (chunk->body[pos] - '0');
+			pos++;
+			n_digits++;
+		}
+
+		if (n_digits == 0 || number > img->maxval) {
+			chunk->error = 1;
+			return NULL;
+		}
+
+		if (skip > 0) {
+			skip--;
+			token++;
+			continue;
+		}
+
+		components[token % tpp] = number;
+
+		if (token % tpp == tpp - 1) {
+			size_t pixel = token / tpp;
+			uint32_t row = pixel / chunk->image_width;
+			uint32_t column = pixel % chunk->image_width;
+
+			if (row >= region->y
+				&& column >= region->x
+				&& column < region->x + region->width
+			) {
+				uint32_t value = components[0];
+
+				if (tpp == 3) {
+					value = (components[0] & 0xff)
+						+ ((components[1] & 0xff) << 8)
+						+ ((components[2] & 0xff) << 16);
+				}
+
+				img->data[(size_t)(row - region->y) * region->width
+					+ (column - region->x)] = value;
+			}
+		}
+
+		token++;
+	}
+
+	netpbm_trace_end("parse tokens", trace, chunk->start,
+		chunk->end - chunk->start);
+
+	return NULL;
+}
+
+/**
+ * @brief Helper function that runs chunk task on n threads and waits for them
+ */
+static int run_chunk_tasks(void *(*task)(void *), struct ascii_chunk *chunks,
+		unsigned long n_threads)
+{
+	pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+	if (threads == NULL)
 		return -1;
+
+	unsigned long created = 0;
+
+	for (; created < n_threads; created++) {
+		if (pthread_create(&threads[created], NULL, task,
+				(void *)(&chunks[created])) != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", created);
+			break;
+		}
+	}
+
+	for (unsigned long t = 0; t < created; t++)
+		pthread_join(threads[t], NULL);
+
+	free(threads);
+
+	return created == n_threads ? 0 : -1;
+}
+
+/**
+ * @brief Helper function that decodes ASCII image data using n threads
+ *
+ * Rest of the file is loaded into memory and split into chunks on
+ * whitespace. Tokens are counted in each chunk in parallel, and then
+ * parsed in parallel into their places in the image data. Data with
+ * comments is decoded by a single thread, since a chunk may start inside
+ * a comment.
+ *
+ * @param[in] ifile - file positioned at the start of the image data
+ * @param[out] img - image with allocated data and filled header fields
+ * @param[in] image_width - width of the whole image in the file
+ * @param[in] region - region to read, already clipped to the image
+ * @param[in] n_threads - amount of threads to use
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_ascii_parallel(FILE *ifile, netpbm_image_t *img,
+		uint32_t image_width, const netpbm_rect_t *region,
+		unsigned long n_threads)
+{
+	uint8_t *body = NULL;
+	size_t body_len = 0;
+	size_t body_size = 0;
+	struct ascii_chunk *chunks = NULL;
+	int ret = -1;
+
+	while (!feof(ifile)) {
+		if (body_size - body_len < READ_BLOCK_SIZE) {
+			body_size = body_size * 2 + READ_BLOCK_SIZE;
+
+			uint8_t *grown = (uint8_t *) realloc(body, body_size);
+			if (grown == NULL)
+				goto out;
+			body = grown;
+		}
+
+		body_len += fread(body + body_len, 1, body_size - body_len, ifile);
+
+		if (ferror(ifile))
+			goto out;
+	}
+
+	if (memchr(body, '#', body_len) != NULL || n_threads > body_len)
+		n_threads = 1;
+
+	chunks = (struct ascii_chunk *) calloc(n_threads, sizeof(struct ascii_chunk));
+	if (chunks == NULL)
+		goto out;
+
+	/* split data on whitespace, so that tokens don't cross chunks */
+	size_t start = 0;
+
+	for (unsigned long t = 0; t < n_threads; t++) {
+		size_t end = body_len * (t + 1) / n_threads;
+
+		if (end < start)
+			end = start;
+		while (end < body_len && !isspace(body[end]))
+			end++;
+
+		chunks[t] = (struct ascii_chunk){
+			.body = body,
+			.body_len = body_len,
+			.start = start,
+			.end = end,
+			.img = img,
+			.region = region,
+			.image_width = image_width
+		};
+		start = end;
+	}
+
+	if (run_chunk_tasks(count_tokens_task, chunks, n_threads) != 0)
+		goto out;
+
+	/* Tokens after the first invalid character are not a part of image */
+	const size_t tpp = img->type == NETPBM_ASCII_PIXMAP ? 3 : 1;
+	const size_t total_tokens = tpp * image_width
+		* (region->y + region->height);
+	size_t first_token = 0;
+
+	for (unsigned long t = 0; t < n_threads; t++) {
+		chunks[t].first_token = first_token;
+		chunks[t].total_tokens = total_tokens;
+
+		if (first_token >= total_tokens)
+			chunks[t].n_tokens = 0;
+
+		first_token += chunks[t].n_tokens;
+
+		if (chunks[t].invalid) {
+			for (unsigned long r = t + 1; r < n_threads; r++)
+				chunks[r].n_tokens = 0;
+			break;
+		}
 	}
 
+	if (first_token < total_tokens)
+		goto out;
+
+	if (run_chunk_tasks(parse_tokens_task, chunks, n_threads) != 0)
+		goto out;
+
+	ret = 0;
+	for (unsigned long t = 0; t < n_threads; t++) {
+		if (chunks[t].error)
+			ret = -1;
+	}
+
+out:
+	free(chunks);
+	free(body);
+	return ret;
+}
+
+/* End File Processing Helper Functions */
+
+/**
+ * @brief Helper function that reads the header of the image
+ *
+ * Leaves the file at the first byte of the pixel data.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_netpbm_header(FILE *ifile, netpbm_image_t *img)
+{
 	/*
 	 * 1. A "magic number" for identifying the file type:
 	 * -- An ASCII PBM file's magic number is the two characters "P1".
@@ -183,7 +604,6 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 
 	if (magic[0] != 'P' || magic[1] < '1' || magic[1] > '7') {
 		fprintf(stderr, "Unable to identify magic number\n");
-		fclose(ifile);
 		return -1;
 	}
 
@@ -205,9 +625,13 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 	if (READ_NUMBER(ifile, &img->height))
 		goto error;
 
-	/* 6. Whitespace. */
-	if (SKIP_WHITESPACE(ifile) != 0)
+	/* 6. Whitespace. Binary bitmap data starts right after it. */
+	if (img->type == NETPBM_BINARY_BITMAP) {
+		if (SKIP_SINGLE_WHITESPACE(ifile) != 0)
+			goto error;
+	} else if (SKIP_WHITESPACE(ifile) != 0) {
 		goto error;
+	}
 
 	/*
 	 * 7.1.
@@ -223,7 +647,12 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 	 */
 	if (img->type != NETPBM_ASCII_BITMAP && img->type != NETPBM_BINARY_BITMAP) {
 		READ_NUMBER(ifile, &img->maxval);
-		SKIP_WHITESPACE(ifile);
+
+		// don't eat binary data that looks like whitespace
+		if (NETPBM_TYPE_IS_BINARY(img->type))
+			SKIP_SINGLE_WHITESPACE(ifile);
+		else
+			SKIP_WHITESPACE(ifile);
 	} else {
 		img->maxval = 1;
 	}
@@ -241,6 +670,37 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 	);
 #endif // DEBUG
 
+	return 0;
+
+error:
+	fprintf(stderr, "Error reading file\n");
+	return -1;
+}
+
+/**
+ * @brief Helper function that reads one image from the opened file
+ *
+ * If capacity is given, data of the image is reused when it can hold
+ * the new image, and reallocated otherwise. With arena, data is taken
+ * from it, and the old data is released to it.
+ *
+ * @param[in] ifile - file positioned at the start of the image
+ * @param[out] img - netpbm image structure
+ * @param[in,out] region - region to load, or NULL for the whole image
+ * @param[in,out] capacity - amount of pixels img->data can hold, or NULL
+ * @param[in] arena - arena of buffers, or NULL
+ * @param[in] n_threads - decode ASCII data using n threads. Reads the file
+ * 	up to the end, so can't be used with streams
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_netpbm_image(FILE *ifile, netpbm_image_t *img,
+		netpbm_rect_t *region, size_t *capacity, netpbm_arena_t *arena,
+		unsigned long n_threads)
+{
+	if (read_netpbm_header(ifile, img) != 0)
+		return -1;
+
 	 /* 8.
 	  * -- P1: Width x Height bits, each either '1' or '0', starting at
 	  * 		the top-left corner of the bitmap, proceeding in normal
@@ -282,19 +742,88 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 	  * [ ] TODO: PAM format
 	  */
 
+	/* Clip requested region to the image */
+	netpbm_rect_t full = { 0, 0, img->width, img->height };
+
+	if (region == NULL) {
+		region = &full;
+	} else {
+		if (region->x >= img->width || region->y >= img->height
+			|| region->width == 0 || region->height == 0) {
+			fprintf(stderr, "Region is outside of the image\n");
+			return -1;
+		}
+
+		if (region->width > img->width - region->x)
+			region->width = img->width - region->x;
+		if (region->height > img->height - region->y)
+			region->height = img->height - region->y;
+	}
+
+	const uint32_t image_width = img->width;
+
 	/* allocate data */
-	img->data = (uint32_t *) malloc(sizeof(uint32_t *) * img->width * img->height);
+	size_t n_pixels = (size_t)region->width * region->height;
+	size_t size;
+
+	if (netpbm_size_mul(n_pixels, sizeof(uint32_t), &size) != 0) {
+		fprintf(stderr, "Image is too big\n");
+		return -1;
+	}
+
+	if (capacity == NULL || *capacity < n_pixels) {
+		uint32_t *data;
+
+		if (arena != NULL) {
+			// old contents are overwritten anyway, so nothing is copied
+			data = (uint32_t *) netpbm_arena_alloc(arena, size);
+
+			if (data != NULL && capacity != NULL)
+				netpbm_arena_release(arena, img->data);
+		} else {
+			data = (uint32_t *) realloc(
+				capacity != NULL ? img->data : NULL, size);
+			netpbm_advise_huge_pages(data, size);
+		}
+
+		if (data == NULL) {
+			fprintf(stderr, "Unable to allocate memory for image\n");
+			return -1;
+		}
+
+		img->data = data;
+		if (capacity != NULL)
+			*capacity = n_pixels;
+	}
+
+	img->width = region->width;
+	img->height = region->height;
+
+	if (NETPBM_TYPE_IS_BINARY(img->type)) {
+		if (read_binary_region(ifile, img, image_width, region, arena) != 0)
+			goto error;
+
+		return 0;
+	}
 
-	uint32_t cp = 0;
-	// temp variable
-	uint32_t byte = 0;
+	if (n_threads > 1) {
+		if (read_ascii_parallel(ifile, img, image_width, region,
+				n_threads) != 0)
+			goto error;
 
-	// for P4
+		return 0;
+	}
+
+	/* ASCII formats can't be seeked, so every pixel is parsed, and
+	 * only the ones inside the region are stored
+	 */
+	size_t cp = 0;
+	uint32_t pixel = 0;
+	uint32_t row = 0;
 	uint32_t column = 0;
-	uint32_t bits_read = 0;
-	uint32_t byte_needed = 1;
 
-	const uint32_t total_pixels = img->width * img->height;
+	const size_t total_pixels = (size_t)image_width
+		* (region->y + region->height);
 
 	while (cp < total_pixels) {
 		if (img->type == NETPBM_ASCII_BITMAP) {
@@ -310,12 +839,12 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 
 			// XXX: assumes whitelines between digits.
 			// GIMP, for example, not uses them.
-			if (READ_PIXEL_WORD(ifile, img->maxval, &(img->data[cp])) != 0)
+			if (READ_PIXEL_WORD(ifile, img->maxval, &pixel) != 0)
 				goto error;
 
 		} else if (img->type == NETPBM_ASCII_GREYMAP) {
 			// read image word by word
-			if (READ_PIXEL_WORD(ifile, img->maxval, &(img->data[cp])) != 0)
+			if (READ_PIXEL_WORD(ifile, img->maxval, &pixel) != 0)
 				goto error;
 
 		} else if (img->type == NETPBM_ASCII_PIXMAP) {
@@ -331,65 +860,182 @@ int read_netpbm_file(char *filename, netpbm_image_t *img)
 			if (READ_PIXEL_WORD(ifile, img->maxval, &blue) != 0)
 				goto error;
 
-			img->data[cp]
+			pixel
 				= (red & 0xff)
 				+ ((green & 0xff) << 8)
 				+ ((blue & 0xff) << 16);
+		}
 
-		} else if (img->type == NETPBM_BINARY_BITMAP) {
-			// read byte, split into 8 bits
-			// If image size isn't exactly divisible by 8, we
-			// ignore last bits in the byte, like here:
-			// http://fejlesztek.hu/pbm-p4-image-file-format/
-
-			if (byte_needed) {
-				bits_read = 0;
-				byte_needed = 0;
-				if (READ_BYTE(ifile, &byte) != 0)
-					goto error;
-			}
+		if (row >= region->y
+			&& column >= region->x
+			&& column < region->x + region->width
+		) {
+			img->data[(size_t)(row - region->y) * region->width
+				+ (column - region->x)] = pixel;
+		}
 
-			img->data[cp] = ((byte >> (7 - bits_read)) & 1U)
-				? 255U : 0;
+		if (++column == image_width) {
+			column = 0;
+			row++;
+		}
 
-			column++;
-			bits_read++;
+		cp++;
+	}
 
-			if (column == img->width) {
-				column = 0;
-				byte_needed = 1;
-			}
+	return 0;
 
-			if (bits_read == 8)
-				byte_needed = 1;
+error:
+	fprintf(stderr, "Error reading file\n");
+	return -1;
+}
 
-		} else if (img->type == NETPBM_BINARY_GREYMAP) {
-			if (READ_BYTE(ifile, &(img->data[cp])) != 0)
-				goto error;
+int netpbm_read_image(FILE *ifile, netpbm_image_t *img,
+		unsigned long n_threads)
+{
+	return read_netpbm_image(ifile, img, NULL, NULL, NULL, n_threads);
+}
 
-		} else if (img->type == NETPBM_BINARY_PIXMAP) {
-			uint32_t red, green, blue;
-			if (READ_BYTE(ifile, &red) != 0)
-				goto error;
-			if (READ_BYTE(ifile, &green) != 0)
-				goto error;
-			if (READ_BYTE(ifile, &blue) != 0)
-				goto error;
+int read_netpbm_file_region(char *filename, netpbm_image_t *img,
+		netpbm_rect_t *region)
+{
+	return read_netpbm_file_mt(filename, img, region, 1);
+}
 
-			img->data[cp]
-				= (red & 0xff)
-				+ ((green & 0xff) << 8)
-				+ ((blue & 0xff) << 16);
-		}
+int read_netpbm_file_mt(char *filename, netpbm_image_t *img,
+		netpbm_rect_t *region, unsigned long n_threads)
+{
+	FILE *ifile = fopen(filename, "rb");
 
-		cp++;
+	if (ifile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
 	}
 
+	uint64_t trace = netpbm_trace_begin();
+	int ret = read_netpbm_image(ifile, img, region, NULL, NULL, n_threads);
+
+	netpbm_trace_end("read", trace, 0, ret == 0 ? img->height : 0);
+
 	fclose(ifile);
-	return 0;
+	return ret;
+}
+
+int read_netpbm_file(char *filename, netpbm_image_t *img)
+{
+	return read_netpbm_file_region(filename, img, NULL);
+}
+
+int read_netpbm_file_header(char *filename, netpbm_image_t *img)
+{
+	FILE *ifile = fopen(filename, "rb");
+
+	img->data = NULL;
+
+	if (ifile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	int ret = read_netpbm_header(ifile, img);
+
+	fclose(ifile);
+	return ret;
+}
+
+int read_netpbm_bitmap(char *filename, netpbm_bitmap_t *bmp)
+{
+	FILE *ifile = fopen(filename, "rb");
+	netpbm_image_t header;
+	uint8_t *row_data = NULL;
+	int ret = -1;
+
+	bmp->data = NULL;
+
+	if (ifile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	if (read_netpbm_header(ifile, &header) != 0)
+		goto out;
+
+	if (header.type != NETPBM_BINARY_BITMAP) {
+		fprintf(stderr, "Image is not a binary bitmap\n");
+		goto out;
+	}
+
+	const uint32_t width = header.width;
+	const uint32_t height = header.height;
+
+	if (netpbm_bitmap_alloc(bmp, width, height) != 0)
+		goto out;
+
+	/* Rows of the file are padded to whole bytes, and are read into
+	 * whole words
+	 */
+	const size_t words = bmp->stride - 2;
+	const size_t row_bytes = ((size_t)width + 7) / 8;
+	const uint64_t last_mask = width % 64 ? ~0ULL << (64 - width % 64) : ~0ULL;
+
+	row_data = (uint8_t *) calloc(words, sizeof(uint64_t));
+	if (row_data == NULL && words > 0) {
+		fprintf(stderr, "Unable to allocate memory for image\n");
+		goto out;
+	}
+
+	for (uint32_t row = 0; row < height; row++) {
+		uint64_t *dest = bmp->data + (row + 1) * bmp->stride + 1;
+
+		if (fread(row_data, 1, row_bytes, ifile) != row_bytes)
+			goto error;
+
+		for (size_t w = 0; w < words; w++) {
+			uint64_t word;
+
+			memcpy(&word, row_data + w * sizeof(uint64_t), sizeof(word));
+			dest[w] = be64toh(word);
+		}
+
+		// padding bits of the file may have any value
+		if (words > 0)
+			dest[words - 1] &= last_mask;
+	}
+
+	ret = 0;
+	goto out;
 
 error:
 	fprintf(stderr, "Error reading file\n");
+out:
+	if (ret != 0)
+		free_netpbm_bitmap(bmp);
+
+	free(row_data);
 	fclose(ifile);
-	return -1;
+
+	return ret;
+}
+
+int netpbm_stream_read(netpbm_stream_t *stream, netpbm_image_t *img)
+{
+	/* Images may be separated by whitespace, and end of the stream
+	 * may only be found after skipping it
+	 */
+	if (SKIP_WHITESPACE(stream->file) != 0) {
+		if (feof(stream->file))
+			return 0;
+
+		fprintf(stderr, "Error reading file\n");
+		return -1;
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+
+	if (read_netpbm_image(stream->file, img, NULL, &stream->capacity,
+			stream->arena, 1) != 0)
+		return -1;
+
+	netpbm_trace_end("read", trace, stream->count, 1);
+	stream->count++;
+	return 1;
 }
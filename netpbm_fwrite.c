@@ -24,12 +24,19 @@
  */
 
 #include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
 
 #include <errno.h>
 
+/* Approximate size of text formatted by one thread at a time */
+#define FORMAT_BLOCK_SIZE (1 << 20)
+
 /* Helper Functions */
 static inline int __WRITE_BYTE(FILE *ofile, uint8_t byte)
 {
@@ -62,14 +69,231 @@ static inline int __WRITE_ASCII_NUMBER(FILE *ofile, uint32_t number)
 	return 0;
 }
 
+/**
+ * @brief Block of image rows formatted as ASCII text by one thread
+ */
+struct ascii_block {
+	netpbm_image_t *img;
 
-int write_netpbm_file(char *filename, netpbm_image_t *img)
+	uint32_t row_start;
+	uint32_t row_end;
+
+	uint8_t *text; /**< Buffer big enough for the formatted rows */
+	size_t length; /**< Length of the formatted text */
+};
+
+static inline uint8_t *format_ascii_number(uint8_t *out, uint32_t number)
 {
-	FILE *ofile = fopen(filename, "wb");
+	// split number into digits characters array
+	uint8_t digits[16];
+	uint8_t n_digits = 0;
 
-	if (ofile == NULL)
-		fprintf(stderr, "Unable to open file: error %d\n", errno);
+	do {
+		digits[n_digits++] = '0' + (number % 10);
+		number /= 10;
+	} while (number > 0);
+
+	while (n_digits > 0)
+		*out++ = digits[--n_digits];
+
+	return out;
+}
+
+static void *format_block_task(void *arguments)
+{
+	struct ascii_block *block = (struct ascii_block *) arguments;
+	netpbm_image_t *img = block->img;
+	uint8_t *out = block->text;
+
+	size_t cp = (size_t)block->row_start * img->width;
+	const size_t cp_end = (size_t)block->row_end * img->width;
+	uint64_t trace = netpbm_trace_begin();
+
+	for (; cp < cp_end; cp++) {
+		if (img->type == NETPBM_ASCII_PIXMAP) {
+			out = format_ascii_number(out, NETPBM_RED(img->data[cp]));
+			*out++ = ' ';
+			out = format_ascii_number(out, NETPBM_GREEN(img->data[cp]));
+			*out++ = ' ';
+			out = format_ascii_number(out, NETPBM_BLUE(img->data[cp]));
+			*out++ = '\n';
+		} else {
+			// Prevent big values from Sobel from ruining output
+			if (img->data[cp] > img->maxval)
+				img->data[cp] = img->maxval;
+
+			out = format_ascii_number(out, img->data[cp]);
+			*out++ = ' ';
+		}
+	}
+
+	block->length = out - block->text;
+
+	netpbm_trace_end("format rows", trace, block->row_start,
+		block->row_end - block->row_start);
+
+	return NULL;
+}
 
+/**
+ * @brief Helper function that formats ASCII image data using n threads
+ *
+ * Image is processed in rounds. In each round, every thread formats a
+ * block of rows into its own buffer, and then buffers are written to the
+ * file in order. Output is identical to the single-threaded writer.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int write_ascii_parallel(FILE *ofile, netpbm_image_t *img,
+		unsigned long n_threads, netpbm_arena_t *arena)
+{
+	/* Upper bound of the formatted pixel length */
+	size_t pixel_length = 0;
+
+	if (img->type == NETPBM_ASCII_PIXMAP) {
+		pixel_length = 3 * 4;
+	} else {
+		for (uint32_t v = img->maxval; v > 0; v /= 10)
+			pixel_length++;
+		pixel_length += 2;
+	}
+
+	size_t row_length = pixel_length * img->width;
+	uint32_t block_rows = row_length > 0 ? FORMAT_BLOCK_SIZE / row_length : 1;
+
+	if (block_rows == 0)
+		block_rows = 1;
+
+	struct ascii_block *blocks = (struct ascii_block *)
+		calloc(n_threads, sizeof(struct ascii_block));
+	pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+	int ret = -1;
+
+	if (blocks == NULL || threads == NULL)
+		goto out;
+
+	for (unsigned long t = 0; t < n_threads; t++) {
+		blocks[t].img = img;
+		blocks[t].text = (uint8_t *) netpbm_scratch_alloc(arena,
+			row_length * block_rows);
+
+		if (blocks[t].text == NULL)
+			goto out;
+	}
+
+	for (uint32_t row = 0; row < img->height; ) {
+		unsigned long n_blocks = 0;
+
+		for (; n_blocks < n_threads && row < img->height; n_blocks++) {
+			blocks[n_blocks].row_start = row;
+			row = (img->height - row > block_rows)
+				? row + block_rows : img->height;
+			blocks[n_blocks].row_end = row;
+
+			if (pthread_create(&threads[n_blocks], NULL,
+					format_block_task,
+					(void *)(&blocks[n_blocks])) != 0) {
+				fprintf(stderr, "Unable to create thread %lu!\n",
+					n_blocks);
+				for (unsigned long t = 0; t < n_blocks; t++)
+					pthread_join(threads[t], NULL);
+				goto out;
+			}
+		}
+
+		for (unsigned long t = 0; t < n_blocks; t++)
+			pthread_join(threads[t], NULL);
+
+		for (unsigned long t = 0; t < n_blocks; t++) {
+			if (fwrite(blocks[t].text, 1, blocks[t].length, ofile)
+					!= blocks[t].length)
+				goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	if (blocks != NULL) {
+		for (unsigned long t = 0; t < n_threads; t++)
+			netpbm_scratch_free(arena, blocks[t].text);
+	}
+	free(blocks);
+	free(threads);
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that writes binary image data row by row
+ *
+ * If amount of columns of a bitmap isn't divisible by 8, last bits of the
+ * row are zero. Values of greymaps and pixmaps are truncated to bytes.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int write_binary_rows(FILE *ofile, netpbm_image_t *img,
+		netpbm_arena_t *arena)
+{
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
+	size_t row_bytes;
+	int ret = 0;
+
+	if (img->type == NETPBM_BINARY_BITMAP)
+		row_bytes = ((size_t)img->width + 7) / 8;
+	else if (img->type == NETPBM_BINARY_GREYMAP)
+		row_bytes = img->width;
+	else
+		row_bytes = (size_t)img->width * 3;
+
+	uint8_t *row_data = (uint8_t *) netpbm_scratch_alloc(arena, row_bytes);
+
+	if (row_data == NULL)
+		return -1;
+
+	for (uint32_t row = 0; row < img->height; row++) {
+		const uint32_t *src = img->data + (size_t)row * img->width;
+
+		if (img->type == NETPBM_BINARY_BITMAP) {
+			kernels->pack_bits(src, row_data, img->width);
+
+		} else if (img->type == NETPBM_BINARY_GREYMAP) {
+			for (uint32_t column = 0; column < img->width; column++)
+				row_data[column] = (uint8_t) src[column];
+
+		} else {
+			for (uint32_t column = 0; column < img->width; column++) {
+				uint8_t *rgb = row_data + (size_t)column * 3;
+
+				rgb[0] = NETPBM_RED(src[column]);
+				rgb[1] = NETPBM_GREEN(src[column]);
+				rgb[2] = NETPBM_BLUE(src[column]);
+			}
+		}
+
+		if (fwrite(row_data, 1, row_bytes, ofile) != row_bytes) {
+			ret = -1;
+			break;
+		}
+	}
+
+	netpbm_scratch_free(arena, row_data);
+	return ret;
+}
+
+/**
+ * @brief Helper function that writes one image to the opened file
+ *
+ * @param[in] ofile - file to write to
+ * @param[in] img - netpbm image structure to be written
+ * @param[in] n_threads - format ASCII data using n threads
+ * @param[in] arena - arena for the scratch buffers, or NULL
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int write_netpbm_image(FILE *ofile, netpbm_image_t *img,
+		unsigned long n_threads, netpbm_arena_t *arena)
+{
 #define WRITE_BYTE(X)	\
 	do {\
 		if (__WRITE_BYTE(ofile, (X)) != 0) \
@@ -170,14 +394,22 @@ int write_netpbm_file(char *filename, netpbm_image_t *img)
 	  * [ ] TODO: PAM format
 	  */
 
-	uint32_t cp = 0;
-	const uint32_t total_pixels = img->width * img->height;
+	if (NETPBM_TYPE_IS_ASCII(img->type) && n_threads > 1) {
+		if (write_ascii_parallel(ofile, img, n_threads, arena) != 0)
+			goto error;
 
-	// for binary bitmap format
-	uint8_t byte = 0;
-	uint8_t bits_filled = 0;
-	uint32_t column = 0;
-	uint8_t byte_ready = 0;
+		return 0;
+	}
+
+	if (NETPBM_TYPE_IS_BINARY(img->type)) {
+		if (write_binary_rows(ofile, img, arena) != 0)
+			goto error;
+
+		return 0;
+	}
+
+	size_t cp = 0;
+	const size_t total_pixels = (size_t)img->width * img->height;
 
 	while (cp < total_pixels) {
 		if (img->type == NETPBM_ASCII_BITMAP || img->type == NETPBM_ASCII_GREYMAP) {
@@ -195,50 +427,281 @@ int write_netpbm_file(char *filename, netpbm_image_t *img)
 			PUT_SPACE();
 			WRITE_ASCII_NUMBER(NETPBM_BLUE(img->data[cp]));
 			PUT_WHITESPACE();
+		}
 
-		} else if (img->type == NETPBM_BINARY_BITMAP) {
-			// If amount of columns isn't divisible by 8,
-			// We allocate all required bytes, and ignore
-			// last bits
+		cp++;
+	}
 
-			if (img->data[cp] > 0)
-				byte |= (1U << (7 - bits_filled));
+	return 0;
 
-			bits_filled++;
-			column++;
+error:
+	fprintf(stderr, "Error writing file\n");
+	return -1;
+}
 
-			if (column == img->width) {
-				column = 0;
-				byte_ready = 1;
-			}
+int netpbm_write_image(FILE *ofile, netpbm_image_t *img,
+		unsigned long n_threads)
+{
+	return write_netpbm_image(ofile, img, n_threads, NULL);
+}
 
-			if (bits_filled == 8)
-				byte_ready = 1;
+int write_netpbm_file(char *filename, netpbm_image_t *img)
+{
+	return write_netpbm_file_mt(filename, img, 1);
+}
 
-			if (byte_ready) {
-				byte_ready = 0;
-				bits_filled = 0;
-				WRITE_BYTE(byte);
-				byte = 0;
-			}
+int write_netpbm_file_mt(char *filename, netpbm_image_t *img,
+		unsigned long n_threads)
+{
+	FILE *ofile = fopen(filename, "wb");
 
-		} else if (img->type == NETPBM_BINARY_GREYMAP) {
-			WRITE_BYTE(img->data[cp]);
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+	int ret = write_netpbm_image(ofile, img, n_threads, NULL);
 
-		} else if (img->type == NETPBM_BINARY_PIXMAP) {
-			WRITE_BYTE((uint8_t)(NETPBM_RED(img->data[cp])));
-			WRITE_BYTE((uint8_t)(NETPBM_GREEN(img->data[cp])));
-			WRITE_BYTE((uint8_t)(NETPBM_BLUE(img->data[cp])));
+	if (fclose(ofile) != 0)
+		ret = -1;
+
+	netpbm_trace_end("write", trace, 0, img->height);
+
+	return ret;
+}
+
+int write_netpbm_strip(char *filename, netpbm_image_t *img)
+{
+	if (!NETPBM_TYPE_IS_BINARY(img->type)) {
+		fprintf(stderr, "Strips can only be written for binary images\n");
+		return -1;
+	}
+
+	FILE *ofile = fopen(filename, "wb");
+
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+	int ret = write_binary_rows(ofile, img, NULL);
+
+	if (fclose(ofile) != 0)
+		ret = -1;
+
+	netpbm_trace_end("write", trace, 0, img->height);
+	if (ret != 0)
+		fprintf(stderr, "Error writing file\n");
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that appends the strip file to the output
+ *
+ * @return amount of rows in the strip, or -1 on error
+ */
+static int64_t append_strip(FILE *ofile, char *strip, size_t row_bytes,
+		uint8_t *buffer, size_t buffer_size)
+{
+	FILE *ifile = fopen(strip, "rb");
+	uint64_t total = 0;
+	size_t n;
+
+	if (ifile == NULL) {
+		fprintf(stderr, "Unable to open strip %s: error %d\n", strip, errno);
+		return -1;
+	}
+
+	while ((n = fread(buffer, 1, buffer_size, ifile)) > 0) {
+		if (fwrite(buffer, 1, n, ofile) != n) {
+			fprintf(stderr, "Error writing file\n");
+			fclose(ifile);
+			return -1;
 		}
+		total += n;
+	}
 
-		cp++;
+	if (ferror(ifile)) {
+		fprintf(stderr, "Error reading strip %s\n", strip);
+		fclose(ifile);
+		return -1;
 	}
 
-	fclose(ofile);
-	return 0;
+	fclose(ifile);
 
-error:
-	fprintf(stderr, "Error writing file\n");
-	fclose(ofile);
-	return -1;
+	if (total % row_bytes != 0) {
+		fprintf(stderr, "Strip %s doesn't hold whole rows\n", strip);
+		return -1;
+	}
+
+	return total / row_bytes;
+}
+
+int netpbm_merge_strips(char *filename, const netpbm_image_t *header,
+		char **strips, size_t n_strips)
+{
+	const size_t buffer_size = 1 << 20;
+	size_t row_bytes;
+	uint64_t rows = 0;
+	int ret = -1;
+
+	switch (header->type) {
+	case NETPBM_BINARY_BITMAP:
+		row_bytes = ((size_t)header->width + 7) / 8;
+		break;
+	case NETPBM_BINARY_GREYMAP:
+		row_bytes = header->width;
+		break;
+	case NETPBM_BINARY_PIXMAP:
+		row_bytes = (size_t)header->width * 3;
+		break;
+	default:
+		fprintf(stderr, "Strips can only be merged into binary images\n");
+		return -1;
+	}
+
+	if (row_bytes == 0) {
+		fprintf(stderr, "Image has no pixels\n");
+		return -1;
+	}
+
+	uint8_t *buffer = (uint8_t *) malloc(buffer_size);
+	if (buffer == NULL) {
+		fprintf(stderr, "Unable to allocate memory for output\n");
+		return -1;
+	}
+
+	FILE *ofile = fopen(filename, "wb");
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		free(buffer);
+		return -1;
+	}
+
+	/* Header is the same as written by write_netpbm_image() */
+	int written = header->type == NETPBM_BINARY_BITMAP
+		? fprintf(ofile, "P4\n%u\n%u\n", header->width, header->height)
+		: fprintf(ofile, "P%d\n%u\n%u\n%u\n", header->type,
+			header->width, header->height, header->maxval);
+
+	if (written < 0) {
+		fprintf(stderr, "Error writing file\n");
+		goto out;
+	}
+
+	for (size_t s = 0; s < n_strips; s++) {
+		int64_t strip_rows = append_strip(ofile, strips[s], row_bytes,
+			buffer, buffer_size);
+
+		if (strip_rows < 0)
+			goto out;
+
+		rows += strip_rows;
+	}
+
+	if (rows != header->height) {
+		fprintf(stderr, "Strips hold %llu rows of %u\n",
+			(unsigned long long) rows, header->height);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (fclose(ofile) != 0 && ret == 0) {
+		fprintf(stderr, "Error writing file\n");
+		ret = -1;
+	}
+
+	free(buffer);
+
+	return ret;
+}
+
+int write_netpbm_bitmap(char *filename, const netpbm_bitmap_t *bmp)
+{
+	const size_t words = bmp->stride - 2;
+	const size_t row_bytes = ((size_t)bmp->width + 7) / 8;
+	int ret = -1;
+
+	uint8_t *row_data = (uint8_t *) malloc(words * sizeof(uint64_t) + 1);
+	if (row_data == NULL) {
+		fprintf(stderr, "Unable to allocate memory for output\n");
+		return -1;
+	}
+
+	FILE *ofile = fopen(filename, "wb");
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		free(row_data);
+		return -1;
+	}
+
+	/* Header is the same as written by write_netpbm_image() */
+	if (fprintf(ofile, "P4\n%u\n%u\n", bmp->width, bmp->height) < 0)
+		goto out;
+
+	for (uint32_t row = 0; row < bmp->height; row++) {
+		const uint64_t *src = bmp->data + (row + 1) * bmp->stride + 1;
+
+		for (size_t w = 0; w < words; w++) {
+			uint64_t word = htobe64(src[w]);
+
+			memcpy(row_data + w * sizeof(uint64_t), &word, sizeof(word));
+		}
+
+		if (fwrite(row_data, 1, row_bytes, ofile) != row_bytes)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (fclose(ofile) != 0)
+		ret = -1;
+	if (ret != 0)
+		fprintf(stderr, "Error writing file\n");
+
+	free(row_data);
+
+	return ret;
+}
+
+int write_netpbm_bytes(char *filename, uint32_t width, uint32_t height,
+		const uint8_t *data)
+{
+	FILE *ofile = fopen(filename, "wb");
+	const size_t size = (size_t)width * height;
+	int ret = -1;
+
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	if (fprintf(ofile, "P5\n%u\n%u\n255\n", width, height) >= 0
+		&& fwrite(data, 1, size, ofile) == size)
+		ret = 0;
+
+	if (fclose(ofile) != 0)
+		ret = -1;
+	if (ret != 0)
+		fprintf(stderr, "Error writing file\n");
+
+	return ret;
+}
+
+int netpbm_stream_write(netpbm_stream_t *stream, netpbm_image_t *img)
+{
+	uint64_t trace = netpbm_trace_begin();
+
+	if (write_netpbm_image(stream->file, img, 1, stream->arena) != 0)
+		return -1;
+
+	netpbm_trace_end("write", trace, stream->count, 1);
+	stream->count++;
+	return 0;
 }
@@ -24,6 +24,7 @@
  */
 
 #include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,8 @@
 #include <math.h>
 #include <time.h>
 
+/** Size of tiles checked for uniform values before Sobel operator */
+#define UNIFORM_TILE_SIZE 32
 
 int netpbm_to_greyscale(netpbm_image_t *img)
 {
@@ -57,17 +60,15 @@ int netpbm_to_greyscale(netpbm_image_t *img)
 		break;
 	}
 
-	size_t total_pixels = img->width * img->height;
+	size_t total_pixels = (size_t)img->width * img->height;
+	uint64_t trace = netpbm_trace_begin();
 
-	for (size_t i = 0; i < total_pixels; i++) {
-		img->data[i]
-			= 0.21 * NETPBM_RED(img->data[i])
-			+ 0.72 * NETPBM_GREEN(img->data[i])
-			+ 0.07 * NETPBM_BLUE(img->data[i]);
+	/* Grey value of each pixel is computed using luminosity method:
+	 * 0.21 R + 0.72 G + 0.07 B, clamped to maxval
+	 */
+	netpbm_get_kernels()->greyscale(img->data, total_pixels, img->maxval);
 
-		if (img->data[i] > img->maxval)
-			img->data[i] = img->maxval;
-	}
+	netpbm_trace_end("greyscale", trace, 0, total_pixels);
 
 	// It's now a greyscale image, not RGB, so adjust image type
 	img->type -= 1;
@@ -157,61 +158,592 @@ struct worker_info {
 
 	size_t i_start;
 	size_t i_end;
+
+	uint32_t blur_radius; /**< Radius of Gaussian pre-smoothing, or 0 */
+	uint32_t *rows; /**< 3 smoothed rows of p_width pixels */
+	uint64_t *blur_tmp; /**< Sums of the vertical blur pass */
+
+	uint8_t *uniform; /**< Flags of uniform tiles in the current band */
+	size_t skipped; /**< Pixels zero-filled without convolution */
+
+	int count_events; /**< Read hardware counters of the task */
+	uint64_t counters[NETPBM_COUNTERS];
+	uint32_t counters_valid;
+
+	netpbm_output_t *output; /**< File the results are stored to, or NULL */
+	int output_error;
+
+	uint64_t *bins; /**< Histogram of the task results, or NULL */
+	uint32_t n_bins;
+	uint32_t min, max;
+	uint64_t sum;
+
+	int gradients; /**< Keep gradients or directions of the results */
+	int32_t *gradient_x; /**< Gradients of the image, or NULL */
+	int32_t *gradient_y;
+	uint8_t *direction; /**< Directions of the image, or NULL */
+	int32_t *span_x; /**< Gradients of a span, if they are not stored */
+	int32_t *span_y;
+
+	/** Rows of the image the task pads itself, so that they are first
+	 * touched on its node, or an empty range */
+	uint32_t pad_start, pad_end;
+	/** Waited for by spawned workers after padding, or NULL */
+	pthread_barrier_t *padded;
+	/** Passed by spawned workers before padding */
+	struct spawn_gate *gate;
+};
+
+/**
+ * @brief Helper function that copies rows [first, end) of the image to
+ * the center of the padded array
+ *
+ * Padded rows start from the second element of the row below. Buffer may
+ * be reused, so the border columns are zeroed here too, and border rows
+ * are zeroed with the first and the last row of the image.
+ */
+static void pad_rows(uint32_t *p_data, size_t p_width, const uint32_t *src,
+		uint32_t width, uint32_t height, uint32_t first, uint32_t end)
+{
+	// fill border with zeroes
+	// TODO: implement some other kind of padding?
+	if (first == 0)
+		memset(p_data, 0, sizeof(uint32_t) * p_width);
+	if (end == height)
+		memset(p_data + p_width * ((size_t)height + 1), 0,
+			sizeof(uint32_t) * p_width);
+
+	for (size_t row = first; row < end; row++) {
+		uint32_t *p_row = p_data + p_width * (row + 1);
+
+		p_row[0] = 0;
+		memcpy(p_row + 1, src + row * width, sizeof(uint32_t) * width);
+		p_row[p_width - 1] = 0;
+	}
+}
+
+/**
+ * @brief Helper function that stores the computed pixels to the output
+ * file, while they are still in cache
+ */
+static void store_span(struct worker_info *info, size_t first, size_t n)
+{
+	if (info->output == NULL || info->output_error)
+		return;
+
+	if (netpbm_output_store(info->output, info->dest + first, first, n) != 0)
+		info->output_error = 1;
+}
+
+/**
+ * @brief Helper function that adds the computed pixels to the histogram
+ * of the task, while they are still in cache
+ */
+static void tally_span(struct worker_info *info, size_t first, size_t n)
+{
+	if (info->bins == NULL)
+		return;
+
+	const uint32_t *src = info->dest + first;
+	const uint32_t last = info->n_bins - 1;
+	uint32_t min = info->min;
+	uint32_t max = info->max;
+	uint64_t sum = info->sum;
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t value = src[i];
+
+		info->bins[value < last ? value : last]++;
+		min = value < min ? value : min;
+		max = value > max ? value : max;
+		sum += value;
+	}
+
+	info->min = min;
+	info->max = max;
+	info->sum = sum;
+}
+
+/**
+ * @brief Helper function that applies Sobel operator to n pixels starting
+ * at first, given rows above, at and below them, keeping the gradients
+ *
+ * Gradients are stored to the task rows if only directions are requested.
+ */
+static void gradient_span(struct worker_info *info,
+		const struct netpbm_kernels *kernels, const uint32_t *a,
+		const uint32_t *b, const uint32_t *c, size_t first, uint32_t n)
+{
+	int32_t *gx = info->gradient_x != NULL
+		? info->gradient_x + first : info->span_x;
+	int32_t *gy = info->gradient_y != NULL
+		? info->gradient_y + first : info->span_y;
+
+	kernels->sobel_gradients(a, b, c, info->dest + first, gx, gy, n);
+
+	if (info->direction != NULL)
+		kernels->quantize_directions(gx, gy, info->direction + first, n);
+}
+
+/**
+ * @brief Helper function that zeroes gradients of a uniform span, which
+ * have horizontal direction
+ */
+static void zero_gradients(struct worker_info *info, size_t first, size_t n)
+{
+	if (info->gradient_x != NULL)
+		memset(info->gradient_x + first, 0, sizeof(int32_t) * n);
+	if (info->gradient_y != NULL)
+		memset(info->gradient_y + first, 0, sizeof(int32_t) * n);
+	if (info->direction != NULL)
+		memset(info->direction + first, NETPBM_DIRECTION_HORIZONTAL, n);
+}
+
+/**
+ * @brief Helper function that checks if the tile and its 1-pixel halo
+ * have the same value everywhere
+ *
+ * Sobel output of such tile is zero, since kernels add up to zero. Most
+ * tiles of natural images differ within the first row, so the check is
+ * cheap when it fails.
+ */
+static int tile_is_uniform(const struct worker_info *info,
+		const struct netpbm_kernels *kernels, uint32_t x0, uint32_t y0)
+{
+	uint32_t tw = info->d_width - x0 < UNIFORM_TILE_SIZE
+		? info->d_width - x0 : UNIFORM_TILE_SIZE;
+	uint32_t th = info->d_height - y0 < UNIFORM_TILE_SIZE
+		? info->d_height - y0 : UNIFORM_TILE_SIZE;
+
+	/* Padded coordinates of the tile start one row and column earlier */
+	const uint32_t *row = info->p_data + (size_t)y0 * info->p_width + x0;
+	const uint32_t value = row[0];
+
+	for (uint32_t r = 0; r < th + 2; r++, row += info->p_width) {
+		if (!kernels->is_uniform(row, tw + 2, value))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Helper function that applies Sobel operator to a part of the row,
+ * zero-filling uniform tiles
+ *
+ * Neighbouring tiles of the same kind are handled at once, so that
+ * convolution runs over spans as long as possible.
+ */
+static void sobel_row_span(struct worker_info *info,
+		const struct netpbm_kernels *kernels, uint32_t x, uint32_t y,
+		uint32_t n)
+{
+	const uint32_t end = x + n;
+
+	while (x < end) {
+		const uint8_t uniform = info->uniform[x / UNIFORM_TILE_SIZE];
+		uint32_t next = x;
+
+		do {
+			next = (next / UNIFORM_TILE_SIZE + 1) * UNIFORM_TILE_SIZE;
+		} while (next < end
+			&& info->uniform[next / UNIFORM_TILE_SIZE] == uniform);
+
+		if (next > end)
+			next = end;
+
+		if (uniform) {
+			memset(info->dest + (size_t)y * info->d_width + x, 0,
+				sizeof(uint32_t) * (next - x));
+			info->skipped += next - x;
+
+			if (info->bins != NULL) {
+				info->bins[0] += next - x;
+				info->min = 0;
+			}
+			if (info->gradients)
+				zero_gradients(info, (size_t)y * info->d_width + x,
+					next - x);
+		} else if (!info->gradients) {
+			kernels->sobel_span(info->p_data, info->p_width,
+				info->dest, x, y, next - x);
+			tally_span(info, (size_t)y * info->d_width + x, next - x);
+		} else {
+			const uint32_t *a = info->p_data + (size_t)y * info->p_width + x;
+
+			gradient_span(info, kernels, a, a + info->p_width,
+				a + 2 * (size_t)info->p_width,
+				(size_t)y * info->d_width + x, next - x);
+			tally_span(info, (size_t)y * info->d_width + x, next - x);
+		}
+
+		x = next;
+	}
+}
+
+/**
+ * @brief Helper function that smooths row y into the padded row buffer
+ *
+ * Rows outside of the image are zero, like the padding of the Sobel input.
+ */
+static void smooth_row(const struct worker_info *info,
+		const struct netpbm_kernels *kernels, uint32_t *row, int64_t y)
+{
+	if (y < 0 || y >= info->d_height) {
+		memset(row, 0, sizeof(uint32_t) * info->p_width);
+		return;
+	}
+
+	row[0] = 0;
+	kernels->blur_row(info->p_data, info->p_width, info->d_height, y,
+		info->blur_radius, row + 1, info->blur_tmp);
+	row[info->p_width - 1] = 0;
+}
+
+/**
+ * @brief Helper function that applies Sobel operator to the smoothed image
+ *
+ * Smoothed rows are kept in a ring of 3 rows, so full smoothed image is
+ * never stored. Rows next to the range of another worker are smoothed by
+ * both of them.
+ */
+static void smoothed_sobel_task(struct worker_info *info,
+		const struct netpbm_kernels *kernels)
+{
+	if (info->i_start == info->i_end)
+		return;
+
+	uint32_t *ring[3] = {
+		info->rows,
+		info->rows + info->p_width,
+		info->rows + 2 * (size_t)info->p_width
+	};
+	uint32_t y_first = info->i_start / info->d_width;
+	uint32_t y_last = (info->i_end - 1) / info->d_width;
+
+	for (int k = 0; k < 3; k++)
+		smooth_row(info, kernels, ring[k], (int64_t)y_first - 1 + k);
+
+	for (uint32_t y = y_first; y <= y_last; y++) {
+		if (y > y_first) {
+			uint32_t *oldest = ring[0];
+
+			ring[0] = ring[1];
+			ring[1] = ring[2];
+			ring[2] = oldest;
+			smooth_row(info, kernels, ring[2], (int64_t)y + 1);
+		}
+
+		uint32_t x0 = y == y_first ? info->i_start % info->d_width : 0;
+		uint32_t x1 = y == y_last
+			? (info->i_end - 1) % info->d_width + 1 : info->d_width;
+
+		if (!info->gradients)
+			kernels->sobel_rows(ring[0] + x0, ring[1] + x0, ring[2] + x0,
+				info->dest + (size_t)y * info->d_width + x0, x1 - x0);
+		else
+			gradient_span(info, kernels, ring[0] + x0, ring[1] + x0,
+				ring[2] + x0, (size_t)y * info->d_width + x0, x1 - x0);
+		tally_span(info, (size_t)y * info->d_width + x0, x1 - x0);
+		store_span(info, (size_t)y * info->d_width + x0, x1 - x0);
+	}
+}
+
+/**
+ * @brief Helper function that applies Sobel operator to the range of
+ * pixels of the task
+ */
+static void sobel_task(struct worker_info *info,
+		const struct netpbm_kernels *kernels)
+{
+	if (info->blur_radius > 0) {
+		smoothed_sobel_task(info, kernels);
+		return;
+	}
+
+	/* Range of pixels is processed as spans of whole or partial rows.
+	 * Uniform tiles are found for each band of tile rows the range
+	 * touches, so bands shared with another worker are checked twice.
+	 */
+	size_t i = info->i_start;
+	uint32_t band = UINT32_MAX;
+	const uint32_t tiles_x = (info->d_width + UNIFORM_TILE_SIZE - 1)
+		/ UNIFORM_TILE_SIZE;
+
+	while (i < info->i_end) {
+		uint32_t x = i % info->d_width;
+		uint32_t y = i / info->d_width;
+		size_t n = info->d_width - x;
+
+		if (n > info->i_end - i)
+			n = info->i_end - i;
+
+		if (y / UNIFORM_TILE_SIZE != band) {
+			band = y / UNIFORM_TILE_SIZE;
+
+			for (uint32_t t = 0; t < tiles_x; t++)
+				info->uniform[t] = tile_is_uniform(info, kernels,
+					t * UNIFORM_TILE_SIZE, band * UNIFORM_TILE_SIZE);
+		}
+
+		sobel_row_span(info, kernels, x, y, n);
+		store_span(info, i, n);
+
+		i += n;
+	}
+}
+
+/**
+ * @brief Helper function that pads the band of the task, on the worker
+ * that processes it
+ */
+static void *pad_task(void *arguments)
+{
+	struct worker_info *info = (struct worker_info *) arguments;
+	uint64_t trace = netpbm_trace_begin();
+
+	// border rows are zeroed by the tasks padding the edge rows
+	if (info->pad_start == info->pad_end)
+		return NULL;
+
+	pad_rows(info->p_data, info->p_width, info->dest, info->d_width,
+		info->d_height, info->pad_start, info->pad_end);
+
+	netpbm_trace_end("pad band", trace, info->pad_start,
+		info->pad_end - info->pad_start);
+
+	return NULL;
+}
+
+/**
+ * @brief start of the spawned workers
+ *
+ * Workers waiting at the padding barrier only get past it once all of
+ * them run, so they wait here until every thread is created, and give
+ * up if one of them could not be.
+ */
+struct spawn_gate {
+	pthread_mutex_t lock;
+	pthread_cond_t opened;
+	int state; /**< 0 while threads are created, 1 to run, -1 to give up */
 };
 
+/**
+ * @brief Helper function that waits until the gate is opened
+ *
+ * @return 0 if the worker may run, -1 if it must give up
+ */
+static int gate_wait(struct spawn_gate *gate)
+{
+	pthread_mutex_lock(&gate->lock);
+	while (gate->state == 0)
+		pthread_cond_wait(&gate->opened, &gate->lock);
+
+	int state = gate->state;
+
+	pthread_mutex_unlock(&gate->lock);
+
+	return state > 0 ? 0 : -1;
+}
+
 void *thread_task(void *arguments)
 {
 	struct worker_info *info = (struct worker_info *) arguments;
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
 
-	/* Sobel kernel components */
-	const uint32_t x_kernel[] = {
-		-1, 0, 1,
-		-2, 0, 2,
-		-1, 0, 1
-	};
+	/* Neighbouring bands are read after every worker padded its own */
+	if (info->padded != NULL) {
+		if (gate_wait(info->gate) != 0)
+			return NULL;
+
+		pad_task(info);
+		pthread_barrier_wait(info->padded);
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+
+	if (!info->count_events) {
+		sobel_task(info, kernels);
+	} else {
+		/* Counters follow the thread, so they are opened by the worker */
+		struct netpbm_counters counters;
 
-	const uint32_t y_kernel[] = {
-		-1, -2, -1,
-		 0,  0,  0,
-		 1,  2,  1
+		netpbm_counters_start(&counters);
+		sobel_task(info, kernels);
+		netpbm_counters_stop(&counters, info->counters,
+			&info->counters_valid);
+	}
+
+	netpbm_trace_end("sobel task", trace, info->i_start,
+		info->i_end - info->i_start);
+
+	return NULL;
+}
+
+/**
+ * @brief Helper function that runs Sobel workers on the new threads
+ *
+ * Creates a thread for each element of w_info, and waits for all of them
+ * to finish. With pin, threads are pinned to CPUs ordered by NUMA node
+ * from the start, or left unpinned if that is not possible.
+ *
+ * @returns 0 if no problem occured, -1 otherwise
+ */
+static int spawn_workers(pthread_t *threads, struct worker_info *w_info,
+		unsigned long n_threads, int pin)
+{
+	struct spawn_gate gate = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.opened = PTHREAD_COND_INITIALIZER,
+		.state = 0
 	};
+	uint64_t trace = netpbm_trace_begin();
+	unsigned long created = 0;
+	int ret = 0;
 
-	for (size_t i = info->i_start; i < info->i_end; i++) {
-		uint32_t out_x = 0;
-		uint32_t out_y = 0;
+	for (; created < n_threads; created++) {
+		pthread_attr_t attr;
+		int pinned = pin && pthread_attr_init(&attr) == 0;
 
-		// Add 1 to focus point coordinates to avoid padded edges
+		if (pinned && netpbm_pin_attr(&attr, created, n_threads) != 0) {
+			pthread_attr_destroy(&attr);
+			pinned = 0;
+		}
 
-		if (apply_kernel(info->p_data,
-				info->p_width, info->p_height,
-				(i % info->d_width) + 1, (i / info->d_width) + 1,
-				x_kernel, 3, 3,
-				&out_x
-		) != 0) {
-			fprintf(stderr, "Unable to apply kernel to the data!\n");
-			exit(EXIT_FAILURE);
-		};
+		w_info[created].gate = &gate;
 
-		if (apply_kernel(info->p_data,
-				info->p_width, info->p_height,
-				(i % info->d_width) + 1, (i / info->d_width) + 1,
-				y_kernel, 3, 3,
-				&out_y
-		) != 0) {
-			fprintf(stderr, "Unable to apply kernel to the data!\n");
-			exit(EXIT_FAILURE);
-		};
+		/* create thread */
+		int error = pthread_create(
+			&threads[created], pinned ? &attr : NULL,
+			thread_task,
+			(void*)(&w_info[created])
+		);
 
-		uint32_t val = sqrt(out_x * out_x + out_y * out_y);
+		if (pinned)
+			pthread_attr_destroy(&attr);
 
-		info->dest[i] = val;
+		if (error != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", created);
+			ret = -1;
+			break;
+		}
 	}
 
-	return NULL;
+	/* Workers that would wait for the missing ones at the barrier give
+	 * up instead
+	 */
+	pthread_mutex_lock(&gate.lock);
+	gate.state = ret == 0 ? 1 : -1;
+	pthread_cond_broadcast(&gate.opened);
+	pthread_mutex_unlock(&gate.lock);
+
+	if (ret == 0)
+		netpbm_trace_end("spawn workers", trace, 0, n_threads);
+
+	// threads that were started still use the buffers
+	for (unsigned long t = 0; t < created; t++) {
+		switch (pthread_join(threads[t], NULL)) {
+		case EDEADLK:
+			fprintf(stderr, "Deadlock occured!\n");
+			ret = -1;
+			break;
+
+		case EINVAL:
+			fprintf(stderr,
+				"Thread %lu is not a joinable thread, "
+				"or another thread is already waiting to "
+				"join it!\n", t
+			);
+			ret = -1;
+			break;
+
+		case ESRCH:
+			fprintf(stderr, "Thread %lu could not be found\n", t);
+			ret = -1;
+			break;
+
+		case 0:
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that returns amount of histogram bins, one more
+ * than the strongest magnitude of an image with the given maxval
+ *
+ * Gradients are at most 4 maxval, so squared magnitude is 32 maxval^2.
+ * Magnitudes are square roots of 32-bit values, so they never reach 65536.
+ */
+static uint32_t histogram_bins(uint32_t maxval)
+{
+	double strongest = sqrt(32.0 * maxval * maxval);
+
+	return strongest >= 65535.0 ? 65536 : (uint32_t) strongest + 1;
+}
+
+/**
+ * @brief Helper function that merges histograms of the tasks
+ *
+ * @returns 0 if no problem occured, -1 otherwise
+ */
+static int merge_histograms(netpbm_histogram_t *histogram,
+		const struct worker_info *w_info, size_t n_tasks,
+		uint32_t n_bins, size_t t_pixels)
+{
+	if (histogram->bins == NULL || histogram->n_bins != n_bins) {
+		uint64_t *bins = (uint64_t *) realloc(histogram->bins,
+			n_bins * sizeof(uint64_t));
+
+		if (bins == NULL) {
+			fprintf(stderr, "Unable to allocate memory for histogram\n");
+			return -1;
+		}
+		histogram->bins = bins;
+		histogram->n_bins = n_bins;
+	}
+
+	memset(histogram->bins, 0, n_bins * sizeof(uint64_t));
+	histogram->min = t_pixels > 0 ? UINT32_MAX : 0;
+	histogram->max = 0;
+	histogram->sum = 0;
+	histogram->pixels = t_pixels;
+
+	for (size_t t = 0; t < n_tasks; t++) {
+		const struct worker_info *info = &w_info[t];
+
+		for (uint32_t b = 0; b < n_bins; b++)
+			histogram->bins[b] += info->bins[b];
+
+		if (info->min < histogram->min)
+			histogram->min = info->min;
+		if (info->max > histogram->max)
+			histogram->max = info->max;
+		histogram->sum += info->sum;
+	}
+
+	return 0;
 }
 
 int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads)
 {
+	netpbm_sobel_opts_t opts = {
+		.n_threads = n_threads,
+		.pool = NULL
+	};
+
+	return netpbm_sobel_ext(img, &opts);
+}
+
+int netpbm_sobel_ext(netpbm_image_t *img, const netpbm_sobel_opts_t *opts)
+{
+	unsigned long n_threads = opts->n_threads;
+
+	if (opts->pool != NULL && n_threads == 0)
+		n_threads = netpbm_pool_size(opts->pool);
+
 	if (img->data == NULL) {
 		fprintf(stderr, "Image structure is not initialized\n");
 		return -1;
@@ -227,43 +759,148 @@ int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads)
 		return -1;
 	}
 
+	if (opts->blur != 0 && opts->blur != 3 && opts->blur != 5) {
+		fprintf(stderr, "Blur kernel size must be 3 or 5\n");
+		return -1;
+	}
+
+	/* Spans of a task don't start on byte boundaries of bitmaps */
+	if (opts->output != NULL && (opts->output->type != NETPBM_BINARY_GREYMAP
+		|| opts->output->width != img->width
+		|| opts->output->height != img->height)) {
+		fprintf(stderr, "Output must be a greymap of the image size\n");
+		return -1;
+	}
+
 	/* Pad the data */
-	uint32_t p_height = img->height + 2;
-	uint32_t p_width = img->width + 2;
-	uint32_t p_elems = p_width * p_height;
-	uint32_t *p_data = (uint32_t *) malloc(sizeof(uint32_t) * p_elems);
+	size_t p_height = (size_t)img->height + 2;
+	size_t p_width = (size_t)img->width + 2;
+	size_t p_size;
 
-	// fill data with zeroes
-	// TODO: implement some other kind of padding?
-	memset(p_data, 0, sizeof(uint32_t) * p_elems);
+	if (p_width > UINT32_MAX || p_height > UINT32_MAX
+		|| netpbm_size_mul(p_width, p_height, &p_size) != 0
+		|| netpbm_size_mul(p_size, sizeof(uint32_t), &p_size) != 0) {
+		fprintf(stderr, "Image is too big\n");
+		return -1;
+	}
+
+	/* With a pool, job may be split into more tasks than threads */
+	size_t t_pixels = (size_t)img->width * img->height;
+	size_t n_tasks = n_threads;
+
+	if (opts->pool != NULL && opts->chunk > 0)
+		n_tasks = t_pixels > opts->chunk
+			? (t_pixels + opts->chunk - 1) / opts->chunk : 1;
+
+	uint32_t *p_data = (uint32_t *) netpbm_scratch_alloc(opts->arena, p_size);
+
+	struct worker_info *w_info = (struct worker_info *) netpbm_scratch_alloc(
+		opts->arena, sizeof(struct worker_info) * n_tasks);
+
+	pthread_t *threads = (pthread_t *) netpbm_scratch_alloc(opts->arena,
+		sizeof(pthread_t) * n_threads);
 
-	/* Copy image data to the center of padded array line by line,
-	 * starting from the second element of the second row
-	 * of the padded data array
+	/* Every task smooths rows into its own ring of rows */
+	const uint32_t blur_radius = opts->blur / 2;
+	size_t rows_size = (3 * p_width * sizeof(uint32_t) + 63) & ~(size_t)63;
+	size_t tmp_size = (img->width + 2 * blur_radius) * sizeof(uint64_t);
+	size_t blur_stride = (rows_size + tmp_size + 63) & ~(size_t)63;
+	uint8_t *blur_data = NULL;
+
+	if (blur_radius > 0) {
+		size_t blur_size;
+
+		if (netpbm_size_mul(blur_stride, n_tasks, &blur_size) == 0)
+			blur_data = (uint8_t *) netpbm_scratch_alloc(opts->arena,
+				blur_size);
+	}
+
+	/* Otherwise every task keeps flags for a band of tiles */
+	const size_t tiles_x = ((size_t)img->width + UNIFORM_TILE_SIZE - 1)
+		/ UNIFORM_TILE_SIZE;
+	uint8_t *uniform = NULL;
+
+	if (blur_radius == 0) {
+		size_t uniform_size;
+
+		if (netpbm_size_mul(tiles_x, n_tasks, &uniform_size) == 0)
+			uniform = (uint8_t *) netpbm_scratch_alloc(opts->arena,
+				uniform_size);
+	}
+
+	/* Every task counts its results into its own histogram */
+	const uint32_t n_bins = histogram_bins(img->maxval);
+	uint64_t *bins = NULL;
+
+	if (opts->histogram != NULL) {
+		size_t bins_size;
+
+		if (netpbm_size_mul(n_bins * sizeof(uint64_t), n_tasks,
+				&bins_size) == 0)
+			bins = (uint64_t *) netpbm_scratch_alloc(opts->arena,
+				bins_size);
+		if (bins != NULL)
+			memset(bins, 0, bins_size);
+	}
+
+	/* Every task keeps gradients of a span, unless both are stored */
+	const int gradients = opts->gradient_x != NULL
+		|| opts->gradient_y != NULL || opts->direction != NULL;
+	const int span_gradients = gradients
+		&& (opts->gradient_x == NULL || opts->gradient_y == NULL);
+	size_t span_stride = ((size_t)img->width * sizeof(int32_t) + 63)
+		& ~(size_t)63;
+	uint8_t *span_data = NULL;
+
+	if (span_gradients) {
+		size_t span_size;
+
+		if (netpbm_size_mul(2 * span_stride, n_tasks, &span_size) == 0)
+			span_data = (uint8_t *) netpbm_scratch_alloc(opts->arena,
+				span_size);
+	}
+
+	/* With pinning, workers pad their own bands. Spawned workers wait
+	 * for each other, pool tasks may not run at once, so the pool pads
+	 * in a pass of its own
 	 */
-	for (size_t row = 0; row < img->height; row++) {
-		memcpy((p_data + p_width * (row + 1) + 1),
-			(img->data + row * img->width),
-			sizeof(uint32_t) * img->width
-		);
+	const int pin = opts->pin && t_pixels > 0;
+	pthread_barrier_t padded;
+	int barrier = pin && opts->pool == NULL
+		&& pthread_barrier_init(&padded, NULL, n_tasks) == 0;
+
+	int ret = -1;
+	uint64_t trace = netpbm_trace_begin();
+
+	if (pin && opts->pool == NULL && !barrier) {
+		fprintf(stderr, "Unable to create barrier for Sobel operator\n");
+		goto out;
 	}
 
-	struct worker_info *w_info = (struct worker_info *)
-		malloc(sizeof(struct worker_info) * n_threads);
+	if (p_data == NULL || w_info == NULL || threads == NULL
+		|| (blur_radius > 0 && blur_data == NULL)
+		|| (blur_radius == 0 && uniform == NULL)
+		|| (opts->histogram != NULL && bins == NULL)
+		|| (span_gradients && span_data == NULL)) {
+		fprintf(stderr, "Unable to allocate memory for Sobel operator\n");
+		goto out;
+	}
 
-	pthread_t *threads = (pthread_t *)
-		malloc(sizeof(pthread_t) * n_threads);
+	if (!pin) {
+		pad_rows(p_data, p_width, img->data, img->width, img->height,
+			0, img->height);
+		netpbm_trace_end("pad image", trace, 0, t_pixels);
+	}
 
-	/* split the job between n threads */
-	uint32_t t_pixels = img->width * img->height;
-	/** minimal amount of pixels to be processed by thread */
-	size_t e = t_pixels / n_threads;
-	/** amount of threads that will take e+1 pixels */
-	size_t o = t_pixels % n_threads;
+	/* split the job between n tasks */
+	/** minimal amount of pixels to be processed by task */
+	size_t e = t_pixels / n_tasks;
+	/** amount of tasks that will take e+1 pixels */
+	size_t o = t_pixels % n_tasks;
 
 	size_t ind = 0;
 
-	for (size_t t = 0; t < n_threads; t++) {
+	for (size_t t = 0; t < n_tasks; t++) {
 		/* fill worker info */
 		size_t end = ind + e;
 		if (o > 0) {
@@ -279,23 +916,53 @@ int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads)
 			.d_width = img->width,
 			.d_height = img->height,
 			.i_start = ind,
-			.i_end = end
+			.i_end = end,
+
+			.blur_radius = blur_radius,
+			.count_events = opts->counters && opts->stats != NULL,
+			.output = opts->output,
+
+			.bins = bins != NULL ? bins + t * n_bins : NULL,
+			.n_bins = n_bins,
+			.min = UINT32_MAX,
+
+			.gradients = gradients,
+			.gradient_x = opts->gradient_x,
+			.gradient_y = opts->gradient_y,
+			.direction = opts->direction
 		};
 		ind = end;
 
+		if (span_gradients) {
+			uint8_t *scratch = span_data + 2 * t * span_stride;
+
+			w_info[t].span_x = (int32_t *) scratch;
+			w_info[t].span_y = (int32_t *) (scratch + span_stride);
+		}
+
+		/* Task pads rows from the one of its first pixel to the one of
+		 * the first pixel of the next task, so every row is padded once
+		 */
+		if (pin) {
+			w_info[t].pad_start = t == 0 ? 0 : w_info[t].i_start / img->width;
+			w_info[t].pad_end = img->height;
+			w_info[t].padded = barrier ? &padded : NULL;
+			if (t > 0)
+				w_info[t - 1].pad_end = w_info[t].pad_start;
+		}
+
+		if (blur_radius > 0) {
+			uint8_t *scratch = blur_data + t * blur_stride;
+
+			w_info[t].rows = (uint32_t *) scratch;
+			w_info[t].blur_tmp = (uint64_t *) (scratch + rows_size);
+		} else {
+			w_info[t].uniform = uniform + t * tiles_x;
+		}
+
 #if DEBUG
 		printf("Thread %lu : %lu - %lu\n", t, w_info[t].i_start, w_info[t].i_end);
 #endif
-
-		/* create thread */
-		if (pthread_create(
-			&threads[t], NULL,
-			thread_task,
-			(void*)(&w_info[t])
-		) != 0) {
-			fprintf(stderr, "Unable to create thread %lu!\n", t);
-			return -1;
-		}
 	}
 
 	if (ind != t_pixels) {
@@ -303,33 +970,59 @@ int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads)
 		exit(EXIT_FAILURE);
 	}
 
-	for (size_t t = 0; t < n_threads; t++) {
-		switch (pthread_join(threads[t], NULL)) {
-		case EDEADLK:
-			fprintf(stderr, "Deadlock occured!\n");
-			return -1;
+	if (opts->pool != NULL) {
+		if (pin && netpbm_pool_run(opts->pool, pad_task,
+				w_info, sizeof(struct worker_info), n_tasks) != 0)
+			goto out;
 
-		case EINVAL:
-			fprintf(stderr,
-				"Thread %lu is not a joinable thread, "
-				"or another thread is already waiting to "
-				"join it!\n", t
-			);
-			return -1;
+		if (netpbm_pool_run(opts->pool, thread_task,
+				w_info, sizeof(struct worker_info), n_tasks) != 0)
+			goto out;
 
-		case ESRCH:
-			fprintf(stderr, "Thread %lu could not be found\n", t);
-			return -1;
+	} else if (spawn_workers(threads, w_info, n_threads, pin) != 0) {
+		goto out;
+	}
 
-		case 0:
-			break;
+	for (size_t t = 0; t < n_tasks; t++) {
+		if (w_info[t].output_error)
+			goto out;
+	}
+
+	if (opts->histogram != NULL && merge_histograms(opts->histogram,
+			w_info, n_tasks, n_bins, t_pixels) != 0)
+		goto out;
+
+	if (opts->stats != NULL) {
+		opts->stats->pixels = t_pixels;
+		opts->stats->skipped = 0;
+		memset(opts->stats->counters, 0, sizeof(opts->stats->counters));
+		// counter is only valid if every task could read it
+		opts->stats->counters_valid = opts->counters
+			? (1U << NETPBM_COUNTERS) - 1 : 0;
+
+		for (size_t t = 0; t < n_tasks; t++) {
+			opts->stats->skipped += w_info[t].skipped;
+			opts->stats->counters_valid &= w_info[t].counters_valid;
+
+			for (int c = 0; c < NETPBM_COUNTERS; c++)
+				opts->stats->counters[c] += w_info[t].counters[c];
 		}
 	}
 
-	free(threads);
-	free(w_info);
+	netpbm_trace_end("sobel", trace, 0, t_pixels);
+	ret = 0;
+
+out:
+	if (barrier)
+		pthread_barrier_destroy(&padded);
 
-	free(p_data);
+	netpbm_scratch_free(opts->arena, span_data);
+	netpbm_scratch_free(opts->arena, bins);
+	netpbm_scratch_free(opts->arena, uniform);
+	netpbm_scratch_free(opts->arena, blur_data);
+	netpbm_scratch_free(opts->arena, threads);
+	netpbm_scratch_free(opts->arena, w_info);
+	netpbm_scratch_free(opts->arena, p_data);
 
 	/* Normalize data up to maxval */
 	/* XXX: Normalization results in low contrast, although really clean
@@ -339,17 +1032,48 @@ int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads)
 #if 0
 	uint32_t local_maxval = 0;
 
-	for (size_t cp = 0; cp < (img->height * img->width); cp++) {
+	for (size_t cp = 0; cp < ((size_t)img->height * img->width); cp++) {
 		if (img->data[cp] > local_maxval)
 			local_maxval = img->data[cp];
 	}
 
-	for (size_t cp = 0; cp < (img->height * img->width); cp++) {
+	for (size_t cp = 0; cp < ((size_t)img->height * img->width); cp++) {
 		double val = (double)(img->data[cp]) / (double)(local_maxval);
 		img->data[cp] = round(val * img->maxval);
 	}
 #endif
 
+	return ret;
+}
+
+int netpbm_crop(netpbm_image_t *img, const netpbm_rect_t *rect)
+{
+	if (img->data == NULL) {
+		fprintf(stderr, "Image structure is not initialized\n");
+		return -1;
+	}
+
+	if (rect->x >= img->width || rect->y >= img->height
+		|| rect->width > img->width - rect->x
+		|| rect->height > img->height - rect->y
+	) {
+		fprintf(stderr, "Crop region is out of bounds\n");
+		return -1;
+	}
+
+	/* Destination never overtakes the source, so rows can be moved
+	 * in place from top to bottom
+	 */
+	for (size_t row = 0; row < rect->height; row++) {
+		memmove(img->data + row * rect->width,
+			img->data + (rect->y + row) * img->width + rect->x,
+			sizeof(uint32_t) * rect->width
+		);
+	}
+
+	img->width = rect->width;
+	img->height = rect->height;
+
 	return 0;
 }
 
@@ -27,6 +27,8 @@
 #define NETPBM_GS_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 /**
  * @enum Netpbm image file formats
@@ -63,6 +65,294 @@ typedef struct {
 	uint32_t *data; /**< Pixel data in row-major order */
 } netpbm_image_t;
 
+/**
+ * @brief packed 1-bit image, processed without unpacking
+ *
+ * Rows are stored in 64-bit words, with the leftmost pixel in the highest
+ * bit. Row y starts at data + (y + 1) * stride + 1. Rows above and below
+ * the image, words before and after every row, and bits past the width
+ * are zero, like padding of the Sobel operator.
+ */
+typedef struct {
+	uint32_t width; /**< Image width, in pixels */
+	uint32_t height; /**< Image height, in pixels */
+	size_t stride; /**< Words per row, including zero words around it */
+	uint64_t *data; /**< Pixel rows */
+} netpbm_bitmap_t;
+
+/**
+ * @brief filters of netpbm_downsample()
+ */
+enum NETPBM_DOWNSAMPLE {
+	NETPBM_DOWNSAMPLE_BOX = 0, /**< Average of 2x2 pixels */
+	NETPBM_DOWNSAMPLE_GAUSSIAN = 1 /**< 4x4 pixels weighted with 1 3 3 1 */
+};
+
+/**
+ * @brief directions of the gradient, quantized to 45 degrees
+ *
+ * Rows grow downwards, so the diagonal direction points towards the bottom
+ * right or top left of the image, where gradients have the same sign.
+ */
+enum NETPBM_DIRECTION {
+	NETPBM_DIRECTION_HORIZONTAL = 0, /**< Within 22.5 degrees of a row */
+	NETPBM_DIRECTION_DIAGONAL = 1, /**< Towards bottom right or top left */
+	NETPBM_DIRECTION_VERTICAL = 2, /**< Within 22.5 degrees of a column */
+	NETPBM_DIRECTION_ANTIDIAGONAL = 3 /**< Towards bottom left or top right */
+};
+
+/**
+ * @brief structure describing rectangular region of the image
+ */
+typedef struct {
+	uint32_t x; /**< Leftmost column of the region */
+	uint32_t y; /**< Topmost row of the region */
+
+	uint32_t width; /**< Region width, in pixels */
+	uint32_t height; /**< Region height, in pixels */
+} netpbm_rect_t;
+/**
+ * @brief pool of persistent worker threads
+ *
+ * Threads are created once by netpbm_pool_create() and reused by every
+ * call that is given the pool, instead of being created per call.
+ */
+typedef struct netpbm_pool netpbm_pool_t;
+
+/**
+ * @brief arena of buffers reused between images
+ *
+ * Buffers are rounded up to size classes and kept after they are released,
+ * so processing a sequence of similar images stops allocating memory after
+ * the first few of them. Released buffers take at most as much memory as
+ * was ever handed out at once, the oldest of them are freed beyond that,
+ * so buffers of sizes no longer used don't pile up when images change.
+ * Created by netpbm_arena_create().
+ */
+typedef struct netpbm_arena netpbm_arena_t;
+
+/** Back buffers of 2 MiB and more with huge pages */
+#define NETPBM_ARENA_HUGE_PAGES 0x1
+
+/**
+ * @brief statistics of the arena usage
+ */
+typedef struct {
+	size_t requests; /**< Buffers handed out */
+	size_t reused; /**< Requests served with previously released buffers */
+	size_t blocks; /**< Buffers held by the arena */
+	size_t bytes; /**< Memory held by the arena, in bytes */
+} netpbm_arena_stats_t;
+
+/**
+ * @brief hardware performance counters
+ */
+enum NETPBM_COUNTER {
+	NETPBM_COUNTER_CYCLES = 0, /**< CPU cycles */
+	NETPBM_COUNTER_INSTRUCTIONS = 1, /**< Instructions retired */
+	NETPBM_COUNTER_LLC_MISSES = 2, /**< Last level cache misses */
+	NETPBM_COUNTER_BRANCH_MISSES = 3, /**< Mispredicted branches */
+	NETPBM_COUNTERS = 4 /**< Amount of counters */
+};
+
+/**
+ * @brief work done by the Sobel operator
+ */
+typedef struct {
+	size_t pixels; /**< Pixels of the image */
+	/** Pixels of uniform tiles, zero-filled without convolution */
+	size_t skipped;
+	/** Counters summed over the worker threads, if requested */
+	uint64_t counters[NETPBM_COUNTERS];
+	/** Bit 1 << NETPBM_COUNTER_* is set for each counter that could be
+	 * read. Counters may be missing in virtual machines, or be forbidden
+	 * by kernel.perf_event_paranoid */
+	uint32_t counters_valid;
+} netpbm_sobel_stats_t;
+
+/**
+ * @brief histogram and statistics of Sobel operator results
+ *
+ * Filled by the workers while they compute the results, so the output is
+ * not read again. Bins are allocated by netpbm_sobel_ext(), structure must
+ * be zeroed before the first use and freed with netpbm_histogram_free().
+ */
+typedef struct {
+	/** Pixels of each magnitude. Magnitudes above n_bins - 1, possible
+	 * only if the image has values above maxval, are in the last bin */
+	uint64_t *bins;
+	/** Strongest magnitude an image of this maxval can have, plus one */
+	uint32_t n_bins;
+	uint32_t min; /**< Smallest magnitude */
+	uint32_t max; /**< Largest magnitude */
+	uint64_t sum; /**< Sum of magnitudes, for the mean */
+	size_t pixels; /**< Pixels counted */
+} netpbm_histogram_t;
+
+/**
+ * @brief binary image file that threads write in place
+ *
+ * The file is sized when opened, so every row has a known offset. It is
+ * mapped into memory if its blocks could be allocated, and written with
+ * pwrite() otherwise.
+ */
+typedef struct {
+	int fd;
+	uint8_t *map; /**< Mapped file, or NULL */
+	size_t map_size;
+	size_t data_offset; /**< Length of the header, offset of the first row */
+
+	enum NETPBM_TYPE type;
+	uint32_t width;
+	uint32_t height;
+} netpbm_output_t;
+
+/**
+ * @brief options of the Sobel operator
+ */
+typedef struct {
+	unsigned long n_threads; /**< Split job between n threads */
+	netpbm_pool_t *pool; /**< Worker threads to use, or NULL */
+	netpbm_arena_t *arena; /**< Scratch buffers to reuse, or NULL */
+	/** Size of Gaussian kernel smoothing the image before Sobel operator,
+	 * 3 or 5, or 0 to disable. Edge pixels are repeated outside of the
+	 * image */
+	uint32_t blur;
+	netpbm_sobel_stats_t *stats; /**< Filled in if not NULL */
+	/** With a pool, split job into tasks of this many pixels, so that
+	 * threads finishing early take more work. 0 for a task per thread */
+	size_t chunk;
+	/** Read hardware performance counters of the workers into stats.
+	 * Costs a few system calls per worker */
+	int counters;
+	/** Greymap of the image size that workers store their results to
+	 * while they are still in cache, or NULL */
+	netpbm_output_t *output;
+	/** Histogram of the results, filled in if not NULL. Smoothing, if
+	 * any, is applied before. Costs a pass over the results while they
+	 * are in cache, and n_bins counters per task */
+	netpbm_histogram_t *histogram;
+	/** Width * height horizontal and vertical gradients, stored while
+	 * the results are computed, or NULL. Smoothing, if any, is applied
+	 * before */
+	int32_t *gradient_x;
+	int32_t *gradient_y;
+	/** Width * height gradient directions, one of NETPBM_DIRECTION_*,
+	 * or NULL. Used by netpbm_suppress_nonmaxima() to thin the edges */
+	uint8_t *direction;
+	/** Let every task pad its own band of the image, so that its pages
+	 * are first touched on the NUMA node of the worker. Threads created
+	 * for the job are pinned to CPUs ordered by node, so neighbouring
+	 * bands share a node. Pool threads are pinned by netpbm_pool_pin(),
+	 * but take tasks in any order. Where threads can't be pinned, they
+	 * run unpinned */
+	int pin;
+} netpbm_sobel_opts_t;
+
+/**
+ * @brief costs of the Sobel operator on this machine
+ *
+ * Used by netpbm_sobel_tune() to pick amount of threads and size of tasks.
+ * Measured with netpbm_tuning_calibrate(), or guessed by
+ * netpbm_tuning_default().
+ */
+typedef struct {
+	double pixel_ns; /**< Time to process a pixel on one thread */
+	double thread_ns; /**< Time to start and join a worker thread */
+	double task_ns; /**< Time to hand a task to a pool thread */
+} netpbm_tuning_t;
+
+/**
+ * @brief sequential stream of Netpbm images
+ *
+ * Netpbm allows several images to be concatenated in one file. Stream
+ * is opened with netpbm_stream_open(), and images are read or written
+ * one by one.
+ */
+typedef struct {
+	FILE *file; /**< Underlying file, may be stdin or stdout */
+	size_t capacity; /**< Pixels that data of the last read image holds */
+	size_t count; /**< Images read or written so far */
+	/** Buffers to reuse, or NULL. Set after netpbm_stream_open(). Data of
+	 * the images read belongs to the arena then. */
+	netpbm_arena_t *arena;
+} netpbm_stream_t;
+
+/**
+ * @brief pipeline processing every image of a stream
+ *
+ * Next image is read on its own thread while the current one is processed,
+ * and the previous one is written on another thread. Queues between the
+ * stages hold up to depth images, so the slowest stage limits throughput.
+ */
+typedef struct {
+	netpbm_stream_t *input; /**< Stream opened for reading */
+	netpbm_stream_t *output; /**< Stream opened for writing */
+	size_t depth; /**< Images in flight, 0 for default of 3 */
+
+	/** Called on the calling thread for every image, in stream order.
+	 * Returns 0 if no problem occured, -1 otherwise. */
+	int (*process)(netpbm_image_t *img, void *arg);
+	void *arg; /**< Argument passed to process */
+} netpbm_pipeline_t;
+
+/**
+ * @enum I/O backends of netpbm_batch_t
+ */
+enum NETPBM_BATCH_BACKEND {
+	NETPBM_BATCH_AUTO = 0, /**< io_uring if the kernel allows it, stdio otherwise */
+	NETPBM_BATCH_STDIO = 1, /**< Buffered stdio, one file after another */
+	NETPBM_BATCH_URING = 2 /**< Linux io_uring, every file at once */
+};
+
+/**
+ * @brief batch of image files read or written together
+ *
+ * With io_uring, requests for every file of the batch are submitted at
+ * once, into a buffer registered with the kernel and reused between
+ * batches, so the calling thread waits for the disk once per batch
+ * instead of once per file. Created by netpbm_batch_create().
+ */
+typedef struct netpbm_batch netpbm_batch_t;
+
+/**
+ * @brief on-disk cache of processed images
+ *
+ * Results are stored under a key computed from the input file contents
+ * and processing options. Least recently used results are evicted when
+ * total size exceeds the limit.
+ */
+typedef struct {
+	char *dir; /**< Cache directory, created if needed */
+	uint64_t max_size; /**< Size limit of all entries, in bytes */
+} netpbm_cache_t;
+
+/**
+ * @brief state of incremental Sobel processing of a frame sequence
+ *
+ * Keeps previous frame and its Sobel output, so that only tiles that
+ * changed between frames are recomputed. Must be initialized with
+ * netpbm_delta_init() and freed with netpbm_delta_free().
+ */
+typedef struct {
+	uint32_t width; /**< Frame width, 0 before the first frame */
+	uint32_t height; /**< Frame height */
+	uint32_t tile_size; /**< Side of a square tile, in pixels */
+
+	uint32_t *p_frame; /**< Previous frame, padded like in netpbm_sobel() */
+	uint32_t *output; /**< Sobel output of the previous frame */
+	uint16_t *dirty; /**< Per-tile mask of changed 3x3 neighbourhood */
+	size_t *order; /**< Indices of dirty tiles */
+
+	uint32_t tiles_x; /**< Amount of tile columns */
+	uint32_t tiles_y; /**< Amount of tile rows */
+
+	size_t tiles_changed; /**< Tiles changed in the last frame */
+
+	netpbm_pool_t *pool; /**< Worker threads to use, or NULL */
+	netpbm_arena_t *arena; /**< Scratch buffers to reuse, or NULL */
+} netpbm_delta_t;
+
 
 /**
  * @brief Load Netpbm image from a file
@@ -79,6 +369,53 @@ typedef struct {
  */
 int read_netpbm_file(char *filename, netpbm_image_t *img);
 
+/**
+ * @brief Load only the header of Netpbm image from a file
+ *
+ * Fills type, size and maxval of the image without reading pixels, so
+ * data field is NULL and nothing has to be freed.
+ *
+ * @param[in] filename - image filename/path
+ * @param[out] img - netpbm image structure
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int read_netpbm_file_header(char *filename, netpbm_image_t *img);
+
+/**
+ * @brief Load region of the Netpbm image from a file
+ *
+ * Works like read_netpbm_file(), but only stores pixels inside the given
+ * region, so resulting image has the size of the region. For binary formats
+ * only the needed rows and columns are read from the file, ASCII formats
+ * are parsed up to the last row of the region.
+ *
+ * @param[in] filename - image filename/path
+ * @param[out] img - pre-allocated netpbm image structure.
+ * @param[in,out] region - region to load, or NULL for the whole image.
+ * 	Clipped to the image size on return.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int read_netpbm_file_region(char *filename, netpbm_image_t *img,
+		netpbm_rect_t *region);
+
+/**
+ * @brief Load region of the Netpbm image from a file using n threads
+ *
+ * Works like read_netpbm_file_region(), but ASCII data is split into
+ * chunks that are decoded by n threads in parallel.
+ *
+ * @param[in] filename - image filename/path
+ * @param[out] img - pre-allocated netpbm image structure.
+ * @param[in,out] region - region to load, or NULL for the whole image.
+ * @param[in] n_threads - amount of threads to decode ASCII data with.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int read_netpbm_file_mt(char *filename, netpbm_image_t *img,
+		netpbm_rect_t *region, unsigned long n_threads);
+
 /**
  * @brief turn netpbm image into greyscale, if applicable
  *
@@ -106,6 +443,302 @@ int netpbm_to_greyscale(netpbm_image_t *img);
  * @return 0 if no problem occured, 1 if image is not greyscale, -1 otherwise
  */
 int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads);
+
+/**
+ * @brief apply Sobel operator with extended options
+ *
+ * Same as netpbm_sobel(), but takes options structure. If pool is given,
+ * its threads are used instead of creating new ones, and n_threads may be
+ * 0 to split the job between all threads of the pool.
+ *
+ * Without smoothing, tiles where the input is uniform, together with the
+ * neighbouring pixels, are zero-filled without convolution, which makes
+ * mostly blank images like document scans faster.
+ *
+ * @param[in,out] img - greyscale Netpbm image.
+ * @param[in] opts - Sobel operator options.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_sobel_ext(netpbm_image_t *img, const netpbm_sobel_opts_t *opts);
+
+/**
+ * @brief thin edges of Sobel operator results to one pixel
+ *
+ * Pixels that are weaker than either neighbour along the gradient
+ * direction are set to 0. Of two equal neighbours, the one before the
+ * other along the gradient is kept, so plateaus are thinned too. Pixels
+ * outside of the image are 0. Rows are split into bands processed in
+ * place by the threads, which only copy the rows around their band.
+ *
+ * @param[in,out] img - Sobel operator results
+ * @param[in] direction - directions stored by netpbm_sobel_ext()
+ * @param[in] opts - threads or pool, task size and arena to use
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_suppress_nonmaxima(netpbm_image_t *img, const uint8_t *direction,
+		const netpbm_sobel_opts_t *opts);
+
+/**
+ * @brief find magnitude below which the given share of pixels is
+ *
+ * @param[in] histogram - histogram filled by netpbm_sobel_ext()
+ * @param[in] percent - share of pixels, from 0 to 100
+ *
+ * @return smallest magnitude that at least percent of the pixels do not
+ * 	exceed, 0 for an empty histogram
+ */
+uint32_t netpbm_histogram_percentile(const netpbm_histogram_t *histogram,
+		double percent);
+
+/**
+ * @brief pick threshold of the edges with Otsu's method
+ *
+ * Threshold splits the magnitudes into two classes with the largest
+ * variance between them. Pixels above the threshold are edges.
+ *
+ * @param[in] histogram - histogram filled by netpbm_sobel_ext()
+ *
+ * @return threshold, 0 for an empty or uniform histogram
+ */
+uint32_t netpbm_histogram_otsu(const netpbm_histogram_t *histogram);
+
+/**
+ * @brief free bins of the histogram
+ *
+ * @param[in] histogram - histogram, may have NULL bins
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_histogram_free(netpbm_histogram_t *histogram);
+
+/**
+ * @brief turn greyscale image into black and white
+ *
+ * Pixels above the threshold are set to maxval, others to 0.
+ *
+ * @param[in,out] img - greyscale Netpbm image
+ * @param[in] threshold - largest value that is turned black
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_threshold(netpbm_image_t *img, uint32_t threshold);
+
+/**
+ * @brief create pool of worker threads
+ *
+ * @param[in] n_threads - amount of threads to create.
+ *
+ * @return pointer to the pool, or NULL on error
+ */
+netpbm_pool_t *netpbm_pool_create(unsigned long n_threads);
+
+/**
+ * @brief pin threads of the pool to CPUs ordered by NUMA node
+ *
+ * Threads are spread evenly over the CPUs the process may run on, so every
+ * node gets its share of them.
+ *
+ * @param[in] pool - pool of worker threads.
+ *
+ * @return 0 if every thread was pinned, 1 if some of them couldn't be
+ */
+int netpbm_pool_pin(netpbm_pool_t *pool);
+
+/**
+ * @brief get amount of NUMA nodes that the process may run on
+ *
+ * @return amount of nodes, 1 if the machine has no NUMA information
+ */
+unsigned long netpbm_numa_nodes(void);
+
+/**
+ * @brief get amount of threads in the pool
+ *
+ * @param[in] pool - pool of worker threads.
+ *
+ * @return amount of threads
+ */
+unsigned long netpbm_pool_size(const netpbm_pool_t *pool);
+
+/**
+ * @brief stop worker threads and free the pool
+ *
+ * @param[in] pool - pool of worker threads, may be NULL.
+ */
+void netpbm_pool_destroy(netpbm_pool_t *pool);
+
+/**
+ * @brief create arena of reusable buffers
+ *
+ * @param[in] flags - 0, or NETPBM_ARENA_HUGE_PAGES
+ *
+ * @return pointer to the arena, or NULL on error
+ */
+netpbm_arena_t *netpbm_arena_create(int flags);
+
+/**
+ * @brief get buffer of at least size bytes from the arena
+ *
+ * Released buffer of the same size class is reused if there is one.
+ * Buffers are aligned to 64 bytes. Safe to call from several threads.
+ *
+ * @param[in] arena - arena of buffers
+ * @param[in] size - size of the buffer, in bytes
+ *
+ * @return pointer to the buffer, or NULL on error
+ */
+void *netpbm_arena_alloc(netpbm_arena_t *arena, size_t size);
+
+/**
+ * @brief return buffer to the arena for reuse
+ *
+ * @param[in] arena - arena the buffer was taken from
+ * @param[in] ptr - buffer, may be NULL
+ */
+void netpbm_arena_release(netpbm_arena_t *arena, void *ptr);
+
+/**
+ * @brief free released buffers held by the arena
+ *
+ * Useful to give memory back between bursts of work, as the arena keeps
+ * buffers for the largest images it has seen.
+ *
+ * @param[in] arena - arena of buffers
+ */
+void netpbm_arena_trim(netpbm_arena_t *arena);
+
+/**
+ * @brief get statistics of the arena usage
+ *
+ * @param[in] arena - arena of buffers
+ * @param[out] stats - statistics
+ */
+void netpbm_arena_stats(netpbm_arena_t *arena, netpbm_arena_stats_t *stats);
+
+/**
+ * @brief free the arena and every buffer in it, released or not
+ *
+ * @param[in] arena - arena of buffers, may be NULL.
+ */
+void netpbm_arena_destroy(netpbm_arena_t *arena);
+
+/**
+ * @brief back large image and scratch buffers with huge pages
+ *
+ * Applies to buffers that don't come from an arena, which has its own
+ * NETPBM_ARENA_HUGE_PAGES flag. Disabled by default.
+ *
+ * @param[in] enable - 1 to enable, 0 to disable
+ */
+void netpbm_set_huge_pages(int enable);
+
+/**
+ * @brief start recording timeline of worker threads and processing stages
+ *
+ * Events are kept in memory, and written by netpbm_trace_stop() in Chrome
+ * trace event format, which can be opened by chrome://tracing or Perfetto.
+ *
+ * @param[in] filename - trace file name/path
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_trace_start(const char *filename);
+
+/**
+ * @brief stop recording and write the trace file
+ *
+ * Must be called when no other thread uses the library.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_trace_stop(void);
+
+/**
+ * @brief initialize state for incremental Sobel processing
+ *
+ * @param[out] delta - state structure to initialize.
+ * @param[in] tile_size - side of a tile in pixels, 0 for default of 32.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_delta_init(netpbm_delta_t *delta, uint32_t tile_size);
+
+/**
+ * @brief apply Sobel operator to the next frame of a sequence
+ *
+ * Produces the same result as netpbm_sobel(), but compares the frame with
+ * the previous one tile by tile, and only recomputes changed tiles and
+ * their 1-pixel neighbourhood. Other pixels are taken from the output of
+ * the previous frame. If frame size changes, whole frame is recomputed.
+ *
+ * @param[in,out] delta - incremental processing state.
+ * @param[in,out] img - greyscale Netpbm image, replaced with Sobel output.
+ * @param[in] n_threads - split changed tiles between n threads.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_sobel_delta(netpbm_delta_t *delta, netpbm_image_t *img,
+		unsigned long n_threads);
+
+/**
+ * @brief Frees memory held by incremental Sobel processing state.
+ *
+ * @param[in] delta - state structure to be freed.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_delta_free(netpbm_delta_t *delta);
+
+/**
+ * @brief halve Netpbm image size for the next level of a pyramid
+ *
+ * Every pixel of the result filters 2x2 or 4x4 pixels of the source, with
+ * edge pixels repeated outside of it, so odd sizes are rounded up. Results
+ * are greymaps of the same encoding. Pixmaps are turned into greyscale in
+ * the same pass, like by netpbm_to_greyscale(), and bitmaps become
+ * greymaps with maxval 255.
+ *
+ * @param[in] src - Netpbm image
+ * @param[out] dest - downsampled image, allocated by the function
+ * @param[in] filter - box or Gaussian filter
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_downsample(const netpbm_image_t *src, netpbm_image_t *dest,
+		enum NETPBM_DOWNSAMPLE filter);
+
+/**
+ * @brief build levels of the image pyramid
+ *
+ * Level k is downsampled from level k - 1 with netpbm_downsample(), so it
+ * has 1/2^(k+1) of the image size, and each level costs a quarter of
+ * the previous one.
+ *
+ * @param[in] img - Netpbm image
+ * @param[out] levels - n_levels images, allocated by the function
+ * @param[in] n_levels - amount of levels
+ * @param[in] filter - box or Gaussian filter
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_pyramid(const netpbm_image_t *img, netpbm_image_t *levels,
+		uint32_t n_levels, enum NETPBM_DOWNSAMPLE filter);
+
+/**
+ * @brief crop Netpbm image to the given region
+ *
+ * Moves pixels of the region to the beginning of the data array and
+ * adjusts image size. Memory is not reallocated.
+ *
+ * @param[in,out] img - Netpbm image structure to be cropped.
+ * @param[in] rect - region to keep, must lie inside the image.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_crop(netpbm_image_t *img, const netpbm_rect_t *rect);
+
 /**
  * @brief Write Netpbm image to the file
  *
@@ -119,6 +752,423 @@ int netpbm_sobel(netpbm_image_t *img, unsigned long n_threads);
  */
 int write_netpbm_file(char *filename, netpbm_image_t *img);
 
+/**
+ * @brief Write Netpbm image to the file using n threads
+ *
+ * Works like write_netpbm_file(), but ASCII data is formatted by n
+ * threads in parallel. Binary data is written by one thread.
+ *
+ * @param[in] filename - output image filename/path
+ * @param[in] img - netpbm image structure to be written.
+ * @param[in] n_threads - amount of threads to format ASCII data with.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int write_netpbm_file_mt(char *filename, netpbm_image_t *img,
+		unsigned long n_threads);
+
+/**
+ * @brief Write rows of binary Netpbm image without the header
+ *
+ * Rows are stored the same way as by write_netpbm_file(), so strips of
+ * the consecutive rows can be concatenated by netpbm_merge_strips().
+ *
+ * @param[in] filename - output strip filename/path
+ * @param[in] img - netpbm image structure holding rows of the strip.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int write_netpbm_strip(char *filename, netpbm_image_t *img);
+
+/**
+ * @brief Create binary Netpbm file to be written in place
+ *
+ * Writes the header for the type, size and maxval of img, and sizes the
+ * file for all of its rows, which are then stored with
+ * netpbm_output_store() by any amount of threads.
+ *
+ * @param[out] out - output structure to initialize.
+ * @param[in] filename - output image filename/path, must be a regular file.
+ * @param[in] img - image the file is created for, data is unused.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_output_open(netpbm_output_t *out, char *filename,
+		const netpbm_image_t *img);
+
+/**
+ * @brief Store pixels to their place in the output file
+ *
+ * Values are stored the same way as by write_netpbm_file(). Can be called
+ * by several threads for different pixels at once.
+ *
+ * @param[in] out - output opened by netpbm_output_open().
+ * @param[in] pixels - count pixels to store.
+ * @param[in] first - index of the first pixel in the image. Bitmaps are
+ * 	stored by whole rows only.
+ * @param[in] count - amount of pixels.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_output_store(netpbm_output_t *out, const uint32_t *pixels,
+		size_t first, size_t count);
+
+/**
+ * @brief Finish writing of the output file
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_output_close(netpbm_output_t *out);
+
+/**
+ * @brief Write binary Netpbm image using n threads
+ *
+ * Works like write_netpbm_file(), but rows are converted and stored to
+ * their place in the file by n threads at once.
+ *
+ * @param[in] filename - output image filename/path, must be a regular file.
+ * @param[in] img - netpbm image structure to be written.
+ * @param[in] n_threads - amount of threads to write rows with.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int write_netpbm_file_direct(char *filename, netpbm_image_t *img,
+		unsigned long n_threads);
+
+/**
+ * @brief Write binary Netpbm image made of strips
+ *
+ * Writes header of the image, followed by contents of the strip files in
+ * the given order. Strips must hold exactly the rows of the image.
+ *
+ * @param[in] filename - output image filename/path
+ * @param[in] header - type, size and maxval of the image, data is unused.
+ * @param[in] strips - strip filenames/paths, from the top of the image.
+ * @param[in] n_strips - amount of strips.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_merge_strips(char *filename, const netpbm_image_t *header,
+		char **strips, size_t n_strips);
+
+/**
+ * @brief Open stream of Netpbm images
+ *
+ * @param[out] stream - stream structure to initialize.
+ * @param[in] filename - file name/path, or "-" for stdin/stdout.
+ * @param[in] mode - "r" to read images, "w" to write them.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_stream_open(netpbm_stream_t *stream, char *filename,
+		const char *mode);
+
+/**
+ * @brief Read next image from the stream
+ *
+ * Data of the image is reused between calls, and only reallocated when
+ * the next image is bigger. Before the first call img->data must be NULL,
+ * and image must not be freed between calls. After the last call, free
+ * it with free_netpbm_image(), unless stream has an arena, which owns
+ * the data then.
+ *
+ * @param[in] stream - stream opened for reading.
+ * @param[in,out] img - netpbm image structure.
+ *
+ * @return 1 if image was read, 0 at the end of stream, -1 otherwise
+ */
+int netpbm_stream_read(netpbm_stream_t *stream, netpbm_image_t *img);
+
+/**
+ * @brief Append image to the stream
+ *
+ * @param[in] stream - stream opened for writing.
+ * @param[in] img - netpbm image structure to be written.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_stream_write(netpbm_stream_t *stream, netpbm_image_t *img);
+
+/**
+ * @brief Close stream of Netpbm images
+ *
+ * @param[in] stream - stream to close.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_stream_close(netpbm_stream_t *stream);
+
+/**
+ * @brief Read, process and write every image of a stream in a pipeline
+ *
+ * Images are written in the order they are read. Data of the images is
+ * freed at the end, or left to the arena of the input stream.
+ *
+ * @param[in] pipeline - streams, and processing of the images
+ *
+ * @return 0 if every image was processed, -1 otherwise
+ */
+int netpbm_pipeline_run(const netpbm_pipeline_t *pipeline);
+
+/**
+ * @brief Create batch of image files
+ *
+ * With NETPBM_BATCH_AUTO, falls back to stdio when io_uring is not
+ * available, which netpbm_batch_backend() tells.
+ *
+ * @param[in] backend - I/O backend to use
+ * @param[in] depth - requests in flight at once, 0 for default of 64
+ *
+ * @return pointer to the batch, or NULL on error
+ */
+netpbm_batch_t *netpbm_batch_create(enum NETPBM_BATCH_BACKEND backend,
+		unsigned int depth);
+
+/**
+ * @brief Get I/O backend the batch uses
+ *
+ * @return NETPBM_BATCH_STDIO or NETPBM_BATCH_URING
+ */
+enum NETPBM_BATCH_BACKEND netpbm_batch_backend(const netpbm_batch_t *batch);
+
+/**
+ * @brief Load Netpbm images from the files
+ *
+ * Same as read_netpbm_file_mt() for each of the files. It's up to user to
+ * later call free_netpbm_image() for every image.
+ *
+ * @param[in] batch - batch from netpbm_batch_create()
+ * @param[in] filenames - image filenames/paths
+ * @param[out] imgs - count pre-allocated netpbm image structures
+ * @param[in] count - amount of the files
+ * @param[in] n_threads - decode ASCII data of each image using n threads
+ *
+ * @return 0 if every image was read, -1 otherwise. Data of every image is
+ * NULL then
+ */
+int netpbm_batch_read(netpbm_batch_t *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads);
+
+/**
+ * @brief Write Netpbm images to the files
+ *
+ * Same as write_netpbm_file_mt() for each of the images.
+ *
+ * @param[in] batch - batch from netpbm_batch_create()
+ * @param[in] filenames - image filenames/paths
+ * @param[in] imgs - count netpbm image structures to be written
+ * @param[in] count - amount of the files
+ * @param[in] n_threads - encode ASCII data of each image using n threads
+ *
+ * @return 0 if every image was written, -1 otherwise
+ */
+int netpbm_batch_write(netpbm_batch_t *batch, char **filenames,
+		netpbm_image_t *imgs, size_t count, unsigned long n_threads);
+
+/**
+ * @brief Free the batch and its buffer
+ *
+ * @param[in] batch - batch of image files, may be NULL.
+ */
+void netpbm_batch_destroy(netpbm_batch_t *batch);
+
+/**
+ * @brief Compute cache key of the input file and processing options
+ *
+ * Options are hashed as raw bytes, so padding of the options structure
+ * must be zeroed.
+ *
+ * @param[in] filename - input image filename/path
+ * @param[in] opts - options that affect the result
+ * @param[in] opts_size - size of the options
+ * @param[out] key - computed key
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_cache_key(const char *filename, const void *opts,
+		size_t opts_size, uint64_t *key);
+
+/**
+ * @brief Copy cached result to the output file, if there is one
+ *
+ * @param[in] cache - cache description
+ * @param[in] key - key from netpbm_cache_key()
+ * @param[in] ofilename - output filename/path
+ *
+ * @return 1 on cache hit, 0 on miss, -1 on error
+ */
+int netpbm_cache_fetch(const netpbm_cache_t *cache, uint64_t key,
+		const char *ofilename);
+
+/**
+ * @brief Store result file in the cache and evict old entries
+ *
+ * @param[in] cache - cache description
+ * @param[in] key - key from netpbm_cache_key()
+ * @param[in] ofilename - result filename/path
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_cache_store(const netpbm_cache_t *cache, uint64_t key,
+		const char *ofilename);
+
+/**
+ * @brief Select instruction set of the hot loops
+ *
+ * By default, the best instruction set supported by the CPU is selected
+ * on first use. This function overrides the choice, which is mostly
+ * useful for testing and benchmarking each of them.
+ *
+ * @param[in] name - "scalar", "sse2", "avx2" or "avx512".
+ *
+ * @return 0 if no problem occured, -1 if the instruction set is unknown,
+ * 	not compiled in, or not supported by the CPU
+ */
+int netpbm_set_kernels(const char *name);
+
+/**
+ * @brief Get name of the selected instruction set of the hot loops
+ *
+ * @return instruction set name, like "avx2"
+ */
+const char *netpbm_kernels_name(void);
+
+/**
+ * @brief Allocate zeroed bitmap
+ *
+ * @param[out] bmp - bitmap to allocate
+ * @param[in] width - width, in pixels
+ * @param[in] height - height, in pixels
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_bitmap_alloc(netpbm_bitmap_t *bmp, uint32_t width,
+		uint32_t height);
+
+/**
+ * @brief Read P4 file into packed bitmap
+ *
+ * @param[in] filename - input filename/path
+ * @param[out] bmp - bitmap, allocated by the function
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int read_netpbm_bitmap(char *filename, netpbm_bitmap_t *bmp);
+
+/**
+ * @brief Write packed bitmap as P4 file
+ *
+ * @param[in] filename - output filename/path
+ * @param[in] bmp - bitmap to write
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int write_netpbm_bitmap(char *filename, const netpbm_bitmap_t *bmp);
+
+/**
+ * @brief Write byte values as P5 file with maxval 255
+ *
+ * @param[in] filename - output filename/path
+ * @param[in] width - width, in pixels
+ * @param[in] height - height, in pixels
+ * @param[in] data - width * height values in row-major order
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int write_netpbm_bytes(char *filename, uint32_t width, uint32_t height,
+		const uint8_t *data);
+
+/**
+ * @brief Apply Sobel operator to packed bitmap
+ *
+ * Gradients of 64 pixels are computed at once with bitwise operations on
+ * the packed rows. Edge mask has the bits set where Sobel operator of the
+ * unpacked image is not zero, so it matches P4 output of netpbm_sobel().
+ * Magnitudes are Sobel results of the unpacked image, scaled so that the
+ * strongest edge a bitmap can have is 255.
+ *
+ * @param[in] bmp - input bitmap
+ * @param[out] edges - bitmap of the same size for the edge mask, or NULL
+ * @param[out] magnitudes - width * height bytes for the magnitudes, or NULL
+ * @param[in] opts - threads or pool to use. Smoothing is not supported.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_sobel_bitmap(const netpbm_bitmap_t *bmp, netpbm_bitmap_t *edges,
+		uint8_t *magnitudes, const netpbm_sobel_opts_t *opts);
+
+/**
+ * @brief Free data of the bitmap
+ *
+ * @param[in] bmp - bitmap, may have NULL data
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int free_netpbm_bitmap(netpbm_bitmap_t *bmp);
+
+/**
+ * @brief Get amount of CPUs the process may run on
+ *
+ * Takes CPU affinity mask and CPU quota of the cgroup into account, so
+ * that containers limited to a part of the machine don't oversubscribe.
+ *
+ * @return amount of CPUs, at least 1
+ */
+unsigned long netpbm_available_cpus(void);
+
+/**
+ * @brief Fill tuning with costs typical for current machines
+ *
+ * @param[out] tuning - costs to fill
+ */
+void netpbm_tuning_default(netpbm_tuning_t *tuning);
+
+/**
+ * @brief Measure costs of the Sobel operator on this machine
+ *
+ * Runs microbenchmarks for a fraction of a second.
+ *
+ * @param[out] tuning - measured costs
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_tuning_calibrate(netpbm_tuning_t *tuning);
+
+/**
+ * @brief Load tuning profile stored by netpbm_tuning_save()
+ *
+ * @param[out] tuning - costs read from the profile
+ * @param[in] path - profile filename/path
+ *
+ * @return 0 if no problem occured, 1 if there is no profile, -1 otherwise
+ */
+int netpbm_tuning_load(netpbm_tuning_t *tuning, const char *path);
+
+/**
+ * @brief Store tuning profile, replacing the old one atomically
+ *
+ * @param[in] tuning - costs to store
+ * @param[in] path - profile filename/path
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_tuning_save(const netpbm_tuning_t *tuning, const char *path);
+
+/**
+ * @brief Pick amount of threads and size of tasks for the image
+ *
+ * Small images are processed by fewer threads, since starting a thread
+ * costs more than the work it would do. With a pool, the job is split
+ * into several tasks per thread of the pool.
+ *
+ * @param[in] tuning - costs of this machine
+ * @param[in] img - image to be processed
+ * @param[in,out] opts - options, where n_threads and chunk are set. Pool
+ * 	must be set before the call, if it is used.
+ */
+void netpbm_sobel_tune(const netpbm_tuning_t *tuning,
+		const netpbm_image_t *img, netpbm_sobel_opts_t *opts);
+
 /**
  * @brief Frees allocated memory in Netpbm image structure.
  *
@@ -0,0 +1,345 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_gs_internal.h
+ * @author Sergey Koziakov
+ * @brief declares helpers shared between NETPBM_GS library sources
+ *
+ * This header is not a part of the public interface.
+ */
+
+#ifndef NETPBM_GS_INTERNAL_H
+#define NETPBM_GS_INTERNAL_H
+
+#include "netpbm_gs.h"
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * @brief table of hot loops compiled for one instruction set
+ *
+ * The same source is compiled for several instruction sets, and the table
+ * for the best one supported by the CPU is selected once at startup. All
+ * tables produce bit-identical results.
+ */
+struct netpbm_kernels {
+	const char *name; /**< Instruction set name, like "avx2" */
+
+	/**
+	 * @brief apply Sobel operator to n pixels, given rows above, at and
+	 * below them
+	 *
+	 * Row pointers point one column left of the first pixel. Results are
+	 * identical to applying apply_kernel() with Sobel kernels.
+	 */
+	void (*sobel_rows)(const uint32_t *a, const uint32_t *b,
+			const uint32_t *c, uint32_t *out, uint32_t n);
+
+	/**
+	 * @brief apply Sobel operator like sobel_rows, also storing the
+	 * horizontal and vertical gradients of each pixel
+	 */
+	void (*sobel_gradients)(const uint32_t *a, const uint32_t *b,
+			const uint32_t *c, uint32_t *out, int32_t *gx, int32_t *gy,
+			uint32_t n);
+
+	/**
+	 * @brief quantize directions of n gradients to NETPBM_DIRECTION_*
+	 *
+	 * Sectors are split at odd multiples of 22.5 degrees, tested exactly
+	 * in integers. Zero gradient is horizontal.
+	 */
+	void (*quantize_directions)(const int32_t *gx, const int32_t *gy,
+			uint8_t *direction, uint32_t n);
+
+	/**
+	 * @brief suppress n pixels that are not maxima along their gradient
+	 *
+	 * Rows above, at and below the pixels point one column left of the
+	 * first one, like in sobel_rows.
+	 */
+	void (*suppress_row)(const uint32_t *a, const uint32_t *b,
+			const uint32_t *c, const uint8_t *direction, uint32_t *out,
+			uint32_t n);
+
+	/**
+	 * @brief apply Sobel operator to a horizontal span of pixels
+	 *
+	 * Computes n output pixels of the row y, starting at column x.
+	 * Coordinates are given in the unpadded image, padded data must have
+	 * 1-pixel border. Results are identical to applying apply_kernel()
+	 * with Sobel kernels. Output has width of p_width - 2.
+	 */
+	void (*sobel_span)(const uint32_t *p_data, uint32_t p_width,
+			uint32_t *dest, uint32_t x, uint32_t y, uint32_t n);
+
+	/**
+	 * @brief find edges in a row of 1-bit pixels, 64 pixels at a time
+	 *
+	 * Rows above, at and below the output one are packed like in
+	 * netpbm_bitmap_t, and words right before and after each of them
+	 * must be zero. Output bit is set where Sobel operator of the
+	 * unpacked pixels is not zero.
+	 */
+	void (*sobel_bits)(const uint64_t *a, const uint64_t *b,
+			const uint64_t *c, uint64_t *out, size_t words);
+
+	/**
+	 * @brief apply Gaussian blur to a row of the image
+	 *
+	 * Smooths row y of the image stored in padded data with 1-pixel
+	 * border, using 3x3 (radius 1) or 5x5 (radius 2) binomial kernel.
+	 * Pixels outside of the image repeat the edge ones, and results are
+	 * rounded to nearest. Stores p_width - 2 values to dest. tmp must
+	 * hold p_width - 2 + 2 * radius values.
+	 */
+	void (*blur_row)(const uint32_t *p_data, uint32_t p_width,
+			uint32_t height, uint32_t y, uint32_t radius,
+			uint32_t *dest, uint64_t *tmp);
+
+	/**
+	 * @brief check if all n values are equal to value
+	 *
+	 * @return 1 if they are, 0 otherwise
+	 */
+	int (*is_uniform)(const uint32_t *src, uint32_t n, uint32_t value);
+
+	/**
+	 * @brief turn n packed RGB pixels into grey, clamped to maxval
+	 */
+	void (*greyscale)(uint32_t *data, size_t n, uint32_t maxval);
+
+	/**
+	 * @brief expand n bits of P4 row, starting at bit first_bit of src,
+	 * into 0 or 255 values
+	 */
+	void (*unpack_bits)(const uint8_t *src, uint32_t first_bit,
+			uint32_t *dest, uint32_t n);
+
+	/**
+	 * @brief pack n values into P4 row bits, non-zero values set the bit.
+	 * Unused bits of the last byte are zeroed.
+	 */
+	void (*pack_bits)(const uint32_t *src, uint8_t *dest, uint32_t n);
+};
+
+extern const struct netpbm_kernels netpbm_kernels_scalar;
+#ifdef NETPBM_X86_KERNELS
+extern const struct netpbm_kernels netpbm_kernels_sse2;
+extern const struct netpbm_kernels netpbm_kernels_avx2;
+extern const struct netpbm_kernels netpbm_kernels_avx512;
+#endif
+
+/**
+ * @brief convolve a kernel with the image at one point
+ *
+ * Straightforward reference that the optimized Sobel operator must match.
+ * Data must be padded so that the kernel fits around the focus point.
+ *
+ * @param[in] data_in - data matrix of dw x dh values
+ * @param[in] fx - focus point column
+ * @param[in] fy - focus point row
+ * @param[in] kernel - kw x kh kernel, both odd
+ * @param[out] out - convolution, wrapped around like unsigned values
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int apply_kernel(
+		uint32_t *data_in, uint32_t dw, uint32_t dh,
+		uint32_t fx, uint32_t fy,
+		const uint32_t *kernel, const uint32_t kw, const uint32_t kh,
+		uint32_t *out
+);
+
+/**
+ * @brief get kernels for the best instruction set supported by the CPU
+ *
+ * Selected once on the first call, unless netpbm_set_kernels() was called
+ * before. NETPBM_KERNELS environment variable overrides the selection.
+ *
+ * @return table of kernels
+ */
+const struct netpbm_kernels *netpbm_get_kernels(void);
+
+/**
+ * @brief run tasks on the pool threads and wait for them to finish
+ *
+ * Each of n_tasks tasks is called with the pointer to its own element of
+ * the args array.
+ *
+ * @param[in] pool - pool of worker threads
+ * @param[in] task - function executed by the worker
+ * @param[in] args - array of task arguments
+ * @param[in] arg_size - size of one element of args
+ * @param[in] n_tasks - amount of tasks
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_pool_run(netpbm_pool_t *pool, void *(*task)(void *),
+		void *args, size_t arg_size, size_t n_tasks);
+
+/**
+ * @brief hardware performance counters of the calling thread
+ */
+struct netpbm_counters {
+	int fds[NETPBM_COUNTERS]; /**< Counter descriptors, -1 if unavailable */
+};
+
+/**
+ * @brief start counting events of the calling thread
+ *
+ * Counters that are not available are skipped, and not tried again.
+ */
+void netpbm_counters_start(struct netpbm_counters *counters);
+
+/**
+ * @brief stop counting events and read them
+ *
+ * @param[in] counters - counters started by netpbm_counters_start() on
+ * 	the same thread
+ * @param[out] values - NETPBM_COUNTERS values
+ * @param[out] valid - bit for each counter that could be read
+ */
+void netpbm_counters_stop(struct netpbm_counters *counters,
+		uint64_t *values, uint32_t *valid);
+
+/** CPUs of the topology, at most */
+#define NETPBM_MAX_CPUS 1024
+
+/**
+ * @brief CPUs the process may run on, ordered by their NUMA node
+ */
+struct netpbm_topology {
+	unsigned long n_cpus;
+	unsigned long n_nodes; /**< Nodes with at least one of the CPUs */
+	int cpus[NETPBM_MAX_CPUS];
+};
+
+/**
+ * @brief read NUMA topology from the node directory of sysfs
+ *
+ * CPUs outside of the affinity mask are skipped. Without the directory,
+ * all CPUs are on one node.
+ *
+ * @param[in] node_dir - directory with node0/cpulist, node1/cpulist and
+ * 	so on, normally /sys/devices/system/node
+ * @param[out] topo - topology
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_topology_read(const char *node_dir, struct netpbm_topology *topo);
+
+/**
+ * @brief get NUMA topology of this machine, read once on the first call
+ *
+ * @return topology, with no CPUs if it could not be read
+ */
+const struct netpbm_topology *netpbm_topology(void);
+
+/**
+ * @brief set affinity of the thread to be created to the CPU of worker
+ * index out of count
+ *
+ * Workers are spread evenly over the CPUs ordered by node, so neighbouring
+ * workers share a node.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_pin_attr(pthread_attr_t *attr, unsigned long index,
+		unsigned long count);
+
+/**
+ * @brief pin running thread to the CPU of worker index out of count, like
+ * netpbm_pin_attr()
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int netpbm_pin_thread(pthread_t thread, unsigned long index,
+		unsigned long count);
+
+/**
+ * @brief multiply sizes, checking for overflow
+ *
+ * @return 0 if product fits into size_t, -1 otherwise
+ */
+static inline int netpbm_size_mul(size_t a, size_t b, size_t *result)
+{
+	return __builtin_mul_overflow(a, b, result) ? -1 : 0;
+}
+
+/**
+ * @brief ask kernel to back the buffer with huge pages, if enabled with
+ * netpbm_set_huge_pages() and the buffer is big enough
+ */
+void netpbm_advise_huge_pages(void *ptr, size_t size);
+
+/**
+ * @brief get scratch buffer from the arena, or from malloc() without one
+ *
+ * @return pointer to the buffer, or NULL on error
+ */
+void *netpbm_scratch_alloc(netpbm_arena_t *arena, size_t size);
+
+/**
+ * @brief release buffer taken with netpbm_scratch_alloc()
+ */
+void netpbm_scratch_free(netpbm_arena_t *arena, void *ptr);
+
+/**
+ * @brief get start time of the traced event
+ *
+ * @return timestamp to pass to netpbm_trace_end(), 0 if trace is disabled
+ */
+uint64_t netpbm_trace_begin(void);
+
+/**
+ * @brief record event of the calling thread, begun at start
+ *
+ * Does nothing if start is 0.
+ *
+ * @param[in] name - event name, must outlive the trace
+ * @param[in] start - result of netpbm_trace_begin()
+ * @param[in] first - first item processed, or -1 to omit the items
+ * @param[in] count - amount of items processed
+ */
+void netpbm_trace_end(const char *name, uint64_t start,
+		int64_t first, int64_t count);
+
+/**
+ * @brief name the calling thread in the trace, if it is enabled
+ *
+ * @param[in] name - thread name, must outlive the trace
+ */
+void netpbm_trace_thread(const char *name);
+
+/**
+ * @brief read one image from the opened file, like read_netpbm_file_mt()
+ */
+int netpbm_read_image(FILE *ifile, netpbm_image_t *img,
+		unsigned long n_threads);
+
+/**
+ * @brief write one image to the opened file, like write_netpbm_file_mt()
+ */
+int netpbm_write_image(FILE *ofile, netpbm_image_t *img,
+		unsigned long n_threads);
+
+#endif // NETPBM_GS_INTERNAL_H
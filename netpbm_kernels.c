@@ -0,0 +1,301 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_kernels.c
+ * @author Sergey Koziakov
+ * @brief hot loops of NETPBM_GS library
+ *
+ * This file is compiled once for each supported instruction set, with
+ * KERNEL_ISA defined to its name and matching -m flags, and relies on the
+ * compiler to vectorize the loops. Floating point contraction must be
+ * disabled, so that all variants give bit-identical results.
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <math.h>
+
+#ifndef KERNEL_ISA
+#define KERNEL_ISA scalar
+#endif
+
+#define KERNEL_CONCAT(A, B) A ## B
+#define KERNEL_TABLE(ISA) KERNEL_CONCAT(netpbm_kernels_, ISA)
+#define KERNEL_STRINGIFY(X) #X
+#define KERNEL_NAME(ISA) KERNEL_STRINGIFY(ISA)
+
+static void sobel_rows(const uint32_t *restrict a, const uint32_t *restrict b,
+		const uint32_t *restrict c, uint32_t *restrict out, uint32_t n)
+{
+	/* Arithmetic is done on unsigned values to wrap around exactly
+	 * like apply_kernel() does.
+	 */
+	for (size_t i = 0; i < n; i++) {
+		uint32_t out_x = (a[i + 2] - a[i])
+			+ 2 * (b[i + 2] - b[i])
+			+ (c[i + 2] - c[i]);
+		uint32_t out_y = (c[i] + 2 * c[i + 1] + c[i + 2])
+			- (a[i] + 2 * a[i + 1] + a[i + 2]);
+		uint32_t sum = out_x * out_x + out_y * out_y;
+
+		// unsigned to double through a biased int32_t, which is exact
+		// and, unlike a 64-bit conversion, available in vector registers
+		double value = (double)(int32_t)(sum ^ 0x80000000U) + 2147483648.0;
+
+		// square root of 32-bit value always fits into int32_t
+		out[i] = (int32_t) sqrt(value);
+	}
+}
+
+static void sobel_gradients(const uint32_t *restrict a,
+		const uint32_t *restrict b, const uint32_t *restrict c,
+		uint32_t *restrict out, int32_t *restrict gx, int32_t *restrict gy,
+		uint32_t n)
+{
+	/* Same arithmetic as sobel_rows(), so magnitudes are identical */
+	for (size_t i = 0; i < n; i++) {
+		uint32_t out_x = (a[i + 2] - a[i])
+			+ 2 * (b[i + 2] - b[i])
+			+ (c[i + 2] - c[i]);
+		uint32_t out_y = (c[i] + 2 * c[i + 1] + c[i + 2])
+			- (a[i] + 2 * a[i + 1] + a[i + 2]);
+		uint32_t sum = out_x * out_x + out_y * out_y;
+		double value = (double)(int32_t)(sum ^ 0x80000000U) + 2147483648.0;
+
+		out[i] = (int32_t) sqrt(value);
+		gx[i] = (int32_t) out_x;
+		gy[i] = (int32_t) out_y;
+	}
+}
+
+static void quantize_directions(const int32_t *restrict gx,
+		const int32_t *restrict gy, uint8_t *restrict direction, uint32_t n)
+{
+	/* Gradient is within 22.5 degrees of a row if |gy| <= |gx| tan 22.5,
+	 * where tan 22.5 = sqrt(2) - 1, so (|gx| + |gy|)^2 <= 2 gx^2, or
+	 * gy^2 + 2 |gx gy| <= gx^2. Same test with gx and gy swapped finds
+	 * gradients within 22.5 degrees of a column. Absolute values are at
+	 * most 2^31, so the sums fit into 64 bits.
+	 */
+	for (size_t i = 0; i < n; i++) {
+		uint64_t ax = gx[i] < 0 ? 0U - (uint32_t)gx[i] : (uint32_t)gx[i];
+		uint64_t ay = gy[i] < 0 ? 0U - (uint32_t)gy[i] : (uint32_t)gy[i];
+		uint64_t cross = 2 * ax * ay;
+		uint8_t diagonal = (gx[i] ^ gy[i]) >= 0
+			? NETPBM_DIRECTION_DIAGONAL : NETPBM_DIRECTION_ANTIDIAGONAL;
+
+		direction[i] = ay * ay + cross <= ax * ax ? NETPBM_DIRECTION_HORIZONTAL
+			: ax * ax + cross <= ay * ay ? NETPBM_DIRECTION_VERTICAL
+			: diagonal;
+	}
+}
+
+static void suppress_row(const uint32_t *restrict a,
+		const uint32_t *restrict b, const uint32_t *restrict c,
+		const uint8_t *restrict direction, uint32_t *restrict out,
+		uint32_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		const uint8_t d = direction[i];
+		const uint32_t value = b[i + 1];
+
+		/* Neighbours before and after the pixel along the gradient */
+		uint32_t before = d == NETPBM_DIRECTION_HORIZONTAL ? b[i]
+			: d == NETPBM_DIRECTION_DIAGONAL ? a[i]
+			: d == NETPBM_DIRECTION_VERTICAL ? a[i + 1] : a[i + 2];
+		uint32_t after = d == NETPBM_DIRECTION_HORIZONTAL ? b[i + 2]
+			: d == NETPBM_DIRECTION_DIAGONAL ? c[i + 2]
+			: d == NETPBM_DIRECTION_VERTICAL ? c[i + 1] : c[i];
+
+		out[i] = value > before && value >= after ? value : 0;
+	}
+}
+
+static void sobel_span(const uint32_t *p_data, uint32_t p_width,
+		uint32_t *dest, uint32_t x, uint32_t y, uint32_t n)
+{
+	/* Rows above, at and below the focus point, starting one column left
+	 * of it
+	 */
+	const uint32_t *a = p_data + (size_t)y * p_width + x;
+
+	sobel_rows(a, a + p_width, a + 2 * (size_t)p_width,
+		dest + (size_t)y * (p_width - 2) + x, n);
+}
+
+static void sobel_bits(const uint64_t *restrict a, const uint64_t *restrict b,
+		const uint64_t *restrict c, uint64_t *restrict out, size_t words)
+{
+	/* Pixel x is in bit 63 - x % 64 of its word, so the left and right
+	 * neighbours of 64 pixels are the word shifted by one bit, with the
+	 * edge bit of the next word shifted in. Words around the row are zero.
+	 */
+	for (size_t i = 0; i < words; i++) {
+		uint64_t al = (a[i] >> 1) | (a[i - 1] << 63);
+		uint64_t ar = (a[i] << 1) | (a[i + 1] >> 63);
+		uint64_t bl = (b[i] >> 1) | (b[i - 1] << 63);
+		uint64_t br = (b[i] << 1) | (b[i + 1] >> 63);
+		uint64_t cl = (c[i] >> 1) | (c[i - 1] << 63);
+		uint64_t cr = (c[i] << 1) | (c[i + 1] >> 63);
+
+		/* Weighted sums x + 2y + z of 64 pixels at once, as 3 bit
+		 * planes: x ^ z, (x & z) ^ y and x & z & y. Gradient is zero
+		 * only if the sums it subtracts are equal.
+		 */
+		uint64_t right = ar & cr, left = al & cl;
+		uint64_t bottom = cl & cr, top = al & ar;
+
+		uint64_t gx = ((ar ^ cr) ^ (al ^ cl))
+			| ((right ^ br) ^ (left ^ bl))
+			| ((right & br) ^ (left & bl));
+		uint64_t gy = ((cl ^ cr) ^ (al ^ ar))
+			| ((bottom ^ c[i]) ^ (top ^ a[i]))
+			| ((bottom & c[i]) ^ (top & a[i]));
+
+		out[i] = gx | gy;
+	}
+}
+
+static void blur_row(const uint32_t *p_data, uint32_t p_width,
+		uint32_t height, uint32_t y, uint32_t radius,
+		uint32_t *restrict dest, uint64_t *restrict tmp)
+{
+	/* Rows of binomial coefficients, kernel is their outer product */
+	static const uint64_t weights[2][5] = {
+		{ 1, 2, 1 },
+		{ 1, 4, 6, 4, 1 }
+	};
+	const uint64_t *w = weights[radius - 1];
+	const uint32_t width = p_width - 2;
+	const uint32_t taps = 2 * radius + 1;
+
+	/* Vertical pass. Rows outside of the image repeat the edge ones */
+	uint64_t *restrict sum = tmp + radius;
+
+	for (uint32_t x = 0; x < width; x++)
+		sum[x] = 0;
+
+	for (uint32_t k = 0; k < taps; k++) {
+		int64_t row = (int64_t)y + k - radius;
+
+		if (row < 0)
+			row = 0;
+		if (row >= height)
+			row = height - 1;
+
+		const uint32_t *restrict src = p_data + (size_t)(row + 1) * p_width + 1;
+		const uint64_t weight = w[k];
+
+		for (uint32_t x = 0; x < width; x++)
+			sum[x] += weight * src[x];
+	}
+
+	/* Columns outside of the image repeat the edge ones */
+	for (uint32_t k = 0; k < radius; k++) {
+		tmp[k] = sum[0];
+		sum[width + k] = sum[width - 1];
+	}
+
+	/* Horizontal pass, rounded to nearest. Weights add up to 16 or 256 */
+	if (radius == 1) {
+		for (uint32_t x = 0; x < width; x++) {
+			dest[x] = (tmp[x] + 2 * tmp[x + 1] + tmp[x + 2] + 8) >> 4;
+		}
+	} else {
+		for (uint32_t x = 0; x < width; x++) {
+			dest[x] = (tmp[x] + 4 * tmp[x + 1] + 6 * tmp[x + 2]
+				+ 4 * tmp[x + 3] + tmp[x + 4] + 128) >> 8;
+		}
+	}
+}
+
+static int is_uniform(const uint32_t *src, uint32_t n, uint32_t value)
+{
+	/* No early exit, so that the loop is vectorized */
+	uint32_t diff = 0;
+
+	for (uint32_t i = 0; i < n; i++)
+		diff |= src[i] ^ value;
+
+	return diff == 0;
+}
+
+static void greyscale(uint32_t *data, size_t n, uint32_t maxval)
+{
+	for (size_t i = 0; i < n; i++) {
+		int32_t red = NETPBM_RED(data[i]);
+		int32_t green = NETPBM_GREEN(data[i]);
+		int32_t blue = NETPBM_BLUE(data[i]);
+
+		uint32_t grey = (int32_t)(0.21 * red + 0.72 * green + 0.07 * blue);
+
+		data[i] = grey > maxval ? maxval : grey;
+	}
+}
+
+static void unpack_bits(const uint8_t *src, uint32_t first_bit,
+		uint32_t *dest, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		size_t bit = (size_t)first_bit + i;
+
+		dest[i] = ((src[bit / 8] >> (7 - bit % 8)) & 1U) ? 255U : 0;
+	}
+}
+
+static void pack_bits(const uint32_t *src, uint8_t *dest, uint32_t n)
+{
+	uint32_t full_bytes = n / 8;
+
+	for (uint32_t byte = 0; byte < full_bytes; byte++) {
+		const uint32_t *s = src + byte * 8;
+		uint8_t bits = 0;
+
+		for (int k = 0; k < 8; k++)
+			bits |= (s[k] > 0) << (7 - k);
+
+		dest[byte] = bits;
+	}
+
+	if (n % 8 != 0) {
+		uint8_t bits = 0;
+
+		for (uint32_t k = 0; k < n % 8; k++)
+			bits |= (src[full_bytes * 8 + k] > 0) << (7 - k);
+
+		dest[full_bytes] = bits;
+	}
+}
+
+const struct netpbm_kernels KERNEL_TABLE(KERNEL_ISA) = {
+	.name = KERNEL_NAME(KERNEL_ISA),
+	.sobel_rows = sobel_rows,
+	.sobel_gradients = sobel_gradients,
+	.quantize_directions = quantize_directions,
+	.suppress_row = suppress_row,
+	.sobel_span = sobel_span,
+	.sobel_bits = sobel_bits,
+	.blur_row = blur_row,
+	.is_uniform = is_uniform,
+	.greyscale = greyscale,
+	.unpack_bits = unpack_bits,
+	.pack_bits = pack_bits
+};
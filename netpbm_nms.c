@@ -0,0 +1,226 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_nms.c
+ * @author Sergey Koziakov
+ * @brief non-maximum suppression of Sobel operator results
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+/**
+ * @brief Data local to the worker thread
+ */
+struct suppress_worker_info {
+	netpbm_image_t *img;
+	const uint8_t *direction;
+
+	uint32_t y_start;
+	uint32_t y_end;
+
+	/** 4 rows of width + 2 values, zero at both ends: ring of rows
+	 * around the current one, with the row above the band in the first
+	 * of them, and the row below the band */
+	uint32_t *rows;
+	size_t stride; /**< Distance between the rows */
+};
+
+/**
+ * @brief Helper function that copies row y of the image between zeroes
+ * of the padded row, or zeroes it outside of the image
+ */
+static void copy_row(const netpbm_image_t *img, int64_t y, uint32_t *row)
+{
+	row[0] = 0;
+	row[img->width + 1] = 0;
+
+	if (y < 0 || y >= img->height)
+		memset(row + 1, 0, sizeof(uint32_t) * img->width);
+	else
+		memcpy(row + 1, img->data + (size_t)y * img->width,
+			sizeof(uint32_t) * img->width);
+}
+
+static void *suppress_task(void *arguments)
+{
+	struct suppress_worker_info *info =
+		(struct suppress_worker_info *) arguments;
+	const struct netpbm_kernels *kernels = netpbm_get_kernels();
+	netpbm_image_t *img = info->img;
+	uint64_t trace = netpbm_trace_begin();
+
+	uint32_t *ring[3] = {
+		info->rows,
+		info->rows + info->stride,
+		info->rows + 2 * info->stride
+	};
+	const uint32_t *below = info->rows + 3 * info->stride;
+
+	if (info->y_start == info->y_end)
+		return NULL;
+
+	/* Rows are overwritten in place, so every row is copied before it
+	 * is, and the rows around the band were copied before the start
+	 */
+	copy_row(img, info->y_start, ring[1]);
+
+	for (uint32_t y = info->y_start; y < info->y_end; y++) {
+		const uint32_t *next = below;
+
+		if (y + 1 < info->y_end) {
+			copy_row(img, (int64_t)y + 1, ring[2]);
+			next = ring[2];
+		}
+
+		kernels->suppress_row(ring[0], ring[1], next,
+			info->direction + (size_t)y * img->width,
+			img->data + (size_t)y * img->width, img->width);
+
+		uint32_t *oldest = ring[0];
+
+		ring[0] = ring[1];
+		ring[1] = ring[2];
+		ring[2] = oldest;
+	}
+
+	netpbm_trace_end("suppress task", trace, info->y_start,
+		info->y_end - info->y_start);
+
+	return NULL;
+}
+
+int netpbm_suppress_nonmaxima(netpbm_image_t *img, const uint8_t *direction,
+		const netpbm_sobel_opts_t *opts)
+{
+	unsigned long n_threads = opts->n_threads;
+
+	if (opts->pool != NULL && n_threads == 0)
+		n_threads = netpbm_pool_size(opts->pool);
+
+	if (img->data == NULL || direction == NULL) {
+		fprintf(stderr, "Image structure is not initialized\n");
+		return -1;
+	}
+
+	if (n_threads == 0 || n_threads == ULONG_MAX) {
+		fprintf(stderr, "Invalid amount of threads!\n");
+		return -1;
+	}
+
+	if (img->width == 0 || img->height == 0)
+		return 0;
+
+	/* Bands are whole rows. With a pool, job may be split into more
+	 * tasks than threads, like by the Sobel operator
+	 */
+	size_t t_pixels = (size_t)img->width * img->height;
+	size_t n_tasks = n_threads;
+
+	if (opts->pool != NULL && opts->chunk > 0)
+		n_tasks = t_pixels > opts->chunk
+			? (t_pixels + opts->chunk - 1) / opts->chunk : 1;
+	if (n_tasks > img->height)
+		n_tasks = img->height;
+
+	const size_t stride = ((size_t)img->width + 2 + 15) & ~(size_t)15;
+	size_t rows_size;
+	uint32_t *rows = NULL;
+
+	if (netpbm_size_mul(4 * stride * sizeof(uint32_t), n_tasks,
+			&rows_size) == 0)
+		rows = (uint32_t *) netpbm_scratch_alloc(opts->arena, rows_size);
+
+	struct suppress_worker_info *w_info = (struct suppress_worker_info *)
+		netpbm_scratch_alloc(opts->arena,
+			sizeof(struct suppress_worker_info) * n_tasks);
+	pthread_t *threads = (pthread_t *) netpbm_scratch_alloc(opts->arena,
+		sizeof(pthread_t) * n_tasks);
+	unsigned long created = 0;
+	int ret = -1;
+	uint64_t trace = netpbm_trace_begin();
+
+	if (rows == NULL || w_info == NULL || threads == NULL) {
+		fprintf(stderr, "Unable to allocate memory for "
+				"non-maximum suppression\n");
+		goto out;
+	}
+
+	/* split rows between n tasks */
+	uint32_t e = img->height / n_tasks;
+	uint32_t o = img->height % n_tasks;
+	uint32_t ind = 0;
+
+	for (size_t t = 0; t < n_tasks; t++) {
+		uint32_t end = ind + e + (t < o ? 1 : 0);
+
+		w_info[t] = (struct suppress_worker_info){
+			.img = img,
+			.direction = direction,
+			.y_start = ind,
+			.y_end = end,
+			.rows = rows + 4 * t * stride,
+			.stride = stride
+		};
+
+		// neighbouring tasks overwrite these rows
+		copy_row(img, (int64_t)ind - 1, w_info[t].rows);
+		copy_row(img, end, w_info[t].rows + 3 * stride);
+		ind = end;
+	}
+
+	if (opts->pool != NULL) {
+		if (netpbm_pool_run(opts->pool, suppress_task, w_info,
+				sizeof(struct suppress_worker_info), n_tasks) == 0)
+			ret = 0;
+		goto out;
+	}
+
+	for (; created < n_tasks; created++) {
+		if (pthread_create(&threads[created], NULL, suppress_task,
+				&w_info[created]) != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", created);
+			break;
+		}
+	}
+
+	// threads that were started still use the buffers
+	for (unsigned long t = 0; t < created; t++)
+		pthread_join(threads[t], NULL);
+
+	if (created == n_tasks)
+		ret = 0;
+
+out:
+	if (ret == 0)
+		netpbm_trace_end("suppress nonmaxima", trace, 0, t_pixels);
+
+	netpbm_scratch_free(opts->arena, threads);
+	netpbm_scratch_free(opts->arena, w_info);
+	netpbm_scratch_free(opts->arena, rows);
+
+	return ret;
+}
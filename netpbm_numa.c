@@ -0,0 +1,245 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_numa.c
+ * @author Sergey Koziakov
+ * @brief placement of worker threads on CPUs of NUMA nodes
+ */
+
+#define _GNU_SOURCE
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+static struct netpbm_topology topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Helper function that parses list of CPUs, like "0-3,8-11"
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	const char *p = list;
+
+	CPU_ZERO(set);
+
+	while (*p != '\0' && *p != '\n') {
+		char *end;
+		unsigned long first = strtoul(p, &end, 10);
+		unsigned long last = first;
+
+		if (end == p)
+			return -1;
+
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+
+		for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, set);
+
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that compares node numbers for qsort()
+ */
+static int compare_nodes(const void *a, const void *b)
+{
+	int x = *(const int *) a;
+	int y = *(const int *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Helper function that adds CPUs of the set, which the process may
+ * run on, to the topology
+ *
+ * @return amount of CPUs added
+ */
+static unsigned long add_cpus(struct netpbm_topology *topo,
+		const cpu_set_t *set, const cpu_set_t *allowed, cpu_set_t *added)
+{
+	unsigned long count = 0;
+
+	for (int cpu = 0; cpu < CPU_SETSIZE
+		&& topo->n_cpus < NETPBM_MAX_CPUS; cpu++) {
+		if (!CPU_ISSET(cpu, set) || !CPU_ISSET(cpu, allowed)
+			|| CPU_ISSET(cpu, added))
+			continue;
+
+		CPU_SET(cpu, added);
+		topo->cpus[topo->n_cpus++] = cpu;
+		count++;
+	}
+
+	return count;
+}
+
+int netpbm_topology_read(const char *node_dir, struct netpbm_topology *topo)
+{
+	cpu_set_t allowed, added, set;
+	int nodes[NETPBM_MAX_CPUS];
+	size_t n_nodes = 0;
+	DIR *dir = opendir(node_dir);
+
+	memset(topo, 0, sizeof(*topo));
+	CPU_ZERO(&added);
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &allowed);
+	}
+
+	/* Node directories are named node0, node1 and so on, but numbers
+	 * may have gaps
+	 */
+	struct dirent *entry;
+
+	while (dir != NULL && (entry = readdir(dir)) != NULL
+		&& n_nodes < NETPBM_MAX_CPUS) {
+		char *end;
+
+		if (strncmp(entry->d_name, "node", 4) != 0)
+			continue;
+
+		long node = strtol(entry->d_name + 4, &end, 10);
+
+		if (end != entry->d_name + 4 && *end == '\0' && node >= 0)
+			nodes[n_nodes++] = (int) node;
+	}
+
+	if (dir != NULL)
+		closedir(dir);
+
+	qsort(nodes, n_nodes, sizeof(int), compare_nodes);
+
+	for (size_t n = 0; n < n_nodes; n++) {
+		char path[4096];
+		char list[4096];
+		FILE *file;
+
+		snprintf(path, sizeof(path), "%s/node%d/cpulist", node_dir, nodes[n]);
+		if ((file = fopen(path, "r")) == NULL)
+			continue;
+
+		int ok = fgets(list, sizeof(list), file) != NULL
+			&& parse_cpulist(list, &set) == 0;
+
+		fclose(file);
+
+		// memory-only nodes have no CPUs to add
+		if (ok && add_cpus(topo, &set, &allowed, &added) > 0)
+			topo->n_nodes++;
+	}
+
+	/* Without node information, all CPUs are on one node */
+	if (add_cpus(topo, &allowed, &allowed, &added) > 0 && topo->n_nodes == 0)
+		topo->n_nodes = 1;
+
+	return topo->n_cpus > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Helper function that reads topology of this machine once
+ */
+static void read_topology(void)
+{
+	netpbm_topology_read(NODE_DIR, &topology);
+}
+
+const struct netpbm_topology *netpbm_topology(void)
+{
+	pthread_once(&topology_once, read_topology);
+
+	return &topology;
+}
+
+unsigned long netpbm_numa_nodes(void)
+{
+	const struct netpbm_topology *topo = netpbm_topology();
+
+	return topo->n_nodes > 0 ? topo->n_nodes : 1;
+}
+
+/**
+ * @brief Helper function that fills set with the CPU of worker index out
+ * of count
+ *
+ * Workers are spread evenly over CPUs ordered by node, so that neighbouring
+ * workers, which process neighbouring bands, share a node.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int worker_cpu(unsigned long index, unsigned long count,
+		cpu_set_t *set)
+{
+	const struct netpbm_topology *topo = netpbm_topology();
+
+	if (topo->n_cpus == 0 || count == 0)
+		return -1;
+
+	CPU_ZERO(set);
+	CPU_SET(topo->cpus[(unsigned long long) index * topo->n_cpus / count
+		% topo->n_cpus], set);
+
+	return 0;
+}
+
+int netpbm_pin_attr(pthread_attr_t *attr, unsigned long index,
+		unsigned long count)
+{
+	cpu_set_t set;
+
+	if (worker_cpu(index, count, &set) != 0)
+		return -1;
+
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int netpbm_pin_thread(pthread_t thread, unsigned long index,
+		unsigned long count)
+{
+	cpu_set_t set;
+
+	if (worker_cpu(index, count, &set) != 0)
+		return -1;
+
+	return pthread_setaffinity_np(thread, sizeof(set), &set) == 0 ? 0 : -1;
+}
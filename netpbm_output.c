@@ -0,0 +1,358 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_output.c
+ * @author Sergey Koziakov
+ * @brief binary images written in place by many threads
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <errno.h>
+
+/** Bytes converted at once when rows are written with pwrite() */
+#define PWRITE_CHUNK 65536
+
+/**
+ * @brief Helper function that returns bytes of the file for count pixels
+ */
+static size_t output_bytes(const netpbm_output_t *out, size_t count)
+{
+	if (out->type == NETPBM_BINARY_BITMAP)
+		return count / out->width * (((size_t)out->width + 7) / 8);
+
+	return out->type == NETPBM_BINARY_PIXMAP ? count * 3 : count;
+}
+
+/**
+ * @brief Helper function that writes the whole buffer at the offset
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int pwrite_all(int fd, const uint8_t *buffer, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t written = pwrite(fd, buffer, size, offset);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written <= 0)
+			return -1;
+
+		buffer += written;
+		size -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that converts pixels to the bytes of the file
+ *
+ * Values are stored the same way as by write_netpbm_file(). Bitmaps are
+ * converted by whole rows.
+ */
+static void convert_pixels(const netpbm_output_t *out, const uint32_t *pixels,
+		size_t count, uint8_t *dest)
+{
+	if (out->type == NETPBM_BINARY_BITMAP) {
+		const struct netpbm_kernels *kernels = netpbm_get_kernels();
+		const size_t row_bytes = ((size_t)out->width + 7) / 8;
+
+		for (size_t row = 0; row < count / out->width; row++)
+			kernels->pack_bits(pixels + row * out->width,
+				dest + row * row_bytes, out->width);
+
+	} else if (out->type == NETPBM_BINARY_GREYMAP) {
+		for (size_t p = 0; p < count; p++)
+			dest[p] = (uint8_t) pixels[p];
+
+	} else {
+		for (size_t p = 0; p < count; p++) {
+			uint8_t *rgb = dest + p * 3;
+
+			rgb[0] = NETPBM_RED(pixels[p]);
+			rgb[1] = NETPBM_GREEN(pixels[p]);
+			rgb[2] = NETPBM_BLUE(pixels[p]);
+		}
+	}
+}
+
+int netpbm_output_open(netpbm_output_t *out, char *filename,
+		const netpbm_image_t *img)
+{
+	char header[64];
+	int header_len;
+	size_t size;
+
+	out->fd = -1;
+	out->map = NULL;
+
+	if (!NETPBM_TYPE_IS_BINARY(img->type)) {
+		fprintf(stderr, "Only binary images can be written in place\n");
+		return -1;
+	}
+
+	/* Header is the same as written by write_netpbm_image() */
+	if (img->type == NETPBM_BINARY_BITMAP)
+		header_len = snprintf(header, sizeof(header), "P4\n%u\n%u\n",
+			img->width, img->height);
+	else
+		header_len = snprintf(header, sizeof(header), "P%d\n%u\n%u\n%u\n",
+			img->type, img->width, img->height, img->maxval);
+
+	out->type = img->type;
+	out->width = img->width;
+	out->height = img->height;
+	out->data_offset = header_len;
+
+	if (img->width == 0) {
+		size = header_len;
+	} else if (netpbm_size_mul(output_bytes(out, img->width), img->height,
+			&size) != 0 || size > SIZE_MAX - header_len) {
+		fprintf(stderr, "Image is too big\n");
+		return -1;
+	} else {
+		size += header_len;
+	}
+
+	out->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (out->fd < 0) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	/* File is sized up front, so rows can be stored in any order */
+	if (ftruncate(out->fd, size) != 0
+		|| pwrite_all(out->fd, (const uint8_t *) header, header_len, 0) != 0) {
+		fprintf(stderr, "Unable to size output file: error %d\n", errno);
+		goto error;
+	}
+
+	out->map_size = size;
+
+	/* Stores into holes of a sparse file raise SIGBUS when the disk is
+	 * full, so the file is only mapped once its blocks are allocated.
+	 * Rows are written with pwrite() otherwise, which reports errors
+	 */
+	if (size == 0 || posix_fallocate(out->fd, 0, size) != 0)
+		return 0;
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		out->fd, 0);
+
+	if (map != MAP_FAILED)
+		out->map = (uint8_t *) map;
+
+	return 0;
+
+error:
+	close(out->fd);
+	out->fd = -1;
+	return -1;
+}
+
+int netpbm_output_store(netpbm_output_t *out, const uint32_t *pixels,
+		size_t first, size_t count)
+{
+	if (count == 0)
+		return 0;
+
+	if (out->type == NETPBM_BINARY_BITMAP
+		&& (first % out->width != 0 || count % out->width != 0)) {
+		fprintf(stderr, "Bitmaps can only be stored by whole rows\n");
+		return -1;
+	}
+
+	const size_t offset = out->data_offset + output_bytes(out, first);
+
+	if (out->map != NULL) {
+		convert_pixels(out, pixels, count, out->map + offset);
+		return 0;
+	}
+
+	/* Pixels are converted in chunks, of whole rows for bitmaps */
+	size_t chunk = out->type == NETPBM_BINARY_BITMAP
+		? out->width * (PWRITE_CHUNK / output_bytes(out, out->width) + 1)
+		: PWRITE_CHUNK;
+	uint8_t *buffer = (uint8_t *) malloc(output_bytes(out, chunk));
+	size_t done = 0;
+
+	if (buffer == NULL) {
+		fprintf(stderr, "Unable to allocate memory for output\n");
+		return -1;
+	}
+
+	while (done < count) {
+		size_t n = count - done < chunk ? count - done : chunk;
+		size_t bytes = output_bytes(out, n);
+
+		convert_pixels(out, pixels + done, n, buffer);
+
+		if (pwrite_all(out->fd, buffer, bytes,
+				offset + output_bytes(out, done)) != 0) {
+			fprintf(stderr, "Error writing file: error %d\n", errno);
+			free(buffer);
+			return -1;
+		}
+
+		done += n;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+int netpbm_output_close(netpbm_output_t *out)
+{
+	int ret = 0;
+
+	/* Errors of the writeback are only reported by msync() */
+	if (out->map != NULL && msync(out->map, out->map_size, MS_SYNC) != 0)
+		ret = -1;
+
+	if (out->map != NULL && munmap(out->map, out->map_size) != 0)
+		ret = -1;
+
+	if (out->fd >= 0 && close(out->fd) != 0)
+		ret = -1;
+
+	if (ret != 0)
+		fprintf(stderr, "Error writing file\n");
+
+	out->map = NULL;
+	out->fd = -1;
+
+	return ret;
+}
+
+/**
+ * @brief Rows stored by one thread of write_netpbm_file_direct()
+ */
+struct store_task {
+	netpbm_output_t *out;
+	const netpbm_image_t *img;
+	uint32_t row_start;
+	uint32_t row_end;
+	int ret;
+};
+
+static void *store_rows_task(void *arguments)
+{
+	struct store_task *task = (struct store_task *) arguments;
+	const size_t width = task->img->width;
+	uint64_t trace = netpbm_trace_begin();
+
+	task->ret = netpbm_output_store(task->out,
+		task->img->data + task->row_start * width,
+		task->row_start * width,
+		(task->row_end - task->row_start) * width);
+
+	netpbm_trace_end("store rows", trace, task->row_start,
+		task->row_end - task->row_start);
+
+	return NULL;
+}
+
+int write_netpbm_file_direct(char *filename, netpbm_image_t *img,
+		unsigned long n_threads)
+{
+	netpbm_output_t out;
+
+	if (n_threads == 0 || n_threads == ULONG_MAX) {
+		fprintf(stderr, "Invalid amount of threads!\n");
+		return -1;
+	}
+
+	if (n_threads > img->height)
+		n_threads = img->height ? img->height : 1;
+
+	if (netpbm_output_open(&out, filename, img) != 0)
+		return -1;
+
+	struct store_task *tasks = (struct store_task *)
+		calloc(n_threads, sizeof(struct store_task));
+	pthread_t *threads = (pthread_t *) calloc(n_threads, sizeof(pthread_t));
+	unsigned long created = 0;
+	int ret = -1;
+
+	if (tasks == NULL || threads == NULL) {
+		fprintf(stderr, "Unable to allocate memory for output\n");
+		goto out;
+	}
+
+	/* split rows between n threads, the calling thread takes the first */
+	uint32_t e = img->height / n_threads;
+	uint32_t o = img->height % n_threads;
+	uint32_t ind = 0;
+
+	for (unsigned long t = 0; t < n_threads; t++) {
+		uint32_t end = ind + e + (t < o ? 1 : 0);
+
+		tasks[t] = (struct store_task){
+			.out = &out,
+			.img = img,
+			.row_start = ind,
+			.row_end = end
+		};
+		ind = end;
+	}
+
+	for (created = 1; created < n_threads; created++) {
+		if (pthread_create(&threads[created], NULL, store_rows_task,
+				&tasks[created]) != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", created);
+			break;
+		}
+	}
+
+	store_rows_task(&tasks[0]);
+	ret = tasks[0].ret;
+
+	for (unsigned long t = 1; t < created; t++) {
+		pthread_join(threads[t], NULL);
+		if (tasks[t].ret != 0)
+			ret = -1;
+	}
+
+	if (created < n_threads)
+		ret = -1;
+
+out:
+	free(threads);
+	free(tasks);
+
+	if (netpbm_output_close(&out) != 0)
+		ret = -1;
+
+	return ret;
+}
@@ -0,0 +1,138 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_perf.c
+ * @author Sergey Koziakov
+ * @brief hardware performance counters of the worker threads
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#ifdef __linux__
+static const uint64_t events[NETPBM_COUNTERS] = {
+	[NETPBM_COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+	[NETPBM_COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+	[NETPBM_COUNTER_LLC_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+	[NETPBM_COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/** Counters the kernel refused to open once, never tried again */
+static uint32_t unavailable = 0;
+
+void netpbm_counters_start(struct netpbm_counters *counters)
+{
+	for (int c = 0; c < NETPBM_COUNTERS; c++) {
+		counters->fds[c] = -1;
+
+		if (__atomic_load_n(&unavailable, __ATOMIC_RELAXED) & (1U << c))
+			continue;
+
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = events[c];
+		attr.disabled = 1;
+		// unprivileged processes may only count their own code
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+			| PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		/* Count the calling thread on whatever CPU it runs */
+		counters->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+		// running out of descriptors doesn't make the counter unusable
+		if (counters->fds[c] < 0 && errno != EMFILE && errno != ENFILE)
+			__atomic_fetch_or(&unavailable, 1U << c, __ATOMIC_RELAXED);
+	}
+
+	for (int c = 0; c < NETPBM_COUNTERS; c++) {
+		if (counters->fds[c] >= 0)
+			ioctl(counters->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+void netpbm_counters_stop(struct netpbm_counters *counters,
+		uint64_t *values, uint32_t *valid)
+{
+	*valid = 0;
+
+	for (int c = 0; c < NETPBM_COUNTERS; c++) {
+		if (counters->fds[c] >= 0)
+			ioctl(counters->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+	}
+
+	for (int c = 0; c < NETPBM_COUNTERS; c++) {
+		/* value, time enabled, time running */
+		uint64_t data[3];
+
+		values[c] = 0;
+
+		if (counters->fds[c] < 0)
+			continue;
+
+		if (read(counters->fds[c], data, sizeof(data)) == sizeof(data)
+			&& data[2] > 0) {
+			// counters were multiplexed with other events, so the
+			// value is extrapolated to the whole time
+			values[c] = data[2] < data[1]
+				? (uint64_t)((double)data[0] * data[1] / data[2])
+				: data[0];
+			*valid |= 1U << c;
+		}
+
+		close(counters->fds[c]);
+		counters->fds[c] = -1;
+	}
+}
+
+#else // counters are only implemented with perf_event_open()
+
+void netpbm_counters_start(struct netpbm_counters *counters)
+{
+	for (int c = 0; c < NETPBM_COUNTERS; c++)
+		counters->fds[c] = -1;
+}
+
+void netpbm_counters_stop(struct netpbm_counters *counters,
+		uint64_t *values, uint32_t *valid)
+{
+	(void) counters;
+
+	memset(values, 0, sizeof(uint64_t) * NETPBM_COUNTERS);
+	*valid = 0;
+}
+
+#endif
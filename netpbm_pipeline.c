@@ -0,0 +1,247 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_pipeline.c
+ * @author Sergey Koziakov
+ * @brief implementation of the pipeline overlapping I/O and processing
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define DEFAULT_PIPELINE_DEPTH 3
+
+/**
+ * @brief image buffer passed between the stages
+ */
+struct pipeline_slot {
+	netpbm_image_t image;
+	size_t capacity; /**< Pixels that data of the image holds */
+	int last; /**< Marks the end of the input stream */
+};
+
+/**
+ * @brief FIFO of slots. Every queue can hold all slots, so pushing never
+ * blocks, and the amount of slots bounds the work in flight.
+ */
+struct slot_queue {
+	struct pipeline_slot **slots;
+	size_t head;
+	size_t count;
+};
+
+struct pipeline {
+	const netpbm_pipeline_t *opts;
+	size_t n_slots;
+
+	pthread_mutex_t lock; /**< Protects queues and failed flag */
+	pthread_cond_t changed; /**< Signalled on every push and failure */
+
+	struct slot_queue free; /**< Slots ready to be read into */
+	struct slot_queue decoded; /**< Images waiting for processing */
+	struct slot_queue processed; /**< Images waiting to be written */
+
+	int failed; /**< Some stage failed, so everyone should stop */
+};
+
+static void queue_push(struct pipeline *pl, struct slot_queue *queue,
+		struct pipeline_slot *slot)
+{
+	pthread_mutex_lock(&pl->lock);
+	queue->slots[(queue->head + queue->count++) % pl->n_slots] = slot;
+	pthread_cond_broadcast(&pl->changed);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+/**
+ * @brief Helper function that waits for the next slot of the queue
+ *
+ * @return slot, or NULL if pipeline failed
+ */
+static struct pipeline_slot *queue_pop(struct pipeline *pl,
+		struct slot_queue *queue)
+{
+	struct pipeline_slot *slot = NULL;
+
+	pthread_mutex_lock(&pl->lock);
+
+	while (!pl->failed && queue->count == 0)
+		pthread_cond_wait(&pl->changed, &pl->lock);
+
+	if (!pl->failed) {
+		slot = queue->slots[queue->head];
+		queue->head = (queue->head + 1) % pl->n_slots;
+		queue->count--;
+	}
+
+	pthread_mutex_unlock(&pl->lock);
+
+	return slot;
+}
+
+static void pipeline_fail(struct pipeline *pl)
+{
+	pthread_mutex_lock(&pl->lock);
+	pl->failed = 1;
+	pthread_cond_broadcast(&pl->changed);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+static void *reader_task(void *arguments)
+{
+	struct pipeline *pl = (struct pipeline *) arguments;
+	netpbm_stream_t *input = pl->opts->input;
+	struct pipeline_slot *slot;
+
+	netpbm_trace_thread("reader");
+
+	while ((slot = queue_pop(pl, &pl->free)) != NULL) {
+		// capacity of the stream belongs to the image read into
+		input->capacity = slot->capacity;
+		int ret = netpbm_stream_read(input, &slot->image);
+		slot->capacity = input->capacity;
+
+		if (ret < 0) {
+			pipeline_fail(pl);
+			break;
+		}
+
+		// the slot belongs to the next stage once pushed
+		int last = slot->last = (ret == 0);
+		queue_push(pl, &pl->decoded, slot);
+
+		if (last)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *writer_task(void *arguments)
+{
+	struct pipeline *pl = (struct pipeline *) arguments;
+	struct pipeline_slot *slot;
+
+	netpbm_trace_thread("writer");
+
+	while ((slot = queue_pop(pl, &pl->processed)) != NULL && !slot->last) {
+		if (netpbm_stream_write(pl->opts->output, &slot->image) != 0) {
+			pipeline_fail(pl);
+			break;
+		}
+
+		queue_push(pl, &pl->free, slot);
+	}
+
+	return NULL;
+}
+
+int netpbm_pipeline_run(const netpbm_pipeline_t *opts)
+{
+	struct pipeline pl = {
+		.opts = opts,
+		.n_slots = opts->depth ? opts->depth : DEFAULT_PIPELINE_DEPTH
+	};
+	pthread_t reader, writer;
+	int ret = -1;
+
+	struct pipeline_slot *slots = (struct pipeline_slot *)
+		calloc(pl.n_slots, sizeof(struct pipeline_slot));
+	pl.free.slots = (struct pipeline_slot **)
+		malloc(sizeof(struct pipeline_slot *) * pl.n_slots);
+	pl.decoded.slots = (struct pipeline_slot **)
+		malloc(sizeof(struct pipeline_slot *) * pl.n_slots);
+	pl.processed.slots = (struct pipeline_slot **)
+		malloc(sizeof(struct pipeline_slot *) * pl.n_slots);
+
+	if (slots == NULL || pl.free.slots == NULL
+		|| pl.decoded.slots == NULL || pl.processed.slots == NULL) {
+		fprintf(stderr, "Unable to allocate pipeline\n");
+		goto out;
+	}
+
+	for (size_t s = 0; s < pl.n_slots; s++)
+		pl.free.slots[pl.free.count++] = &slots[s];
+
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.changed, NULL);
+
+	if (pthread_create(&reader, NULL, reader_task, &pl) != 0) {
+		fprintf(stderr, "Unable to create reader thread\n");
+		goto destroy;
+	}
+
+	if (pthread_create(&writer, NULL, writer_task, &pl) != 0) {
+		fprintf(stderr, "Unable to create writer thread\n");
+		pipeline_fail(&pl);
+		pthread_join(reader, NULL);
+		goto destroy;
+	}
+
+	/* Images are processed on the calling thread, in stream order */
+	struct pipeline_slot *slot;
+	size_t frame = 0;
+
+	while ((slot = queue_pop(&pl, &pl.decoded)) != NULL) {
+		int last = slot->last;
+		uint64_t trace = netpbm_trace_begin();
+
+		if (!last && opts->process(&slot->image, opts->arg) != 0) {
+			pipeline_fail(&pl);
+			break;
+		}
+
+		if (!last)
+			netpbm_trace_end("process", trace, frame++, 1);
+
+		// writer may recycle the slot to the reader right after the push
+		queue_push(&pl, &pl.processed, slot);
+
+		if (last)
+			break;
+	}
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	ret = pl.failed ? -1 : 0;
+
+destroy:
+	pthread_cond_destroy(&pl.changed);
+	pthread_mutex_destroy(&pl.lock);
+
+	// data taken from the arena of the stream belongs to it
+	for (size_t s = 0; s < pl.n_slots; s++) {
+		if (opts->input->arena == NULL && slots[s].image.data != NULL)
+			free_netpbm_image(&slots[s].image);
+	}
+
+out:
+	free(pl.processed.slots);
+	free(pl.decoded.slots);
+	free(pl.free.slots);
+	free(slots);
+
+	return ret;
+}
@@ -0,0 +1,186 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_pool.c
+ * @author Sergey Koziakov
+ * @brief implementation of the pool of persistent worker threads
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+struct netpbm_pool {
+	pthread_t *threads;
+	unsigned long n_threads;
+
+	pthread_mutex_t run_lock; /**< Serializes netpbm_pool_run() callers */
+	pthread_mutex_t lock; /**< Protects fields below */
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+
+	void *(*task)(void *);
+	uint8_t *args;
+	size_t arg_size;
+	size_t n_tasks;
+	size_t next_task; /**< Index of the first task nobody took */
+	size_t done_tasks;
+
+	int shutdown;
+};
+
+static void *pool_worker(void *arguments)
+{
+	netpbm_pool_t *pool = (netpbm_pool_t *) arguments;
+
+	netpbm_trace_thread("pool worker");
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (1) {
+		while (!pool->shutdown && pool->next_task >= pool->n_tasks)
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+
+		if (pool->shutdown)
+			break;
+
+		size_t t = pool->next_task++;
+		void *(*task)(void *) = pool->task;
+		void *arg = pool->args + t * pool->arg_size;
+
+		pthread_mutex_unlock(&pool->lock);
+		task(arg);
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->done_tasks == pool->n_tasks)
+			pthread_cond_signal(&pool->work_done);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+netpbm_pool_t *netpbm_pool_create(unsigned long n_threads)
+{
+	if (n_threads == 0) {
+		fprintf(stderr, "Invalid amount of threads!\n");
+		return NULL;
+	}
+
+	netpbm_pool_t *pool = (netpbm_pool_t *) calloc(1, sizeof(netpbm_pool_t));
+	if (pool == NULL)
+		return NULL;
+
+	pool->threads = (pthread_t *) malloc(sizeof(pthread_t) * n_threads);
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->run_lock, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+
+	for (unsigned long t = 0; t < n_threads; t++) {
+		if (pthread_create(&pool->threads[t], NULL,
+				pool_worker, (void *) pool) != 0) {
+			fprintf(stderr, "Unable to create thread %lu!\n", t);
+			netpbm_pool_destroy(pool);
+			return NULL;
+		}
+		pool->n_threads++;
+	}
+
+	return pool;
+}
+
+int netpbm_pool_pin(netpbm_pool_t *pool)
+{
+	int ret = 0;
+
+	for (unsigned long t = 0; t < pool->n_threads; t++) {
+		if (netpbm_pin_thread(pool->threads[t], t, pool->n_threads) != 0)
+			ret = 1;
+	}
+
+	return ret;
+}
+
+unsigned long netpbm_pool_size(const netpbm_pool_t *pool)
+{
+	return pool->n_threads;
+}
+
+int netpbm_pool_run(netpbm_pool_t *pool, void *(*task)(void *),
+		void *args, size_t arg_size, size_t n_tasks)
+{
+	if (n_tasks == 0)
+		return 0;
+
+	pthread_mutex_lock(&pool->run_lock);
+	pthread_mutex_lock(&pool->lock);
+
+	pool->task = task;
+	pool->args = (uint8_t *) args;
+	pool->arg_size = arg_size;
+	pool->n_tasks = n_tasks;
+	pool->next_task = 0;
+	pool->done_tasks = 0;
+
+	pthread_cond_broadcast(&pool->work_ready);
+
+	while (pool->done_tasks < pool->n_tasks)
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+
+	pool->n_tasks = 0;
+	pool->next_task = 0;
+
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->run_lock);
+
+	return 0;
+}
+
+void netpbm_pool_destroy(netpbm_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned long t = 0; t < pool->n_threads; t++)
+		pthread_join(pool->threads[t], NULL);
+
+	pthread_cond_destroy(&pool->work_done);
+	pthread_cond_destroy(&pool->work_ready);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->run_lock);
+
+	free(pool->threads);
+	free(pool);
+}
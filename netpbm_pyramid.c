@@ -0,0 +1,172 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_pyramid.c
+ * @author Sergey Koziakov
+ * @brief downsampling of images into levels of a pyramid
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Helper function that returns grey values of the source row
+ *
+ * Pixmaps are turned grey the same way as by netpbm_to_greyscale(), so
+ * that it doesn't need a pass of its own. Set bits of bitmaps are black,
+ * so they become 0, and clear bits become 255. Rows of greymaps are
+ * returned as they are, others are converted into the buffer.
+ */
+static const uint32_t *grey_row(const netpbm_image_t *src, uint32_t y,
+		uint32_t *buffer)
+{
+	const uint32_t *row = src->data + (size_t)y * src->width;
+
+	switch (src->type) {
+	case NETPBM_ASCII_PIXMAP:
+	case NETPBM_BINARY_PIXMAP:
+		memcpy(buffer, row, src->width * sizeof(uint32_t));
+		netpbm_get_kernels()->greyscale(buffer, src->width, src->maxval);
+		return buffer;
+	case NETPBM_ASCII_BITMAP:
+	case NETPBM_BINARY_BITMAP:
+		for (uint32_t x = 0; x < src->width; x++)
+			buffer[x] = row[x] ? 0 : 255;
+		return buffer;
+	default:
+		return row;
+	}
+}
+
+int netpbm_downsample(const netpbm_image_t *src, netpbm_image_t *dest,
+		enum NETPBM_DOWNSAMPLE filter)
+{
+	if (src->data == NULL) {
+		fprintf(stderr, "Image structure is not initialized\n");
+		return -1;
+	}
+
+	if (filter != NETPBM_DOWNSAMPLE_BOX
+		&& filter != NETPBM_DOWNSAMPLE_GAUSSIAN) {
+		fprintf(stderr, "Unknown downsampling filter\n");
+		return -1;
+	}
+
+	/* Box filter averages 2x2 pixels, Gaussian filter weights 4x4 pixels
+	 * around them with the outer product of 1 3 3 1. Pixels outside of
+	 * the image repeat the edge ones, so odd sizes are rounded up.
+	 */
+	static const uint64_t weights[2][4] = {
+		{ 0, 1, 1, 0 },
+		{ 1, 3, 3, 1 }
+	};
+	const uint64_t *w = weights[filter];
+	const uint32_t shift = filter == NETPBM_DOWNSAMPLE_BOX ? 2 : 6;
+
+	const uint32_t width = src->width / 2 + src->width % 2;
+	const uint32_t height = src->height / 2 + src->height % 2;
+	uint32_t *data = (uint32_t *) malloc((size_t)width * height
+		* sizeof(uint32_t) + 1);
+	uint32_t *buffer = (uint32_t *) malloc((size_t)src->width
+		* sizeof(uint32_t) + 1);
+	uint64_t *sums = (uint64_t *) malloc((size_t)src->width
+		* sizeof(uint64_t) + 1);
+
+	if (data == NULL || buffer == NULL || sums == NULL) {
+		fprintf(stderr, "Unable to allocate memory for downsampling\n");
+		free(data);
+		free(buffer);
+		free(sums);
+		return -1;
+	}
+
+	uint64_t trace = netpbm_trace_begin();
+
+	for (uint32_t y = 0; y < height; y++) {
+		/* Vertical pass over source rows 2y - 1 to 2y + 2 */
+		memset(sums, 0, src->width * sizeof(uint64_t));
+
+		for (int k = 0; k < 4; k++) {
+			int64_t row = 2 * (int64_t)y - 1 + k;
+
+			if (w[k] == 0)
+				continue;
+			if (row < 0)
+				row = 0;
+			if (row >= src->height)
+				row = src->height - 1;
+
+			const uint32_t *grey = grey_row(src, row, buffer);
+
+			for (uint32_t x = 0; x < src->width; x++)
+				sums[x] += w[k] * grey[x];
+		}
+
+		/* Horizontal pass, rounded to nearest */
+		uint32_t *dest_row = data + (size_t)y * width;
+		const int64_t last = src->width - 1;
+
+		for (uint32_t x = 0; x < width; x++) {
+			int64_t left = 2 * (int64_t)x - 1;
+			int64_t right = 2 * (int64_t)x + 2;
+			uint64_t sum = w[0] * sums[left < 0 ? 0 : left]
+				+ w[1] * sums[2 * x]
+				+ w[2] * sums[2 * x + 1 > last ? last : 2 * x + 1]
+				+ w[3] * sums[right > last ? last : right];
+
+			dest_row[x] = (sum + (1U << (shift - 1))) >> shift;
+		}
+	}
+
+	netpbm_trace_end("downsample", trace, 0, height);
+
+	free(buffer);
+	free(sums);
+
+	/* Levels are greymaps of the same encoding */
+	dest->type = NETPBM_TYPE_IS_ASCII(src->type) ? NETPBM_ASCII_GREYMAP
+		: NETPBM_BINARY_GREYMAP;
+	dest->maxval = src->type == NETPBM_ASCII_BITMAP
+		|| src->type == NETPBM_BINARY_BITMAP ? 255 : src->maxval;
+	dest->width = width;
+	dest->height = height;
+	dest->data = data;
+
+	return 0;
+}
+
+int netpbm_pyramid(const netpbm_image_t *img, netpbm_image_t *levels,
+		uint32_t n_levels, enum NETPBM_DOWNSAMPLE filter)
+{
+	for (uint32_t k = 0; k < n_levels; k++) {
+		if (netpbm_downsample(k == 0 ? img : &levels[k - 1], &levels[k],
+				filter) != 0) {
+			while (k-- > 0)
+				free_netpbm_image(&levels[k]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_stats.c
+ * @author Sergey Koziakov
+ * @brief statistics and thresholds of Sobel operator results
+ */
+
+#include "netpbm_gs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+uint32_t netpbm_histogram_percentile(const netpbm_histogram_t *histogram,
+		double percent)
+{
+	if (histogram->bins == NULL || histogram->pixels == 0)
+		return 0;
+
+	/* Rank of the pixel, counting from 1, that the magnitude must reach */
+	double rank = ceil(percent / 100.0 * histogram->pixels);
+	uint64_t cumulative = 0;
+
+	if (rank < 1.0)
+		rank = 1.0;
+
+	for (uint32_t b = 0; b + 1 < histogram->n_bins; b++) {
+		cumulative += histogram->bins[b];
+		if (cumulative >= rank)
+			return b;
+	}
+
+	// last bin also holds the magnitudes above it
+	return histogram->max;
+}
+
+uint32_t netpbm_histogram_otsu(const netpbm_histogram_t *histogram)
+{
+	if (histogram->bins == NULL || histogram->pixels == 0)
+		return 0;
+
+	/* Between-class variance of threshold t is
+	 * w0 * w1 * (mean0 - mean1)^2, where w0 and mean0 are weight and mean
+	 * of the magnitudes up to t, and w1, mean1 of the ones above it
+	 */
+	const double total = histogram->pixels;
+	double total_sum = 0;
+
+	for (uint32_t b = 0; b < histogram->n_bins; b++)
+		total_sum += (double)b * histogram->bins[b];
+
+	double w0 = 0;
+	double sum0 = 0;
+	double best_variance = 0;
+	uint32_t threshold = 0;
+
+	for (uint32_t b = 0; b + 1 < histogram->n_bins; b++) {
+		w0 += histogram->bins[b];
+		sum0 += (double)b * histogram->bins[b];
+
+		if (w0 == 0)
+			continue;
+
+		double w1 = total - w0;
+
+		if (w1 == 0)
+			break;
+
+		double difference = sum0 / w0 - (total_sum - sum0) / w1;
+		double variance = w0 * w1 * difference * difference;
+
+		if (variance > best_variance) {
+			best_variance = variance;
+			threshold = b;
+		}
+	}
+
+	return threshold;
+}
+
+int netpbm_histogram_free(netpbm_histogram_t *histogram)
+{
+	free(histogram->bins);
+	histogram->bins = NULL;
+	histogram->n_bins = 0;
+
+	return 0;
+}
+
+int netpbm_threshold(netpbm_image_t *img, uint32_t threshold)
+{
+	if (img->data == NULL) {
+		fprintf(stderr, "Image structure is not initialized\n");
+		return -1;
+	}
+
+	if (img->type == NETPBM_ASCII_PIXMAP || img->type == NETPBM_BINARY_PIXMAP) {
+		fprintf(stderr, "Turn image into greyscale first using -g flag\n");
+		return -1;
+	}
+
+	const size_t total_pixels = (size_t)img->width * img->height;
+	const uint32_t maxval = img->maxval;
+
+	for (size_t i = 0; i < total_pixels; i++)
+		img->data[i] = img->data[i] > threshold ? maxval : 0;
+
+	return 0;
+}
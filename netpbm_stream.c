@@ -0,0 +1,69 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_stream.c
+ * @author Sergey Koziakov
+ * @brief implementation of multi-image Netpbm streams
+ */
+
+#include "netpbm_gs.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <errno.h>
+
+int netpbm_stream_open(netpbm_stream_t *stream, char *filename,
+		const char *mode)
+{
+	int writing = (mode[0] == 'w');
+
+	stream->capacity = 0;
+	stream->count = 0;
+	stream->arena = NULL;
+
+	if (strcmp(filename, "-") == 0) {
+		stream->file = writing ? stdout : stdin;
+		return 0;
+	}
+
+	stream->file = fopen(filename, writing ? "wb" : "rb");
+
+	if (stream->file == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int netpbm_stream_close(netpbm_stream_t *stream)
+{
+	int ret = 0;
+
+	if (stream->file == stdout)
+		ret = fflush(stream->file);
+	else if (stream->file != stdin)
+		ret = fclose(stream->file);
+
+	stream->file = NULL;
+
+	return ret == 0 ? 0 : -1;
+}
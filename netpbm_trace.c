@@ -0,0 +1,252 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_trace.c
+ * @author Sergey Koziakov
+ * @brief timeline of worker and stage activity in Chrome trace format
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <time.h>
+#include <errno.h>
+
+/**
+ * @brief recorded event, written out by netpbm_trace_stop()
+ */
+struct trace_event {
+	const char *name; /**< Event or thread name, never freed */
+	char phase; /**< 'X' for complete events, 'M' for thread names */
+	long tid;
+	uint64_t start; /**< Nanoseconds since the trace started */
+	uint64_t duration;
+	int64_t first; /**< First item processed, or -1 */
+	int64_t count; /**< Amount of items processed */
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_enabled = 0;
+static FILE *trace_file = NULL;
+static uint64_t trace_origin;
+
+static struct trace_event *events = NULL;
+static size_t n_events = 0;
+static size_t events_capacity = 0;
+static size_t events_dropped = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long current_tid(void)
+{
+#ifdef SYS_gettid
+	return syscall(SYS_gettid);
+#else
+	return (long) getpid();
+#endif
+}
+
+/**
+ * @brief Helper function that stores the event, dropping it if there is
+ * no memory left
+ */
+static void add_event(const struct trace_event *event)
+{
+	pthread_mutex_lock(&trace_lock);
+
+	if (!trace_enabled)
+		goto out;
+
+	if (n_events == events_capacity) {
+		size_t capacity = events_capacity ? events_capacity * 2 : 4096;
+		struct trace_event *grown = (struct trace_event *)
+			realloc(events, capacity * sizeof(struct trace_event));
+
+		if (grown == NULL) {
+			events_dropped++;
+			goto out;
+		}
+
+		events = grown;
+		events_capacity = capacity;
+	}
+
+	events[n_events++] = *event;
+
+out:
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int netpbm_trace_start(const char *filename)
+{
+	FILE *file = fopen(filename, "w");
+
+	if (file == NULL) {
+		fprintf(stderr, "Unable to open trace file: error %d\n", errno);
+		return -1;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_file != NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		fclose(file);
+		fprintf(stderr, "Trace is already started\n");
+		return -1;
+	}
+
+	trace_file = file;
+	trace_origin = now_ns();
+	n_events = 0;
+	events_dropped = 0;
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&trace_lock);
+
+	netpbm_trace_thread("main");
+
+	return 0;
+}
+
+int netpbm_trace_stop(void)
+{
+	pthread_mutex_lock(&trace_lock);
+
+	FILE *file = trace_file;
+	int ret = 0;
+
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+	trace_file = NULL;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	if (file == NULL) {
+		fprintf(stderr, "Trace is not started\n");
+		return -1;
+	}
+
+	/* Workers have finished, so events are no longer modified */
+	const long pid = (long) getpid();
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (size_t e = 0; e < n_events; e++) {
+		const struct trace_event *event = &events[e];
+		const char *separator = e + 1 < n_events ? "," : "";
+
+		if (event->phase == 'M') {
+			fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}%s\n",
+				pid, event->tid, event->name, separator);
+			continue;
+		}
+
+		// timestamps are in microseconds
+		fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,"
+			"\"tid\":%ld,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+			event->name, pid, event->tid,
+			(unsigned long long) (event->start / 1000),
+			(unsigned) (event->start % 1000),
+			(unsigned long long) (event->duration / 1000),
+			(unsigned) (event->duration % 1000));
+
+		if (event->first >= 0)
+			fprintf(file, ",\"args\":{\"first\":%lld,\"count\":%lld}",
+				(long long) event->first, (long long) event->count);
+
+		fprintf(file, "}%s\n", separator);
+	}
+
+	fprintf(file, "]}\n");
+
+	if (ferror(file))
+		ret = -1;
+	if (fclose(file) != 0)
+		ret = -1;
+	if (ret != 0)
+		fprintf(stderr, "Error writing trace file\n");
+
+	if (events_dropped > 0)
+		fprintf(stderr, "Trace is missing %lu events, out of memory\n",
+			(unsigned long) events_dropped);
+
+	free(events);
+	events = NULL;
+	n_events = 0;
+	events_capacity = 0;
+
+	return ret;
+}
+
+uint64_t netpbm_trace_begin(void)
+{
+	if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return now_ns();
+}
+
+void netpbm_trace_end(const char *name, uint64_t start,
+		int64_t first, int64_t count)
+{
+	if (start == 0)
+		return;
+
+	const uint64_t end = now_ns();
+	struct trace_event event = {
+		.name = name,
+		.phase = 'X',
+		.tid = current_tid(),
+		// begun before the trace was restarted
+		.start = start > trace_origin ? start - trace_origin : 0,
+		.duration = end - start,
+		.first = first,
+		.count = count
+	};
+
+	add_event(&event);
+}
+
+void netpbm_trace_thread(const char *name)
+{
+	if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return;
+
+	struct trace_event event = {
+		.name = name,
+		.phase = 'M',
+		.tid = current_tid(),
+		.first = -1
+	};
+
+	add_event(&event);
+}
@@ -0,0 +1,409 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file netpbm_tune.c
+ * @author Sergey Koziakov
+ * @brief choice of thread count and task size from costs of the machine
+ */
+
+#define _GNU_SOURCE
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/** Split pool jobs into this many tasks per thread, for load balancing */
+#define TASKS_PER_THREAD 4
+/** Task should take at least this many times longer than handing it over */
+#define MIN_TASK_OVERHEADS 32
+
+/** Side of the image measured by calibration */
+#define CALIBRATION_SIZE 1024
+#define CALIBRATION_ROUNDS 5
+#define CALIBRATION_THREADS 64
+#define CALIBRATION_TASKS 256
+
+static unsigned long available_cpus = 1;
+static pthread_once_t cpus_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Helper function that reads CPU quota of the cgroup directory
+ *
+ * Both cgroup v2 cpu.max and cgroup v1 cpu.cfs_quota_us files are tried.
+ *
+ * @return amount of CPUs the quota allows, or 0 if there is no quota
+ */
+static unsigned long read_cpu_quota(const char *dir)
+{
+	char path[4096];
+	long long quota = -1, period = 0;
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/cpu.max", dir);
+	if ((file = fopen(path, "r")) != NULL) {
+		// "max 100000" when there is no quota
+		if (fscanf(file, "%lld %lld", &quota, &period) != 2)
+			quota = -1;
+		fclose(file);
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+		if ((file = fopen(path, "r")) != NULL) {
+			if (fscanf(file, "%lld", &quota) != 1)
+				quota = -1;
+			fclose(file);
+		}
+
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if ((file = fopen(path, "r")) != NULL) {
+			if (fscanf(file, "%lld", &period) != 1)
+				period = 0;
+			fclose(file);
+		}
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+
+	// partial CPU still lets one thread run
+	return (unsigned long)((quota + period - 1) / period);
+}
+
+/**
+ * @brief Helper function that finds CPU quota of the process cgroup
+ *
+ * Cgroup path from /proc/self/cgroup is looked up under the usual mount
+ * points. Inside of a container, its cgroup is usually mounted as the
+ * root, so the root is tried too.
+ *
+ * @return amount of CPUs the quota allows, or 0 if there is no quota
+ */
+static unsigned long cgroup_cpu_limit(void)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	char line[4096];
+	unsigned long limit = 0;
+
+	if (file == NULL)
+		return 0;
+
+	while (limit == 0 && fgets(line, sizeof(line), file) != NULL) {
+		// "id:controllers:path", controllers are empty for cgroup v2
+		char *controllers = strchr(line, ':');
+		char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+
+		if (path == NULL)
+			continue;
+
+		*path++ = '\0';
+		controllers++;
+		path[strcspn(path, "\n")] = '\0';
+
+		const char *mounts[3] = { NULL, NULL, NULL };
+
+		if (*controllers == '\0') {
+			mounts[0] = "/sys/fs/cgroup";
+		} else if (strcmp(controllers, "cpu") == 0
+			|| strncmp(controllers, "cpu,", 4) == 0
+			|| strstr(controllers, ",cpu,") != NULL) {
+			mounts[0] = "/sys/fs/cgroup/cpu";
+			mounts[1] = "/sys/fs/cgroup/cpu,cpuacct";
+		}
+
+		for (int m = 0; limit == 0 && m < 3 && mounts[m] != NULL; m++) {
+			char dir[4096 + 64];
+
+			snprintf(dir, sizeof(dir), "%s%s", mounts[m],
+				strcmp(path, "/") == 0 ? "" : path);
+			limit = read_cpu_quota(dir);
+
+			if (limit == 0 && strcmp(path, "/") != 0)
+				limit = read_cpu_quota(mounts[m]);
+		}
+	}
+
+	fclose(file);
+
+	return limit;
+}
+
+static void find_available_cpus(void)
+{
+	cpu_set_t set;
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+	available_cpus = online > 0 ? (unsigned long) online : 1;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		available_cpus = CPU_COUNT(&set);
+
+	unsigned long limit = cgroup_cpu_limit();
+
+	if (limit > 0 && limit < available_cpus)
+		available_cpus = limit;
+}
+
+unsigned long netpbm_available_cpus(void)
+{
+	pthread_once(&cpus_once, find_available_cpus);
+	return available_cpus;
+}
+
+void netpbm_tuning_default(netpbm_tuning_t *tuning)
+{
+	tuning->pixel_ns = 1.0;
+	tuning->thread_ns = 30000.0;
+	tuning->task_ns = 5000.0;
+}
+
+static double elapsed_ns(const struct timespec *start,
+		const struct timespec *finish)
+{
+	return (finish->tv_sec - start->tv_sec) * 1e9
+		+ (finish->tv_nsec - start->tv_nsec);
+}
+
+static void *empty_task(void *arguments)
+{
+	return arguments;
+}
+
+int netpbm_tuning_calibrate(netpbm_tuning_t *tuning)
+{
+	const size_t pixels = (size_t)CALIBRATION_SIZE * CALIBRATION_SIZE;
+	uint32_t *source = (uint32_t *) malloc(sizeof(uint32_t) * pixels);
+	netpbm_image_t img = {
+		.type = NETPBM_BINARY_GREYMAP,
+		.maxval = 255,
+		.height = CALIBRATION_SIZE,
+		.width = CALIBRATION_SIZE,
+		.data = (uint32_t *) malloc(sizeof(uint32_t) * pixels)
+	};
+	netpbm_pool_t *pool = netpbm_pool_create(1);
+	struct timespec start, finish;
+	int ret = -1;
+
+	if (source == NULL || img.data == NULL || pool == NULL) {
+		fprintf(stderr, "Unable to allocate memory for calibration\n");
+		goto out;
+	}
+
+	/* Noise, so that no tile is skipped as uniform */
+	uint32_t seed = 1;
+
+	for (size_t i = 0; i < pixels; i++) {
+		seed = seed * 1103515245U + 12345U;
+		source[i] = (seed >> 16) & 0xff;
+	}
+
+	/* Sobel operator on a pool thread, without thread creation */
+	netpbm_sobel_opts_t opts = { .n_threads = 1, .pool = pool };
+	double best = INFINITY;
+
+	for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+		memcpy(img.data, source, sizeof(uint32_t) * pixels);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (netpbm_sobel_ext(&img, &opts) != 0)
+			goto out;
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+
+		if (elapsed_ns(&start, &finish) < best)
+			best = elapsed_ns(&start, &finish);
+	}
+
+	tuning->pixel_ns = best / pixels;
+
+	/* Starting and joining a thread */
+	best = INFINITY;
+
+	for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (int t = 0; t < CALIBRATION_THREADS; t++) {
+			pthread_t thread;
+
+			if (pthread_create(&thread, NULL, empty_task, NULL) != 0) {
+				fprintf(stderr, "Unable to create thread!\n");
+				goto out;
+			}
+			pthread_join(thread, NULL);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+
+		if (elapsed_ns(&start, &finish) < best)
+			best = elapsed_ns(&start, &finish);
+	}
+
+	tuning->thread_ns = best / CALIBRATION_THREADS;
+
+	/* Handing a task to a sleeping pool thread and waiting for it */
+	best = INFINITY;
+
+	for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+		uint8_t arg;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (int t = 0; t < CALIBRATION_TASKS; t++)
+			netpbm_pool_run(pool, empty_task, &arg, sizeof(arg), 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &finish);
+
+		if (elapsed_ns(&start, &finish) < best)
+			best = elapsed_ns(&start, &finish);
+	}
+
+	tuning->task_ns = best / CALIBRATION_TASKS;
+
+	ret = 0;
+
+out:
+	netpbm_pool_destroy(pool);
+	free(img.data);
+	free(source);
+
+	return ret;
+}
+
+int netpbm_tuning_load(netpbm_tuning_t *tuning, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	char line[256];
+	netpbm_tuning_t loaded = { 0, 0, 0 };
+
+	if (file == NULL) {
+		if (errno == ENOENT)
+			return 1;
+
+		fprintf(stderr, "Unable to open tuning profile: error %d\n", errno);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char key[64];
+		double value;
+
+		if (line[0] == '#' || sscanf(line, "%63s %lf", key, &value) != 2)
+			continue;
+
+		if (strcmp(key, "pixel_ns") == 0)
+			loaded.pixel_ns = value;
+		else if (strcmp(key, "thread_ns") == 0)
+			loaded.thread_ns = value;
+		else if (strcmp(key, "task_ns") == 0)
+			loaded.task_ns = value;
+	}
+
+	fclose(file);
+
+	if (!(loaded.pixel_ns > 0 && loaded.thread_ns > 0 && loaded.task_ns > 0)) {
+		fprintf(stderr, "Tuning profile %s is invalid\n", path);
+		return -1;
+	}
+
+	*tuning = loaded;
+
+	return 0;
+}
+
+int netpbm_tuning_save(const netpbm_tuning_t *tuning, const char *path)
+{
+	char tmp_path[4096];
+
+	if ((size_t) snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path,
+			(long) getpid()) >= sizeof(tmp_path)) {
+		fprintf(stderr, "Tuning profile path is too long\n");
+		return -1;
+	}
+
+	FILE *file = fopen(tmp_path, "w");
+
+	if (file == NULL) {
+		fprintf(stderr, "Unable to open file: error %d\n", errno);
+		return -1;
+	}
+
+	fprintf(file, "# ngsobel tuning profile\n"
+		"pixel_ns %.6f\n"
+		"thread_ns %.1f\n"
+		"task_ns %.1f\n",
+		tuning->pixel_ns, tuning->thread_ns, tuning->task_ns);
+
+	if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+		fprintf(stderr, "Unable to store tuning profile: error %d\n", errno);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void netpbm_sobel_tune(const netpbm_tuning_t *tuning,
+		const netpbm_image_t *img, netpbm_sobel_opts_t *opts)
+{
+	const size_t pixels = (size_t)img->width * img->height;
+	const double work_ns = pixels * tuning->pixel_ns;
+	const unsigned long cpus = netpbm_available_cpus();
+
+	if (opts->pool == NULL) {
+		/* Time of work / n + n * thread_ns is the lowest at
+		 * n = sqrt(work / thread_ns)
+		 */
+		double best = sqrt(work_ns / tuning->thread_ns);
+
+		opts->n_threads = best < 1.0 ? 1
+			: best > cpus ? cpus : (unsigned long)(best + 0.5);
+		opts->chunk = 0;
+		return;
+	}
+
+	opts->n_threads = netpbm_pool_size(opts->pool);
+
+	/* Enough tasks to balance the load, as long as each of them is
+	 * much longer than handing it over
+	 */
+	double max_tasks = (double)TASKS_PER_THREAD
+		* (opts->n_threads < cpus ? opts->n_threads : cpus);
+	double tasks = work_ns / (MIN_TASK_OVERHEADS * tuning->task_ns);
+
+	if (tasks > max_tasks)
+		tasks = max_tasks;
+	if (tasks < 1.0)
+		tasks = 1.0;
+
+	size_t chunk = (size_t)ceil(pixels / tasks);
+
+	// whole rows keep spans of the kernels long
+	if (chunk > img->width && img->width > 0)
+		chunk = (chunk + img->width - 1) / img->width * img->width;
+
+	opts->chunk = chunk > 0 ? chunk : 1;
+}
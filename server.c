@@ -0,0 +1,524 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file server.c
+ * @author Sergey Koziakov
+ * @brief implementation of ngsobel server and client
+ */
+
+#include "server.h"
+#include "netpbm_gs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+
+/** Amount of threads reading requests and writing responses */
+#define N_HANDLERS 4
+/** Amount of accepted connections waiting for a handler */
+#define QUEUE_SIZE 64
+/** Seconds a client may stay silent, or not read the response */
+#define CONNECTION_TIMEOUT_S 10
+/** How often the accepting thread waiting for the queue checks for stop */
+#define STOP_POLL_NS 100000000
+
+/**
+ * @brief bounded queue of accepted connections
+ */
+struct conn_queue {
+	int fds[QUEUE_SIZE];
+	size_t head; /**< Index of the oldest connection */
+	size_t count;
+	int stopping; /**< Handlers exit, connections left are closed */
+
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+};
+
+/**
+ * @brief state shared by handler threads
+ */
+struct server {
+	struct conn_queue queue;
+	netpbm_pool_t *pool;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig)
+{
+	(void) sig;
+	stop_requested = 1;
+}
+
+/**
+ * @brief Helper function that queues accepted connection
+ *
+ * @return 0 if connection was queued, -1 if server stopped waiting for
+ * space in the queue
+ */
+static int queue_push(struct conn_queue *q, int fd)
+{
+	pthread_mutex_lock(&q->lock);
+
+	/* Backpressure: wait for handlers to free some space. Signals don't
+	 * wake the wait, so stop is checked periodically
+	 */
+	while (q->count == QUEUE_SIZE && !stop_requested) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += STOP_POLL_NS;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+
+		pthread_cond_timedwait(&q->not_full, &q->lock, &deadline);
+	}
+
+	if (q->count == QUEUE_SIZE) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	q->fds[(q->head + q->count) % QUEUE_SIZE] = fd;
+	q->count++;
+
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+/**
+ * @return descriptor of the connection, or -1 if the server stops
+ */
+static int queue_pop(struct conn_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while (q->count == 0 && !q->stopping)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+
+	if (q->stopping) {
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	int fd = q->fds[q->head];
+	q->head = (q->head + 1) % QUEUE_SIZE;
+	q->count--;
+
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+
+	return fd;
+}
+
+/**
+ * @brief Helper function that lets handlers exit after their current
+ * connections, and closes the ones still queued once they did
+ */
+static void queue_stop(struct conn_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->stopping = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * @brief Helper function that reads one line of the request
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int read_line(FILE *in, char *line, size_t size)
+{
+	if (fgets(line, size, in) == NULL)
+		return -1;
+
+	size_t len = strlen(line);
+	if (len == 0 || line[len - 1] != '\n')
+		return -1;
+
+	line[len - 1] = '\0';
+	return 0;
+}
+
+/**
+ * @brief Helper function that serves one connection
+ *
+ * Image and scratch buffers are kept between requests served by the same
+ * handler.
+ */
+static void serve_connection(struct server *srv, int fd,
+		netpbm_image_t *image, size_t *capacity, netpbm_arena_t *arena)
+{
+	FILE *in = fdopen(fd, "rb");
+	int out_fd = dup(fd);
+	FILE *out = out_fd >= 0 ? fdopen(out_fd, "wb") : NULL;
+
+	char options[64];
+	char ifilename[PATH_MAX + 1];
+	char ofilename[PATH_MAX + 1];
+	int do_greyscale = 0;
+	int do_sobel = 0;
+	const char *error = NULL;
+
+	if (in == NULL || out == NULL) {
+		if (in != NULL)
+			fclose(in);
+		else
+			close(fd);
+		if (out_fd >= 0)
+			close(out_fd);
+		return;
+	}
+
+	if (read_line(in, options, sizeof(options)) != 0
+		|| read_line(in, ifilename, sizeof(ifilename)) != 0
+		|| read_line(in, ofilename, sizeof(ofilename)) != 0
+		|| sscanf(options, "greyscale=%d sobel=%d",
+			&do_greyscale, &do_sobel) != 2
+	) {
+		error = "Malformed request";
+		goto respond;
+	}
+
+	netpbm_stream_t istream = { .file = in };
+
+	if (strcmp(ifilename, "-") != 0
+		&& netpbm_stream_open(&istream, ifilename, "r") != 0) {
+		error = "Unable to open input file";
+		goto respond;
+	}
+
+	istream.capacity = *capacity;
+	istream.arena = arena;
+	int read_ret = netpbm_stream_read(&istream, image);
+	*capacity = istream.capacity;
+
+	if (istream.file != in)
+		netpbm_stream_close(&istream);
+
+	if (read_ret != 1) {
+		error = "Unable to read image";
+		goto respond;
+	}
+
+	if (do_greyscale && netpbm_to_greyscale(image) != 0) {
+		error = "Unable to turn image into greyscale";
+		goto respond;
+	}
+
+	netpbm_sobel_opts_t sobel_opts = {
+		.n_threads = 0,
+		.pool = srv->pool,
+		.arena = arena
+	};
+
+	if (do_sobel && netpbm_sobel_ext(image, &sobel_opts) != 0) {
+		error = "Unable to apply Sobel operator";
+		goto respond;
+	}
+
+	if (strcmp(ofilename, "-") != 0
+		&& write_netpbm_file(ofilename, image) != 0) {
+		error = "Unable to write output file";
+		goto respond;
+	}
+
+respond:
+	if (error != NULL) {
+		fprintf(out, "ERR %s\n", error);
+	} else {
+		fprintf(out, "OK\n");
+
+		if (strcmp(ofilename, "-") == 0) {
+			netpbm_stream_t ostream = { .file = out, .arena = arena };
+			netpbm_stream_write(&ostream, image);
+		}
+	}
+
+	fclose(out);
+	fclose(in);
+}
+
+static void *handler_task(void *arguments)
+{
+	struct server *srv = (struct server *) arguments;
+	netpbm_image_t image = { .data = NULL };
+	size_t capacity = 0;
+	netpbm_arena_t *arena = netpbm_arena_create(0);
+	int fd;
+
+	// connections are still served without the arena if it couldn't
+	// be created
+	while ((fd = queue_pop(&srv->queue)) >= 0)
+		serve_connection(srv, fd, &image, &capacity, arena);
+
+	if (arena != NULL)
+		netpbm_arena_destroy(arena);
+	else if (image.data != NULL)
+		free_netpbm_image(&image);
+
+	return NULL;
+}
+
+int server_run(const char *socket_path, unsigned long n_threads)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct server srv = { .pool = NULL };
+	pthread_t handlers[N_HANDLERS];
+	size_t n_handlers = 0;
+	int ret = -1;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		fprintf(stderr, "Unable to create socket: error %d\n", errno);
+		return -1;
+	}
+
+	// remove socket left by a previous server, but never a regular file
+	struct stat st;
+	if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path);
+
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+		|| listen(lfd, QUEUE_SIZE) != 0) {
+		fprintf(stderr, "Unable to listen on socket: error %d\n", errno);
+		close(lfd);
+		return -1;
+	}
+
+	pthread_mutex_init(&srv.queue.lock, NULL);
+	pthread_cond_init(&srv.queue.not_empty, NULL);
+	pthread_cond_init(&srv.queue.not_full, NULL);
+
+	/* Only the accepting thread handles signals, so that accept() is
+	 * interrupted by them. Threads inherit the blocked mask.
+	 */
+	sigset_t stop_signals, old_mask;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+	srv.pool = netpbm_pool_create(n_threads);
+
+	for (; srv.pool != NULL && n_handlers < N_HANDLERS; n_handlers++) {
+		if (pthread_create(&handlers[n_handlers], NULL,
+				handler_task, (void *) &srv) != 0)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (n_handlers != N_HANDLERS) {
+		fprintf(stderr, "Unable to start server threads\n");
+		goto out;
+	}
+
+	struct sigaction sa = { .sa_handler = handle_stop };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	// clients may disconnect before reading the response
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("Listening on %s\n", socket_path);
+	fflush(stdout);
+
+	while (!stop_requested) {
+		int cfd = accept(lfd, NULL, NULL);
+
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Unable to accept connection: error %d\n", errno);
+			break;
+		}
+
+		/* Silent clients would hold handlers forever, and ones that
+		 * don't read the response would block them on writing
+		 */
+		struct timeval timeout = { .tv_sec = CONNECTION_TIMEOUT_S };
+
+		setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		if (queue_push(&srv.queue, cfd) != 0)
+			close(cfd);
+	}
+
+	ret = 0;
+
+out:
+	// handlers finish their connections within the timeouts
+	queue_stop(&srv.queue);
+	for (size_t h = 0; h < n_handlers; h++)
+		pthread_join(handlers[h], NULL);
+
+	for (; srv.queue.count > 0; srv.queue.count--) {
+		close(srv.queue.fds[srv.queue.head]);
+		srv.queue.head = (srv.queue.head + 1) % QUEUE_SIZE;
+	}
+
+	netpbm_pool_destroy(srv.pool);
+
+	pthread_cond_destroy(&srv.queue.not_full);
+	pthread_cond_destroy(&srv.queue.not_empty);
+	pthread_mutex_destroy(&srv.queue.lock);
+
+	close(lfd);
+	unlink(socket_path);
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that copies everything from one file to another
+ */
+static int copy_stream(FILE *from, FILE *to)
+{
+	char buffer[1 << 16];
+	size_t n;
+
+	while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+		if (fwrite(buffer, 1, n, to) != n)
+			return -1;
+	}
+
+	return ferror(from) ? -1 : 0;
+}
+
+/**
+ * @brief Helper function that makes path absolute, since server may
+ * run in another directory
+ */
+static int absolute_path(const char *path, char *out, size_t size)
+{
+	if (strcmp(path, "-") == 0 || path[0] == '/') {
+		if ((size_t) snprintf(out, size, "%s", path) >= size)
+			return -1;
+		return 0;
+	}
+
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+
+	if ((size_t) snprintf(out, size, "%s/%s", cwd, path) >= size)
+		return -1;
+
+	return 0;
+}
+
+int client_request(const char *socket_path, const char *ifilename,
+		const char *ofilename, int do_greyscale, int do_sobel)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char ipath[PATH_MAX + 1];
+	char opath[PATH_MAX + 1];
+	char status[256];
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	if (absolute_path(ifilename, ipath, sizeof(ipath)) != 0
+		|| absolute_path(ofilename, opath, sizeof(opath)) != 0) {
+		fprintf(stderr, "File path is too long\n");
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "Unable to connect to server: error %d\n", errno);
+		close(fd);
+		return -1;
+	}
+
+	FILE *in = fdopen(fd, "rb");
+	FILE *out = fdopen(dup(fd), "wb");
+	int ret = -1;
+
+	if (in == NULL || out == NULL)
+		goto out;
+
+	fprintf(out, "greyscale=%d sobel=%d\n%s\n%s\n",
+		do_greyscale ? 1 : 0, do_sobel ? 1 : 0, ipath, opath);
+
+	if (strcmp(ipath, "-") == 0 && copy_stream(stdin, out) != 0)
+		goto out;
+
+	if (fflush(out) != 0)
+		goto out;
+	shutdown(fileno(out), SHUT_WR);
+
+	if (fgets(status, sizeof(status), in) == NULL) {
+		fprintf(stderr, "Server closed connection\n");
+		goto out;
+	}
+
+	if (strcmp(status, "OK\n") != 0) {
+		fprintf(stderr, "Server error: %s", status);
+		goto out;
+	}
+
+	if (strcmp(opath, "-") == 0 && copy_stream(in, stdout) != 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	if (out != NULL)
+		fclose(out);
+	if (in != NULL)
+		fclose(in);
+	else
+		close(fd);
+
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file server.h
+ * @author Sergey Koziakov
+ * @brief declares ngsobel server and client over a Unix domain socket
+ *
+ * Protocol is line-based. Client sends three lines:
+ * -- "greyscale=N sobel=N" with N being 0 or 1,
+ * -- input file path, or "-" if image data follows the request,
+ * -- output file path, or "-" to receive image data in the response.
+ *
+ * Server answers with "OK" or "ERR message" line, followed by the
+ * resulting image if the output was "-". Each connection carries one
+ * request.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/**
+ * @brief run ngsobel server until SIGINT or SIGTERM
+ *
+ * Connections are put into a bounded queue, and served by a fixed set of
+ * handler threads. When the queue is full, server stops accepting new
+ * connections until handlers catch up. Sobel operator runs on a pool of
+ * n_threads persistent threads shared by all handlers.
+ *
+ * @param[in] socket_path - path of the Unix socket to listen on
+ * @param[in] n_threads - amount of Sobel worker threads
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int server_run(const char *socket_path, unsigned long n_threads);
+
+/**
+ * @brief send request to the ngsobel server and wait for the response
+ *
+ * @param[in] socket_path - path of the server socket
+ * @param[in] ifilename - input file path, or "-" to send stdin
+ * @param[in] ofilename - output file path, or "-" to receive to stdout
+ * @param[in] do_greyscale - turn image to greyscale
+ * @param[in] do_sobel - apply Sobel operator
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+int client_request(const char *socket_path, const char *ifilename,
+		const char *ofilename, int do_greyscale, int do_sobel);
+
+#endif // SERVER_H
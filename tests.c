@@ -0,0 +1,2277 @@
+/*
+ * NetPBM to Grayscale with Sobel algorithm
+ * Copyright (C) 2019 Sergey Koziakov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/**
+ * @file tests.c
+ * @author Sergey Koziakov
+ * @brief differential tests of the optimized paths and performance gate
+ *
+ * Every reader, writer, greyscale conversion and Sobel operator variant
+ * is run on random and edge case images with each available instruction
+ * set, and its result is compared bit for bit with straightforward
+ * reference code built on apply_kernel(). Throughput of the hot paths is
+ * then compared with a baseline recorded by -B.
+ */
+
+#include "netpbm_gs.h"
+#include "netpbm_gs_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+/* Percents of throughput that may be lost before the gate fails */
+#define DEFAULT_TOLERANCE 25.0
+
+/* Runs of every benchmark, the best one is taken */
+#define PERF_RUNS 7
+
+#define MAX_BASELINE 32
+
+/* Options of encode_image() */
+#define ENCODE_HEADER 0x1
+#define ENCODE_NOISE 0x2
+
+enum PATTERN {
+	PATTERN_RANDOM = 0, /**< Random values */
+	PATTERN_ZERO = 1, /**< All zero */
+	PATTERN_MAX = 2, /**< All maxval */
+	PATTERN_BLOCKS = 3, /**< Uniform blocks with a few random pixels */
+	PATTERNS = 4
+};
+
+static const char *pattern_names[PATTERNS] = {
+	"random", "zero", "max", "blocks"
+};
+
+/* Single pixels and rows or columns, sizes around vector widths, words
+ * of packed bitmaps and tiles
+ */
+static const uint32_t sizes[][2] = {
+	{ 1, 1 }, { 1, 7 }, { 7, 1 }, { 2, 2 }, { 3, 3 }, { 8, 5 },
+	{ 17, 4 }, { 31, 17 }, { 33, 65 }, { 64, 3 }, { 65, 9 },
+	{ 127, 5 }, { 257, 40 }, { 3, 150 }
+};
+
+#define N_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static const char *kernel_sets[] = { "scalar", "sse2", "avx2", "avx512" };
+
+#define N_KERNEL_SETS (sizeof(kernel_sets) / sizeof(kernel_sets[0]))
+
+/**
+ * @brief way of running the Sobel operator
+ */
+struct sobel_config {
+	unsigned long n_threads;
+	int pool; /**< Use the shared pool */
+	size_t chunk; /**< Task size with the pool */
+	int arena; /**< Reuse buffers of the shared arena */
+	int output; /**< Store results to a file from the workers */
+	int pin; /**< Workers pad their own bands, pinned to CPUs */
+};
+
+static const struct sobel_config sobel_configs[] = {
+	{ 1, 0, 0, 0, 0, 0 },
+	{ 2, 0, 0, 0, 0, 0 },
+	{ 3, 0, 0, 1, 0, 0 },
+	{ 7, 0, 0, 0, 1, 0 },
+	{ 0, 1, 0, 0, 0, 0 },
+	{ 0, 1, 37, 1, 0, 0 },
+	{ 2, 1, 37, 0, 1, 0 },
+	{ 3, 0, 0, 1, 0, 1 },
+	{ 0, 1, 37, 0, 0, 1 }
+};
+
+#define N_SOBEL_CONFIGS (sizeof(sobel_configs) / sizeof(sobel_configs[0]))
+
+static const uint32_t x_kernel[] = {
+	-1, 0, 1,
+	-2, 0, 2,
+	-1, 0, 1
+};
+
+static const uint32_t y_kernel[] = {
+	-1, -2, -1,
+	0, 0, 0,
+	1, 2, 1
+};
+
+static char *work_dir = "test_out";
+static size_t checks;
+static size_t failures;
+static uint64_t random_state = 0x2545f4914f6cdd1dULL;
+
+static netpbm_pool_t *pool;
+static netpbm_arena_t *arena;
+
+/**
+ * @brief Helper function that returns next pseudo-random number
+ *
+ * Sequence is fixed, so that failures can be reproduced.
+ */
+static uint32_t random_u32(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+
+	return (uint32_t)(random_state >> 32);
+}
+
+static uint32_t random_below(uint32_t n)
+{
+	return n == 0 ? 0 : random_u32() % n;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Helper function that counts the check and reports its failure
+ *
+ * @param[in] ok - whether the check passed
+ * @param[in] format - printf() format of the failure description
+ *
+ * @return 0 if check passed, -1 otherwise
+ */
+static int check(int ok, const char *format, ...)
+{
+	checks++;
+	if (ok)
+		return 0;
+
+	va_list args;
+
+	failures++;
+	fprintf(stderr, "FAIL: ");
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+
+	return -1;
+}
+
+static void temp_path(char *path, size_t size, const char *name)
+{
+	snprintf(path, size, "%s/ngtests_%s", work_dir, name);
+}
+
+static int alloc_image(netpbm_image_t *img, enum NETPBM_TYPE type,
+		uint32_t width, uint32_t height, uint32_t maxval)
+{
+	img->type = type;
+	img->width = width;
+	img->height = height;
+	img->maxval = maxval;
+	img->data = (uint32_t *) calloc((size_t)width * height + 1,
+		sizeof(uint32_t));
+
+	if (img->data == NULL) {
+		fprintf(stderr, "Unable to allocate memory for image\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int copy_image(const netpbm_image_t *src, netpbm_image_t *dest)
+{
+	if (alloc_image(dest, src->type, src->width, src->height,
+		src->maxval) != 0)
+		return -1;
+
+	memcpy(dest->data, src->data,
+		(size_t)src->width * src->height * sizeof(uint32_t));
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that returns pixel value as it is read from
+ * the file: 0 or 1 for P1, 0 or 255 for P4, packed channels for pixmaps
+ */
+static uint32_t random_value(const netpbm_image_t *img)
+{
+	switch (img->type) {
+	case NETPBM_ASCII_BITMAP:
+		return random_below(2);
+	case NETPBM_BINARY_BITMAP:
+		return random_below(2) * 255;
+	case NETPBM_ASCII_PIXMAP:
+	case NETPBM_BINARY_PIXMAP:
+		return random_below(img->maxval + 1)
+			| random_below(img->maxval + 1) << 8
+			| random_below(img->maxval + 1) << 16;
+	default:
+		return random_below(img->maxval + 1);
+	}
+}
+
+static uint32_t max_value(const netpbm_image_t *img)
+{
+	switch (img->type) {
+	case NETPBM_BINARY_BITMAP:
+		return 255;
+	case NETPBM_ASCII_PIXMAP:
+	case NETPBM_BINARY_PIXMAP:
+		return img->maxval * 0x010101;
+	default:
+		return img->maxval;
+	}
+}
+
+static void fill_image(netpbm_image_t *img, enum PATTERN pattern)
+{
+	const size_t total_pixels = (size_t)img->width * img->height;
+	uint32_t blocks[4];
+
+	for (int i = 0; i < 4; i++)
+		blocks[i] = random_value(img);
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint32_t x = i % img->width;
+		uint32_t y = i / img->width;
+
+		switch (pattern) {
+		case PATTERN_RANDOM:
+			img->data[i] = random_value(img);
+			break;
+		case PATTERN_ZERO:
+			img->data[i] = 0;
+			break;
+		case PATTERN_MAX:
+			img->data[i] = max_value(img);
+			break;
+		default:
+			img->data[i] = random_below(256) == 0 ? random_value(img)
+				: blocks[(x / 40 + 3 * (y / 40)) % 4];
+			break;
+		}
+	}
+}
+
+static const char *separator(int flags)
+{
+	static const char *noise[] = { " ", "\n", "\t ", "  \n" };
+
+	return flags & ENCODE_NOISE ? noise[random_below(4)] : " ";
+}
+
+/**
+ * @brief Helper function that encodes image the way the writers should
+ *
+ * Values above maxval are clamped in ASCII bitmaps and greymaps, and
+ * truncated to a byte in binary greymaps, non-zero values set P4 bits.
+ * With ENCODE_NOISE, the header has a comment, values are separated by
+ * various whitespace and unused bits of P4 rows are random, which the
+ * readers must accept.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int encode_image(const netpbm_image_t *img, int flags, FILE *file)
+{
+	if (flags & ENCODE_HEADER) {
+		if (flags & ENCODE_NOISE)
+			fprintf(file, "P%d\n# ngtests\n%u %u\n", img->type,
+				img->width, img->height);
+		else
+			fprintf(file, "P%d\n%u\n%u\n", img->type, img->width,
+				img->height);
+
+		if (img->type != NETPBM_ASCII_BITMAP
+			&& img->type != NETPBM_BINARY_BITMAP)
+			fprintf(file, "%u\n", img->maxval);
+	}
+
+	if (img->type == NETPBM_BINARY_BITMAP) {
+		for (uint32_t y = 0; y < img->height; y++) {
+			const uint32_t *row = img->data + (size_t)y * img->width;
+
+			for (uint32_t x = 0; x < img->width; x += 8) {
+				uint8_t byte = 0;
+
+				for (uint32_t bit = 0; bit < 8; bit++) {
+					int set = x + bit < img->width ? row[x + bit] != 0
+						: (flags & ENCODE_NOISE) && random_below(2);
+
+					if (set)
+						byte |= 0x80 >> bit;
+				}
+				fputc(byte, file);
+			}
+		}
+
+		return ferror(file) ? -1 : 0;
+	}
+
+	const size_t total_pixels = (size_t)img->width * img->height;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint32_t value = img->data[i];
+
+		switch (img->type) {
+		case NETPBM_ASCII_BITMAP:
+		case NETPBM_ASCII_GREYMAP:
+			fprintf(file, "%u%s", value > img->maxval ? img->maxval : value,
+				separator(flags));
+			break;
+		case NETPBM_ASCII_PIXMAP:
+			if (flags & ENCODE_NOISE)
+				fprintf(file, "%u%s%u%s%u%s", NETPBM_RED(value),
+					separator(flags), NETPBM_GREEN(value),
+					separator(flags), NETPBM_BLUE(value),
+					separator(flags));
+			else
+				fprintf(file, "%u %u %u\n", NETPBM_RED(value),
+					NETPBM_GREEN(value), NETPBM_BLUE(value));
+			break;
+		case NETPBM_BINARY_GREYMAP:
+			fputc(value & 0xff, file);
+			break;
+		case NETPBM_BINARY_PIXMAP:
+			fputc(NETPBM_RED(value), file);
+			fputc(NETPBM_GREEN(value), file);
+			fputc(NETPBM_BLUE(value), file);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return ferror(file) ? -1 : 0;
+}
+
+static int encode_file(char *filename, const netpbm_image_t *img, int flags)
+{
+	FILE *ofile = fopen(filename, "wb");
+
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to open file %s\n", filename);
+		return -1;
+	}
+
+	int ret = encode_image(img, flags, ofile);
+
+	if (fclose(ofile) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that appends encoded image to the buffer
+ *
+ * @param[in,out] buffer - buffer allocated with malloc(), or NULL
+ * @param[in,out] size - bytes in the buffer
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int encode_buffer(const netpbm_image_t *img, int flags,
+		char **buffer, size_t *size)
+{
+	char *encoded = NULL;
+	size_t encoded_size = 0;
+	FILE *file = open_memstream(&encoded, &encoded_size);
+
+	if (file == NULL)
+		return -1;
+
+	int ret = encode_image(img, flags, file);
+
+	if (fclose(file) != 0 || ret != 0)
+		goto error;
+
+	char *grown = (char *) realloc(*buffer, *size + encoded_size + 1);
+
+	if (grown == NULL)
+		goto error;
+
+	memcpy(grown + *size, encoded, encoded_size);
+	*buffer = grown;
+	*size += encoded_size;
+	free(encoded);
+
+	return 0;
+
+error:
+	free(encoded);
+	return -1;
+}
+
+/**
+ * @brief Helper function that compares file with the expected contents
+ *
+ * @return 0 if they are equal, -1 otherwise
+ */
+static int check_file(char *filename, const char *expected, size_t size,
+		const char *what)
+{
+	FILE *ifile = fopen(filename, "rb");
+
+	if (ifile == NULL)
+		return check(0, "%s: unable to open %s", what, filename);
+
+	size_t offset = 0;
+	int byte;
+
+	while ((byte = fgetc(ifile)) != EOF) {
+		if (offset >= size || (char) byte != expected[offset])
+			break;
+		offset++;
+	}
+
+	int at_end = byte == EOF && offset == size;
+
+	fclose(ifile);
+
+	return check(at_end, "%s: %s differs at byte %zu of %zu", what,
+		filename, offset, size);
+}
+
+static int check_data(const uint32_t *expected, const uint32_t *actual,
+		uint32_t width, uint32_t height, const char *what)
+{
+	const size_t total_pixels = (size_t)width * height;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		if (expected[i] != actual[i])
+			return check(0, "%s: pixel %zu,%zu is %u, expected %u",
+				what, i % width, i / width, actual[i], expected[i]);
+	}
+
+	return check(1, "%s", what);
+}
+
+static int check_image(const netpbm_image_t *expected,
+		const netpbm_image_t *actual, const char *what)
+{
+	if (expected->type != actual->type
+		|| expected->width != actual->width
+		|| expected->height != actual->height
+		|| expected->maxval != actual->maxval
+		|| actual->data == NULL)
+		return check(0, "%s: got P%d %ux%u maxval %u, expected "
+			"P%d %ux%u maxval %u", what, actual->type, actual->width,
+			actual->height, actual->maxval, expected->type,
+			expected->width, expected->height, expected->maxval);
+
+	return check_data(expected->data, actual->data, expected->width,
+		expected->height, what);
+}
+
+/**
+ * @brief Helper function that compares packed bitmap with the image
+ *
+ * Bits are set where the image is not zero. Words around the rows, rows
+ * around the image and bits past the width must be zero.
+ */
+static int check_bitmap(const netpbm_bitmap_t *bmp,
+		const netpbm_image_t *expected, const char *what)
+{
+	if (bmp->width != expected->width || bmp->height != expected->height
+		|| bmp->data == NULL)
+		return check(0, "%s: got bitmap %ux%u, expected %ux%u", what,
+			bmp->width, bmp->height, expected->width, expected->height);
+
+	const size_t words = bmp->stride - 2;
+
+	for (size_t i = 0; i < bmp->stride; i++) {
+		if (bmp->data[i] != 0 || bmp->data[(bmp->height + 1)
+			* bmp->stride + i] != 0)
+			return check(0, "%s: padding rows are not zero", what);
+	}
+
+	for (uint32_t y = 0; y < bmp->height; y++) {
+		const uint64_t *row = bmp->data + (y + 1) * bmp->stride + 1;
+
+		if (row[-1] != 0 || row[words] != 0)
+			return check(0, "%s: padding of row %u is not zero", what, y);
+
+		for (size_t x = 0; x < words * 64; x++) {
+			int bit = (row[x / 64] >> (63 - x % 64)) & 1;
+			int want = x < expected->width
+				&& expected->data[(size_t)y * expected->width + x] != 0;
+
+			if (bit != want)
+				return check(0, "%s: bit %zu,%u is %d, expected %d",
+					what, x, y, bit, want);
+		}
+	}
+
+	return check(1, "%s", what);
+}
+
+/**
+ * @brief Helper function that crops image data, like readers of regions
+ */
+static int crop_image(const netpbm_image_t *src, const netpbm_rect_t *rect,
+		netpbm_image_t *dest)
+{
+	if (alloc_image(dest, src->type, rect->width, rect->height,
+		src->maxval) != 0)
+		return -1;
+
+	for (uint32_t y = 0; y < rect->height; y++)
+		memcpy(dest->data + (size_t)y * rect->width,
+			src->data + (size_t)(rect->y + y) * src->width + rect->x,
+			rect->width * sizeof(uint32_t));
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that smooths image with the Gaussian kernel
+ *
+ * Outer product of binomial coefficients is applied at once, with edge
+ * pixels repeated outside of the image, and rounded to nearest.
+ */
+static void reference_blur(const netpbm_image_t *img, uint32_t radius,
+		uint32_t *dest)
+{
+	static const uint64_t weights[2][5] = {
+		{ 1, 2, 1 },
+		{ 1, 4, 6, 4, 1 }
+	};
+	const uint64_t *w = weights[radius - 1];
+	const uint32_t shift = radius == 1 ? 4 : 8;
+	const int64_t width = img->width;
+	const int64_t height = img->height;
+
+	for (int64_t y = 0; y < height; y++) {
+		for (int64_t x = 0; x < width; x++) {
+			uint64_t sum = 0;
+
+			for (int64_t i = -(int64_t)radius; i <= radius; i++) {
+				int64_t row = y + i < 0 ? 0
+					: y + i >= height ? height - 1 : y + i;
+
+				for (int64_t j = -(int64_t)radius; j <= radius; j++) {
+					int64_t column = x + j < 0 ? 0
+						: x + j >= width ? width - 1 : x + j;
+
+					sum += w[i + radius] * w[j + radius]
+						* img->data[row * width + column];
+				}
+			}
+
+			dest[y * width + x] = (sum + (1U << (shift - 1))) >> shift;
+		}
+	}
+}
+
+/**
+ * @brief Helper function that applies Sobel operator pixel by pixel
+ *
+ * @param[in] img - greyscale image
+ * @param[in] blur - size of the Gaussian kernel, or 0
+ * @param[out] out - width * height results
+ * @param[out] gx - width * height horizontal gradients, or NULL
+ * @param[out] gy - width * height vertical gradients, or NULL
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int reference_sobel(const netpbm_image_t *img, uint32_t blur,
+		uint32_t *out, int32_t *gx, int32_t *gy)
+{
+	const uint32_t p_width = img->width + 2;
+	const uint32_t p_height = img->height + 2;
+	const size_t total_pixels = (size_t)img->width * img->height;
+	uint32_t *p_data = (uint32_t *) calloc((size_t)p_width * p_height,
+		sizeof(uint32_t));
+	uint32_t *blurred = (uint32_t *) malloc(total_pixels
+		* sizeof(uint32_t) + 1);
+	const uint32_t *src = img->data;
+
+	if (p_data == NULL || blurred == NULL) {
+		fprintf(stderr, "Unable to allocate memory for reference\n");
+		goto error;
+	}
+
+	if (blur != 0) {
+		reference_blur(img, blur / 2, blurred);
+		src = blurred;
+	}
+
+	for (uint32_t y = 0; y < img->height; y++)
+		memcpy(p_data + (size_t)(y + 1) * p_width + 1,
+			src + (size_t)y * img->width, img->width * sizeof(uint32_t));
+
+	for (uint32_t y = 0; y < img->height; y++) {
+		for (uint32_t x = 0; x < img->width; x++) {
+			uint32_t out_x, out_y;
+
+			if (apply_kernel(p_data, p_width, p_height, x + 1, y + 1,
+				x_kernel, 3, 3, &out_x) != 0)
+				goto error;
+			if (apply_kernel(p_data, p_width, p_height, x + 1, y + 1,
+				y_kernel, 3, 3, &out_y) != 0)
+				goto error;
+
+			out[(size_t)y * img->width + x] = (uint32_t)
+				sqrt(out_x * out_x + out_y * out_y);
+			if (gx != NULL)
+				gx[(size_t)y * img->width + x] = (int32_t) out_x;
+			if (gy != NULL)
+				gy[(size_t)y * img->width + x] = (int32_t) out_y;
+		}
+	}
+
+	free(p_data);
+	free(blurred);
+	return 0;
+
+error:
+	free(p_data);
+	free(blurred);
+	return -1;
+}
+
+/**
+ * @brief Helper function that quantizes direction of the gradient from
+ * its angle
+ */
+static uint8_t reference_direction(int32_t gx, int32_t gy)
+{
+	double angle = atan2((double) gy, (double) gx) * 180.0 / M_PI;
+
+	// directions are the same in the opposite half of the circle
+	if (angle < 0)
+		angle += 180.0;
+
+	if (angle < 22.5 || angle >= 157.5)
+		return NETPBM_DIRECTION_HORIZONTAL;
+	if (angle < 67.5)
+		return NETPBM_DIRECTION_DIAGONAL;
+	if (angle < 112.5)
+		return NETPBM_DIRECTION_VERTICAL;
+	return NETPBM_DIRECTION_ANTIDIAGONAL;
+}
+
+/**
+ * @brief Helper function that suppresses non-maxima pixel by pixel
+ *
+ * @param[in] img - Sobel operator results
+ * @param[in] direction - directions of the gradients
+ * @param[out] out - width * height results
+ */
+static void reference_suppress(const netpbm_image_t *img,
+		const uint8_t *direction, uint32_t *out)
+{
+	/* Offsets of the neighbour after the pixel, for each direction */
+	static const int dx[4] = { 1, 1, 0, -1 };
+	static const int dy[4] = { 0, 1, 1, 1 };
+
+	for (uint32_t y = 0; y < img->height; y++) {
+		for (uint32_t x = 0; x < img->width; x++) {
+			size_t i = (size_t)y * img->width + x;
+			int d = direction[i];
+			uint32_t neighbours[2] = { 0, 0 };
+
+			for (int k = 0; k < 2; k++) {
+				int64_t nx = (int64_t)x + (k ? dx[d] : -dx[d]);
+				int64_t ny = (int64_t)y + (k ? dy[d] : -dy[d]);
+
+				if (nx >= 0 && nx < img->width
+					&& ny >= 0 && ny < img->height)
+					neighbours[k] = img->data[ny * img->width + nx];
+			}
+
+			out[i] = img->data[i] > neighbours[0]
+				&& img->data[i] >= neighbours[1] ? img->data[i] : 0;
+		}
+	}
+}
+
+static void reference_greyscale(netpbm_image_t *img)
+{
+	const size_t total_pixels = (size_t)img->width * img->height;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint32_t red = NETPBM_RED(img->data[i]);
+		uint32_t green = NETPBM_GREEN(img->data[i]);
+		uint32_t blue = NETPBM_BLUE(img->data[i]);
+		uint32_t grey = (uint32_t)(0.21 * red + 0.72 * green + 0.07 * blue);
+
+		img->data[i] = grey > img->maxval ? img->maxval : grey;
+	}
+
+	img->type -= 1;
+}
+
+/**
+ * @brief Helper function that halves the image pixel by pixel
+ *
+ * Pixmaps are turned grey first, and set bits of bitmaps into black 0
+ * and clear ones into white 255.
+ */
+static int reference_downsample(const netpbm_image_t *src,
+		netpbm_image_t *dest, enum NETPBM_DOWNSAMPLE filter)
+{
+	static const uint64_t box[] = { 0, 1, 1, 0 };
+	static const uint64_t gaussian[] = { 1, 3, 3, 1 };
+	const uint64_t *w = filter == NETPBM_DOWNSAMPLE_BOX ? box : gaussian;
+	const uint32_t shift = filter == NETPBM_DOWNSAMPLE_BOX ? 2 : 6;
+	const int bitmap = src->type == NETPBM_ASCII_BITMAP
+		|| src->type == NETPBM_BINARY_BITMAP;
+	netpbm_image_t grey;
+
+	if (copy_image(src, &grey) != 0)
+		return -1;
+
+	if (src->type == NETPBM_ASCII_PIXMAP || src->type == NETPBM_BINARY_PIXMAP)
+		reference_greyscale(&grey);
+
+	for (size_t i = 0; bitmap && i < (size_t)src->width * src->height; i++)
+		grey.data[i] = grey.data[i] ? 0 : 255;
+
+	if (alloc_image(dest, NETPBM_TYPE_IS_ASCII(src->type)
+		? NETPBM_ASCII_GREYMAP : NETPBM_BINARY_GREYMAP,
+		(src->width + 1) / 2, (src->height + 1) / 2,
+		bitmap ? 255 : src->maxval) != 0) {
+		free_netpbm_image(&grey);
+		return -1;
+	}
+
+	for (int64_t y = 0; y < dest->height; y++) {
+		for (int64_t x = 0; x < dest->width; x++) {
+			uint64_t sum = 0;
+
+			for (int64_t i = 0; i < 4; i++) {
+				int64_t row = 2 * y - 1 + i;
+
+				row = row < 0 ? 0 : row >= src->height
+					? src->height - 1 : row;
+
+				for (int64_t j = 0; j < 4; j++) {
+					int64_t column = 2 * x - 1 + j;
+
+					column = column < 0 ? 0 : column >= src->width
+						? src->width - 1 : column;
+					sum += w[i] * w[j]
+						* grey.data[row * src->width + column];
+				}
+			}
+
+			dest->data[y * dest->width + x] = (sum
+				+ (1U << (shift - 1))) >> shift;
+		}
+	}
+
+	free_netpbm_image(&grey);
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that picks random region, sometimes reaching
+ * past the image, and clips it the way the readers do
+ */
+static void random_region(const netpbm_image_t *img, netpbm_rect_t *region,
+		netpbm_rect_t *clipped)
+{
+	region->x = random_below(img->width);
+	region->y = random_below(img->height);
+	region->width = 1 + random_below(img->width - region->x);
+	region->height = 1 + random_below(img->height - region->y);
+
+	if (random_below(4) == 0) {
+		region->width += 5;
+		region->height += 3;
+	}
+
+	*clipped = *region;
+	if (clipped->width > img->width - clipped->x)
+		clipped->width = img->width - clipped->x;
+	if (clipped->height > img->height - clipped->y)
+		clipped->height = img->height - clipped->y;
+}
+
+static void check_readers_of(const netpbm_image_t *expected)
+{
+	char path[PATH_MAX];
+	char what[128];
+	netpbm_image_t actual = { 0 };
+	netpbm_image_t crop = { 0 };
+	netpbm_rect_t region, clipped;
+
+	temp_path(path, sizeof(path), "read.pnm");
+	snprintf(what, sizeof(what), "read P%d %ux%u maxval %u kernels %s",
+		expected->type, expected->width, expected->height,
+		expected->maxval, netpbm_kernels_name());
+
+	if (encode_file(path, expected, ENCODE_HEADER | ENCODE_NOISE) != 0) {
+		check(0, "%s: unable to encode", what);
+		return;
+	}
+
+	if (check(read_netpbm_file(path, &actual) == 0, "%s: failed", what) == 0)
+		check_image(expected, &actual, what);
+	free_netpbm_image(&actual);
+
+	for (unsigned long n_threads = 2; n_threads <= 4; n_threads += 2) {
+		char what_mt[160];
+
+		snprintf(what_mt, sizeof(what_mt), "%s threads %lu", what,
+			n_threads);
+		if (check(read_netpbm_file_mt(path, &actual, NULL, n_threads) == 0,
+			"%s: failed", what_mt) == 0)
+			check_image(expected, &actual, what_mt);
+		free_netpbm_image(&actual);
+	}
+
+	for (unsigned long n_threads = 1; n_threads <= 3; n_threads += 2) {
+		char what_region[192];
+
+		random_region(expected, &region, &clipped);
+		snprintf(what_region, sizeof(what_region),
+			"%s region %u,%u,%u,%u threads %lu", what, region.x,
+			region.y, region.width, region.height, n_threads);
+
+		if (crop_image(expected, &clipped, &crop) != 0)
+			return;
+
+		int ret = n_threads == 1
+			? read_netpbm_file_region(path, &actual, &region)
+			: read_netpbm_file_mt(path, &actual, &region, n_threads);
+
+		if (check(ret == 0, "%s: failed", what_region) == 0)
+			check_image(&crop, &actual, what_region);
+		free_netpbm_image(&actual);
+		free_netpbm_image(&crop);
+	}
+}
+
+/**
+ * @brief Helper function that reads two images of different sizes
+ * from one stream, so that data of the first one is reallocated
+ */
+static void check_stream_reader(const netpbm_image_t *first)
+{
+	char path[PATH_MAX];
+	char what[128];
+	netpbm_image_t second = { 0 };
+	netpbm_image_t actual = { 0 };
+	netpbm_stream_t stream;
+	char *encoded = NULL;
+	size_t size = 0;
+
+	temp_path(path, sizeof(path), "stream.pnm");
+	snprintf(what, sizeof(what), "stream read P%d %ux%u kernels %s",
+		first->type, first->width, first->height, netpbm_kernels_name());
+
+	if (alloc_image(&second, first->type, first->width + 3,
+		first->height + 2, first->maxval) != 0)
+		return;
+	fill_image(&second, PATTERN_RANDOM);
+
+	if (encode_buffer(first, ENCODE_HEADER | ENCODE_NOISE, &encoded,
+		&size) != 0 || encode_buffer(&second, ENCODE_HEADER, &encoded,
+		&size) != 0)
+		goto out;
+
+	FILE *ofile = fopen(path, "wb");
+
+	if (ofile == NULL)
+		goto out;
+	fwrite(encoded, 1, size, ofile);
+	fclose(ofile);
+
+	if (check(netpbm_stream_open(&stream, path, "r") == 0, "%s: open",
+		what) != 0)
+		goto out;
+
+	if (check(netpbm_stream_read(&stream, &actual) == 1,
+		"%s: first image", what) == 0)
+		check_image(first, &actual, what);
+	if (check(netpbm_stream_read(&stream, &actual) == 1,
+		"%s: second image", what) == 0)
+		check_image(&second, &actual, what);
+	check(netpbm_stream_read(&stream, &actual) == 0, "%s: end", what);
+
+	netpbm_stream_close(&stream);
+	free_netpbm_image(&actual);
+
+out:
+	free(encoded);
+	free_netpbm_image(&second);
+}
+
+static void check_readers(void)
+{
+	static const uint32_t maxvals[] = { 1, 7, 255, 65535 };
+
+	for (enum NETPBM_TYPE type = NETPBM_ASCII_BITMAP;
+		type <= NETPBM_BINARY_PIXMAP; type++) {
+		int bitmap = type == NETPBM_ASCII_BITMAP
+			|| type == NETPBM_BINARY_BITMAP;
+
+		for (size_t m = 0; m < sizeof(maxvals) / sizeof(maxvals[0]); m++) {
+			if (bitmap && maxvals[m] != 1)
+				continue;
+			// only ASCII greymaps hold values wider than a byte
+			if (maxvals[m] > 255 && type != NETPBM_ASCII_GREYMAP)
+				continue;
+
+			for (size_t s = 0; s < N_SIZES; s++) {
+				netpbm_image_t img;
+
+				if (alloc_image(&img, type, sizes[s][0], sizes[s][1],
+					maxvals[m]) != 0)
+					return;
+
+				fill_image(&img, PATTERN_RANDOM);
+				check_readers_of(&img);
+				if (bitmap || maxvals[m] == 255)
+					check_stream_reader(&img);
+				free_netpbm_image(&img);
+			}
+		}
+	}
+}
+
+static void check_writers_of(const netpbm_image_t *img)
+{
+	char path[PATH_MAX];
+	char what[160];
+	netpbm_image_t copy;
+	netpbm_stream_t stream;
+	char *expected = NULL;
+	size_t size = 0;
+	char *body = NULL;
+	size_t body_size = 0;
+	const int binary = NETPBM_TYPE_IS_BINARY(img->type);
+
+	temp_path(path, sizeof(path), "write.pnm");
+	snprintf(what, sizeof(what), "write P%d %ux%u maxval %u kernels %s",
+		img->type, img->width, img->height, img->maxval,
+		netpbm_kernels_name());
+
+	if (encode_buffer(img, ENCODE_HEADER, &expected, &size) != 0
+		|| encode_buffer(img, 0, &body, &body_size) != 0)
+		goto out;
+
+	for (unsigned long n_threads = 1; n_threads <= 3; n_threads += 2) {
+		if (copy_image(img, &copy) != 0)
+			goto out;
+		if (check(write_netpbm_file_mt(path, &copy, n_threads) == 0,
+			"%s: threads %lu failed", what, n_threads) == 0)
+			check_file(path, expected, size, what);
+		free_netpbm_image(&copy);
+	}
+
+	if (binary) {
+		if (copy_image(img, &copy) != 0)
+			goto out;
+		if (check(write_netpbm_file_direct(path, &copy, 3) == 0,
+			"%s: direct failed", what) == 0)
+			check_file(path, expected, size, what);
+		free_netpbm_image(&copy);
+
+		if (copy_image(img, &copy) != 0)
+			goto out;
+		if (check(write_netpbm_strip(path, &copy) == 0,
+			"%s: strip failed", what) == 0)
+			check_file(path, body, body_size, what);
+		free_netpbm_image(&copy);
+	}
+
+	// stream of the same image twice
+	if (encode_buffer(img, ENCODE_HEADER, &expected, &size) != 0)
+		goto out;
+	if (check(netpbm_stream_open(&stream, path, "w") == 0, "%s: stream",
+		what) != 0)
+		goto out;
+	for (int i = 0; i < 2; i++) {
+		if (copy_image(img, &copy) != 0)
+			break;
+		check(netpbm_stream_write(&stream, &copy) == 0,
+			"%s: stream write failed", what);
+		free_netpbm_image(&copy);
+	}
+	netpbm_stream_close(&stream);
+	check_file(path, expected, size, what);
+
+out:
+	free(expected);
+	free(body);
+}
+
+static void check_writers(void)
+{
+	for (enum NETPBM_TYPE type = NETPBM_ASCII_BITMAP;
+		type <= NETPBM_BINARY_PIXMAP; type++) {
+		for (size_t s = 0; s < N_SIZES; s++) {
+			netpbm_image_t img;
+			uint32_t maxval = type == NETPBM_ASCII_BITMAP
+				|| type == NETPBM_BINARY_BITMAP ? 1
+				: type == NETPBM_ASCII_GREYMAP && s % 2 ? 65535 : 255;
+
+			if (alloc_image(&img, type, sizes[s][0], sizes[s][1],
+				maxval) != 0)
+				return;
+
+			// results of Sobel operator exceed maxval
+			for (size_t i = 0; i < (size_t)img.width * img.height; i++)
+				img.data[i] = NETPBM_TYPE_IS_ASCII(type)
+					&& type != NETPBM_ASCII_PIXMAP
+					? random_below(2 * maxval + 2)
+					: type == NETPBM_BINARY_BITMAP ? random_below(3)
+					: type == NETPBM_BINARY_GREYMAP ? random_below(1024)
+					: random_u32() & 0xffffff;
+
+			check_writers_of(&img);
+			free_netpbm_image(&img);
+		}
+	}
+}
+
+static void check_greyscale(void)
+{
+	for (size_t s = 0; s < N_SIZES + 40; s++) {
+		// every length up to 40 covers the tails of vector loops
+		uint32_t width = s < N_SIZES ? sizes[s][0] : s - N_SIZES + 1;
+		uint32_t height = s < N_SIZES ? sizes[s][1] : 1;
+		enum NETPBM_TYPE type = s % 2 ? NETPBM_ASCII_PIXMAP
+			: NETPBM_BINARY_PIXMAP;
+		netpbm_image_t expected, actual;
+		char what[128];
+
+		// maxval below the channels checks clamping
+		if (alloc_image(&expected, type, width, height,
+			s % 3 ? 255 : 100) != 0)
+			return;
+		for (size_t i = 0; i < (size_t)width * height; i++)
+			expected.data[i] = random_u32() & 0xffffff;
+
+		if (copy_image(&expected, &actual) != 0) {
+			free_netpbm_image(&expected);
+			return;
+		}
+
+		snprintf(what, sizeof(what), "greyscale %ux%u maxval %u kernels %s",
+			width, height, expected.maxval, netpbm_kernels_name());
+		reference_greyscale(&expected);
+		if (check(netpbm_to_greyscale(&actual) == 0, "%s: failed",
+			what) == 0)
+			check_image(&expected, &actual, what);
+
+		free_netpbm_image(&expected);
+		free_netpbm_image(&actual);
+	}
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Helper function that compares histogram with the results, and
+ * its percentiles and Otsu threshold with sorting and exhaustive search
+ */
+static void check_histogram(const netpbm_image_t *expected,
+		const netpbm_histogram_t *histogram, int thresholds,
+		const char *what)
+{
+	const size_t total_pixels = (size_t)expected->width * expected->height;
+	const uint32_t last = histogram->n_bins - 1;
+	uint64_t *bins = (uint64_t *) calloc(histogram->n_bins,
+		sizeof(uint64_t));
+	uint32_t *sorted = (uint32_t *) malloc(total_pixels
+		* sizeof(uint32_t) + 1);
+	uint32_t min = UINT32_MAX, max = 0;
+	uint64_t sum = 0;
+
+	if (bins == NULL || sorted == NULL || histogram->bins == NULL)
+		goto out;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint32_t value = expected->data[i];
+
+		bins[value < last ? value : last]++;
+		min = value < min ? value : min;
+		max = value > max ? value : max;
+		sum += value;
+	}
+
+	if (check(histogram->pixels == total_pixels && histogram->min == min
+		&& histogram->max == max && histogram->sum == sum,
+		"%s: histogram of %zu pixels, min %u, max %u, sum %llu, expected "
+		"%zu, %u, %u, %llu", what, histogram->pixels, histogram->min,
+		histogram->max, (unsigned long long) histogram->sum, total_pixels,
+		min, max, (unsigned long long) sum) != 0)
+		goto out;
+
+	check(memcmp(bins, histogram->bins, histogram->n_bins
+		* sizeof(uint64_t)) == 0, "%s: histogram bins differ", what);
+
+	if (!thresholds)
+		goto out;
+
+	memcpy(sorted, expected->data, total_pixels * sizeof(uint32_t));
+	qsort(sorted, total_pixels, sizeof(uint32_t), compare_u32);
+
+	for (double percent = 0; percent <= 100; percent += 12.5) {
+		size_t rank = (size_t) ceil(percent / 100 * total_pixels);
+		uint32_t value = sorted[rank > 0 ? rank - 1 : 0];
+
+		check(netpbm_histogram_percentile(histogram, percent) == value,
+			"%s: %.1f%% percentile is %u, expected %u", what, percent,
+			netpbm_histogram_percentile(histogram, percent), value);
+	}
+
+	/* Every threshold is tried, splitting the sorted results */
+	double best_variance = 0;
+	uint32_t best = 0;
+
+	for (size_t split = 1; split < total_pixels; split++) {
+		if (sorted[split] == sorted[split - 1])
+			continue;
+
+		double sum0 = 0, sum1 = 0;
+
+		for (size_t i = 0; i < total_pixels; i++)
+			*(i < split ? &sum0 : &sum1) += sorted[i];
+
+		double difference = sum0 / split - sum1 / (total_pixels - split);
+		double variance = (double) split * (total_pixels - split)
+			* difference * difference;
+
+		if (variance > best_variance * (1 + 1e-12)) {
+			best_variance = variance;
+			best = sorted[split - 1];
+		}
+	}
+
+	check(netpbm_histogram_otsu(histogram) == best,
+		"%s: Otsu threshold is %u, expected %u", what,
+		netpbm_histogram_otsu(histogram), best);
+
+out:
+	free(bins);
+	free(sorted);
+}
+
+static void check_pyramid(void)
+{
+	for (enum NETPBM_TYPE type = NETPBM_ASCII_BITMAP;
+		type <= NETPBM_BINARY_PIXMAP; type++) {
+		for (size_t s = 0; s < N_SIZES; s++) {
+			uint32_t maxval = type == NETPBM_ASCII_BITMAP
+				|| type == NETPBM_BINARY_BITMAP ? 1
+				: type == NETPBM_ASCII_GREYMAP ? 65535 : 255;
+			netpbm_image_t img;
+
+			if (alloc_image(&img, type, sizes[s][0], sizes[s][1],
+				maxval) != 0)
+				return;
+			fill_image(&img, s % 2 ? PATTERN_RANDOM : PATTERN_BLOCKS);
+
+			for (int filter = NETPBM_DOWNSAMPLE_BOX;
+				filter <= NETPBM_DOWNSAMPLE_GAUSSIAN; filter++) {
+				netpbm_image_t levels[3];
+				netpbm_image_t expected[3] = { { 0 } };
+				char what[128];
+
+				snprintf(what, sizeof(what), "pyramid P%d %ux%u filter %d "
+					"kernels %s", type, img.width, img.height, filter,
+					netpbm_kernels_name());
+
+				if (check(netpbm_pyramid(&img, levels, 3, filter) == 0,
+					"%s: failed", what) != 0)
+					continue;
+
+				for (int k = 0; k < 3; k++) {
+					if (reference_downsample(k == 0 ? &img
+						: &expected[k - 1], &expected[k], filter) != 0)
+						break;
+					check_image(&expected[k], &levels[k], what);
+				}
+
+				for (int k = 0; k < 3; k++) {
+					free_netpbm_image(&levels[k]);
+					free_netpbm_image(&expected[k]);
+				}
+			}
+
+			free_netpbm_image(&img);
+		}
+	}
+}
+
+/**
+ * @brief Helper function that fills Sobel options of the given way to
+ * run it
+ */
+static void sobel_options(const struct sobel_config *config,
+		netpbm_sobel_opts_t *opts)
+{
+	*opts = (netpbm_sobel_opts_t){
+		.n_threads = config->n_threads,
+		.pool = config->pool ? pool : NULL,
+		.arena = config->arena ? arena : NULL,
+		.chunk = config->chunk,
+		.pin = config->pin
+	};
+}
+
+/**
+ * @brief Helper function that runs Sobel operator in the given way
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int run_sobel(netpbm_image_t *img, uint32_t blur,
+		const struct sobel_config *config, char *output_path,
+		netpbm_histogram_t *histogram, int32_t *gx, int32_t *gy,
+		uint8_t *direction)
+{
+	netpbm_output_t output;
+	netpbm_sobel_opts_t opts;
+
+	sobel_options(config, &opts);
+	opts.blur = blur;
+	opts.histogram = histogram;
+	opts.gradient_x = gx;
+	opts.gradient_y = gy;
+	opts.direction = direction;
+
+	if (output_path != NULL) {
+		if (netpbm_output_open(&output, output_path, img) != 0)
+			return -1;
+		opts.output = &output;
+	}
+
+	int ret = netpbm_sobel_ext(img, &opts);
+
+	if (output_path != NULL && netpbm_output_close(&output) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+/**
+ * @brief Helper function that checks gradients, directions and
+ * non-maximum suppression of Sobel operator results
+ *
+ * @param[in] expected - reference results
+ * @param[in] expected_x - reference horizontal gradients
+ * @param[in] expected_y - reference vertical gradients
+ * @param[in] actual - results of the given way
+ * @param[in] gx - horizontal gradients, or NULL if they were not stored
+ * @param[in] gy - vertical gradients, or NULL if they were not stored
+ * @param[in] direction - directions
+ */
+static void check_gradients(const netpbm_image_t *expected,
+		const int32_t *expected_x, const int32_t *expected_y,
+		const netpbm_image_t *actual, const int32_t *gx, const int32_t *gy,
+		const uint8_t *direction, const struct sobel_config *config,
+		const char *what)
+{
+	const size_t total_pixels = (size_t)expected->width * expected->height;
+	netpbm_image_t thin, expected_thin;
+	netpbm_sobel_opts_t opts;
+
+	if (gx != NULL && check(memcmp(expected_x, gx, total_pixels
+		* sizeof(int32_t)) == 0, "%s: wrong horizontal gradients",
+		what) != 0)
+		return;
+	if (gy != NULL && check(memcmp(expected_y, gy, total_pixels
+		* sizeof(int32_t)) == 0, "%s: wrong vertical gradients",
+		what) != 0)
+		return;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint8_t d = reference_direction(expected_x[i], expected_y[i]);
+
+		if (direction[i] != d) {
+			check(0, "%s: direction of pixel %zu,%zu is %u, expected "
+				"%u", what, i % expected->width, i / expected->width,
+				direction[i], d);
+			return;
+		}
+	}
+
+	if (copy_image(actual, &thin) != 0)
+		return;
+	if (copy_image(expected, &expected_thin) != 0) {
+		free_netpbm_image(&thin);
+		return;
+	}
+
+	reference_suppress(expected, direction, expected_thin.data);
+	sobel_options(config, &opts);
+
+	if (check(netpbm_suppress_nonmaxima(&thin, direction, &opts) == 0,
+		"%s: suppression failed", what) == 0)
+		check_image(&expected_thin, &thin, what);
+
+	free_netpbm_image(&expected_thin);
+	free_netpbm_image(&thin);
+}
+
+static void check_sobel_of(const netpbm_image_t *img, const char *pattern)
+{
+	static const uint32_t blurs[] = { 0, 3, 5 };
+	const size_t total_pixels = (size_t)img->width * img->height;
+	char path[PATH_MAX];
+	netpbm_image_t expected;
+	netpbm_histogram_t histogram = { .bins = NULL };
+	int32_t *gradients = (int32_t *) malloc(4 * total_pixels
+		* sizeof(int32_t) + 1);
+	uint8_t *direction = (uint8_t *) malloc(total_pixels + 1);
+	int32_t *expected_x = gradients;
+	int32_t *expected_y = gradients + total_pixels;
+
+	temp_path(path, sizeof(path), "sobel.pgm");
+
+	if (gradients == NULL || direction == NULL) {
+		fprintf(stderr, "Unable to allocate memory for gradients\n");
+		goto out;
+	}
+
+	if (copy_image(img, &expected) != 0)
+		goto out;
+
+	for (size_t b = 0; b < sizeof(blurs) / sizeof(blurs[0]); b++) {
+		char *encoded = NULL;
+		size_t size = 0;
+
+		if (reference_sobel(img, blurs[b], expected.data,
+			expected_x, expected_y) != 0)
+			break;
+		if (encode_buffer(&expected, ENCODE_HEADER, &encoded, &size) != 0)
+			break;
+
+		for (size_t c = 0; c < N_SOBEL_CONFIGS; c++) {
+			const struct sobel_config *config = &sobel_configs[c];
+			// output files can only hold bytes
+			int output = config->output
+				&& img->type == NETPBM_BINARY_GREYMAP;
+			netpbm_image_t actual;
+			char what[192];
+
+			snprintf(what, sizeof(what), "sobel %ux%u %s maxval %u "
+				"blur %u config %zu kernels %s", img->width,
+				img->height, pattern, img->maxval, blurs[b], c,
+				netpbm_kernels_name());
+
+			if (copy_image(img, &actual) != 0)
+				break;
+
+			/* Every other way also fills the histogram, and two of
+			 * three keep directions, with or without the gradients
+			 */
+			int32_t *gx = c % 3 == 0 ? gradients + 2 * total_pixels : NULL;
+			int32_t *gy = c % 3 == 0 ? gradients + 3 * total_pixels : NULL;
+
+			if (check(run_sobel(&actual, blurs[b], config,
+				output ? path : NULL, c % 2 ? &histogram : NULL,
+				gx, gy, c % 3 != 2 ? direction : NULL) == 0,
+				"%s: failed", what) == 0) {
+				check_image(&expected, &actual, what);
+				if (output)
+					check_file(path, encoded, size, what);
+				if (c % 2)
+					check_histogram(&expected, &histogram, c == 1, what);
+				if (c % 3 != 2)
+					check_gradients(&expected, expected_x, expected_y,
+						&actual, gx, gy, direction, config, what);
+			}
+			free_netpbm_image(&actual);
+		}
+		free(encoded);
+	}
+
+	netpbm_histogram_free(&histogram);
+	free_netpbm_image(&expected);
+
+out:
+	free(direction);
+	free(gradients);
+}
+
+static void check_sobel(void)
+{
+	for (size_t s = 0; s < N_SIZES; s++) {
+		for (int p = 0; p < PATTERNS; p++) {
+			netpbm_image_t img;
+
+			if (alloc_image(&img, NETPBM_BINARY_GREYMAP, sizes[s][0],
+				sizes[s][1], 255) != 0)
+				return;
+			fill_image(&img, p);
+			check_sobel_of(&img, pattern_names[p]);
+			free_netpbm_image(&img);
+		}
+
+		/* Gradients of 16-bit values overflow 32-bit squares, and
+		 * bitmaps are 0 or 1 until they are written
+		 */
+		static const enum NETPBM_TYPE types[] = {
+			NETPBM_ASCII_GREYMAP, NETPBM_ASCII_BITMAP
+		};
+		static const uint32_t maxvals[] = { 65535, 1 };
+
+		for (int t = 0; t < 2; t++) {
+			netpbm_image_t img;
+
+			if (alloc_image(&img, types[t], sizes[s][0], sizes[s][1],
+				maxvals[t]) != 0)
+				return;
+			fill_image(&img, PATTERN_RANDOM);
+			check_sobel_of(&img, pattern_names[PATTERN_RANDOM]);
+			free_netpbm_image(&img);
+		}
+	}
+}
+
+/**
+ * @brief Helper function that changes a few random rectangles of the frame
+ */
+static void change_frame(netpbm_image_t *img)
+{
+	uint32_t changes = random_below(4);
+
+	for (uint32_t i = 0; i < changes; i++) {
+		netpbm_rect_t rect, clipped;
+		uint32_t value = random_value(img);
+
+		random_region(img, &rect, &clipped);
+		for (uint32_t y = 0; y < clipped.height; y++)
+			for (uint32_t x = 0; x < clipped.width; x++)
+				img->data[(size_t)(clipped.y + y) * img->width
+					+ clipped.x + x] = random_below(2) ? value
+					: random_value(img);
+	}
+}
+
+static void check_delta(void)
+{
+	static const uint32_t frame_sizes[][2] = {
+		{ 70, 45 }, { 70, 45 }, { 70, 45 }, { 70, 45 }, { 70, 45 },
+		{ 33, 80 }, { 33, 80 }, { 1, 1 }, { 1, 1 }
+	};
+
+	for (uint32_t tile_size = 8; tile_size <= 16; tile_size += 8) {
+		for (unsigned long n_threads = 1; n_threads <= 3; n_threads += 2) {
+			netpbm_delta_t delta;
+			netpbm_image_t frame = { 0 };
+
+			if (netpbm_delta_init(&delta, tile_size) != 0)
+				return;
+
+			for (size_t f = 0; f < sizeof(frame_sizes)
+				/ sizeof(frame_sizes[0]); f++) {
+				netpbm_image_t expected, actual;
+				char what[128];
+
+				if (frame.data == NULL || frame.width != frame_sizes[f][0]
+					|| frame.height != frame_sizes[f][1]) {
+					free_netpbm_image(&frame);
+					if (alloc_image(&frame, NETPBM_BINARY_GREYMAP,
+						frame_sizes[f][0], frame_sizes[f][1], 255) != 0)
+						break;
+					fill_image(&frame, PATTERN_BLOCKS);
+				} else {
+					change_frame(&frame);
+				}
+
+				if (copy_image(&frame, &expected) != 0)
+					break;
+				if (copy_image(&frame, &actual) != 0) {
+					free_netpbm_image(&expected);
+					break;
+				}
+
+				snprintf(what, sizeof(what), "delta frame %zu tile %u "
+					"threads %lu kernels %s", f, tile_size, n_threads,
+					netpbm_kernels_name());
+				if (reference_sobel(&frame, 0, expected.data, NULL, NULL) == 0
+					&& check(netpbm_sobel_delta(&delta, &actual,
+					n_threads) == 0, "%s: failed", what) == 0)
+					check_image(&expected, &actual, what);
+
+				free_netpbm_image(&expected);
+				free_netpbm_image(&actual);
+			}
+
+			free_netpbm_image(&frame);
+			netpbm_delta_free(&delta);
+		}
+	}
+}
+
+static void check_bitmap_sobel_of(const netpbm_image_t *img)
+{
+	char path[PATH_MAX];
+	char what[128];
+	netpbm_bitmap_t bmp = { 0 };
+	netpbm_bitmap_t edges = { 0 };
+	netpbm_image_t mask;
+	const size_t total_pixels = (size_t)img->width * img->height;
+	uint8_t *magnitudes = (uint8_t *) malloc(total_pixels + 1);
+	uint8_t *expected = (uint8_t *) malloc(total_pixels + 1);
+	const uint32_t strongest = (uint32_t) sqrt(255.0 * 255.0 * 20);
+
+	temp_path(path, sizeof(path), "bitmap.pbm");
+	snprintf(what, sizeof(what), "bitmap %ux%u kernels %s", img->width,
+		img->height, netpbm_kernels_name());
+
+	if (magnitudes == NULL || expected == NULL
+		|| copy_image(img, &mask) != 0)
+		goto out;
+
+	if (reference_sobel(img, 0, mask.data, NULL, NULL) != 0)
+		goto out_mask;
+
+	for (size_t i = 0; i < total_pixels; i++) {
+		uint32_t value = mask.data[i] * 255 / strongest;
+
+		expected[i] = value > 255 ? 255 : value;
+	}
+
+	if (encode_file(path, img, ENCODE_HEADER | ENCODE_NOISE) != 0
+		|| check(read_netpbm_bitmap(path, &bmp) == 0, "%s: read failed",
+		what) != 0)
+		goto out_mask;
+	check_bitmap(&bmp, img, what);
+
+	if (netpbm_bitmap_alloc(&edges, img->width, img->height) != 0)
+		goto out_mask;
+
+	for (size_t c = 0; c < N_SOBEL_CONFIGS; c++) {
+		const struct sobel_config *config = &sobel_configs[c];
+		netpbm_sobel_opts_t opts = {
+			.n_threads = config->n_threads,
+			.pool = config->pool ? pool : NULL
+		};
+		char what_config[160];
+
+		snprintf(what_config, sizeof(what_config), "%s config %zu",
+			what, c);
+
+		// rows left from the previous run must be overwritten
+		for (uint32_t y = 0; y < edges.height; y++)
+			memset(edges.data + (y + 1) * edges.stride + 1, 0xff,
+				(edges.stride - 2) * sizeof(uint64_t));
+
+		// mask alone, magnitudes alone, then both
+		if (check(netpbm_sobel_bitmap(&bmp, c % 3 == 1 ? NULL : &edges,
+			c % 3 == 0 ? NULL : magnitudes, &opts) == 0, "%s: failed",
+			what_config) != 0)
+			continue;
+
+		if (c % 3 != 1)
+			check_bitmap(&edges, &mask, what_config);
+
+		if (c % 3 != 0) {
+			size_t i = 0;
+
+			while (i < total_pixels && magnitudes[i] == expected[i])
+				i++;
+			check(i == total_pixels, "%s: magnitude %zu is %u, "
+				"expected %u", what_config, i, magnitudes[i],
+				expected[i]);
+		}
+	}
+
+out_mask:
+	free_netpbm_image(&mask);
+out:
+	free_netpbm_bitmap(&bmp);
+	free_netpbm_bitmap(&edges);
+	free(magnitudes);
+	free(expected);
+}
+
+static void check_bitmap_sobel(void)
+{
+	static const uint32_t widths[] = { 62, 63, 64, 65, 127, 128, 129 };
+
+	for (size_t s = 0; s < N_SIZES + sizeof(widths) / sizeof(widths[0]);
+		s++) {
+		uint32_t width = s < N_SIZES ? sizes[s][0] : widths[s - N_SIZES];
+		uint32_t height = s < N_SIZES ? sizes[s][1] : 11;
+
+		for (int p = 0; p < PATTERNS; p++) {
+			netpbm_image_t img;
+
+			if (alloc_image(&img, NETPBM_BINARY_BITMAP, width, height,
+				1) != 0)
+				return;
+			fill_image(&img, p);
+			check_bitmap_sobel_of(&img);
+			free_netpbm_image(&img);
+		}
+	}
+}
+
+/**
+ * @brief Helper function that writes a file of the fake sysfs tree
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int write_sysfs(const char *dir, const char *node, const char *cpulist)
+{
+	char path[PATH_MAX];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, node);
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/%s/cpulist", dir, node);
+	if ((file = fopen(path, "w")) == NULL)
+		return -1;
+
+	fputs(cpulist, file);
+
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Check that arena reuses buffers of frames of the same size, and
+ * frees buffers of the sizes that are no longer used
+ */
+static void check_arena(void)
+{
+	netpbm_arena_t *frames = netpbm_arena_create(0);
+	netpbm_arena_stats_t stats = { 0 };
+
+	if (check(frames != NULL, "arena: unable to create") != 0)
+		return;
+
+	for (size_t f = 0; f < 64; f++) {
+		// frames grow by more than a size class every 8 of them
+		size_t size = (f / 8 + 1) * 100000;
+		void *image = netpbm_arena_alloc(frames, size);
+		void *scratch = netpbm_arena_alloc(frames, size / 2);
+
+		if (check(image != NULL && scratch != NULL,
+			"arena: frame %zu not allocated", f) != 0)
+			break;
+
+		netpbm_arena_release(frames, scratch);
+		netpbm_arena_release(frames, image);
+		netpbm_arena_stats(frames, &stats);
+
+		// size classes waste at most a quarter of the buffer
+		if (check(stats.bytes <= (size + size / 2) * 5 / 4,
+			"arena: holds %zu bytes after frame %zu of %zu bytes",
+			stats.bytes, f, size + size / 2) != 0)
+			break;
+	}
+
+	check(stats.reused >= 2 * (64 - 8), "arena: %zu of %zu buffers reused",
+		stats.reused, stats.requests);
+
+	netpbm_arena_destroy(frames);
+}
+
+/**
+ * @brief Check NUMA topology read from a fake sysfs tree, and pinning
+ *
+ * CPUs of the node with the lower number come first, whichever of them the
+ * process may run on. Node numbers have gaps, one of the nodes has no CPUs
+ * and another directory is not a node.
+ */
+static void check_topology(void)
+{
+	const struct netpbm_topology *machine = netpbm_topology();
+	struct netpbm_topology topo;
+	char dir[PATH_MAX];
+	int low = 0, high = 0;
+
+	temp_path(dir, sizeof(dir), "nodes");
+
+	if (check((mkdir(dir, 0755) == 0 || errno == EEXIST)
+		&& write_sysfs(dir, "node4", "0-255,256-511\n") == 0
+		&& write_sysfs(dir, "node1", "512-1023\n") == 0
+		&& write_sysfs(dir, "node7", "\n") == 0
+		&& write_sysfs(dir, "power", "0\n") == 0,
+		"topology: unable to write fake sysfs") != 0)
+		return;
+
+	if (check(netpbm_topology_read(dir, &topo) == 0, "topology: failed") != 0)
+		return;
+
+	for (unsigned long c = 0; c < machine->n_cpus; c++) {
+		low |= machine->cpus[c] < 512;
+		high |= machine->cpus[c] >= 512;
+	}
+
+	check(topo.n_cpus == machine->n_cpus && topo.n_nodes
+		== (unsigned long)(low + high), "topology: %lu CPUs on %lu nodes, "
+		"expected %lu CPUs on %d nodes", topo.n_cpus, topo.n_nodes,
+		machine->n_cpus, low + high);
+
+	for (unsigned long c = 1; c < topo.n_cpus; c++) {
+		int previous = topo.cpus[c - 1], cpu = topo.cpus[c];
+
+		if ((previous >= 512) == (cpu >= 512) ? previous >= cpu
+			: previous < 512) {
+			check(0, "topology: CPU %d is listed after %d", cpu, previous);
+			break;
+		}
+	}
+
+	/* Without sysfs, every CPU is on one node */
+	temp_path(dir, sizeof(dir), "no_nodes");
+	check(netpbm_topology_read(dir, &topo) == 0 && topo.n_nodes == 1
+		&& topo.n_cpus == machine->n_cpus, "topology: %lu CPUs on %lu "
+		"nodes without sysfs", topo.n_cpus, topo.n_nodes);
+
+	netpbm_pool_t *pinned = netpbm_pool_create(2);
+
+	if (check(pinned != NULL, "topology: unable to create pool") != 0)
+		return;
+
+	int ret = netpbm_pool_pin(pinned);
+
+	check(ret == 0 || ret == 1, "topology: pinning failed");
+	netpbm_pool_destroy(pinned);
+}
+
+#define BATCH_IMAGES 9
+
+/**
+ * @brief Helper function that writes and reads images of every type with
+ * the batch, comparing them with the files of the single image writers
+ */
+static void check_batch_of(netpbm_batch_t *batch, unsigned long n_threads)
+{
+	const char *backend = netpbm_batch_backend(batch) == NETPBM_BATCH_URING
+		? "uring" : "stdio";
+	netpbm_image_t imgs[BATCH_IMAGES] = { { .data = NULL } };
+	netpbm_image_t copies[BATCH_IMAGES] = { { .data = NULL } };
+	netpbm_image_t read[BATCH_IMAGES];
+	char paths[BATCH_IMAGES][PATH_MAX];
+	char *filenames[BATCH_IMAGES];
+	char *expected[BATCH_IMAGES] = { NULL };
+	size_t expected_sizes[BATCH_IMAGES] = { 0 };
+	char what[160];
+	char name[32];
+
+	for (size_t i = 0; i < BATCH_IMAGES; i++) {
+		enum NETPBM_TYPE type = NETPBM_ASCII_BITMAP + i % 6;
+		// last image is bigger than the buffer grown for the first one
+		uint32_t width = i + 1 < BATCH_IMAGES ? sizes[i % N_SIZES][0] : 1100;
+		uint32_t height = i + 1 < BATCH_IMAGES ? sizes[i % N_SIZES][1] : 1000;
+		uint32_t maxval = type == NETPBM_ASCII_BITMAP
+			|| type == NETPBM_BINARY_BITMAP ? 1
+			: type == NETPBM_ASCII_GREYMAP ? 65535 : 255;
+
+		snprintf(name, sizeof(name), "batch%zu.pnm", i);
+		temp_path(paths[i], sizeof(paths[i]), name);
+		filenames[i] = paths[i];
+
+		if (alloc_image(&imgs[i], type, width, height, maxval) != 0
+			|| alloc_image(&copies[i], type, width, height, maxval) != 0)
+			goto out;
+
+		fill_image(&imgs[i], PATTERN_RANDOM);
+		memcpy(copies[i].data, imgs[i].data,
+			(size_t)width * height * sizeof(uint32_t));
+
+		if (encode_buffer(&imgs[i], ENCODE_HEADER, &expected[i],
+				&expected_sizes[i]) != 0)
+			goto out;
+	}
+
+	snprintf(what, sizeof(what), "batch %s threads %lu", backend, n_threads);
+
+	// single file first, so that the buffer grows for the rest
+	if (check(netpbm_batch_write(batch, filenames, copies, 1, n_threads) == 0
+		&& netpbm_batch_write(batch, filenames, copies, BATCH_IMAGES,
+			n_threads) == 0, "%s: write failed", what) != 0)
+		goto out;
+
+	for (size_t i = 0; i < BATCH_IMAGES; i++)
+		check_file(paths[i], expected[i], expected_sizes[i], what);
+
+	if (check(netpbm_batch_read(batch, filenames, read, BATCH_IMAGES,
+			n_threads) == 0, "%s: read failed", what) == 0) {
+		for (size_t i = 0; i < BATCH_IMAGES; i++) {
+			check_image(&imgs[i], &read[i], what);
+			free_netpbm_image(&read[i]);
+		}
+	}
+
+	// a missing file fails the whole batch, leaving no images behind
+	temp_path(paths[BATCH_IMAGES / 2], sizeof(paths[0]), "batch_missing");
+	unlink(paths[BATCH_IMAGES / 2]);
+
+	int failed = netpbm_batch_read(batch, filenames, read, BATCH_IMAGES,
+		n_threads) != 0;
+
+	for (size_t i = 0; i < BATCH_IMAGES; i++)
+		failed = failed && read[i].data == NULL;
+
+	check(failed, "%s: missing file not reported", what);
+
+out:
+	for (size_t i = 0; i < BATCH_IMAGES; i++) {
+		free_netpbm_image(&imgs[i]);
+		free_netpbm_image(&copies[i]);
+		free(expected[i]);
+	}
+}
+
+static void check_batch(void)
+{
+	netpbm_batch_t *batch = netpbm_batch_create(NETPBM_BATCH_STDIO, 0);
+
+	if (check(batch != NULL, "batch: unable to create stdio batch") == 0)
+		check_batch_of(batch, 1);
+	netpbm_batch_destroy(batch);
+
+	// fewer requests in flight than files, so that they are refilled
+	static const unsigned int depths[] = { 2, 64 };
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		batch = netpbm_batch_create(NETPBM_BATCH_AUTO, depths[d]);
+
+		if (check(batch != NULL, "batch: unable to create batch") != 0)
+			return;
+
+		if (netpbm_batch_backend(batch) != NETPBM_BATCH_URING) {
+			printf("io_uring is not available, batches use stdio\n");
+			netpbm_batch_destroy(batch);
+			return;
+		}
+
+		check_batch_of(batch, d == 0 ? 3 : 1);
+		netpbm_batch_destroy(batch);
+	}
+}
+
+/**
+ * @brief throughput of one of the hot paths
+ */
+struct perf_result {
+	char name[32];
+	double mpix; /**< Millions of pixels per second */
+};
+
+/**
+ * @brief Helper function that measures Sobel operator, best of runs
+ *
+ * With thin, edges are also thinned by non-maximum suppression.
+ *
+ * @return throughput in millions of pixels per second, 0 on error
+ */
+static double perf_sobel(const netpbm_image_t *img, uint32_t blur, int thin)
+{
+	const struct sobel_config config = { 1, 0, 0, 1, 0, 0 };
+	uint8_t *direction = NULL;
+	uint64_t best = UINT64_MAX;
+
+	if (thin && (direction = (uint8_t *) malloc((size_t)img->width
+		* img->height + 1)) == NULL)
+		return 0;
+
+	for (int run = 0; run < PERF_RUNS; run++) {
+		netpbm_image_t copy;
+		netpbm_sobel_opts_t opts;
+
+		if (copy_image(img, &copy) != 0)
+			break;
+
+		sobel_options(&config, &opts);
+
+		uint64_t start = now_ns();
+		int ret = run_sobel(&copy, blur, &config, NULL, NULL, NULL, NULL,
+			direction);
+
+		if (ret == 0 && thin)
+			ret = netpbm_suppress_nonmaxima(&copy, direction, &opts);
+
+		uint64_t elapsed = now_ns() - start;
+
+		free_netpbm_image(&copy);
+		if (ret != 0) {
+			best = UINT64_MAX;
+			break;
+		}
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	free(direction);
+
+	if (best == UINT64_MAX)
+		return 0;
+
+	return (double)img->width * img->height * 1e3 / (best ? best : 1);
+}
+
+static double perf_greyscale(const netpbm_image_t *img)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int run = 0; run < PERF_RUNS; run++) {
+		netpbm_image_t copy;
+
+		if (copy_image(img, &copy) != 0)
+			return 0;
+
+		uint64_t start = now_ns();
+		int ret = netpbm_to_greyscale(&copy);
+		uint64_t elapsed = now_ns() - start;
+
+		free_netpbm_image(&copy);
+		if (ret != 0)
+			return 0;
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	return (double)img->width * img->height * 1e3 / (best ? best : 1);
+}
+
+static double perf_read(const netpbm_image_t *img)
+{
+	char path[PATH_MAX];
+	uint64_t best = UINT64_MAX;
+
+	temp_path(path, sizeof(path), "perf.pnm");
+	if (encode_file(path, img, ENCODE_HEADER) != 0)
+		return 0;
+
+	for (int run = 0; run < PERF_RUNS; run++) {
+		netpbm_image_t actual = { 0 };
+
+		uint64_t start = now_ns();
+		int ret = read_netpbm_file(path, &actual);
+		uint64_t elapsed = now_ns() - start;
+
+		free_netpbm_image(&actual);
+		if (ret != 0)
+			return 0;
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	return (double)img->width * img->height * 1e3 / (best ? best : 1);
+}
+
+static double perf_bitmap(const netpbm_image_t *img)
+{
+	char path[PATH_MAX];
+	netpbm_bitmap_t bmp = { 0 };
+	netpbm_bitmap_t edges = { 0 };
+	netpbm_sobel_opts_t opts = { .n_threads = 1 };
+	uint64_t best = UINT64_MAX;
+
+	temp_path(path, sizeof(path), "perf.pbm");
+	if (encode_file(path, img, ENCODE_HEADER) != 0
+		|| read_netpbm_bitmap(path, &bmp) != 0
+		|| netpbm_bitmap_alloc(&edges, img->width, img->height) != 0)
+		goto error;
+
+	for (int run = 0; run < PERF_RUNS; run++) {
+		uint64_t start = now_ns();
+
+		if (netpbm_sobel_bitmap(&bmp, &edges, NULL, &opts) != 0)
+			goto error;
+
+		uint64_t elapsed = now_ns() - start;
+
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	free_netpbm_bitmap(&bmp);
+	free_netpbm_bitmap(&edges);
+	return (double)img->width * img->height * 1e3 / (best ? best : 1);
+
+error:
+	free_netpbm_bitmap(&bmp);
+	free_netpbm_bitmap(&edges);
+	return 0;
+}
+
+/**
+ * @brief Helper function that measures the hot paths on one thread
+ *
+ * @param[out] results - array of at least MAX_BASELINE results
+ *
+ * @return amount of results, or -1 on error
+ */
+static int measure(struct perf_result *results)
+{
+	static const struct {
+		const char *name;
+		enum NETPBM_TYPE type;
+		uint32_t size;
+		enum PATTERN pattern;
+		uint32_t blur;
+	} benchmarks[] = {
+		{ "sobel", NETPBM_BINARY_GREYMAP, 1024, PATTERN_RANDOM, 0 },
+		{ "sobel_sparse", NETPBM_BINARY_GREYMAP, 1024, PATTERN_BLOCKS, 0 },
+		{ "sobel_blur", NETPBM_BINARY_GREYMAP, 1024, PATTERN_RANDOM, 5 },
+		{ "sobel_thin", NETPBM_BINARY_GREYMAP, 1024, PATTERN_RANDOM, 0 },
+		{ "greyscale", NETPBM_BINARY_PIXMAP, 1024, PATTERN_RANDOM, 0 },
+		{ "bitmap", NETPBM_BINARY_BITMAP, 4096, PATTERN_RANDOM, 0 },
+		{ "read_ascii", NETPBM_ASCII_GREYMAP, 512, PATTERN_RANDOM, 0 },
+		{ "read_binary", NETPBM_BINARY_PIXMAP, 1024, PATTERN_RANDOM, 0 }
+	};
+	int n = 0;
+
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		netpbm_image_t img;
+
+		if (alloc_image(&img, benchmarks[i].type, benchmarks[i].size,
+			benchmarks[i].size, 255) != 0)
+			return -1;
+		fill_image(&img, benchmarks[i].pattern);
+
+		double mpix;
+
+		if (strncmp(benchmarks[i].name, "read", 4) == 0)
+			mpix = perf_read(&img);
+		else if (benchmarks[i].type == NETPBM_BINARY_BITMAP)
+			mpix = perf_bitmap(&img);
+		else if (benchmarks[i].type == NETPBM_BINARY_PIXMAP)
+			mpix = perf_greyscale(&img);
+		else
+			mpix = perf_sobel(&img, benchmarks[i].blur,
+				strcmp(benchmarks[i].name, "sobel_thin") == 0);
+
+		free_netpbm_image(&img);
+
+		if (mpix == 0) {
+			fprintf(stderr, "Unable to measure %s\n", benchmarks[i].name);
+			return -1;
+		}
+
+		snprintf(results[n].name, sizeof(results[n].name), "%s",
+			benchmarks[i].name);
+		results[n++].mpix = mpix;
+	}
+
+	return n;
+}
+
+/**
+ * @brief Helper function that loads baseline stored by save_baseline()
+ *
+ * @return amount of results, -1 on error
+ */
+static int load_baseline(const char *path, struct perf_result *baseline)
+{
+	FILE *ifile = fopen(path, "r");
+	int n = 0;
+
+	if (ifile == NULL) {
+		fprintf(stderr, "Unable to open baseline %s: error %d, "
+			"record it with -B\n", path, errno);
+		return -1;
+	}
+
+	while (n < MAX_BASELINE && fscanf(ifile, "%31s %lf",
+		baseline[n].name, &baseline[n].mpix) == 2)
+		n++;
+
+	if (!feof(ifile) && n < MAX_BASELINE) {
+		fprintf(stderr, "Malformed baseline %s\n", path);
+		n = -1;
+	}
+
+	fclose(ifile);
+
+	return n;
+}
+
+static int save_baseline(const char *path, const struct perf_result *results,
+		int n)
+{
+	FILE *ofile = fopen(path, "w");
+
+	if (ofile == NULL) {
+		fprintf(stderr, "Unable to save baseline %s\n", path);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+		fprintf(ofile, "%s %.1f\n", results[i].name, results[i].mpix);
+
+	if (fclose(ofile) != 0)
+		return -1;
+
+	printf("Baseline stored to %s\n", path);
+
+	return 0;
+}
+
+/**
+ * @brief Helper function that fails paths slower than the baseline
+ *
+ * Missing baseline, or a path missing from it, fails the gate. With
+ * record set, results are stored as the new baseline instead.
+ *
+ * @return 0 if no problem occured, -1 otherwise
+ */
+static int perf_gate(const char *path, int record, double tolerance)
+{
+	struct perf_result results[MAX_BASELINE];
+	struct perf_result baseline[MAX_BASELINE];
+	int n = measure(results);
+	int n_baseline = record ? 0 : load_baseline(path, baseline);
+
+	if (n < 0 || n_baseline < 0)
+		return -1;
+
+	if (record) {
+		for (int i = 0; i < n; i++)
+			printf("%-14s %8.1f Mpix/s\n", results[i].name,
+				results[i].mpix);
+
+		return save_baseline(path, results, n);
+	}
+
+	for (int i = 0; i < n; i++) {
+		int b = 0;
+
+		while (b < n_baseline && strcmp(baseline[b].name,
+			results[i].name) != 0)
+			b++;
+
+		if (b == n_baseline) {
+			check(0, "%s is %.1f Mpix/s, but has no baseline, "
+				"record it with -B", results[i].name, results[i].mpix);
+			continue;
+		}
+
+		printf("%-14s %8.1f Mpix/s, baseline %.1f\n", results[i].name,
+			results[i].mpix, baseline[b].mpix);
+		check(results[i].mpix >= baseline[b].mpix
+			* (1.0 - tolerance / 100.0), "%s is %.1f Mpix/s, more than "
+			"%.0f%% below baseline %.1f", results[i].name, results[i].mpix,
+			tolerance, baseline[b].mpix);
+	}
+
+	return 0;
+}
+
+void print_usage(char *binary_name)
+{
+	printf("Usage: %s [-d dir] [-b baseline [-B] [-t percent]] [-h]\n"
+		"\t-d\t- directory for temporary files, test_out by default\n"
+		"\t-b\t- compare throughput with the baseline file\n"
+		"\t-B\t- store new baseline instead of comparing\n"
+		"\t-t\t- percents of throughput that may be lost, "
+		"%.0f by default\n"
+		"\t-h\t- show this message and exit\n",
+		binary_name, DEFAULT_TOLERANCE);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	extern char *optarg;
+	char *baseline = NULL;
+	int record = 0;
+	double tolerance = DEFAULT_TOLERANCE;
+
+	while ((c = getopt(argc, argv, "d:b:Bt:h")) != -1) {
+		switch (c) {
+		case 'd':
+			work_dir = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'B':
+			record = 1;
+			break;
+		case 't':
+			tolerance = strtod(optarg, NULL);
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		case '?':
+			fprintf(stderr, "Unrecognised option: -%c\n", optopt);
+			return -1;
+		}
+	}
+
+	pool = netpbm_pool_create(3);
+	arena = netpbm_arena_create(0);
+
+	if (pool == NULL || arena == NULL) {
+		fprintf(stderr, "Unable to create pool and arena\n");
+		return -1;
+	}
+
+	// restored before measuring throughput
+	const char *best = netpbm_kernels_name();
+
+	for (size_t k = 0; k < N_KERNEL_SETS; k++) {
+		if (netpbm_set_kernels(kernel_sets[k]) != 0)
+			continue;
+
+		size_t before = failures;
+
+		check_readers();
+		check_writers();
+		check_greyscale();
+		check_pyramid();
+		check_sobel();
+		check_delta();
+		check_bitmap_sobel();
+
+		printf("Kernels %-8s %s\n", kernel_sets[k],
+			failures == before ? "OK" : "FAILED");
+	}
+
+	netpbm_set_kernels(best);
+	check_arena();
+	check_topology();
+	check_batch();
+
+	if (baseline != NULL && perf_gate(baseline, record, tolerance) != 0)
+		failures++;
+
+	netpbm_pool_destroy(pool);
+	netpbm_arena_destroy(arena);
+
+	printf("%zu checks, %zu failures\n", checks, failures);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -26,6 +26,13 @@ for index in "${!inputs[@]}"; do
 	./ngsobel -s 0 -i "test_in/${inputs[$index]}" -o "test_out/${outputs[$index]}"
 done
 
+echo ==============================
+echo Running parallel ASCII decoding tests
+for index in 0 1 2; do
+	echo Running test on image "${inputs[$index]}"
+	./ngsobel -s 0 -p 4 -i "test_in/${inputs[$index]}" -o "test_out/mt_${outputs[$index]}"
+done
+
 echo ==============================
 echo Running greyscale test on "${inputs[2]}"
 ./ngsobel -s 0 -i "test_in/${inputs[2]}" -o "test_out/p2_from_p3_greyscale.pgm" -g
@@ -33,6 +40,167 @@ echo Running greyscale test on "${inputs[2]}"
 echo Running greyscale test on "${inputs[5]}"
 ./ngsobel -s 0 -i "test_in/${inputs[5]}" -o "test_out/p5_from_p6_greyscale.pgm" -g
 
+echo ==============================
+echo Running region test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_region.pgm" -r 100,100,200,150
+
+echo Running region test on "${inputs[1]}"
+./ngsobel -i "test_in/${inputs[1]}" -o "test_out/p2_region.pgm" -r 0,0,64,64
+
+echo ==============================
+echo Running multi-image stream test
+cat "test_in/${inputs[4]}" "test_in/${inputs[5]}" "test_in/${inputs[4]}" \
+	| ./ngsobel -m -g -i - -o "test_out/multi_test_out.pnm" -p 2
+
+echo Running incremental multi-image stream test
+cat "test_in/${inputs[4]}" "test_in/${inputs[4]}" "test_in/${inputs[4]}" \
+	| ./ngsobel -m -d -i - -o "test_out/multi_delta_test_out.pgm" -p 2
+
+echo Running multi-image stream test with huge pages
+cat "test_in/${inputs[4]}" "test_in/${inputs[4]}" "test_in/${inputs[4]}" \
+	| ./ngsobel -m -H -i - -o "test_out/multi_huge_test_out.pgm" -p 2
+
+echo ==============================
+echo Running uniform tile test on "${inputs[3]}"
+./ngsobel -i "test_in/${inputs[3]}" -o "test_out/p4_sobel.pbm" -p 1
+./ngsobel -i "test_in/${inputs[3]}" -o "test_out/p4_sobel_mt.pbm" -p 3
+cmp "test_out/p4_sobel.pbm" "test_out/p4_sobel_mt.pbm"
+
+echo ==============================
+echo Running pre-smoothing test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_blur.pgm" -b 5 -p 1
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_blur_mt.pgm" -b 5 -p 4
+cmp "test_out/p5_blur.pgm" "test_out/p5_blur_mt.pgm"
+
+echo ==============================
+echo Running packed bitmap test on "${inputs[3]}"
+./ngsobel -i "test_in/${inputs[3]}" -o "test_out/p4_mask.pbm" -1 mask -p 3
+cmp "test_out/p4_sobel.pbm" "test_out/p4_mask.pbm"
+./ngsobel -i "test_in/${inputs[3]}" -o "test_out/p4_magnitude.pgm" -1 magnitude
+
+echo ==============================
+echo Running strip sharding test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_whole.pgm" -b 3
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_strip0.raw" -b 3 -R 0,100 &
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_strip1.raw" -b 3 -R 100,301 &
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_strip2.raw" -b 3 -R 301,512 &
+wait
+./ngsobel -M -i "test_in/${inputs[4]}" -o "test_out/p5_merged.pgm" \
+	"test_out/p5_strip0.raw" "test_out/p5_strip1.raw" "test_out/p5_strip2.raw"
+cmp "test_out/p5_whole.pgm" "test_out/p5_merged.pgm"
+
+echo ==============================
+echo Running result cache test on "${inputs[4]}"
+rm -rf test_out/cache
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_cache_miss.pgm" -c test_out/cache
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_cache_hit.pgm" -c test_out/cache
+cmp "test_out/p5_cache_miss.pgm" "test_out/p5_cache_hit.pgm"
+
+echo ==============================
+echo Running server test on "${inputs[5]}"
+./ngsobel -S test_out/ngsobel.sock -p 2 &
+server_pid=$!
+sleep 1
+./ngsobel -U test_out/ngsobel.sock -g -i "test_in/${inputs[5]}" -o "test_out/p5_from_p6_server.pgm"
+./ngsobel -U test_out/ngsobel.sock -i - -o - < "test_in/${inputs[4]}" > "test_out/p5_server_inline.pgm"
+kill -TERM $server_pid
+wait $server_pid
+
+echo ==============================
+echo Running kernel dispatch test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_scalar.pgm" -k scalar
+for kernels in sse2 avx2 avx512; do
+	if ./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_$kernels.pgm" -k $kernels; then
+		cmp "test_out/p5_scalar.pgm" "test_out/p5_$kernels.pgm"
+	fi
+done
+
+echo ==============================
+echo Running hardware counters test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_counters.pgm" -e -p 2
+cmp "test_out/p5_scalar.pgm" "test_out/p5_counters.pgm"
+
+echo ==============================
+echo Running direct output test on "${inputs[4]}" and "${inputs[5]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_direct.pgm" -p 3 -D
+cmp "test_out/p5_scalar.pgm" "test_out/p5_direct.pgm"
+./ngsobel -s 0 -i "test_in/${inputs[5]}" -o "test_out/p6_direct.ppm" -p 3 -D
+cmp "test_out/${outputs[5]}" "test_out/p6_direct.ppm"
+
+echo ==============================
+echo Running statistics and threshold test on "${inputs[4]}"
+threshold=$(./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_stats.pgm" \
+	-p 3 -x | sed -n 's/^Otsu threshold: //p')
+cmp "test_out/p5_scalar.pgm" "test_out/p5_stats.pgm"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_otsu.pgm" -p 3 -t otsu
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_threshold.pgm" \
+	-t "$threshold"
+cmp "test_out/p5_otsu.pgm" "test_out/p5_threshold.pgm"
+
+echo ==============================
+echo Running pyramid test on "${inputs[5]}"
+./ngsobel -g -i "test_in/${inputs[5]}" -o "test_out/p6_pyramid.pgm" -p 3 \
+	-l 2,gaussian -L
+for level in 0 1; do
+	[ -s "test_out/p6_pyramid-$level.pgm" ] || echo "Level $level is missing"
+done
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_level2.pgm" -l 2
+head -c 12 "test_out/p5_level2.pgm" | tr '\n' ' ' | grep -q "^P5 128 128 " \
+	|| echo "Level 2 has wrong size"
+
+echo ==============================
+echo Running thin edges test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_thin.pgm" -b 3 -n
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_thin_mt.pgm" -b 3 -n -p 3
+cmp "test_out/p5_thin.pgm" "test_out/p5_thin_mt.pgm"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_thin0.raw" -b 3 -n -R 0,201
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_thin1.raw" -b 3 -n -R 201,512
+./ngsobel -M -i "test_in/${inputs[4]}" -o "test_out/p5_thin_merged.pgm" \
+	"test_out/p5_thin0.raw" "test_out/p5_thin1.raw"
+cmp "test_out/p5_thin.pgm" "test_out/p5_thin_merged.pgm"
+
+echo ==============================
+echo Running pinned workers test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_pinned.pgm" -p 3 -N
+cmp "test_out/p5_scalar.pgm" "test_out/p5_pinned.pgm"
+./ngsobel -m -i "test_in/${inputs[4]}" -o "test_out/p5_pinned_stream.pgm" -p 3 -N
+cmp "test_out/p5_scalar.pgm" "test_out/p5_pinned_stream.pgm"
+
+echo ==============================
+echo Running batch tests
+for backend in auto stdio; do
+	declare -a files=()
+	for index in "${!inputs[@]}"; do
+		files+=("test_in/${inputs[$index]}" "test_out/batch_${backend}_${outputs[$index]}")
+	done
+	./ngsobel -B "$backend" -s 0 "${files[@]}"
+	for index in "${!inputs[@]}"; do
+		cmp "test_out/${outputs[$index]}" "test_out/batch_${backend}_${outputs[$index]}"
+	done
+done
+./ngsobel -B auto -p 3 "test_in/${inputs[4]}" "test_out/p5_batch.pgm" \
+	"test_in/${inputs[4]}" "test_out/p5_batch_again.pgm"
+cmp "test_out/p5_scalar.pgm" "test_out/p5_batch.pgm"
+cmp "test_out/p5_scalar.pgm" "test_out/p5_batch_again.pgm"
+
+echo ==============================
+echo Running trace test on "${inputs[4]}"
+./ngsobel -i "test_in/${inputs[4]}" -o "test_out/p5_traced.pgm" -p 3 \
+	-T "test_out/trace.json"
+cmp "test_out/p5_scalar.pgm" "test_out/p5_traced.pgm"
+grep -q '"name":"sobel task"' "test_out/trace.json"
+
+echo ==============================
+echo Running auto-tuning test on "${inputs[4]}"
+NETPBM_TUNING=test_out/ngsobel.tuning ./ngsobel -A
+NETPBM_TUNING=test_out/ngsobel.tuning ./ngsobel -i "test_in/${inputs[4]}" \
+	-o "test_out/p5_auto.pgm" -p auto
+cmp "test_out/p5_scalar.pgm" "test_out/p5_auto.pgm"
+
+echo ==============================
+echo Running differential tests and performance gate
+./ngtests -b "${NETPBM_BASELINE:-test_in/ngtests.baseline}"
+
 echo ==============================
 echo Testing Sobel operator:
 